@@ -0,0 +1,506 @@
+// Benchmarks of the query path, message walking, downloads and console
+// output, against FakeBackend so that no Telegram account is needed.
+// Built with -DTDSHELL_BUILD_BENCHMARKS=ON, run `tdshell_bench --help`.
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <random>
+#include <sstream>
+#include <streambuf>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include "chatarchive.h"
+#include "commands.h"
+#include "fakebackend.h"
+#include "historywriter.h"
+#include "messagecursor.h"
+#include "metrics.h"
+#include "searchindex.h"
+#include "tdchannel.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+// A logged in channel on a FakeBackend, with its database and files in a
+// temporary directory removed afterwards. Extra accounts share its hub, as
+// with `--account`.
+class FakeSession {
+public:
+  explicit FakeSession(FakeBackend::Options options, std::size_t workers = 2, std::size_t accounts = 1) {
+    directory_ = fs::temp_directory_path() / ("tdshell-bench-" + std::to_string(std::random_device{}()));
+    fs::create_directories(directory_);
+    options.files_directory = FileUtil::u8string(directory_ / "files");
+
+    auto backend = std::make_unique<FakeBackend>(options);
+    backend_ = backend.get();
+    channel_ = std::make_shared<TdChannel>(std::make_shared<ClientHub>(std::move(backend)));
+    channel_->setDatabaseDirectory(FileUtil::u8string(directory_ / "db"));
+    channel_->setWorkerCount(workers);
+    // Before any update is handled, as TdShell does.
+    channel_->openMetadataCache();
+    channel_->start();
+    channel_->waitForLogin();
+    for (std::size_t i = 1; i < accounts; i++) {
+      auto account = std::make_shared<TdChannel>(channel_->hub());
+      account->setDatabaseDirectory(FileUtil::u8string(directory_ / ("db" + std::to_string(i))));
+      account->waitForLogin();
+      accounts_.push_back(std::move(account));
+    }
+  }
+
+  ~FakeSession() {
+    accounts_.clear();
+    channel_.reset();
+    std::error_code ec;
+    fs::remove_all(directory_, ec);
+  }
+
+  std::shared_ptr<TdChannel> &channel() { return channel_; }
+  FakeBackend &backend() { return *backend_; }
+  const fs::path &directory() const { return directory_; }
+
+private:
+  fs::path directory_;
+  FakeBackend *backend_;
+  std::shared_ptr<TdChannel> channel_;
+  std::vector<std::shared_ptr<TdChannel>> accounts_;
+};
+
+// The number of messages left in a cursor.
+coro::Task<std::size_t> walk(MessageCursor &cursor) {
+  std::size_t messages = 0;
+  for (auto page = co_await cursor.nextPage(); !page.empty(); page = co_await cursor.nextPage())
+    messages += page.size();
+  co_return messages;
+}
+
+class NullBuffer : public std::streambuf {
+protected:
+  int_type overflow(int_type ch) override { return traits_type::not_eof(ch); }
+  std::streamsize xsputn(const char *, std::streamsize count) override { return count; }
+};
+
+} // namespace
+
+// Queries sent with send_query() and answered at once: the response goes
+// through the hub workers and process_response() to its handler, recorded
+// by Metrics or not.
+static void BM_ProcessResponse(benchmark::State &state) {
+  FakeSession session({}, static_cast<std::size_t>(state.range(0)));
+  const std::size_t batch = 1000;
+  Metrics::instance().setEnabled(state.range(1) != 0);
+
+  for (auto _ : state) {
+    std::vector<td_api::object_ptr<td_api::getOption>> queries;
+    for (std::size_t i = 0; i < batch; i++)
+      queries.push_back(td_api::make_object<td_api::getOption>("version"));
+    auto results = session.channel()->invokeMany(std::move(queries), batch);
+    benchmark::DoNotOptimize(results);
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+  Metrics::instance().setEnabled(true);
+}
+BENCHMARK(BM_ProcessResponse)->ArgNames({"workers", "metrics"})
+  ->Args({1, 0})->Args({1, 1})->Args({2, 0})->Args({2, 1})->Args({4, 0})->Args({4, 1})->UseRealTime();
+
+// What send_query() and process_response() add to a query for Metrics on
+// their own thread, without the noise of the hub.
+static void BM_QueryMetrics(benchmark::State &state) {
+  auto &metrics = Metrics::instance();
+  metrics.setEnabled(state.range(0) != 0);
+  auto query = td_api::make_object<td_api::getOption>("version");
+  auto response = td_api::make_object<td_api::optionValueString>("1.8.0");
+
+  for (auto _ : state) {
+    auto stats = metrics.querySent(*query);
+    auto sent = stats ? Metrics::Clock::now() : Metrics::Clock::time_point{};
+    benchmark::DoNotOptimize(sent);
+    metrics.queryDone(stats, sent, *response);
+  }
+  metrics.setEnabled(true);
+}
+BENCHMARK(BM_QueryMetrics)->ArgName("metrics")->Arg(0)->Arg(1);
+
+// updateFile published to a subscriber, spread over the workers.
+static void BM_UpdateDispatch(benchmark::State &state) {
+  FakeSession session({}, static_cast<std::size_t>(state.range(0)));
+  const std::size_t batch = 10000;
+
+  std::atomic<std::size_t> seen{0};
+  auto subscription = session.channel()->updates().subscribe<td_api::updateFile>(
+    [&seen](const td_api::updateFile &) {
+      seen.fetch_add(1, std::memory_order_release);
+      seen.notify_one();
+    });
+
+  for (auto _ : state) {
+    auto target = seen.load(std::memory_order_acquire) + batch;
+    session.backend().sendFileUpdates(session.channel()->clientId(), batch);
+    for (auto count = seen.load(std::memory_order_acquire); count < target; count = seen.load(std::memory_order_acquire))
+      seen.wait(count, std::memory_order_acquire);
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+  session.channel()->updates().unsubscribe(subscription);
+}
+BENCHMARK(BM_UpdateDispatch)->ArgName("workers")->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+
+// 1000 getMessage queries answered after 1 ms, `concurrency` at a time:
+// blocking invoke() calls spread over that many threads, or coroutines
+// keeping that many queries in flight from one thread with queryMany().
+static void BM_QueryFanOut(benchmark::State &state) {
+  const bool coroutines = state.range(0) != 0;
+  const auto concurrency = static_cast<std::size_t>(state.range(1));
+  const std::size_t queries = 1000;
+  FakeBackend::Options options;
+  options.messages_per_chat = queries;
+  options.latency = std::chrono::milliseconds(1);
+  FakeSession session(options);
+  auto &channel = *session.channel();
+  auto chat_id = session.backend().chatId(0);
+
+  for (auto _ : state) {
+    std::size_t found = 0;
+    if (coroutines) {
+      std::vector<td_api::object_ptr<td_api::getMessage>> batch;
+      for (std::size_t i = 0; i < queries; i++)
+        batch.push_back(td_api::make_object<td_api::getMessage>(chat_id, session.backend().messageId(i)));
+      coro::Executor executor;
+      auto results = executor.run(channel.queryMany(std::move(batch), concurrency));
+      for (auto &result : results)
+        found += result ? 1 : 0;
+    } else {
+      std::atomic<std::size_t> next{0};
+      std::atomic<std::size_t> answered{0};
+      std::vector<std::thread> threads;
+      for (std::size_t t = 0; t < concurrency; t++) {
+        threads.emplace_back([&] {
+          for (auto i = next++; i < queries; i = next++) {
+            channel.invoke<td_api::getMessage>(chat_id, session.backend().messageId(i));
+            answered++;
+          }
+        });
+      }
+      for (auto &thread : threads)
+        thread.join();
+      found = answered;
+    }
+    benchmark::DoNotOptimize(found);
+  }
+  state.SetItemsProcessed(state.iterations() * queries);
+}
+BENCHMARK(BM_QueryFanOut)->ArgNames({"coroutines", "concurrency"})
+  ->Args({0, 1})->Args({0, 16})->Args({0, 64})
+  ->Args({1, 1})->Args({1, 16})->Args({1, 64})->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Files finishing on other threads while the command thread waits for all
+// of them, either blocked in CompletionQueue::pop() or, as downloads did
+// before, polling each future with wait_for(0). The files finish over about
+// 50 ms whatever their number, the CPU time is the waiting thread's.
+static void BM_CompletionQueue(benchmark::State &state) {
+  const auto tasks = static_cast<std::size_t>(state.range(0));
+  const bool polling = state.range(1) != 0;
+  const std::size_t producers = 4;
+  const std::size_t steps = 100;
+
+  // Producer `p` finishes files p, p + producers, ... in `steps` bursts.
+  auto produce = [&](std::size_t p, const std::function<void(std::size_t)> &finish) {
+    std::size_t share = (tasks + producers - 1 - p) / producers;
+    for (std::size_t step = 0; step < steps; step++) {
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+      for (std::size_t k = share * step / steps; k < share * (step + 1) / steps; k++)
+        finish(p + k * producers);
+    }
+  };
+
+  for (auto _ : state) {
+    std::size_t sum = 0;
+    std::vector<std::thread> threads;
+    if (!polling) {
+      AsynUtil::CompletionQueue<std::size_t> completed;
+      for (std::size_t p = 0; p < producers; p++)
+        threads.emplace_back(produce, p, [&completed](std::size_t i) { completed.push(i); });
+      for (std::size_t i = 0; i < tasks; i++)
+        sum += completed.pop();
+    } else {
+      std::vector<std::promise<std::size_t>> promises(tasks);
+      std::vector<std::future<std::size_t>> futures;
+      for (auto &promise : promises)
+        futures.push_back(promise.get_future());
+      for (std::size_t p = 0; p < producers; p++)
+        threads.emplace_back(produce, p, [&promises](std::size_t i) { promises[i].set_value(i); });
+      std::vector<bool> done(tasks, false);
+      for (std::size_t remaining = tasks; remaining > 0;) {
+        for (std::size_t i = 0; i < tasks; i++) {
+          if (done[i] || futures[i].wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            continue;
+          sum += futures[i].get();
+          done[i] = true;
+          remaining--;
+        }
+      }
+    }
+    for (auto &thread : threads)
+      thread.join();
+    benchmark::DoNotOptimize(sum);
+  }
+  // CPU time of the waiting thread for each file.
+  state.counters["cpu_per_file"] = benchmark::Counter(static_cast<double>(tasks),
+    benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+}
+BENCHMARK(BM_CompletionQueue)->ArgNames({"tasks", "polling"})
+  ->ArgsProduct({{10, 1000, 100000}, {0, 1}})->Unit(benchmark::kMillisecond);
+
+// Walk a whole chat with MessageCursor, which fetches the messages of a
+// range a page at a time while the previous page is handled.
+static void BM_MessageCursor(benchmark::State &state) {
+  FakeBackend::Options options;
+  options.messages_per_chat = static_cast<std::size_t>(state.range(0));
+  options.latency = std::chrono::microseconds(state.range(1));
+  FakeSession session(options);
+  auto &backend = session.backend();
+
+  std::size_t messages = 0;
+  for (auto _ : state) {
+    MessageCursor cursor(*session.channel(), backend.message(0, options.messages_per_chat - 1), backend.message(0, 0));
+    coro::Executor executor;
+    messages += executor.run(walk(cursor));
+  }
+  state.SetItemsProcessed(static_cast<std::int64_t>(messages));
+}
+BENCHMARK(BM_MessageCursor)->ArgNames({"messages", "latency_us"})
+  ->Args({1000, 0})->Args({20000, 0})->Args({10000, 1000})->UseRealTime();
+
+// Walk the media of a chat where one message in twenty has a file, either
+// through the whole history or with the searchChatMessages filters.
+static void BM_MediaCursor(benchmark::State &state) {
+  FakeBackend::Options options;
+  options.messages_per_chat = 20000;
+  options.media_ratio = 0.05;
+  options.latency = std::chrono::microseconds(state.range(1));
+  FakeSession session(options);
+  auto &backend = session.backend();
+  unsigned media = state.range(0) ? MessageCursor::AnyMedia : MessageCursor::AnyMessage;
+
+  std::size_t messages = 0;
+  for (auto _ : state) {
+    MessageCursor cursor(*session.channel(), backend.chatId(0),
+                         backend.messageId(options.messages_per_chat - 1), backend.messageId(0), media);
+    coro::Executor executor;
+    messages += executor.run(walk(cursor));
+  }
+  state.SetItemsProcessed(static_cast<std::int64_t>(messages));
+}
+BENCHMARK(BM_MediaCursor)->ArgNames({"filtered", "latency_us"})
+  ->Args({0, 1000})->Args({1, 1000})->UseRealTime();
+
+// `chats` over a list whose chats all came with updateNewChat, so that
+// only loadChats and getChats are sent.
+static void BM_ListChats(benchmark::State &state) {
+  FakeBackend::Options options;
+  options.chats = static_cast<std::size_t>(state.range(0));
+  options.messages_per_chat = 1;
+  options.latency = std::chrono::microseconds(state.range(1));
+  FakeSession session(options);
+
+  CmdChats command(session.channel());
+  NullBuffer buffer;
+  std::ostream out{&buffer};
+  for (auto _ : state)
+    command.execute({}, out);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ListChats)->ArgNames({"chats", "latency_us"})
+  ->Args({1000, 0})->Args({20000, 0})->Args({20000, 1000})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Runs `download -R` over the whole first chat on each iteration.
+static void downloadRange(benchmark::State &state, FakeSession &session, std::size_t files, int64_t concurrent) {
+  auto &backend = session.backend();
+
+  auto output = FileUtil::u8string(session.directory() / "output");
+  std::vector<std::string> args = {
+    "-t", std::to_string(backend.chatId(0)),
+    "-R", std::to_string(backend.messageId(0)), std::to_string(backend.messageId(files - 1)),
+    "-O", output, "-j", std::to_string(concurrent), "--no-dedup", "--no-progress"
+  };
+
+  CmdDownload command(session.channel());
+  command.setBufferedOutput(true);
+  for (auto _ : state) {
+    std::ostringstream out;
+    command.execute(args, out);
+
+    state.PauseTiming();
+    backend.resetDownloads();
+    fs::remove_all(FileUtil::u8path(output));
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * files);
+  state.SetBytesProcessed(state.iterations() * backend.mediaBytes(0, 0, files - 1));
+}
+
+// `download -R` over a chat where every message has a file: resolving the
+// range, scheduling, updateFile progress and moving the files.
+static void BM_DownloadRange(benchmark::State &state) {
+  FakeBackend::Options options;
+  options.messages_per_chat = static_cast<std::size_t>(state.range(0));
+  options.media_ratio = 1.0;
+  options.size_distribution = FakeBackend::SizeDistribution::Fixed;
+  options.median_size = 1 << 20;
+  FakeSession session(options);
+  downloadRange(state, session, options.messages_per_chat, state.range(1));
+}
+BENCHMARK(BM_DownloadRange)->ArgNames({"files", "concurrent"})
+  ->Args({200, 4})->Args({200, 16})->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// The same range sharded over 1, 2 or 4 accounts on one fake. Files take
+// time to download and each account only runs a few at once, so the time
+// should fall near linearly with the accounts: 4 accounts take at most a
+// third of the time of one, or sharding has regressed.
+static void BM_DownloadRangeAccounts(benchmark::State &state) {
+  FakeBackend::Options options;
+  options.messages_per_chat = 200;
+  options.media_ratio = 1.0;
+  options.size_distribution = FakeBackend::SizeDistribution::Fixed;
+  options.median_size = 1 << 20;
+  options.download_speed = 64 << 20;
+  FakeSession session(options, 2, static_cast<std::size_t>(state.range(0)));
+  downloadRange(state, session, options.messages_per_chat, 4);
+}
+BENCHMARK(BM_DownloadRangeAccounts)->ArgName("accounts")
+  ->Arg(1)->Arg(2)->Arg(4)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+static void BM_ElidedText(benchmark::State &state, std::string word) {
+  std::string text;
+  while (text.size() < 400)
+    text += word;
+  auto width = static_cast<std::uint8_t>(state.range(0));
+  auto mode = static_cast<StrUtil::StrLoc>(state.range(1));
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(StrUtil::elidedText(text, width, mode));
+  state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(text.size()));
+}
+BENCHMARK_CAPTURE(BM_ElidedText, ascii, std::string("lorem ipsum\n"))
+  ->ArgNames({"width", "mode"})->ArgsProduct({{20, 80}, {StrUtil::Left, StrUtil::Middle, StrUtil::Right}});
+BENCHMARK_CAPTURE(BM_ElidedText, utf8, std::string("привет 下载 📦 "))
+  ->ArgNames({"width", "mode"})->ArgsProduct({{20, 80}, {StrUtil::Left, StrUtil::Middle, StrUtil::Right}});
+
+// Half of the messages are text, the rest documents, videos and photos.
+static void BM_PrintMessage(benchmark::State &state) {
+  FakeBackend backend({});
+  std::vector<MessagePtr> messages;
+  for (std::size_t i = 0; i < 1000; i++)
+    messages.push_back(backend.message(0, i));
+
+  NullBuffer buffer;
+  std::ostream out{&buffer};
+  bool elided = state.range(0) != 0;
+  for (auto _ : state) {
+    for (auto &message : messages)
+      ConsoleUtil::printMessage(out, message, elided);
+  }
+  state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(messages.size()));
+}
+BENCHMARK(BM_PrintMessage)->ArgName("elided")->Arg(0)->Arg(1);
+
+// The records of `history --export`, without the queries.
+static void BM_HistoryWriter(benchmark::State &state, HistoryWriter::Format format) {
+  FakeBackend backend({});
+  std::vector<MessagePtr> messages;
+  for (std::size_t i = 0; i < 1000; i++)
+    messages.push_back(backend.message(0, i));
+
+  NullBuffer buffer;
+  std::ostream out{&buffer};
+  HistoryWriter writer(out, format);
+  for (auto _ : state) {
+    for (auto &message : messages)
+      writer.write(*message);
+  }
+  state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(messages.size()));
+}
+BENCHMARK_CAPTURE(BM_HistoryWriter, ndjson, HistoryWriter::Format::Ndjson);
+BENCHMARK_CAPTURE(BM_HistoryWriter, csv, HistoryWriter::Format::Csv);
+
+// `archive query` over 100000 messages: a range of 1000 ids, which only
+// reads the chunks holding it, and a text search, which reads every one.
+static void BM_ArchiveQuery(benchmark::State &state) {
+  const std::size_t messages = 100000;
+  FakeBackend::Options options;
+  options.messages_per_chat = messages;
+  FakeBackend backend(options);
+
+  auto path = fs::temp_directory_path() / ("tdshell-bench-" + std::to_string(std::random_device{}()) + ".tda");
+  {
+    ArchiveWriter writer(FileUtil::u8string(path));
+    for (std::size_t i = messages; i-- > 0;)
+      writer.write(*backend.message(0, i));
+  }
+
+  ArchiveReader::Filter filter;
+  if (state.range(0) == 0) {
+    filter.min_id = backend.messageId(messages / 2);
+    filter.max_id = backend.messageId(messages / 2 + 999);
+  } else {
+    filter.text = "episode";
+  }
+
+  std::size_t found = 0;
+  {
+    ArchiveReader reader(FileUtil::u8string(path));
+    for (auto _ : state) {
+      reader.scan(filter, [&found](const HistoryWriter::Record &) {
+        found++;
+        return true;
+      });
+    }
+    state.counters["chunks_read"] = benchmark::Counter(
+      static_cast<double>(reader.chunksRead()), benchmark::Counter::kAvgIterations);
+  }
+  state.SetItemsProcessed(static_cast<std::int64_t>(found));
+  fs::remove(path);
+}
+BENCHMARK(BM_ArchiveQuery)->ArgName("text_search")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// `search` over 200000 indexed messages in a few segments, for the
+// newest 20 hits of the query.
+static void BM_Search(benchmark::State &state, std::string query) {
+  const std::size_t messages = 200000;
+  FakeBackend::Options options;
+  options.messages_per_chat = messages;
+  FakeBackend backend(options);
+
+  auto directory = fs::temp_directory_path() / ("tdshell-bench-" + std::to_string(std::random_device{}()));
+  {
+    SearchIndex index(FileUtil::u8string(directory));
+    std::vector<MessagePtr> page;
+    for (std::size_t i = 0; i < messages; i++) {
+      page.push_back(backend.message(0, i));
+      if (page.size() == 100 || i + 1 == messages) {
+        index.add(page);
+        page.clear();
+      }
+    }
+  }
+
+  {
+    SearchIndex index(FileUtil::u8string(directory));
+    for (auto _ : state)
+      benchmark::DoNotOptimize(index.search(query));
+    state.counters["segments"] = static_cast<double>(index.segmentCount());
+  }
+  fs::remove_all(directory);
+}
+BENCHMARK_CAPTURE(BM_Search, two_words, std::string("season episode"))->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Search, prefix, std::string("rel*"))->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Search, no_hits, std::string("season nowhere"))->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,461 @@
+#include "chatarchive.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#include <nowide/cstdio.hpp>
+#include <zlib.h>
+
+#include "varint.h"
+
+namespace fs = std::filesystem;
+
+static const char ARCHIVE_MAGIC[8] = {'T', 'D', 'S', 'A', 'R', 'C', 'H', '\0'};
+// Version 2 adds range records, archives of version 1 are upgraded when
+// opened for writing.
+static const std::uint32_t ARCHIVE_VERSION = 2;
+static const std::size_t HEADER_SIZE = sizeof(ARCHIVE_MAGIC) + 2 * sizeof(std::uint32_t);
+static const std::uint32_t CHUNK_MAGIC = 0x4b4e4843;  // "CHNK"
+static const std::uint32_t RANGE_MAGIC = 0x45474e52;  // "RNGE"
+
+static void putSigned(std::string &out, std::int64_t value) {
+  putVarint(out, (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+}
+
+static void putString(std::string &out, std::string_view text) {
+  putVarint(out, text.size());
+  out.append(text.data(), text.size());
+}
+
+// Reads the values of a column one after another, throws once it runs out.
+class ColumnReader {
+public:
+  explicit ColumnReader(std::string_view data) : pos_(data.data()), end_(data.data() + data.size()) {}
+
+  std::uint64_t varint() {
+    std::uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (pos_ == end_)
+        break;
+      auto byte = static_cast<std::uint8_t>(*pos_++);
+      value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return value;
+    }
+    throw std::runtime_error("Corrupted archive column");
+  }
+
+  std::int64_t signedVarint() {
+    auto value = varint();
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+  }
+
+  std::uint8_t byte() {
+    if (pos_ == end_)
+      throw std::runtime_error("Corrupted archive column");
+    return static_cast<std::uint8_t>(*pos_++);
+  }
+
+  std::string_view string() {
+    auto length = varint();
+    if (length > static_cast<std::uint64_t>(end_ - pos_))
+      throw std::runtime_error("Corrupted archive column");
+    std::string_view text(pos_, static_cast<std::size_t>(length));
+    pos_ += length;
+    return text;
+  }
+
+private:
+  const char *pos_;
+  const char *end_;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Archive
+/////////////////////////////////////////////////////////////////////////////
+
+std::size_t Archive::readIndex(const char *data, std::size_t size, std::vector<Chunk> &chunks,
+                              std::vector<Range> &ranges) {
+  std::uint32_t version = 0;
+  if (size < HEADER_SIZE || std::memcmp(data, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0)
+    throw std::runtime_error("Not an archive");
+  std::memcpy(&version, data + sizeof(ARCHIVE_MAGIC), sizeof(version));
+  if (version < 1 || version > ARCHIVE_VERSION)
+    throw std::runtime_error("Unsupported archive version " + std::to_string(version));
+
+  std::size_t pos = HEADER_SIZE;
+  std::uint32_t magic;
+  while (pos + sizeof(magic) <= size) {
+    std::memcpy(&magic, data + pos, sizeof(magic));
+    if (magic == RANGE_MAGIC) {
+      if (pos + sizeof(Range) > size)
+        break;
+      Range range;
+      std::memcpy(&range, data + pos, sizeof(Range));
+      ranges.push_back(range);
+      pos += sizeof(Range);
+      continue;
+    }
+
+    Chunk chunk;
+    if (magic != CHUNK_MAGIC || pos + sizeof(ChunkHeader) > size)
+      break;
+    std::memcpy(&chunk.header, data + pos, sizeof(ChunkHeader));
+
+    std::uint64_t stored = 0;
+    for (auto column_size : chunk.header.stored_size)
+      stored += column_size;
+    chunk.offset = pos + sizeof(ChunkHeader);
+    if (chunk.offset + stored > size)
+      break;
+
+    chunks.push_back(chunk);
+    pos = static_cast<std::size_t>(chunk.offset + stored);
+  }
+  return pos;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// ArchiveWriter
+/////////////////////////////////////////////////////////////////////////////
+
+ArchiveWriter::ArchiveWriter(const std::string &filename, std::size_t chunk_rows)
+  : filename_(filename), chunk_rows_(std::max<std::size_t>(chunk_rows, 1))
+{
+  auto path = FileUtil::u8path(filename_);
+  std::error_code ec;
+  auto size = fs::file_size(path, ec);
+  if (!ec && size > 0) {
+    std::size_t complete;
+    std::uint32_t version;
+    {
+      FileUtil::MappedFile mapped(path);
+      complete = Archive::readIndex(mapped.data(), mapped.size(), chunks_, ranges_);
+      std::memcpy(&version, mapped.data() + sizeof(ARCHIVE_MAGIC), sizeof(version));
+    }
+    // A chunk cut short by a crash.
+    if (complete < size)
+      fs::resize_file(path, complete);
+    if (version < ARCHIVE_VERSION) {
+      file_ = nowide::fopen(filename_.c_str(), "r+b");
+      if (file_) {
+        std::fseek(file_, sizeof(ARCHIVE_MAGIC), SEEK_SET);
+        std::fwrite(&ARCHIVE_VERSION, 1, sizeof(ARCHIVE_VERSION), file_);
+        std::fclose(file_);
+      }
+    }
+    file_ = nowide::fopen(filename_.c_str(), "ab");
+  } else {
+    if (path.has_parent_path())
+      fs::create_directories(path.parent_path());
+    file_ = nowide::fopen(filename_.c_str(), "wb");
+    if (file_) {
+      std::uint32_t header[2] = {ARCHIVE_VERSION, 0};
+      std::fwrite(ARCHIVE_MAGIC, 1, sizeof(ARCHIVE_MAGIC), file_);
+      std::fwrite(header, 1, sizeof(header), file_);
+    }
+  }
+
+  if (!file_)
+    throw std::runtime_error("Failed to open archive " + filename_);
+}
+
+ArchiveWriter::~ArchiveWriter() {
+  try {
+    flush();
+  } catch (...) {
+  }
+  std::fclose(file_);
+}
+
+void ArchiveWriter::beginWalk(std::int64_t chat_id, std::int64_t newest_id) {
+  // Rows of an earlier walk aren't part of this one.
+  if (header_.rows > 0)
+    writeChunk();
+  walking_ = true;
+  walk_chat_id_ = chat_id;
+  walk_newest_id_ = newest_id;
+}
+
+void ArchiveWriter::endWalk(std::int64_t oldest_id, bool complete) {
+  if (header_.rows > 0)
+    writeChunk();
+  if (walking_)
+    writeRange(oldest_id, complete);
+  walking_ = false;
+  flush();
+}
+
+std::vector<Archive::Range> ArchiveWriter::ranges(std::int64_t chat_id) const {
+  std::vector<Archive::Range> ranges;
+  for (auto &range : ranges_) {
+    if (range.chat_id == chat_id)
+      ranges.push_back(range);
+  }
+
+  // Archives written before range records only appended the messages newer
+  // than those they held, take their chunks as one range.
+  if (ranges.empty()) {
+    Archive::Range span{RANGE_MAGIC, 0, chat_id, 0, 0};
+    for (auto &chunk : chunks_) {
+      if (chunk.header.chat_id != chat_id)
+        continue;
+      span.newest_id = std::max(span.newest_id, chunk.header.max_id);
+      span.oldest_id = span.oldest_id ? std::min(span.oldest_id, chunk.header.min_id) : chunk.header.min_id;
+    }
+    if (span.newest_id != 0)
+      ranges.push_back(span);
+  }
+
+  std::sort(ranges.begin(), ranges.end(), [](const Archive::Range &a, const Archive::Range &b) {
+    return a.newest_id > b.newest_id;
+  });
+  std::vector<Archive::Range> merged;
+  for (auto &range : ranges) {
+    if (!merged.empty() && range.newest_id >= merged.back().oldest_id) {
+      auto &last = merged.back();
+      if (range.oldest_id < last.oldest_id) {
+        last.oldest_id = range.oldest_id;
+        last.complete = range.complete;
+      } else if (range.oldest_id == last.oldest_id) {
+        last.complete |= range.complete;
+      }
+    } else {
+      merged.push_back(range);
+    }
+  }
+  return merged;
+}
+
+void ArchiveWriter::write(const td_api::message &message) {
+  write(HistoryWriter::describe(message));
+}
+
+void ArchiveWriter::write(const HistoryWriter::Record &record) {
+  if (header_.rows > 0 && record.chat_id != header_.chat_id)
+    writeChunk();
+
+  if (header_.rows == 0) {
+    header_.chat_id = record.chat_id;
+    header_.min_id = header_.max_id = record.id;
+    header_.min_date = header_.max_date = record.date;
+    last_id_ = 0;
+    last_date_ = 0;
+  } else {
+    header_.min_id = std::min(header_.min_id, record.id);
+    header_.max_id = std::max(header_.max_id, record.id);
+    header_.min_date = std::min(header_.min_date, record.date);
+    header_.max_date = std::max(header_.max_date, record.date);
+  }
+
+  putSigned(columns_[Archive::ColumnId], record.id - last_id_);
+  putSigned(columns_[Archive::ColumnDate], record.date - last_date_);
+  putSigned(columns_[Archive::ColumnSender], record.sender_id);
+  columns_[Archive::ColumnType] += static_cast<char>(HistoryWriter::typeNumber(record.type));
+  putString(columns_[Archive::ColumnText], record.text);
+  putString(columns_[Archive::ColumnFileName], record.file_name);
+  putSigned(columns_[Archive::ColumnFileSize], record.file_size);
+  putString(columns_[Archive::ColumnMimeType], record.mime_type);
+  last_id_ = record.id;
+  last_date_ = record.date;
+  header_.rows++;
+  count_++;
+
+  if (header_.rows >= chunk_rows_)
+    writeChunk();
+}
+
+void ArchiveWriter::flush() {
+  if (header_.rows > 0)
+    writeChunk();
+  if (std::fflush(file_) != 0 || std::ferror(file_))
+    throw std::runtime_error("Failed to write archive " + filename_);
+}
+
+void ArchiveWriter::writeChunk() {
+  std::string stored[Archive::COLUMNS];
+  for (std::size_t i = 0; i < Archive::COLUMNS; i++) {
+    auto &raw = columns_[i];
+    uLongf length = compressBound(static_cast<uLong>(raw.size()));
+    stored[i].resize(length);
+    if (compress2(reinterpret_cast<Bytef*>(stored[i].data()), &length,
+                  reinterpret_cast<const Bytef*>(raw.data()), static_cast<uLong>(raw.size()),
+                  Z_DEFAULT_COMPRESSION) != Z_OK)
+      throw std::runtime_error("Failed to compress an archive chunk");
+    stored[i].resize(length);
+    header_.stored_size[i] = static_cast<std::uint32_t>(length);
+    header_.raw_size[i] = static_cast<std::uint32_t>(raw.size());
+  }
+  header_.magic = CHUNK_MAGIC;
+
+  std::fwrite(&header_, 1, sizeof(header_), file_);
+  for (auto &column : stored)
+    std::fwrite(column.data(), 1, column.size(), file_);
+  if (std::ferror(file_))
+    throw std::runtime_error("Failed to write archive " + filename_);
+
+  Archive::Chunk chunk;
+  chunk.header = header_;
+  chunk.offset = 0;  // Only the header is needed here
+  chunks_.push_back(chunk);
+
+  header_ = {};
+  for (auto &column : columns_)
+    column.clear();
+
+  // The walk has written every message down to the oldest of the chunk.
+  if (walking_ && chunk.header.chat_id == walk_chat_id_)
+    writeRange(chunk.header.min_id, false);
+}
+
+void ArchiveWriter::writeRange(std::int64_t oldest_id, bool complete) {
+  Archive::Range range{RANGE_MAGIC, complete ? 1u : 0u, walk_chat_id_, walk_newest_id_, oldest_id};
+  std::fwrite(&range, 1, sizeof(range), file_);
+  if (std::ferror(file_))
+    throw std::runtime_error("Failed to write archive " + filename_);
+  ranges_.push_back(range);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// ArchiveReader
+/////////////////////////////////////////////////////////////////////////////
+
+ArchiveReader::ArchiveReader(const std::string &filename)
+  : file_(FileUtil::u8path(filename))
+{
+  std::vector<Archive::Range> ranges;
+  Archive::readIndex(file_.data(), file_.size(), chunks_, ranges);
+}
+
+std::string_view ArchiveReader::column(const Archive::Chunk &chunk, Archive::Column column) {
+  std::uint64_t offset = chunk.offset;
+  for (std::size_t i = 0; i < column; i++)
+    offset += chunk.header.stored_size[i];
+
+  auto &buffer = buffers_[column];
+  uLongf length = chunk.header.raw_size[column];
+  buffer.resize(length);
+  if (uncompress(reinterpret_cast<Bytef*>(buffer.data()), &length,
+                 reinterpret_cast<const Bytef*>(file_.data() + offset),
+                 chunk.header.stored_size[column]) != Z_OK
+      || length != chunk.header.raw_size[column])
+    throw std::runtime_error("Corrupted archive chunk");
+
+  bytes_read_ += chunk.header.stored_size[column];
+  return buffer;
+}
+
+void ArchiveReader::scan(const Filter &filter, const Visitor &visit) {
+  // Only the chunks that may hold a match, newest first.
+  std::vector<const Archive::Chunk*> selected;
+  for (auto &chunk : chunks_) {
+    auto &header = chunk.header;
+    if ((filter.chat_id != 0 && header.chat_id != filter.chat_id)
+        || header.max_id < filter.min_id || header.min_id > filter.max_id
+        || header.max_date < filter.since || header.min_date > filter.until)
+      continue;
+    selected.push_back(&chunk);
+  }
+  std::stable_sort(selected.begin(), selected.end(), [](auto a, auto b) {
+    return a->header.max_id > b->header.max_id;
+  });
+
+  std::uint8_t type = 0;
+  if (!filter.type.empty()) {
+    type = HistoryWriter::typeNumber(filter.type);
+    if (type == 0 && filter.type != HistoryWriter::typeName(0))
+      throw std::logic_error("Unknown message type: " + filter.type);
+  }
+
+  std::vector<std::int64_t> ids, dates, senders, sizes;
+  std::vector<std::uint8_t> types;
+  std::vector<std::string_view> texts, names, mimes;
+  std::vector<std::uint32_t> rows;
+  for (auto chunk : selected) {
+    std::size_t count = chunk->header.rows;
+    chunks_read_++;
+
+    ColumnReader id_column(column(*chunk, Archive::ColumnId));
+    ColumnReader date_column(column(*chunk, Archive::ColumnDate));
+    ids.resize(count);
+    dates.resize(count);
+    rows.clear();
+    std::int64_t id = 0, date = 0;
+    for (std::size_t i = 0; i < count; i++) {
+      ids[i] = id += id_column.signedVarint();
+      dates[i] = date += date_column.signedVarint();
+      if (id >= filter.min_id && id <= filter.max_id && date >= filter.since && date <= filter.until)
+        rows.push_back(static_cast<std::uint32_t>(i));
+    }
+
+    // The other columns, each read only if the rows left still need it.
+    auto readNumbers = [&](Archive::Column which, std::vector<std::int64_t> &values) {
+      ColumnReader reader(column(*chunk, which));
+      values.resize(count);
+      for (auto &value : values)
+        value = reader.signedVarint();
+    };
+    auto readStrings = [&](Archive::Column which, std::vector<std::string_view> &values) {
+      ColumnReader reader(column(*chunk, which));
+      values.resize(count);
+      for (auto &value : values)
+        value = reader.string();
+    };
+    auto readTypes = [&]() {
+      ColumnReader reader(column(*chunk, Archive::ColumnType));
+      types.resize(count);
+      for (auto &value : types)
+        value = reader.byte();
+    };
+    auto keep = [&rows](auto match) {
+      rows.erase(std::remove_if(rows.begin(), rows.end(), [&](std::uint32_t row) { return !match(row); }),
+                 rows.end());
+    };
+
+    bool have_senders = false, have_types = false, have_texts = false;
+    if (filter.sender_id != 0 && !rows.empty()) {
+      readNumbers(Archive::ColumnSender, senders);
+      have_senders = true;
+      keep([&](std::uint32_t row) { return senders[row] == filter.sender_id; });
+    }
+    if (!filter.type.empty() && !rows.empty()) {
+      readTypes();
+      have_types = true;
+      keep([&](std::uint32_t row) { return types[row] == type; });
+    }
+    if (!filter.text.empty() && !rows.empty()) {
+      readStrings(Archive::ColumnText, texts);
+      have_texts = true;
+      keep([&](std::uint32_t row) { return texts[row].find(filter.text) != std::string_view::npos; });
+    }
+    if (rows.empty())
+      continue;
+
+    if (!have_senders)
+      readNumbers(Archive::ColumnSender, senders);
+    if (!have_types)
+      readTypes();
+    if (!have_texts)
+      readStrings(Archive::ColumnText, texts);
+    readStrings(Archive::ColumnFileName, names);
+    readNumbers(Archive::ColumnFileSize, sizes);
+    readStrings(Archive::ColumnMimeType, mimes);
+
+    for (auto row : rows) {
+      HistoryWriter::Record record;
+      record.id = ids[row];
+      record.chat_id = chunk->header.chat_id;
+      record.date = dates[row];
+      record.sender_id = senders[row];
+      record.type = HistoryWriter::typeName(types[row]);
+      record.text = texts[row];
+      record.file_name = names[row];
+      record.file_size = sizes[row];
+      record.mime_type = mimes[row];
+      if (!visit(record))
+        return;
+    }
+  }
+}
@@ -0,0 +1,165 @@
+#ifndef CHAT_ARCHIVE_H
+#define CHAT_ARCHIVE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "historywriter.h"
+#include "utils.h"
+
+// Exported messages kept in a file of compressed column chunks, so that
+// queries over big chats don't have to parse every record again.
+//
+// The file is a versioned header followed by chunks of up to a few
+// thousand messages of one chat. A chunk starts with a fixed header that
+// holds its chat, the range of its message ids and dates, and the size of
+// each column, then the columns, each compressed with zlib on its own.
+// The chunk headers are the sparse index: a query walks them to skip the
+// chunks outside its range, and in the others only decompresses the
+// columns it filters on, then the rest for the rows that matched.
+//
+// Writing only ever appends chunks, a chunk cut short by a crash is
+// dropped the next time the archive is opened for writing. A history walk
+// also appends range records after its chunks: every message of a chat
+// between two ids is archived, down to its first message once the walk
+// reached it. Later walks skip those ranges and carry on below them.
+namespace Archive
+{
+
+enum Column {
+  ColumnId,         // Deltas from the previous row, zigzag varints
+  ColumnDate,       // Deltas from the previous row, zigzag varints
+  ColumnSender,     // Zigzag varints
+  ColumnType,       // A byte per row
+  ColumnText,       // Varint length and bytes per row
+  ColumnFileName,
+  ColumnFileSize,   // Zigzag varints, -1 without a file
+  ColumnMimeType,
+  COLUMNS
+};
+
+struct ChunkHeader {
+  std::uint32_t magic;
+  std::uint32_t rows;
+  std::int64_t chat_id;
+  std::int64_t min_id;
+  std::int64_t max_id;
+  std::int64_t min_date;
+  std::int64_t max_date;
+  std::uint32_t stored_size[COLUMNS];
+  std::uint32_t raw_size[COLUMNS];
+};
+
+// Every message of a chat from oldest_id to newest_id is in the archive,
+// and none older exists when `complete` is set.
+struct Range {
+  std::uint32_t magic;
+  std::uint32_t complete;
+  std::int64_t chat_id;
+  std::int64_t newest_id;
+  std::int64_t oldest_id;
+};
+
+struct Chunk {
+  ChunkHeader header;
+  std::uint64_t offset;  // Of the first column
+};
+
+// Walk the chunk headers and ranges of a file, returns the size of its
+// complete part, or throws if it isn't an archive.
+std::size_t readIndex(const char *data, std::size_t size, std::vector<Chunk> &chunks,
+                      std::vector<Range> &ranges);
+
+} // namespace Archive
+
+class ArchiveWriter {
+public:
+  // Create the file, or open it to append more chunks.
+  explicit ArchiveWriter(const std::string &filename, std::size_t chunk_rows = 4096);
+  // Writes what is left, errors are then ignored.
+  ~ArchiveWriter();
+
+  ArchiveWriter(const ArchiveWriter&) = delete;
+  ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+
+  void write(const td_api::message &message);
+  void write(const HistoryWriter::Record &record);
+  // Write the pending rows as a chunk, even if it isn't full.
+  void flush();
+
+  // Start walking a chat back in time from `newest_id`. Until endWalk(),
+  // every chunk written records the range from it to its oldest message.
+  void beginWalk(std::int64_t chat_id, std::int64_t newest_id);
+  // Write the pending rows and record the walk down to `oldest_id`, the
+  // first message of the chat if `complete`.
+  void endWalk(std::int64_t oldest_id, bool complete);
+  // The archived ranges of a chat, newest first, overlapping ones merged.
+  std::vector<Archive::Range> ranges(std::int64_t chat_id) const;
+  std::size_t count() const { return count_; }
+
+private:
+  void writeChunk();
+  void writeRange(std::int64_t oldest_id, bool complete);
+
+  std::string filename_;
+  std::size_t chunk_rows_;
+  std::FILE *file_{nullptr};
+  std::vector<Archive::Chunk> chunks_;
+  std::vector<Archive::Range> ranges_;
+  std::size_t count_{0};
+  bool walking_{false};
+  std::int64_t walk_chat_id_{0};
+  std::int64_t walk_newest_id_{0};
+
+  Archive::ChunkHeader header_{};
+  std::int64_t last_id_{0};
+  std::int64_t last_date_{0};
+  std::string columns_[Archive::COLUMNS];
+};
+
+class ArchiveReader {
+public:
+  struct Filter {
+    std::int64_t chat_id = 0;  // 0 for every chat
+    std::int64_t min_id = std::numeric_limits<std::int64_t>::min();
+    std::int64_t max_id = std::numeric_limits<std::int64_t>::max();
+    std::int64_t since = std::numeric_limits<std::int64_t>::min();
+    std::int64_t until = std::numeric_limits<std::int64_t>::max();
+    std::int64_t sender_id = 0;  // 0 for every sender
+    std::string type;            // Empty for every type
+    std::string text;            // A substring of the text, empty for any
+  };
+
+  // Return false to stop the scan.
+  using Visitor = std::function<bool(const HistoryWriter::Record &record)>;
+
+  explicit ArchiveReader(const std::string &filename);
+
+  ArchiveReader(const ArchiveReader&) = delete;
+  ArchiveReader& operator=(const ArchiveReader&) = delete;
+
+  // Visit the matching messages, newest chunks first.
+  void scan(const Filter &filter, const Visitor &visit);
+
+  const std::vector<Archive::Chunk> &chunks() const { return chunks_; }
+  std::size_t fileSize() const { return file_.size(); }
+  // Chunks and bytes decompressed by scan() so far.
+  std::size_t chunksRead() const { return chunks_read_; }
+  std::uint64_t bytesRead() const { return bytes_read_; }
+
+private:
+  std::string_view column(const Archive::Chunk &chunk, Archive::Column column);
+
+  FileUtil::MappedFile file_;
+  std::vector<Archive::Chunk> chunks_;
+  std::string buffers_[Archive::COLUMNS];
+  std::size_t chunks_read_{0};
+  std::uint64_t bytes_read_{0};
+};
+
+#endif // CHAT_ARCHIVE_H
@@ -0,0 +1,202 @@
+#include "chatindex.h"
+
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+
+#include <td/utils/utf8.h>
+
+#include "unicodefold.h"
+
+template <class Map>
+static void eraseEntry(Map &map, const typename Map::key_type &key, std::int64_t chat_id) {
+  auto range = map.equal_range(key);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == chat_id) {
+      map.erase(it);
+      return;
+    }
+  }
+}
+
+template <class Map>
+static std::int64_t findFirst(const Map &map, const std::string &key) {
+  auto it = map.find(key);
+  return it == map.end() ? 0 : it->second;
+}
+
+std::string ChatIndex::normalize(const std::string &text) {
+  // Accents, compatibility forms and Unicode punctuation are folded first,
+  // utf8_to_lower then folds the case of the letters left.
+  std::string lower = td::utf8_to_lower(UnicodeFold::fold(text));
+  std::string result;
+  result.reserve(lower.size());
+  bool space = false;
+  for (unsigned char c : lower) {
+    if (c < 0x80 && !std::isalnum(c)) {
+      space = !result.empty();
+      continue;
+    }
+    if (space) {
+      result += ' ';
+      space = false;
+    }
+    result += static_cast<char>(c);
+  }
+  return result;
+}
+
+std::string ChatIndex::usernameKey(const std::string &username) {
+  std::string key = username.size() > 0 && username[0] == '@' ? username.substr(1) : username;
+  // Usernames are ASCII only.
+  for (auto &c : key)
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  return key;
+}
+
+std::vector<std::string> ChatIndex::trigrams(const std::string &normalized) {
+  // Pad so that short titles and word starts get trigrams too. Bytes are
+  // used rather than code points, which is good enough for ranking.
+  std::string padded = "  " + normalized + " ";
+  std::vector<std::string> result;
+  for (std::size_t i = 0; i + 3 <= padded.size(); i++)
+    result.push_back(padded.substr(i, 3));
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+void ChatIndex::set(std::int64_t chat_id, const std::string &title) {
+  std::unique_lock<std::shared_mutex> lock{mutex_};
+  auto it = titles_.find(chat_id);
+  if (it != titles_.end()) {
+    if (it->second == title)
+      return;
+    eraseLocked(chat_id);
+  }
+
+  auto normalized = normalize(title);
+  titles_[chat_id] = title;
+  exact_.emplace(title, chat_id);
+  normalized_.emplace(normalized, chat_id);
+  sorted_.emplace(normalized, chat_id);
+  for (auto &gram : trigrams(normalized))
+    trigrams_[gram].insert(chat_id);
+}
+
+void ChatIndex::setUsername(std::int64_t chat_id, const std::string &username) {
+  auto key = usernameKey(username);
+  std::unique_lock<std::shared_mutex> lock{mutex_};
+  auto it = usernames_.find(chat_id);
+  if (it != usernames_.end()) {
+    if (it->second == key)
+      return;
+    username_chats_.erase(it->second);
+    usernames_.erase(it);
+  }
+
+  if (key.empty())
+    return;
+  usernames_[chat_id] = key;
+  username_chats_[key] = chat_id;
+}
+
+// Remove a chat from every index but titles_, mutex_ must be held.
+void ChatIndex::eraseLocked(std::int64_t chat_id) {
+  auto &title = titles_[chat_id];
+  auto normalized = normalize(title);
+  eraseEntry(exact_, title, chat_id);
+  eraseEntry(normalized_, normalized, chat_id);
+  eraseEntry(sorted_, normalized, chat_id);
+  for (auto &gram : trigrams(normalized)) {
+    auto it = trigrams_.find(gram);
+    if (it == trigrams_.end())
+      continue;
+    it->second.erase(chat_id);
+    if (it->second.empty())
+      trigrams_.erase(it);
+  }
+}
+
+std::string ChatIndex::title(std::int64_t chat_id) const {
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  auto it = titles_.find(chat_id);
+  return it == titles_.end() ? std::string() : it->second;
+}
+
+bool ChatIndex::contains(std::int64_t chat_id) const {
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  return titles_.count(chat_id) > 0;
+}
+
+std::size_t ChatIndex::size() const {
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  return titles_.size();
+}
+
+std::int64_t ChatIndex::findExact(const std::string &title) const {
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  return findFirst(exact_, title);
+}
+
+std::int64_t ChatIndex::findNormalized(const std::string &title) const {
+  auto normalized = normalize(title);
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  return findFirst(normalized_, normalized);
+}
+
+std::int64_t ChatIndex::findUsername(const std::string &username) const {
+  auto key = usernameKey(username);
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  auto it = username_chats_.find(key);
+  return it == username_chats_.end() ? 0 : it->second;
+}
+
+std::vector<std::int64_t> ChatIndex::findPrefix(const std::string &prefix, std::size_t limit) const {
+  auto normalized = normalize(prefix);
+  std::vector<std::int64_t> result;
+  if (normalized.empty())
+    return result;
+
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  for (auto it = sorted_.lower_bound(normalized);
+       it != sorted_.end() && result.size() < limit && it->first.compare(0, normalized.size(), normalized) == 0;
+       ++it)
+    result.push_back(it->second);
+  return result;
+}
+
+std::vector<std::int64_t> ChatIndex::findFuzzy(const std::string &query, std::size_t limit) const {
+  auto grams = trigrams(normalize(query));
+  if (grams.empty())
+    return {};
+
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  std::unordered_map<std::int64_t, std::size_t> shared;
+  for (auto &gram : grams) {
+    auto it = trigrams_.find(gram);
+    if (it == trigrams_.end())
+      continue;
+    for (auto chat_id : it->second)
+      shared[chat_id]++;
+  }
+
+  // Rank by the Dice coefficient of the trigram sets.
+  std::vector<std::pair<double, std::int64_t>> scored;
+  for (auto &pair : shared) {
+    auto title_grams = trigrams(normalize(titles_.at(pair.first))).size();
+    double score = 2.0 * pair.second / (grams.size() + title_grams);
+    if (score >= 0.3)
+      scored.emplace_back(score, pair.first);
+  }
+  lock.unlock();
+
+  std::sort(scored.begin(), scored.end(), [](auto &a, auto &b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  });
+
+  std::vector<std::int64_t> result;
+  for (std::size_t i = 0; i < scored.size() && i < limit; i++)
+    result.push_back(scored[i].second);
+  return result;
+}
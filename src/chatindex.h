@@ -0,0 +1,56 @@
+#ifndef CHAT_INDEX_H
+#define CHAT_INDEX_H
+
+#include <cstdint>
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Resolves chat titles to chat ids. Titles are indexed as they are, in a
+// normalized form (see normalize()) and by trigrams of the normalized form
+// for fuzzy matching. It is updated incrementally from updateNewChat and
+// updateChatTitle.
+class ChatIndex {
+public:
+  // Add a chat or change its title.
+  void set(std::int64_t chat_id, const std::string &title);
+  // Set the public username of a chat, an empty one removes it.
+  void setUsername(std::int64_t chat_id, const std::string &username);
+
+  // Return the title of a chat, or an empty string if it is unknown.
+  std::string title(std::int64_t chat_id) const;
+  bool contains(std::int64_t chat_id) const;
+  std::size_t size() const;
+
+  // The following return 0 or an empty vector when nothing matches.
+  std::int64_t findExact(const std::string &title) const;
+  std::int64_t findNormalized(const std::string &title) const;
+  // Usernames are matched without case and with or without a leading '@'.
+  std::int64_t findUsername(const std::string &username) const;
+  std::vector<std::int64_t> findPrefix(const std::string &prefix, std::size_t limit = 10) const;
+  // Chats with the most similar titles first.
+  std::vector<std::int64_t> findFuzzy(const std::string &query, std::size_t limit = 5) const;
+
+  // NFKD without accents, in lower case, with punctuation and runs of
+  // spaces folded to one space.
+  static std::string normalize(const std::string &text);
+
+private:
+  static std::string usernameKey(const std::string &username);
+  static std::vector<std::string> trigrams(const std::string &normalized);
+  void eraseLocked(std::int64_t chat_id);
+
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<std::int64_t, std::string> titles_;
+  std::unordered_multimap<std::string, std::int64_t> exact_;
+  std::unordered_multimap<std::string, std::int64_t> normalized_;
+  std::multimap<std::string, std::int64_t> sorted_;
+  std::unordered_map<std::string, std::unordered_set<std::int64_t>> trigrams_;
+  std::unordered_map<std::int64_t, std::string> usernames_;
+  std::unordered_map<std::string, std::int64_t> username_chats_;
+};
+
+#endif // CHAT_INDEX_H
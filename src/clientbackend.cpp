@@ -0,0 +1,28 @@
+#include "clientbackend.h"
+
+#include <nowide/iostream.hpp>
+
+TdClientBackend::TdClientBackend() {
+  td::ClientManager::execute(td_api::make_object<td_api::setLogVerbosityLevel>(0));
+  td::ClientManager::execute(td_api::make_object<td_api::setLogStream>(td_api::make_object<td_api::logStreamEmpty>()));
+  td::ClientManager::set_log_message_callback(1, [] (int verbosity_level, const char *message) {
+    if (verbosity_level == 0)
+      nowide::cerr << "Fatal ";
+    nowide::cerr << "Error: " << message << std::endl;
+  });
+
+  client_manager_ = std::make_unique<td::ClientManager>();
+}
+
+std::int32_t TdClientBackend::createClientId() {
+  return client_manager_->create_client_id();
+}
+
+void TdClientBackend::send(std::int32_t client_id, std::uint64_t request_id,
+                           td_api::object_ptr<td_api::Function> function) {
+  client_manager_->send(client_id, request_id, std::move(function));
+}
+
+ClientBackend::Response TdClientBackend::receive(double timeout) {
+  return client_manager_->receive(timeout);
+}
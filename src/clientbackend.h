@@ -0,0 +1,43 @@
+#ifndef CLIENT_BACKEND_H
+#define CLIENT_BACKEND_H
+
+#include <cstdint>
+#include <memory>
+
+#include <td/telegram/Client.h>
+
+#include "common.h"
+
+// What ClientHub needs from TDLib. TdClientBackend is the real thing,
+// FakeBackend answers in process so that the code around it can be
+// measured without a Telegram account.
+class ClientBackend {
+public:
+  typedef td::ClientManager::Response Response;
+
+  virtual ~ClientBackend() = default;
+
+  virtual std::int32_t createClientId() = 0;
+  virtual void send(std::int32_t client_id, std::uint64_t request_id,
+                    td_api::object_ptr<td_api::Function> function) = 0;
+  // Wait up to `timeout` seconds for a response or an update, the object
+  // of the response is null if none arrived.
+  virtual Response receive(double timeout) = 0;
+  // Make a pending receive() return now, if the backend can.
+  virtual void interrupt() {}
+};
+
+class TdClientBackend : public ClientBackend {
+public:
+  TdClientBackend();
+
+  std::int32_t createClientId() override;
+  void send(std::int32_t client_id, std::uint64_t request_id,
+            td_api::object_ptr<td_api::Function> function) override;
+  Response receive(double timeout) override;
+
+private:
+  std::unique_ptr<td::ClientManager> client_manager_;
+};
+
+#endif // CLIENT_BACKEND_H
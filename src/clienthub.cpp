@@ -0,0 +1,137 @@
+#include "clienthub.h"
+
+#include <algorithm>
+#include <mutex>
+
+#include "tdchannel.h"
+
+ClientHub::ClientHub(std::unique_ptr<ClientBackend> backend)
+  : backend_(backend ? std::move(backend) : std::make_unique<TdClientBackend>())
+{
+}
+
+ClientHub::~ClientHub() {
+  stop();
+  // Join the receive thread first so that nothing is queued any more.
+  thread_.reset();
+  workers_.clear();
+}
+
+std::int32_t ClientHub::addChannel(TdChannel *channel) {
+  auto client_id = backend_->createClientId();
+  std::unique_lock<std::shared_mutex> lock{channels_mutex_};
+  channels_[client_id] = channel;
+  client_ids_.push_back(client_id);
+  return client_id;
+}
+
+void ClientHub::removeChannel(std::int32_t client_id) {
+  std::unique_lock<std::shared_mutex> lock{channels_mutex_};
+  channels_.erase(client_id);
+  client_ids_.erase(std::remove(client_ids_.begin(), client_ids_.end(), client_id), client_ids_.end());
+}
+
+std::vector<TdChannel*> ClientHub::channels() const {
+  std::shared_lock<std::shared_mutex> lock{channels_mutex_};
+  std::vector<TdChannel*> result;
+  for (auto client_id : client_ids_)
+    result.push_back(channels_.at(client_id));
+  return result;
+}
+
+void ClientHub::send(std::int32_t client_id, std::uint64_t request_id, td_api::object_ptr<td_api::Function> function) {
+  backend_->send(client_id, request_id, std::move(function));
+}
+
+void ClientHub::start() {
+  if (started_.exchange(true))
+    return;
+
+  for (std::size_t i = 0; i < worker_count_; i++) {
+    auto worker = std::make_unique<Worker>();
+    auto &ref = *worker;
+    worker->thread = std::make_unique<ScopedThread>([this, &ref] {
+      this->runWorker(ref);
+    });
+    workers_.push_back(std::move(worker));
+  }
+
+  thread_ = std::make_unique<ScopedThread>([this] {
+    this->receiveResponses();
+  });
+}
+
+void ClientHub::stop() {
+  if (!stop_.exchange(true, std::memory_order_acq_rel)) {
+    // Whatever the first worker still drains, responses stop waiting for it.
+    updates_handled_.fetch_add(STOPPED, std::memory_order_release);
+    updates_handled_.notify_all();
+  }
+  backend_->interrupt();
+  for (auto &worker : workers_)
+    worker->queue.wake();
+}
+
+void ClientHub::poll(double timeout) {
+  auto response = backend_->receive(timeout);
+  if (response.object)
+    dispatch(std::move(response));
+}
+
+void ClientHub::receiveResponses() {
+  while (!stop_.load(std::memory_order_acquire)) {
+    auto response = backend_->receive(5);
+    if (!response.object)
+      continue;
+    bool ordered = isOrderedUpdate(response);
+    auto sequence = ordered ? ++updates_queued_ : updates_queued_;
+    workerFor(response).queue.push({std::move(response), sequence, ordered});
+  }
+}
+
+// Chat, user and authorization updates change what the channels know, the
+// query that follows them must see it: they are handled in the order TDLib
+// sent them by the first worker, and a response waits for the ones before
+// it. File progress only concerns the download that asked for it.
+bool ClientHub::isOrderedUpdate(const ClientBackend::Response &response) {
+  return response.request_id == 0 && response.object->get_id() != td_api::updateFile::ID;
+}
+
+// Responses are spread over the workers by request id, file updates by
+// client and file id, which keeps the updates of one file in order.
+ClientHub::Worker &ClientHub::workerFor(const ClientBackend::Response &response) {
+  if (workers_.size() == 1 || isOrderedUpdate(response))
+    return *workers_.front();
+  if (response.request_id != 0)
+    return *workers_[response.request_id % workers_.size()];
+  auto &update = static_cast<const td_api::updateFile &>(*response.object);
+  auto key = static_cast<std::uint64_t>(static_cast<std::uint32_t>(response.client_id)) * 31
+           + static_cast<std::uint32_t>(update.file_->id_);
+  return *workers_[1 + key % (workers_.size() - 1)];
+}
+
+void ClientHub::runWorker(Worker &worker) {
+  while (auto queued = worker.queue.popWait(stop_)) {
+    if (queued->ordered_update) {
+      dispatch(std::move(queued->response));
+      updates_handled_.fetch_add(1, std::memory_order_release);
+      updates_handled_.notify_all();
+      continue;
+    }
+    if (queued->response.request_id != 0) {
+      auto handled = updates_handled_.load(std::memory_order_acquire);
+      while (handled < queued->sequence) {
+        updates_handled_.wait(handled, std::memory_order_acquire);
+        handled = updates_handled_.load(std::memory_order_acquire);
+      }
+    }
+    dispatch(std::move(queued->response));
+  }
+}
+
+void ClientHub::dispatch(ClientBackend::Response response) {
+  std::shared_lock<std::shared_mutex> lock{channels_mutex_};
+  auto it = channels_.find(response.client_id);
+  if (it != channels_.end())
+    it->second->process_response(std::move(response));
+}
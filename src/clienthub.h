@@ -0,0 +1,90 @@
+#ifndef CLIENT_HUB_H
+#define CLIENT_HUB_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "clientbackend.h"
+#include "common.h"
+#include "mpscqueue.h"
+#include "scopedthread.h"
+
+class TdChannel;
+
+// Owns the TDLib client backend shared by every account. One thread drains
+// its receive() into the queues of a pool of workers, which
+// hand each response to the TdChannel of the client id it belongs to.
+// Updates other than updateFile are handled in order by the first worker,
+// query responses and file updates are spread over all of them.
+class ClientHub {
+public:
+  // Talk to TDLib unless another backend is given.
+  explicit ClientHub(std::unique_ptr<ClientBackend> backend = nullptr);
+  ~ClientHub();
+
+  ClientHub(const ClientHub&) = delete;
+  ClientHub& operator=(const ClientHub&) = delete;
+
+  // Create a TDLib client for a channel and route its responses to it.
+  std::int32_t addChannel(TdChannel *channel);
+  // Once it returns, no handler of the channel runs any more.
+  void removeChannel(std::int32_t client_id);
+  // Every channel, in the order they were added.
+  std::vector<TdChannel*> channels() const;
+
+  void send(std::int32_t client_id, std::uint64_t request_id, td_api::object_ptr<td_api::Function> function);
+
+  // Number of threads running response handlers, set before start().
+  void setWorkerCount(std::size_t count) { worker_count_ = count == 0 ? 1 : count; }
+
+  // Start the receive thread and the workers, does nothing if they run.
+  void start();
+  void stop();
+  bool started() const { return started_.load(std::memory_order_acquire); }
+  // Receive and handle responses on the calling thread, only before start().
+  void poll(double timeout);
+
+private:
+  struct Queued {
+    ClientBackend::Response response;
+    // For an ordered update its number among them, for a query response
+    // the number of ordered updates received before it.
+    std::uint64_t sequence;
+    bool ordered_update;
+  };
+
+  struct Worker {
+    MpscQueue<Queued> queue;
+    std::unique_ptr<ScopedThread> thread;
+  };
+
+  void receiveResponses();
+  void runWorker(Worker &worker);
+  static bool isOrderedUpdate(const ClientBackend::Response &response);
+  Worker &workerFor(const ClientBackend::Response &response);
+  void dispatch(ClientBackend::Response response);
+
+  std::unique_ptr<ClientBackend> backend_;
+
+  // Held shared while a channel handles a response.
+  mutable std::shared_mutex channels_mutex_;
+  std::unordered_map<std::int32_t, TdChannel*> channels_;
+  std::vector<std::int32_t> client_ids_;
+
+  std::size_t worker_count_{2};
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::unique_ptr<ScopedThread> thread_;
+  std::atomic<bool> started_{false};
+  std::atomic<bool> stop_{false};
+  // Ordered updates queued by the receive thread and handled by the first
+  // worker, responses wait until the updates before them are handled.
+  static constexpr std::uint64_t STOPPED = std::uint64_t{1} << 62;
+  std::uint64_t updates_queued_{0};
+  std::atomic<std::uint64_t> updates_handled_{0};
+};
+
+#endif // CLIENT_HUB_H
@@ -1,16 +1,60 @@
 ﻿#include "commands.h"
 
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 #include <nowide/cstdio.hpp>
 #include <nowide/fstream.hpp>
 #include <nowide/quoted.hpp>
 
 #include "tdchannel.h"
+#include "chatarchive.h"
+#include "historywriter.h"
+#include "messagecursor.h"
+#include "metrics.h"
 #include "utils.h"
 
 namespace fs = std::filesystem;
 
+// Seconds since the epoch of a local date, like 2023-01-31T08:00:00 or 2023-01-31.
+static std::time_t parseDate(const std::string &date) {
+  std::tm t = {};
+  std::istringstream ss(date);
+  // FIXME: make use of Time.h of tdutils
+  ss >> std::get_time(&t, "%Y-%m-%dT%H:%M:%S");
+  if (ss.fail()) {
+    t = {};
+    ss.clear();
+    ss.str(date);
+    ss >> std::get_time(&t, "%Y-%m-%d");
+  }
+  if (ss.fail())
+    throw std::logic_error("Parse date failed");
+
+  t.tm_isdst = -1;
+  return std::mktime(&t);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Program
+/////////////////////////////////////////////////////////////////////////////
+
+std::string Program::workingDirectory() const {
+  return working_directory_.empty() ? FileUtil::u8string(fs::current_path()) : working_directory_;
+}
+
+std::string Program::absolutePath(const std::string &path) const {
+  if (path.empty() || working_directory_.empty() || FileUtil::u8path(path).is_absolute())
+    return path;
+  return FileUtil::u8string(FileUtil::u8path(working_directory_) / FileUtil::u8path(path));
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // CmdChats
 /////////////////////////////////////////////////////////////////////////////
@@ -31,8 +75,36 @@ CmdDownload::CmdDownload(std::shared_ptr<TdChannel> &channel)
   auto opt_chat_title = app_->add_option("--chat-id,-t", chat_title_, "chat id or title, "
                    "if specified the content of options `-R` and `-f` "
                    "will be interpreted as message IDs.");
-  app_->add_option("--output-folder,-O", output_folder_,
+  auto opt_since = app_->add_option("--since", since_,
+                   "Download the files of the messages sent at or after this date (ISO format), "
+                   "require chat title.");
+  auto opt_until = app_->add_option("--until", until_,
+                   "Download the files of the messages sent before this date (ISO format), "
+                   "require chat title.");
+  app_->add_flag("--photos", photos_, "Only download photos of a range or dates.");
+  app_->add_flag("--videos", videos_, "Only download videos of a range or dates.");
+  app_->add_flag("--documents", documents_, "Only download documents of a range or dates.");
+  opt_output_folder_ = app_->add_option("--output-folder,-O", output_folder_,
                    "Put downloaded files to a given folder.");
+  app_->add_option("--max-concurrent,-j", max_concurrent_,
+                   "The maximum number of files each account downloads at the same time.")
+      ->check(CLI::PositiveNumber);
+  app_->add_option("--order", order_,
+                   "The order to download files in: message, smallest or largest.")
+      ->check(CLI::IsMember({"message", "smallest", "largest"}));
+  app_->add_option("--priority", priority_,
+                   "TDLib download priority (1-32), files started later get lower ones.")
+      ->check(CLI::Range(1, 32));
+  app_->add_option("--job", job_,
+                   "Record the job in a journal under this name so that it can be resumed. "
+                   "Range downloads are always recorded.");
+  auto opt_resume = app_->add_option("--resume", resume_,
+                   "Resume an interrupted job, skipping the files already downloaded.");
+  app_->add_flag("--no-progress", no_progress_, "Don't draw the download progress.");
+  app_->add_flag("--no-dedup", no_dedup_,
+                 "Download files again even if they were already downloaded before.");
+  app_->add_flag("--no-shard", no_shard_,
+                 "Download with the main account only, even if other accounts are logged in.");
 
   opt_ids->needs(opt_chat_title);
   opt_ids->excludes(opt_links);
@@ -40,7 +112,13 @@ CmdDownload::CmdDownload(std::shared_ptr<TdChannel> &channel)
   opt_input_file->excludes(opt_links, opt_ids);
   opt_range->excludes(opt_input_file, opt_links, opt_ids);
 
+  opt_since->needs(opt_chat_title);
+  opt_until->needs(opt_chat_title);
+  opt_since->excludes(opt_input_file, opt_links, opt_ids, opt_range);
+  opt_until->excludes(opt_input_file, opt_links, opt_ids, opt_range);
+
   opt_chat_title->excludes(opt_links);
+  opt_resume->excludes(opt_links, opt_ids, opt_input_file, opt_range, opt_chat_title);
 }
 
 void CmdDownload::reset() {
@@ -48,40 +126,251 @@ void CmdDownload::reset() {
   links_.clear();
   msg_ids_.clear();
   input_file_.clear();
-  output_folder_ = fs::current_path().u8string();
+  output_folder_ = workingDirectory();
   range_.clear();
+  since_.clear();
+  until_.clear();
+  photos_ = false;
+  videos_ = false;
+  documents_ = false;
+  max_concurrent_ = 4;
+  order_ = "message";
+  priority_ = 32;
+  job_.clear();
+  resume_.clear();
+  journal_.reset();
+  no_dedup_ = false;
+  no_progress_ = false;
+  no_shard_ = false;
+  media_index_.reset();
+  accounts_.clear();
+  assigned_bytes_.clear();
+  reachable_.clear();
+  queued_files_.clear();
 }
 
 void CmdDownload::run(std::ostream& out) {
+  coro::Executor executor;
+  executor.run(runAsync(out));
+}
+
+coro::Task<void> CmdDownload::runAsync(std::ostream& out) {
+  output_folder_ = absolutePath(output_folder_);
+  input_file_ = absolutePath(input_file_);
+
+  // Files downloaded by earlier jobs, whatever chat they came from.
+  media_index_ = MediaIndex::shared(channel_->databaseDirectory());
+
+  // Accounts added with `--account` share the files of a job with the main one.
+  accounts_ = {channel_.get()};
+  if (!no_shard_) {
+    for (auto channel : channel_->hub()->channels()) {
+      if (channel != channel_.get())
+        accounts_.push_back(channel);
+    }
+  }
+  assigned_bytes_.assign(accounts_.size(), 0);
+
+  if (!resume_.empty()) {
+    co_await resumeJob(out);
+    journal_.reset();
+    co_return;
+  }
+
+  if (!job_.empty())
+    openJournal(job_, false);
+
   if (!input_file_.empty()) {
     // Get links or IDs from file.
     parseMessagesInFile(input_file_);
   }
 
+  std::vector<int64_t> ids;
+  for (auto &s : msg_ids_) {
+    try {
+      ids.push_back(std::stoll(s));
+    } catch (std::invalid_argument const&) {
+      throw std::logic_error("invalid message id: " + s);
+    } catch (std::out_of_range const&) {
+      throw std::logic_error("message id is out of range: " + s);
+    }
+  }
+
+  int64_t chat_id = 0;
+  if (!ids.empty()) {
+    if (chat_title_.empty())
+      throw std::logic_error("Chat id or chat title should be provided.");
+    chat_id = channel_->getChatId(chat_title_);
+  }
+
+  // Record what the job was given before resolving any of it, so that a
+  // resumed job can resolve the messages it never got to.
+  if (journal_) {
+    for (auto &link : links_)
+      journal_->recordLink(link);
+    for (auto id : ids)
+      journal_->recordMessage(chat_id, id);
+  }
+
   if (!links_.empty())
-    download(out, links_);
+    co_await download(out, links_);
 
-  if (!msg_ids_.empty()) {
+  if (!ids.empty())
+    co_await download(out, chat_id, ids);
 
-    std::vector<int64_t> ids;
-    for (auto &s : msg_ids_) {
-      try {
-        ids.push_back(std::stoll(s));
-      } catch (std::invalid_argument const&) {
-        throw std::logic_error("invalid message id: " + s);
-      } catch (std::out_of_range const&) {
-        throw std::logic_error("message id is out of range: " + s);
-      }
+  if (!range_.empty() || !since_.empty() || !until_.empty())
+    co_await downloadMessagesInRange(out);
+
+  journal_.reset();
+}
+
+void CmdDownload::openJournal(const std::string &job, bool resume) {
+  auto path = DownloadJournal::pathFor(channel_->databaseDirectory(), job);
+  journal_ = std::make_unique<DownloadJournal>(path, resume);
+  if (!resume)
+    journal_->recordHeader(output_folder_);
+}
+
+// Extract the media files in messages as download tasks.
+static std::vector<DownloadTask> extractDownloadTasks(std::vector<MessagePtr> &messages) {
+  std::vector<DownloadTask> tasks;
+  for (auto &msg : messages) {
+    size_t ntasks = tasks.size();
+    td_api::downcast_call(
+      *(msg->content_), overloaded(
+        [&](td_api::messageDocument &content) {
+          tasks.emplace(tasks.end(),
+            content.document_->document_->id_,
+            content.document_->file_name_,
+            content.document_->document_->local_->can_be_downloaded_,
+            content.document_->document_->local_->is_downloading_completed_,
+            std::move(content.document_->document_)
+          );
+        },
+        [&](td_api::messageVideo &content) {
+          tasks.emplace(tasks.end(),
+            content.video_->video_->id_,
+            content.video_->file_name_,
+            content.video_->video_->local_->can_be_downloaded_,
+            content.video_->video_->local_->is_downloading_completed_,
+            std::move(content.video_->video_)
+          );
+        },
+        [&](td_api::messagePhoto &content) {
+          auto &ps = content.photo_->sizes_;
+          auto ret = std::max_element(ps.begin(), ps.end(), [] (auto &a, auto &b) {
+            return a->photo_->expected_size_ < b->photo_->expected_size_;
+          });
+          auto &ph = *ret;
+          tasks.emplace(tasks.end(),
+            ph->photo_->id_,
+            content.caption_->text_,
+            ph->photo_->local_->can_be_downloaded_,
+            ph->photo_->local_->is_downloading_completed_,
+            std::move(ph->photo_)
+          );
+        },
+        [](auto &content) {/* Unsupported message. */}
+      )
+    );
+
+    if (tasks.size() > ntasks) {
+      tasks.back().chat_id = msg->chat_id_;
+      tasks.back().message_id = msg->id_;
     }
+  }
 
-    if (chat_title_.empty())
-      throw std::logic_error("Chat id or chat title should be provided.");
+  return tasks;
+}
+
+coro::Task<void> CmdDownload::resumeJob(std::ostream& out) {
+  auto path = DownloadJournal::pathFor(channel_->databaseDirectory(), resume_);
+  if (!fs::exists(FileUtil::u8path(path)))
+    throw std::logic_error("Job not found: " + resume_);
+
+  auto state = DownloadJournal::load(path);
+  if (!opt_output_folder_->count())
+    output_folder_ = state.output_folder;
+
+  openJournal(resume_, true);
+
+  // Messages given by link or id are resolved again unless their file is
+  // already among the tasks, the job may have stopped before getting to them.
+  std::set<std::pair<int64_t, int64_t>> journaled;
+  for (auto &pair : state.tasks)
+    journaled.emplace(pair.second.chat_id, pair.second.message_id);
+
+  std::vector<MessagePtr> messages;
+  if (!state.links.empty())
+    messages = co_await resolveLinks(out, state.links);
+  std::map<int64_t, std::vector<int64_t>> ids;
+  for (auto &message : state.messages) {
+    if (!journaled.count(message))
+      ids[message.first].push_back(message.second);
+  }
+  for (auto &pair : ids) {
+    for (auto &message : co_await resolveMessages(out, pair.first, pair.second))
+      messages.push_back(std::move(message));
+  }
+  messages.erase(std::remove_if(messages.begin(), messages.end(), [&](const MessagePtr &message) {
+    return journaled.count({message->chat_id_, message->id_}) > 0;
+  }), messages.end());
+
+  // File ids stay valid in the same database, so the remaining files can
+  // be downloaded without resolving their messages again.
+  std::vector<const DownloadJournal::Entry*> remaining;
+  std::vector<td_api::object_ptr<td_api::getFile>> queries;
+  for (auto &pair : state.tasks) {
+    if (state.done.count(pair.first))
+      continue;
+    remaining.push_back(&pair.second);
+    queries.push_back(td_api::make_object<td_api::getFile>(pair.first));
+  }
 
-    download(out, chat_title_, ids);
+  out << "Resuming job " << resume_ << ": " << state.done.size() << " files done, "
+      << remaining.size() << " remaining";
+  if (state.isRange() && !state.resolved)
+    out << ", resolving messages from " << (state.checkpoint ? state.checkpoint : state.from_id);
+  if (!messages.empty())
+    out << ", " << messages.size() << (messages.size() > 1 ? " messages" : " message") << " not started";
+  out << std::endl;
+
+  // Journals written before the inputs were recorded don't say what a job
+  // that stopped while resolving was given.
+  if (!state.isRange() && !state.resolved && state.links.empty() && state.messages.empty())
+    out << "Job " << resume_ << " doesn't record the messages it was given, only the files above "
+        << "can be resumed, download the others again." << std::endl;
+
+  DownloadScheduler scheduler(accounts_, out, schedulerOptions());
+  auto files = co_await channel_->queryMany(std::move(queries));
+  std::vector<DownloadTask> tasks;
+  for (size_t i = 0; i < files.size(); i++) {
+    auto &entry = *remaining[i];
+    auto &result = files[i];
+    if (!result) {
+      scheduler.report("Failed to get file " + entry.filename + ": " + result.error->message_);
+      continue;
+    }
+
+    // Read the file before it is moved, arguments are evaluated in any order.
+    auto &file = result.value;
+    auto file_id = file->id_;
+    bool can_be_downloaded = file->local_->can_be_downloaded_;
+    bool is_downloading_completed = file->local_->is_downloading_completed_;
+    DownloadTask task(file_id, entry.filename, can_be_downloaded, is_downloading_completed, std::move(file));
+    task.chat_id = entry.chat_id;
+    task.message_id = entry.message_id;
+    tasks.push_back(std::move(task));
+  }
+  co_await queueTasks(scheduler, std::move(tasks), true);
+  co_await queueTasks(scheduler, extractDownloadTasks(messages));
+
+  if (state.isRange() && !state.resolved) {
+    auto from_id = state.checkpoint ? state.checkpoint : state.from_id;
+    co_await queueMessagesInRange(scheduler, state.chat_id, from_id, state.to_id, state.media);
   }
 
-  if (!range_.empty())
-    downloadMessagesInRange(out);
+  finalizeAll(scheduler);
 }
 
 void CmdDownload::parseMessagesInFile(const std::string &filename)
@@ -103,23 +392,240 @@ void CmdDownload::parseMessagesInFile(const std::string &filename)
   }
 }
 
-void CmdDownload::downloadMessagesInRange(std::ostream& out)
+coro::Task<void> CmdDownload::downloadMessagesInRange(std::ostream& out)
 {
-  if (range_.empty()) return;
-
-  MessagePtr from_msg = nullptr, to_msg = nullptr;
-  // Use chat_title_ to determine how to interpret range_
-  if (chat_title_.empty()) {
-    from_msg = std::move(channel_->invoke<td_api::getMessageLinkInfo>(range_.front())->message_);
-    to_msg = std::move(channel_->invoke<td_api::getMessageLinkInfo>(range_.back())->message_);
+  int64_t chat_id = 0, from_id = 0, to_id = 0;
+  if (!range_.empty()) {
+    MessagePtr from_msg = nullptr, to_msg = nullptr;
+    // Use chat_title_ to determine how to interpret range_
+    if (chat_title_.empty()) {
+      from_msg = std::move((co_await channel_->query<td_api::getMessageLinkInfo>(range_.front()))->message_);
+      to_msg = std::move((co_await channel_->query<td_api::getMessageLinkInfo>(range_.back()))->message_);
+    } else {
+      chat_id = channel_->getChatId(chat_title_);
+      from_msg = co_await channel_->query<td_api::getMessage>(chat_id, std::stoll(range_.front()));
+      to_msg = co_await channel_->query<td_api::getMessage>(chat_id, std::stoll(range_.back()));
+    }
+    if (!from_msg || !to_msg)
+      throw std::logic_error("Message not found.");
+    if (from_msg->chat_id_ != to_msg->chat_id_)
+      throw std::logic_error("Two messages were not from the same chat.");
+
+    chat_id = from_msg->chat_id_;
+    from_id = std::max(from_msg->id_, to_msg->id_);
+    to_id = std::min(from_msg->id_, to_msg->id_);
   } else {
-    int64_t chat_id = channel_->getChatId(chat_title_);
-    from_msg = channel_->invoke<td_api::getMessage>(chat_id, std::stoll(range_.front()));
-    to_msg = channel_->invoke<td_api::getMessage>(chat_id, std::stoll(range_.back()));
+    // getChatMessageByDate gives the last message sent before a date, the
+    // range is what comes after the one before --since.
+    chat_id = channel_->getChatId(chat_title_);
+    if (until_.empty()) {
+      auto chat = co_await channel_->query<td_api::getChat>(chat_id);
+      if (chat->last_message_)
+        from_id = chat->last_message_->id_;
+    } else {
+      auto last = co_await channel_->tryQuery<td_api::getChatMessageByDate>(
+        chat_id, static_cast<int32_t>(parseDate(until_) - 1));
+      if (last && last.value)
+        from_id = last.value->id_;
+    }
+    if (!since_.empty()) {
+      auto before = co_await channel_->tryQuery<td_api::getChatMessageByDate>(
+        chat_id, static_cast<int32_t>(parseDate(since_) - 1));
+      if (before && before.value)
+        to_id = before.value->id_ + 1;
+    }
+    if (from_id == 0 || from_id < to_id) {
+      out << "No messages between the dates." << std::endl;
+      co_return;
+    }
   }
 
-  auto messages = channel_->getMessageForRange(std::move(from_msg), std::move(to_msg));
-  downloadFileInMessages(out, std::move(messages));
+  // Only media messages are asked for, unless some kinds are picked.
+  unsigned media = (photos_ ? MessageCursor::Photos : 0)
+                 | (videos_ ? MessageCursor::Videos : 0)
+                 | (documents_ ? MessageCursor::Documents : 0);
+  if (media == 0)
+    media = MessageCursor::AnyMedia;
+
+  // Range downloads are long, always keep a journal so they can be resumed.
+  if (!journal_) {
+    auto job = std::to_string(chat_id) + "_" + std::to_string(from_id) + "_" + std::to_string(to_id);
+    openJournal(job, false);
+    out << "Job " << job << ", resume it with `download --resume " << job << "`" << std::endl;
+  }
+  journal_->recordRange(chat_id, from_id, to_id, media);
+
+  DownloadScheduler scheduler(accounts_, out, schedulerOptions());
+  co_await queueMessagesInRange(scheduler, chat_id, from_id, to_id, media);
+  finalizeAll(scheduler);
+}
+
+coro::Task<void> CmdDownload::queueMessagesInRange(DownloadScheduler &scheduler, int64_t chat_id,
+                                                   int64_t from_id, int64_t to_id, unsigned media)
+{
+  // Start downloading as soon as each page arrives, the cursor is already
+  // fetching the next one meanwhile, and finalize files as they finish.
+  // With `media` given, the server leaves out the messages without files.
+  MessageCursor cursor(*channel_, chat_id, from_id, to_id, media);
+  for (auto page = co_await cursor.nextPage(); !page.empty(); page = co_await cursor.nextPage()) {
+    co_await queueTasks(scheduler, extractDownloadTasks(page));
+
+    if (journal_)
+      journal_->recordCheckpoint(page.back()->id_);
+
+    while (auto task = scheduler.tryNext())
+      finalizeDownload(scheduler, std::move(*task));
+  }
+
+  if (journal_)
+    journal_->recordResolved();
+}
+
+// Queue tasks resolved by the main account and share them out to the
+// other accounts. Duplicated files and files downloaded by an earlier job
+// are left out, resumed tasks are already in the journal.
+coro::Task<CmdDownload::QueueCounts> CmdDownload::queueTasks(DownloadScheduler &scheduler,
+                                                             std::vector<DownloadTask> tasks, bool resumed) {
+  QueueCounts counts;
+  std::map<std::size_t, std::vector<DownloadTask>> shards;
+  for (auto &task : tasks) {
+    if (!queued_files_.insert(task.file_id).second) {
+      counts.duplicated++;
+      continue;
+    }
+    if (!resumed && reuseDownloaded(scheduler, task)) {
+      counts.reused++;
+      continue;
+    }
+    if (journal_ && !resumed)
+      journal_->recordTask(task);
+
+    auto account = co_await pickAccount(task);
+    if (account == 0) {
+      if (scheduler.add(std::move(task)))
+        counts.queued++;
+      else
+        counts.duplicated++;
+    } else {
+      shards[account].push_back(std::move(task));
+    }
+  }
+
+  // File ids differ between accounts, so each account resolves the
+  // messages of its files again.
+  for (auto &pair : shards) {
+    auto account = pair.first;
+    auto &shard = pair.second;
+    std::vector<td_api::object_ptr<td_api::getMessage>> queries;
+    for (auto &task : shard)
+      queries.push_back(td_api::make_object<td_api::getMessage>(task.chat_id, task.message_id));
+
+    auto results = co_await accounts_[account]->queryMany(std::move(queries));
+    for (size_t i = 0; i < results.size(); i++) {
+      auto &task = shard[i];
+      std::vector<MessagePtr> messages;
+      if (results[i])
+        messages.push_back(std::move(results[i].value));
+
+      auto resolved = extractDownloadTasks(messages);
+      if (resolved.empty()) {
+        // The account can't see the message after all, keep it on the main one.
+        assigned_bytes_[account] -= task.size;
+        assigned_bytes_[0] += task.size;
+      } else {
+        auto origin_file_id = task.file_id;
+        task = std::move(resolved.front());
+        task.account = account;
+        task.origin_file_id = origin_file_id;
+      }
+
+      if (scheduler.add(std::move(task)))
+        counts.queued++;
+      else
+        counts.duplicated++;
+    }
+  }
+
+  co_return counts;
+}
+
+// The account with the fewest bytes assigned among those that can reach
+// the chat of the task.
+coro::Task<std::size_t> CmdDownload::pickAccount(const DownloadTask &task) {
+  if (accounts_.size() < 2 || !task.can_be_downloaded || task.is_downloading_completed)
+    co_return 0;
+
+  std::size_t best = 0;
+  for (auto account : co_await reachableAccounts(task.chat_id)) {
+    if (assigned_bytes_[account] < assigned_bytes_[best])
+      best = account;
+  }
+  assigned_bytes_[best] += task.size;
+  co_return best;
+}
+
+coro::Task<std::vector<std::size_t>> CmdDownload::reachableAccounts(int64_t chat_id) {
+  auto it = reachable_.find(chat_id);
+  if (it != reachable_.end())
+    co_return it->second;
+
+  std::vector<std::size_t> reachable{0};
+  // Only supergroups and channels share message ids between their members,
+  // in other chats every account numbers the messages on its own.
+  auto kind = channel_->get_chat_kind(chat_id);
+  if (kind == ChatKind::Supergroup || kind == ChatKind::Channel) {
+    // Opening the chat by its supergroup works even if the account never
+    // listed it.
+    auto supergroup_id = TdChannel::supergroupId(chat_id);
+    for (std::size_t i = 1; i < accounts_.size(); i++) {
+      auto chat = co_await accounts_[i]->tryQuery<td_api::createSupergroupChat>(supergroup_id, false);
+      if (chat)
+        reachable.push_back(i);
+    }
+  }
+
+  reachable_.emplace(chat_id, reachable);
+  co_return reachable;
+}
+
+// Link a file downloaded by an earlier job into the output folder instead
+// of downloading it again.
+bool CmdDownload::reuseDownloaded(DownloadScheduler &scheduler, const DownloadTask &task) {
+  if (no_dedup_ || !media_index_ || task.unique_id.empty())
+    return false;
+
+  auto existing = media_index_->find(task.unique_id, task.size);
+  if (existing.empty())
+    return false;
+
+  std::error_code ec;
+  fs::path source = FileUtil::u8path(existing);
+  // The file was moved or deleted since, download it again.
+  if (!fs::exists(source, ec))
+    return false;
+
+  fs::path dest = FileUtil::u8path(output_folder_);
+  fs::create_directories(dest, ec);
+  dest /= source.filename();
+
+  // Fall back to pointing at the existing file if it can't be linked,
+  // for instance when it is on another filesystem.
+  if (!fs::exists(dest, ec)) {
+    fs::create_hard_link(source, dest, ec);
+    if (ec)
+      dest = source;
+  } else if (!fs::equivalent(source, dest, ec)) {
+    dest = source;
+  }
+
+  scheduler.report(FileUtil::u8string(fs::absolute(dest)));
+  return true;
+}
+
+void CmdDownload::finalizeAll(DownloadScheduler &scheduler) {
+  // Finalize every file as soon as it is done rather than polling all of them.
+  while (scheduler.pending() > 0)
+    finalizeDownload(scheduler, scheduler.next());
 }
 
 static bool isDownloadableMsg(const MessagePtr &msg) {
@@ -136,195 +642,136 @@ static bool isDownloadableMsg(const MessagePtr &msg) {
   }
 }
 
-void CmdDownload::download(std::ostream& out, std::vector<std::string> links) {
+coro::Task<void> CmdDownload::download(std::ostream& out, std::vector<std::string> links) {
+  co_await downloadFileInMessages(out, co_await resolveLinks(out, std::move(links)));
+}
+
+coro::Task<void> CmdDownload::download(std::ostream& out, std::string chat, std::vector<int64_t> message_ids) {
+  int64_t chat_id = channel_->getChatId(chat);
+  co_await download(out, chat_id, message_ids);
+}
+
+coro::Task<void> CmdDownload::download(std::ostream& out, int64_t chat_id, std::vector<int64_t> message_ids) {
+  co_await downloadFileInMessages(out, co_await resolveMessages(out, chat_id, std::move(message_ids)));
+}
+
+// The messages of links that have a file to download, the others are reported.
+coro::Task<std::vector<MessagePtr>> CmdDownload::resolveLinks(std::ostream& out, std::vector<std::string> links) {
+  std::vector<td_api::object_ptr<td_api::getMessageLinkInfo>> queries;
+  for (auto &link : links)
+    queries.push_back(td_api::make_object<td_api::getMessageLinkInfo>(link));
+
+  auto infos = co_await channel_->queryMany(std::move(queries));
+
   std::vector<MessagePtr> messages;
-  for (auto &link : links) {
-    auto info = channel_->invoke<td_api::getMessageLinkInfo>(link);
-    if (!isDownloadableMsg(info->message_)) {
-      out << "unsupported message: " << link << std::endl;
+  for (size_t i = 0; i < infos.size(); i++) {
+    auto &info = infos[i];
+    if (!info) {
+      out << "failed to resolve " << links[i] << ": " << info.error->message_ << std::endl;
+      continue;
+    }
+    if (!info.value->message_ || !isDownloadableMsg(info.value->message_)) {
+      out << "unsupported message: " << links[i] << std::endl;
       continue;
     }
-    messages.emplace_back(std::move(info->message_));
+    messages.emplace_back(std::move(info.value->message_));
   }
 
-  downloadFileInMessages(out, std::move(messages));
+  co_return messages;
 }
 
-void CmdDownload::download(std::ostream& out, std::string chat, std::vector<int64_t> message_ids) {
-  int64_t chat_id = channel_->getChatId(chat);
-  download(out, chat_id, message_ids);
-}
+// The messages of a chat that have a file to download, the others are reported.
+coro::Task<std::vector<MessagePtr>> CmdDownload::resolveMessages(std::ostream& out, int64_t chat_id,
+                                                                 std::vector<int64_t> message_ids) {
+  std::vector<td_api::object_ptr<td_api::getMessage>> queries;
+  for (auto msg_id : message_ids)
+    queries.push_back(td_api::make_object<td_api::getMessage>(chat_id, msg_id));
+
+  auto results = co_await channel_->queryMany(std::move(queries));
 
-void CmdDownload::download(std::ostream& out, int64_t chat_id, std::vector<int64_t> message_ids) {
   std::vector<MessagePtr> MsgObjs;
-  for (auto msg_id : message_ids) {
-    MessagePtr msg = channel_->invoke<td_api::getMessage>(chat_id, msg_id);
-    if (!isDownloadableMsg(msg)) {
-      out << "unsupported message: " << msg_id << std::endl;
+  for (size_t i = 0; i < results.size(); i++) {
+    auto &result = results[i];
+    if (!result) {
+      out << "failed to get message " << message_ids[i] << ": " << result.error->message_ << std::endl;
       continue;
     }
-    MsgObjs.emplace_back(std::move(msg));
-  }
-
-  downloadFileInMessages(out, std::move(MsgObjs));
-}
-
-struct DownloadTask {
-  std::int32_t file_id;
-  std::string filename;
-  bool can_be_downloaded;
-  bool is_downloading_completed;
-  FilePtr file;
-
-  // Default constructor
-  DownloadTask() = delete;
-
-  // Constructor to initialize the struct with values
-  DownloadTask(std::int32_t id, const std::string& name, bool can_download,
-                bool is_download_completed, FilePtr f)
-    : file_id(id), filename(name), can_be_downloaded(can_download),
-      is_downloading_completed(is_download_completed), file(std::move(f)) {}
-
-  // Move constructor
-  DownloadTask(DownloadTask&& other) noexcept
-    : file_id(other.file_id),
-      filename(std::move(other.filename)),
-      can_be_downloaded(other.can_be_downloaded),
-      is_downloading_completed(other.is_downloading_completed),
-      file(std::move(other.file)) { }
-
-  // Move assignment operator
-  DownloadTask& operator=(DownloadTask&& other) noexcept {
-    if (this != &other) {
-      file_id = other.file_id;
-      filename = std::move(other.filename);
-      can_be_downloaded = other.can_be_downloaded;
-      is_downloading_completed = other.is_downloading_completed;
-      file = std::move(other.file);
+    if (!isDownloadableMsg(result.value)) {
+      out << "unsupported message: " << message_ids[i] << std::endl;
+      continue;
     }
-    return *this;
+    MsgObjs.emplace_back(std::move(result.value));
   }
-};
 
-void CmdDownload::downloadFileInMessages(std::ostream& out, std::vector<MessagePtr> messages) {
-  // Sort messages in descending order
-  std::sort(messages.begin(), messages.end(),
-    [](const MessagePtr& a, const MessagePtr& b) { return a->id_ > a->id_; });
+  co_return MsgObjs;
+}
 
-  // Extract media in messages
-  std::vector<DownloadTask> tasks;
-  for (size_t i = 0; i < messages.size(); i++) {
-    auto &msg = messages[i];
+DownloadScheduler::Options CmdDownload::schedulerOptions() const {
+  DownloadScheduler::Options options;
+  options.max_concurrent = max_concurrent_;
+  options.order = DownloadScheduler::parseOrder(order_);
+  options.priority = priority_;
+  options.show_progress = !no_progress_ && !buffered_output_ && ConsoleUtil::isTerminal();
+  return options;
+}
 
-    td_api::downcast_call(
-      *(msg->content_), overloaded(
-        [&](td_api::messageDocument &content) {
-          tasks.emplace(tasks.end(),
-            content.document_->document_->id_,
-            content.document_->file_name_,
-            content.document_->document_->local_->can_be_downloaded_,
-            content.document_->document_->local_->is_downloading_completed_,
-            std::move(content.document_->document_)
-          );
-        },
-        [&](td_api::messageVideo &content) {
-          tasks.emplace(tasks.end(),
-            content.video_->video_->id_,
-            content.video_->file_name_,
-            content.video_->video_->local_->can_be_downloaded_,
-            content.video_->video_->local_->is_downloading_completed_,
-            std::move(content.video_->video_)
-          );
-        },
-        [&](td_api::messagePhoto &content) {
-          auto &ps = content.photo_->sizes_;
-          auto ret = std::max_element(ps.begin(), ps.end(), [] (auto &a, auto &b) {
-            return a->photo_->expected_size_ < b->photo_->expected_size_;
-          });
-          auto &ph = *ret;
-          tasks.emplace(tasks.end(),
-            ph->photo_->id_,
-            content.caption_->text_,
-            ph->photo_->local_->can_be_downloaded_,
-            ph->photo_->local_->is_downloading_completed_,
-            std::move(ph->photo_)
-          );
-        },
-        [](auto &content) {/* Unsupported message. */}
-      )
-    );
-  }
+coro::Task<void> CmdDownload::downloadFileInMessages(std::ostream& out, std::vector<MessagePtr> messages) {
+  DownloadScheduler scheduler(accounts_, out, schedulerOptions());
 
+  auto tasks = extractDownloadTasks(messages);
   size_t ntasks = tasks.size();
   size_t skipped = messages.size() - ntasks;
 
-  // Remove duplicated files
-  std::sort(
-    tasks.begin(), tasks.end(),
-    [](const DownloadTask& a, const DownloadTask& b) { return a.file_id > b.file_id; });
-  auto last = std::unique(
-    tasks.begin(), tasks.end(),
-    [](const DownloadTask& a, const DownloadTask& b) { return a.file_id == b.file_id; });
-  tasks.erase(last, tasks.end());
+  auto counts = co_await queueTasks(scheduler, std::move(tasks));
 
-  size_t duplicated = ntasks - tasks.size();
+  if (journal_)
+    journal_->recordResolved();
 
-  if (tasks.size() > 1) {
-    out << "Total " << tasks.size() << " files to be downloaded";
+  auto plural = [](std::size_t n, const char *one, const char *many) {
+    return std::to_string(n) + " " + (n == 1 ? one : many);
+  };
+  if (ntasks > 1) {
+    std::ostringstream summary;
+    summary << "Total " << plural(counts.queued, "file", "files") << " to be downloaded";
     if (skipped > 0)
-      out << ", " << skipped << (skipped > 1 ? " messages" : " message") << " skipped";
-    if (duplicated > 0)
-      out << ", " << duplicated << " duplicated" << (duplicated > 1 ? " files" : " file") << " skipped";
-    out << ":" << std::endl;
+      summary << ", " << plural(skipped, "message", "messages") << " skipped";
+    if (counts.duplicated > 0)
+      summary << ", " << plural(counts.duplicated, "duplicated file", "duplicated files") << " skipped";
+    if (counts.reused > 0)
+      summary << ", " << plural(counts.reused, "file", "files") << " already downloaded";
+    summary << ":";
+    scheduler.report(summary.str());
   }
 
-  std::vector<std::promise<FilePtr>> promises{tasks.size()};
-  std::vector<std::future<FilePtr>> futures;
-
-  for (size_t i = 0; i < tasks.size(); i++){
-    auto &task = tasks[i];
-    auto &prom = promises[i];
-
-    if (!task.can_be_downloaded)
-      throw std::logic_error("File can't be download: " + task.filename);
-
-    if (!task.is_downloading_completed) {
-      channel_->addDownloadHandler(task.file_id, [&out, &prom, &task](FilePtr file) {
-        std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
-        ConsoleUtil::printProgress(out, task.filename, file->expected_size_, file->local_->downloaded_size_);
-        if (file->local_->is_downloading_completed_) {
-          out << std::endl;
-          prom.set_value(std::move(file));
-        }
-      });
-
-      channel_->invoke<td_api::downloadFile>(task.file_id, 32, 0, 0, false);
-    } else {
-      prom.set_value(std::move(task.file));
-    }
+  finalizeAll(scheduler);
+}
 
-    futures.push_back(prom.get_future());
+void CmdDownload::finalizeDownload(DownloadScheduler &scheduler, DownloadTask task) {
+  if (!task.error.empty()) {
+    scheduler.report("Failed to download " + task.filename + ": " + task.error);
+    return;
   }
 
-  AsynUtil::waitFutures<FilePtr>(futures, [this, &out] (FilePtr file, size_t i) {
-    channel_->removeDownloadHandler(file->id_);
-
-    fs::path localfile = fs::u8path(file->local_->path_);
-    fs::path destfile = fs::u8path(output_folder_);
+  fs::path localfile = FileUtil::u8path(task.file->local_->path_);
+  fs::path destfile = FileUtil::u8path(output_folder_);
 
-    if (!std::filesystem::exists(destfile)) {
-        if (!std::filesystem::create_directory(destfile)) {
-          throw std::runtime_error("Failed to create directory " + output_folder_);
-        }
-    }
+  if (!std::filesystem::exists(destfile)) {
+      if (!std::filesystem::create_directory(destfile)) {
+        throw std::runtime_error("Failed to create directory " + output_folder_);
+      }
+  }
 
-    destfile /= localfile.filename();
-    fs::rename(localfile, destfile);
+  destfile /= localfile.filename();
+  // A resumed job may have been interrupted right after moving the file.
+  if (fs::exists(localfile) || !fs::exists(destfile))
+    FileUtil::moveFile(localfile, destfile);
 
-    std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
-    out << fs::absolute(destfile).u8string() << std::endl;
-  });
+  if (journal_)
+    journal_->recordDone(task.origin_file_id);
+  if (media_index_)
+    media_index_->insert(task.unique_id, task.size, FileUtil::u8string(fs::absolute(destfile)));
 
+  scheduler.report(FileUtil::u8string(fs::absolute(destfile)));
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -338,50 +785,83 @@ CmdChats::CmdChats(std::shared_ptr<TdChannel> &channel)
   app_->add_option("--filter-id,-F", chat_filter_id_, "Show chats in a folder by filter identifier.");
 }
 
-void CmdChats::run(std::ostream& out) {
-  ChatListPtr chats;
-  if (chat_filter_id_ != 0) {
-    chats = channel_->invoke<td_api::getChats>(
-      td_api::make_object<td_api::chatListFilter>(chat_filter_id_), limit_);
-  } else if (archive_list_) {
-    chats = channel_->invoke<td_api::getChats>(
-      td_api::make_object<td_api::chatListArchive>(), limit_);
-  } else {
-    chats = channel_->invoke<td_api::getChats>(nullptr, limit_);
+static const char *chatIcon(ChatKind kind) {
+  switch (kind) {
+  case ChatKind::Channel:
+    return "📢 ";
+  case ChatKind::Supergroup:
+    return "👥 ";
+  case ChatKind::BasicGroup:
+    return "🙌 ";
+  default:
+    return "👤 ";
   }
+}
 
-  for (auto chat_id : chats->chat_ids_) {
-    auto chat = channel_->invoke<td_api::getChat>(chat_id);
+void CmdChats::run(std::ostream& out) {
+  // Chats are listed a window at a time so that rows show up while the
+  // rest of the list is still being loaded. getChats always starts from the
+  // top of the list, so each window is at least as large as what was shown
+  // already, keeping the ids fetched over the whole listing linear.
+  const int32_t page_size = 100;
+
+  auto make_list = [this]() -> td_api::object_ptr<td_api::ChatList> {
+    if (chat_filter_id_ != 0)
+      return td_api::make_object<td_api::chatListFilter>(chat_filter_id_);
+    if (archive_list_)
+      return td_api::make_object<td_api::chatListArchive>();
+    return nullptr;
+  };
+
+  std::unordered_set<int64_t> shown;
+  bool loaded_all = false;
+  while (shown.size() < static_cast<size_t>(limit_)) {
+    auto step = std::max<int64_t>(page_size, static_cast<int64_t>(shown.size()));
+    auto want = static_cast<int32_t>(std::min<int64_t>(limit_, static_cast<int64_t>(shown.size()) + step));
+
+    if (!loaded_all) {
+      // TDLib answers 404 once every chat of the list is known locally.
+      auto result = channel_->tryInvoke<td_api::loadChats>(make_list(), want - static_cast<int32_t>(shown.size()));
+      if (!result) {
+        if (result.error->code_ != 404)
+          throw std::logic_error("Error: " + td_api::to_string(result.error));
+        loaded_all = true;
+      }
+    }
 
-    td_api::downcast_call(
-      *(chat->type_), overloaded(
-        [&out](td_api::chatTypeSupergroup &type) {
-          if (type.is_channel_) {
-            out << u8"📢 ";
-          } else {
-            out << u8"👥 ";
-          }
-
-          //out << "[super_id: " << type.supergroup_id_ << "] ";
-        },
-        [&out](td_api::chatTypePrivate &type) {
-          out << u8"👤 ";
-          //out << "[user_id: " << type.user_id_ << "] ";
-        },
-        [&out](td_api::chatTypeSecret &type) {
-          out << u8"👤 ";
-          //out << "[secret_id: " << type.secret_chat_id_ << "] ";
-        },
-        [&out](td_api::chatTypeBasicGroup &type) {
-          out << u8"🙌 ";
-          //out << "[basic_id: " << type.basic_group_id_ << "] ";
-        }
-      )
-    );
+    auto chats = channel_->invoke<td_api::getChats>(make_list(), want);
+
+    // Every chat came with an updateNewChat already, only ask for the ones
+    // that were missed.
+    std::vector<int64_t> page;
+    std::vector<td_api::object_ptr<td_api::getChat>> unknown;
+    for (auto chat_id : chats->chat_ids_) {
+      if (!shown.insert(chat_id).second)
+        continue;
+      page.push_back(chat_id);
+      if (channel_->get_chat_kind(chat_id) == ChatKind::Unknown)
+        unknown.push_back(td_api::make_object<td_api::getChat>(chat_id));
+    }
 
-    out << "[chat_id: " << chat_id << "] ";
-    out << chat->title_;
-    out << std::endl;
+    std::unordered_map<int64_t, ChatPtr> fetched;
+    for (auto &result : channel_->invokeMany(std::move(unknown))) {
+      if (result)
+        fetched[result.value->id_] = std::move(result.value);
+    }
+
+    for (auto chat_id : page) {
+      auto it = fetched.find(chat_id);
+      if (it != fetched.end()) {
+        out << chatIcon(TdChannel::chatKind(*it->second->type_));
+        out << "[chat_id: " << chat_id << "] " << it->second->title_ << std::endl;
+      } else {
+        out << chatIcon(channel_->get_chat_kind(chat_id));
+        out << "[chat_id: " << chat_id << "] " << channel_->get_chat_title(chat_id) << std::endl;
+      }
+    }
+
+    if (page.empty() && loaded_all)
+      break;
   }
 }
 
@@ -412,23 +892,23 @@ void CmdChatInfo::run(std::ostream& out) {
     *(chat->type_), overloaded(
       [&out](td_api::chatTypeSupergroup &type) {
         if (type.is_channel_) {
-          out << u8"📢 ";
+          out << "📢 ";
         } else {
-          out << u8"👥 ";
+          out << "👥 ";
         }
 
         out << "[super_id: " << type.supergroup_id_ << "] ";
       },
       [&out](td_api::chatTypePrivate &type) {
-        out << u8"👤 ";
+        out << "👤 ";
         out << "[user_id: " << type.user_id_ << "] ";
       },
       [&out](td_api::chatTypeSecret &type) {
-        out << u8"👤 ";
+        out << "👤 ";
         out << "[secret_id: " << type.secret_chat_id_ << "] ";
       },
       [&out](td_api::chatTypeBasicGroup &type) {
-        out << u8"🙌 ";
+        out << "🙌 ";
         out << "[basic_id: " << type.basic_group_id_ << "] ";
       }
     )
@@ -453,6 +933,17 @@ CmdHistory::CmdHistory(std::shared_ptr<TdChannel> &channel)
   app_->add_option("--date,-d", date_, "Get history no later than the specified date (ISO format).");
   app_->add_option("--limit,-l", limit_, "The maximum number of messages to be returned.");
   app_->add_option("--from-message,-f", from_, "Get history older than the given message (id/link).");
+  auto opt_export = app_->add_option("--export,-e", export_,
+                   "Write the messages as records instead: ndjson, csv or archive. "
+                   "An archive is appended the messages it doesn't hold yet.")
+      ->check(CLI::IsMember({"ndjson", "csv", "archive"}));
+  auto opt_all = app_->add_flag("--all,-a", all_, "Walk back to the first message instead of --limit messages.");
+  auto opt_since = app_->add_option("--since", since_,
+                   "Walk back to the first message sent at or after this date (ISO format) "
+                   "instead of --limit messages.");
+  app_->add_option("--output,-o", output_, "Write the export to this file rather than the console.")
+      ->needs(opt_export);
+  opt_all->excludes(opt_since);
 }
 
 void CmdHistory::reset() {
@@ -460,77 +951,164 @@ void CmdHistory::reset() {
   limit_ = 50;
   date_.clear();
   from_.clear();
+  export_.clear();
+  all_ = false;
+  since_.clear();
+  output_.clear();
 }
 
 void CmdHistory::run(std::ostream& out) {
+  coro::Executor executor;
+  executor.run(runAsync(out));
+}
+
+coro::Task<void> CmdHistory::runAsync(std::ostream& out) {
+  output_ = absolutePath(output_);
   if (!date_.empty()) {
-    history(out, chat_, date_, limit_);
+    co_await history(out, chat_, date_, limit_);
   } else if (!from_.empty()) {
+    MessagePtr msg;
     if (!chat_.empty()) {
+      int64_t message_id;
       try {
-        int64_t chat_id = channel_->getChatId(chat_);
-        auto msg = channel_->invoke<td_api::getMessage>(chat_id, std::stoll(from_));
-        history(out, msg, limit_);
+        message_id = std::stoll(from_);
       } catch (std::invalid_argument const&) {
         throw std::runtime_error("`--from-message` must be an ID not a link when chat title provided.");
       }
+      msg = co_await channel_->query<td_api::getMessage>(channel_->getChatId(chat_), message_id);
     } else {
-      history(out, channel_->invoke<td_api::getMessageLinkInfo>(from_)->message_, limit_);
+      msg = std::move((co_await channel_->query<td_api::getMessageLinkInfo>(from_))->message_);
     }
+    co_await history(out, msg, limit_);
   } else {
-    history(out, chat_, limit_);
+    co_await history(out, chat_, limit_);
   }
 }
 
-void CmdHistory::history(std::ostream& out, std::string chat_title, int32_t limit)
+coro::Task<void> CmdHistory::history(std::ostream& out, std::string chat_title, int32_t limit)
 {
   int64_t chat_id = channel_->getChatId(chat_title);
-  history(out, chat_id, limit);
+  co_await history(out, chat_id, limit);
 }
 
-void CmdHistory::history(std::ostream& out, std::string chat_title, std::string date, int32_t limit)
+coro::Task<void> CmdHistory::history(std::ostream& out, std::string chat_title, std::string date, int32_t limit)
 {
   int64_t chat_id = channel_->getChatId(chat_title);
-  std::tm t = {};
-  std::istringstream ss(date);
-  // FIXME: make use of Time.h of tdutils
-  ss >> std::get_time(&t, "%Y-%m-%dT%H:%M:%S");
-  if (ss.fail()) {
-      throw std::logic_error("Parse date failed");
-  }
+  time_t timestamp = parseDate(date);
 
-  time_t timestamp = std::mktime(&t);
+  auto msg = co_await channel_->query<td_api::getChatMessageByDate>(chat_id, (int32_t) timestamp);
+  co_await printHistory(out, chat_id, msg->id_, limit);
+}
 
-  std::promise<MessagePtr> prom1;
-  channel_->make_query<td_api::getChatMessageByDate>(prom1, chat_id, (int32_t) timestamp);
-  auto msg = prom1.get_future().get();
+coro::Task<void> CmdHistory::history(std::ostream& out, int64_t chat_id, int32_t limit) {
+  auto chat = co_await channel_->query<td_api::getChat>(chat_id);
+  if (!chat->last_message_)
+    co_return;
+  co_await printHistory(out, chat_id, chat->last_message_->id_, limit);
+}
 
-  std::promise<MessageListPtr> prom2;
-  channel_->make_query<td_api::getChatHistory>(prom2, chat_id, msg->id_, -1, limit, false);
-  MessageListPtr messages = prom2.get_future().get();
+coro::Task<void> CmdHistory::history(std::ostream& out, MessagePtr& msg, int32_t limit)
+{
+  co_await printHistory(out, msg->chat_id_, msg->id_, limit);
+}
 
-  for (auto &msg : messages->messages_) {
-    ConsoleUtil::printMessage(out, msg);
+// Print or export `limit` messages, or all of them back to --since,
+// starting at `from_id` and going back in time. Only one page is held at
+// a time, the next one is already requested while it is written out.
+coro::Task<void> CmdHistory::printHistory(std::ostream& out, int64_t chat_id, int64_t from_id, int32_t limit)
+{
+  bool unlimited = all_ || !since_.empty();
+  std::time_t since = since_.empty() ? 0 : parseDate(since_);
+  if (!unlimited && limit <= 0)
+    co_return;
+
+  std::unique_ptr<nowide::ofstream> file;
+  std::unique_ptr<HistoryWriter> writer;
+  std::unique_ptr<ArchiveWriter> archive;
+  // What the archive already holds of the chat, newest first.
+  std::vector<Archive::Range> archived;
+  if (export_ == "archive") {
+    if (output_.empty())
+      throw std::logic_error("`--export archive` needs `--output`.");
+    archive = std::make_unique<ArchiveWriter>(output_);
+    archived = archive->ranges(chat_id);
+    archive->beginWalk(chat_id, from_id);
+  } else if (!export_.empty()) {
+    if (!output_.empty()) {
+      file = std::make_unique<nowide::ofstream>(output_, std::ios::binary);
+      if (!*file)
+        throw std::runtime_error("Failed to open " + output_);
+    }
+    writer = std::make_unique<HistoryWriter>(file ? *file : out, HistoryWriter::parseFormat(export_));
   }
-}
 
-void CmdHistory::history(std::ostream& out, int64_t chat_id, int32_t limit) {
-  std::promise<MessageListPtr> prom;
-  auto fut = prom.get_future();
-  auto chat = channel_->invoke<td_api::getChat>(chat_id);
-  auto messages = channel_->invoke<td_api::getChatHistory>(
-    chat_id, chat->last_message_->id_, -1, limit, false);
-  for (auto &msg : messages->messages_) {
-    ConsoleUtil::printMessage(out, msg);
+  auto started = std::chrono::steady_clock::now();
+  // TDLib returns at most 100 messages, and often fewer, per query.
+  int32_t page_size = unlimited ? 100 : std::min(limit, 100);
+  auto cursor = std::make_unique<MessageCursor>(*channel_, chat_id, from_id, page_size);
+  std::size_t count = 0;
+  std::size_t next_range = 0;
+  // The oldest message walked, and whether it is the first of the chat.
+  int64_t oldest = from_id;
+  bool complete = false;
+  bool done = false;
+  while (!done) {
+    auto page = co_await cursor->nextPage();
+    if (page.empty()) {
+      complete = true;
+      break;
+    }
+
+    for (auto &msg : page) {
+      if ((!unlimited && count >= static_cast<std::size_t>(limit)) || msg->date_ < since) {
+        done = true;
+        break;
+      }
+
+      // Carry on below a range the archive holds, unless it reaches the
+      // first message already.
+      while (next_range < archived.size() && archived[next_range].oldest_id > msg->id_)
+        next_range++;
+      if (next_range < archived.size() && msg->id_ <= archived[next_range].newest_id) {
+        auto &range = archived[next_range++];
+        oldest = range.oldest_id;
+        if (range.complete) {
+          complete = done = true;
+        } else {
+          cursor = std::make_unique<MessageCursor>(*channel_, chat_id, range.oldest_id - 1, page_size);
+        }
+        break;
+      }
+
+      oldest = msg->id_;
+      if (writer)
+        writer->write(*msg);
+      else if (archive)
+        archive->write(*msg);
+      else
+        ConsoleUtil::printMessage(out, msg);
+      count++;
+    }
   }
-}
 
-void CmdHistory::history(std::ostream& out, MessagePtr& msg, int32_t limit)
-{
-  auto messages = channel_->invoke<td_api::getChatHistory>(
-    msg->chat_id_, msg->id_, -1, limit, false);
-  for (auto &msg : messages->messages_) {
-    ConsoleUtil::printMessage(out, msg);
+  if (writer)
+    writer->flush();
+  else if (archive)
+    archive->endWalk(oldest, complete);
+  else
+    co_return;
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  std::ostringstream summary;
+  summary << "Exported " << count << (count == 1 ? " message" : " messages") << " in "
+          << std::fixed << std::setprecision(1) << seconds << " s, "
+          << std::setprecision(0) << (seconds > 0 ? count / seconds : 0.0) << " messages/s";
+  // Keep the summary out of records written to the console.
+  if (file || archive) {
+    out << summary.str() << std::endl;
+  } else {
+    std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
+    std::cerr << summary.str() << std::endl;
   }
 }
 
@@ -558,8 +1136,14 @@ void CmdMessageLink::reset() {
 }
 
 void CmdMessageLink::run(std::ostream& out) {
+  coro::Executor executor;
+  executor.run(runAsync(out));
+}
+
+coro::Task<void> CmdMessageLink::runAsync(std::ostream& out) {
+  input_file_ = absolutePath(input_file_);
   if (!link_.empty()) {
-    auto info = channel_->invoke<td_api::getMessageLinkInfo>(link_);
+    auto info = co_await channel_->query<td_api::getMessageLinkInfo>(link_);
     ConsoleUtil::printMessage(out, info->message_);
   }
 
@@ -577,17 +1161,253 @@ void CmdMessageLink::run(std::ostream& out) {
 
     f.close();
 
-    for (auto &li : links) {
-      auto info = channel_->invoke<td_api::getMessageLinkInfo>(li);
-      ConsoleUtil::printMessage(out, info->message_);
+    std::vector<td_api::object_ptr<td_api::getMessageLinkInfo>> queries;
+    for (auto &li : links)
+      queries.push_back(td_api::make_object<td_api::getMessageLinkInfo>(li));
+
+    auto infos = co_await channel_->queryMany(std::move(queries));
+    for (size_t i = 0; i < infos.size(); i++) {
+      auto &info = infos[i];
+      if (!info) {
+        out << "failed to resolve " << links[i] << ": " << info.error->message_ << std::endl;
+        continue;
+      }
+      if (!info.value->message_) {
+        out << "message not found: " << links[i] << std::endl;
+        continue;
+      }
+      ConsoleUtil::printMessage(out, info.value->message_);
     }
   }
 
   if (!range_.empty()) {
-    MessagePtr from_msg = std::move(channel_->invoke<td_api::getMessageLinkInfo>(range_.front())->message_);
-    MessagePtr to_msg = std::move(channel_->invoke<td_api::getMessageLinkInfo>(range_.back())->message_);
-    auto messages = channel_->getMessageForRange(std::move(from_msg), std::move(to_msg));
-    for (auto &msg : messages)
-      ConsoleUtil::printMessage(out, msg);
+    MessagePtr from_msg = std::move((co_await channel_->query<td_api::getMessageLinkInfo>(range_.front()))->message_);
+    MessagePtr to_msg = std::move((co_await channel_->query<td_api::getMessageLinkInfo>(range_.back()))->message_);
+    MessageCursor cursor(*channel_, std::move(from_msg), std::move(to_msg));
+    for (auto page = co_await cursor.nextPage(); !page.empty(); page = co_await cursor.nextPage()) {
+      for (auto &msg : page)
+        ConsoleUtil::printMessage(out, msg);
+    }
   }
 }
+
+/////////////////////////////////////////////////////////////////////////////
+// CmdArchive
+/////////////////////////////////////////////////////////////////////////////
+
+CmdArchive::CmdArchive(std::shared_ptr<TdChannel> &channel)
+  : Program("archive", "Query chats exported with `history --export archive`", channel) {
+  app_->require_subcommand(1);
+
+  query_ = app_->add_subcommand("query", "Print the archived messages that match, newest first.");
+  query_->add_option("file", file_, "The archive.")->required();
+  query_->add_option("--chat,-t", chat_, "Only messages of this chat (id or title).");
+  query_->add_option("-R,--range", range_, "Only messages with ids between <from,to> or <from to>.")
+      ->expected(2)->delimiter(',');
+  query_->add_option("--since", since_, "Only messages sent at or after this date (ISO format).");
+  query_->add_option("--until", until_, "Only messages sent before this date (ISO format).");
+  query_->add_option("--type", type_, "Only messages of this type.")
+      ->check(CLI::IsMember({"text", "photo", "video", "document", "audio", "other"}));
+  query_->add_option("--sender", sender_, "Only messages sent by this user or chat id.");
+  query_->add_option("--text", text_, "Only messages whose text or caption contains this.");
+  query_->add_option("--format", format_, "ndjson or csv.")
+      ->check(CLI::IsMember({"ndjson", "csv"}));
+  query_->add_option("--limit,-l", limit_, "The maximum number of messages, 0 for all of them.")
+      ->check(CLI::NonNegativeNumber);
+  query_->add_option("--output,-o", output_, "Write the messages to this file rather than the console.");
+
+  info_ = app_->add_subcommand("info", "Show the chats and chunks of an archive.");
+  info_->add_option("file", file_, "The archive.")->required();
+}
+
+void CmdArchive::reset() {
+  file_.clear();
+  chat_.clear();
+  range_.clear();
+  since_.clear();
+  until_.clear();
+  type_.clear();
+  sender_ = 0;
+  text_.clear();
+  format_ = "ndjson";
+  limit_ = 0;
+  output_.clear();
+}
+
+void CmdArchive::run(std::ostream& out) {
+  file_ = absolutePath(file_);
+  output_ = absolutePath(output_);
+  if (query_->parsed())
+    query(out);
+  else if (info_->parsed())
+    info(out);
+}
+
+void CmdArchive::query(std::ostream& out) {
+  ArchiveReader reader(file_);
+  ArchiveReader::Filter filter;
+  if (!chat_.empty())
+    filter.chat_id = channel_->getChatId(chat_);
+  if (!range_.empty()) {
+    filter.min_id = std::min(range_.front(), range_.back());
+    filter.max_id = std::max(range_.front(), range_.back());
+  }
+  if (!since_.empty())
+    filter.since = parseDate(since_);
+  if (!until_.empty())
+    filter.until = parseDate(until_) - 1;
+  filter.sender_id = sender_;
+  filter.type = type_;
+  filter.text = text_;
+
+  std::unique_ptr<nowide::ofstream> file;
+  if (!output_.empty()) {
+    file = std::make_unique<nowide::ofstream>(output_, std::ios::binary);
+    if (!*file)
+      throw std::runtime_error("Failed to open " + output_);
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  HistoryWriter writer(file ? *file : out, HistoryWriter::parseFormat(format_));
+  reader.scan(filter, [&](const HistoryWriter::Record &record) {
+    writer.write(record);
+    return limit_ == 0 || writer.count() < static_cast<std::size_t>(limit_);
+  });
+  writer.flush();
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  std::ostringstream summary;
+  summary << writer.count() << (writer.count() == 1 ? " message" : " messages") << " in "
+          << std::fixed << std::setprecision(2) << seconds << " s, read "
+          << reader.chunksRead() << " of " << reader.chunks().size() << " chunks, "
+          << StrUtil::formatBytes(static_cast<double>(reader.bytesRead())) << " of "
+          << StrUtil::formatBytes(static_cast<double>(reader.fileSize()));
+  if (file) {
+    out << summary.str() << std::endl;
+  } else {
+    std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
+    std::cerr << summary.str() << std::endl;
+  }
+}
+
+void CmdArchive::info(std::ostream& out) {
+  ArchiveReader reader(file_);
+
+  struct ChatStats {
+    std::uint64_t chunks = 0;
+    std::uint64_t messages = 0;
+    int64_t min_id = std::numeric_limits<int64_t>::max();
+    int64_t max_id = 0;
+  };
+  std::map<int64_t, ChatStats> chats;
+  std::uint64_t messages = 0;
+  std::uint64_t raw = 0;
+  for (auto &chunk : reader.chunks()) {
+    auto &stats = chats[chunk.header.chat_id];
+    stats.chunks++;
+    stats.messages += chunk.header.rows;
+    stats.min_id = std::min(stats.min_id, chunk.header.min_id);
+    stats.max_id = std::max(stats.max_id, chunk.header.max_id);
+    messages += chunk.header.rows;
+    for (auto size : chunk.header.raw_size)
+      raw += size;
+  }
+
+  out << messages << " messages in " << reader.chunks().size() << " chunks, "
+      << StrUtil::formatBytes(static_cast<double>(reader.fileSize())) << " ("
+      << StrUtil::formatBytes(static_cast<double>(raw)) << " uncompressed)" << std::endl;
+  for (auto &[chat_id, stats] : chats) {
+    out << "chat " << chat_id << ": " << stats.messages << " messages in " << stats.chunks
+        << " chunks, ids " << stats.min_id << " to " << stats.max_id << std::endl;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// CmdSearch
+/////////////////////////////////////////////////////////////////////////////
+
+CmdSearch::CmdSearch(std::shared_ptr<TdChannel> &channel)
+  : Program("search", "Search the messages seen so far, without going online", channel) {
+  app_->add_option("query", query_,
+                   "Words the messages contain, a word ending with * matches the words it starts.")
+      ->required();
+  app_->add_option("--chat,-t", chat_, "Only search this chat (id or title).");
+  app_->add_option("--limit,-l", limit_, "The maximum number of messages, newest first.")
+      ->check(CLI::PositiveNumber);
+  auto opt_download = app_->add_flag("--download,-D", download_, "Download the files of the messages found.");
+  app_->add_option("--output-folder,-O", output_folder_, "Put downloaded files to a given folder.")
+      ->needs(opt_download);
+}
+
+void CmdSearch::reset() {
+  query_.clear();
+  chat_.clear();
+  limit_ = 20;
+  download_ = false;
+  output_folder_.clear();
+}
+
+void CmdSearch::run(std::ostream& out) {
+  auto index = channel_->searchIndex();
+  if (!index)
+    throw std::runtime_error("The search index is not available.");
+
+  int64_t chat_id = chat_.empty() ? 0 : channel_->getChatId(chat_);
+  auto started = std::chrono::steady_clock::now();
+  auto hits = index->search(StrUtil::join(query_, " "), chat_id, static_cast<std::size_t>(limit_));
+  double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+  for (auto &hit : hits) {
+    auto title = channel_->get_chat_title(hit.chat_id);
+    out << "[chat: " << (title.empty() ? std::to_string(hit.chat_id) : StrUtil::elidedText(title, 20)) << "] "
+        << "[msg_id: " << hit.message_id << "] [type: " << hit.type << "] [text: "
+        << StrUtil::elidedText(hit.text, 60) << "]";
+    if (!hit.file_name.empty())
+      out << " [file: " << StrUtil::elidedText(hit.file_name, 20, StrUtil::Middle) << "]";
+    out << std::endl;
+  }
+  out << "Found " << hits.size() << (hits.size() == 1 ? " message" : " messages") << " in "
+      << std::fixed << std::setprecision(1) << millis << " ms" << std::endl;
+
+  if (!download_)
+    return;
+
+  // Hand the hits over to `download`, a chat at a time.
+  std::map<int64_t, std::vector<std::string>> ids;
+  for (auto &hit : hits) {
+    if (hit.type != "text" && hit.type != "other")
+      ids[hit.chat_id].push_back(std::to_string(hit.message_id));
+  }
+  for (auto &[chat, chat_ids] : ids) {
+    std::vector<std::string> args = {"--chat-id", std::to_string(chat), "--ids"};
+    args.insert(args.end(), chat_ids.begin(), chat_ids.end());
+    if (!output_folder_.empty()) {
+      args.push_back("--output-folder");
+      args.push_back(output_folder_);
+    }
+    CmdDownload download(channel_);
+    download.setBufferedOutput(buffered_output_);
+    download.setWorkingDirectory(working_directory_);
+    download.execute(args, out);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// CmdStats
+/////////////////////////////////////////////////////////////////////////////
+
+CmdStats::CmdStats(std::shared_ptr<TdChannel> &channel)
+  : Program("stats", "Show query latencies, errors and download speed", channel) {
+  app_->add_flag("--prometheus,-p", prometheus_, "Print in the Prometheus text format.");
+}
+
+void CmdStats::reset() {
+  prometheus_ = false;
+}
+
+void CmdStats::run(std::ostream& out) {
+  if (prometheus_)
+    Metrics::instance().writePrometheus(out);
+  else
+    Metrics::instance().writeText(out);
+}
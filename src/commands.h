@@ -1,11 +1,17 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#include <map>
 #include <memory>
+#include <set>
 #include <vector>
 #include <CLI/CLI.hpp>
 
 #include "common.h"
+#include "coro.h"
+#include "downloadscheduler.h"
+#include "downloadjournal.h"
+#include "mediaindex.h"
 
 class TdChannel;
 
@@ -14,6 +20,7 @@ public:
   Program(std::string name, std::string description, std::shared_ptr<TdChannel> &channel)
     : channel_(channel), app_(std::make_unique<CLI::App>(name + " - " + description))
     , name_(name), description_(description) {}
+  virtual ~Program() = default;
 
   void parse(std::vector<std::string> args) {
     reset();
@@ -40,6 +47,12 @@ public:
         if(e.get_name() == "CallForVersion") {
             throw;
         }
+
+        // Scripts and daemon clients need the failure to report it and
+        // set their exit status, the shell only shows it.
+        if(buffered_output_)
+            throw;
+        out << e.what() << std::endl;
     }
   };
 
@@ -49,11 +62,23 @@ public:
   std::string name() { return name_; }
   std::string description() { return description_; }
 
+  // Set when the output is collected and printed once the command is
+  // done, nothing should then be redrawn in place.
+  void setBufferedOutput(bool buffered) { buffered_output_ = buffered; }
+  // Relative paths are resolved against this directory rather than the
+  // process's, for commands run on behalf of a daemon client.
+  void setWorkingDirectory(const std::string &directory) { working_directory_ = directory; }
+
 protected:
+  std::string workingDirectory() const;
+  std::string absolutePath(const std::string &path) const;
+
   std::shared_ptr<TdChannel> channel_;
   std::unique_ptr<CLI::App> app_;
   std::string name_;
   std::string description_;
+  bool buffered_output_{false};
+  std::string working_directory_;
 };
 
 class CmdDownload : public Program {
@@ -62,14 +87,36 @@ public:
 
   void run(std::ostream& out) override;
   void reset() override;
-  void downloadFileInMessages(std::ostream& out, std::vector<MessagePtr> messages);
-  void download(std::ostream& out, std::string chat, std::vector<int64_t> message_ids);
-  void download(std::ostream& out, int64_t chat_id, std::vector<int64_t> message_ids);
-  void download(std::ostream& out, std::vector<std::string> links);
+  coro::Task<void> downloadFileInMessages(std::ostream& out, std::vector<MessagePtr> messages);
+  coro::Task<void> download(std::ostream& out, std::string chat, std::vector<int64_t> message_ids);
+  coro::Task<void> download(std::ostream& out, int64_t chat_id, std::vector<int64_t> message_ids);
+  coro::Task<void> download(std::ostream& out, std::vector<std::string> links);
   void parseMessagesInFile(const std::string &filename);
-  void downloadMessagesInRange(std::ostream& out);
+  coro::Task<void> downloadMessagesInRange(std::ostream& out);
 
 private:
+  coro::Task<void> runAsync(std::ostream& out);
+  DownloadScheduler::Options schedulerOptions() const;
+  // What queueTasks() did with the tasks it was given.
+  struct QueueCounts {
+    std::size_t queued{0};
+    std::size_t duplicated{0};  // Files given twice or already queued
+    std::size_t reused{0};      // Files downloaded by an earlier job
+  };
+  coro::Task<QueueCounts> queueTasks(DownloadScheduler &scheduler, std::vector<DownloadTask> tasks, bool resumed = false);
+  coro::Task<std::size_t> pickAccount(const DownloadTask &task);
+  coro::Task<std::vector<std::size_t>> reachableAccounts(int64_t chat_id);
+  coro::Task<void> queueMessagesInRange(DownloadScheduler &scheduler, int64_t chat_id,
+                                        int64_t from_id, int64_t to_id, unsigned media);
+  void finalizeDownload(DownloadScheduler &scheduler, DownloadTask task);
+  void finalizeAll(DownloadScheduler &scheduler);
+  void openJournal(const std::string &job, bool resume);
+  coro::Task<void> resumeJob(std::ostream& out);
+  coro::Task<std::vector<MessagePtr>> resolveLinks(std::ostream& out, std::vector<std::string> links);
+  coro::Task<std::vector<MessagePtr>> resolveMessages(std::ostream& out, int64_t chat_id,
+                                                      std::vector<int64_t> message_ids);
+  bool reuseDownloaded(DownloadScheduler &scheduler, const DownloadTask &task);
+
   //std::vector<std::string> messages_;
   std::vector<std::string> links_;
   std::vector<std::string> msg_ids_;
@@ -78,6 +125,29 @@ private:
   std::string output_folder_;
   std::string input_file_;
   std::vector<std::string> range_;
+  std::string since_;
+  std::string until_;
+  bool photos_;
+  bool videos_;
+  bool documents_;
+  std::size_t max_concurrent_;
+  std::string order_;
+  int32_t priority_;
+  std::string job_;
+  std::string resume_;
+  CLI::Option *opt_output_folder_;
+  std::unique_ptr<DownloadJournal> journal_;
+  bool no_dedup_;
+  bool no_progress_;
+  bool no_shard_;
+  std::shared_ptr<MediaIndex> media_index_;
+
+  // Accounts the files are shared out to, the first one is channel_.
+  std::vector<TdChannel*> accounts_;
+  std::vector<std::int64_t> assigned_bytes_;
+  std::map<int64_t, std::vector<std::size_t>> reachable_;
+  // Files already queued, by their id in the first account.
+  std::set<int32_t> queued_files_;
 };
 
 class CmdChats : public Program {
@@ -111,16 +181,23 @@ public:
   void run(std::ostream& out) override;
   void reset() override;
 
-  void history(std::ostream& out, int64_t chat_id, int32_t limit);
-  void history(std::ostream& out, std::string chat_title, int32_t limit);
-  void history(std::ostream& out, std::string chat_title, std::string date, int32_t limit);
-  void history(std::ostream& out, MessagePtr& msg, int32_t limit);
+  coro::Task<void> history(std::ostream& out, int64_t chat_id, int32_t limit);
+  coro::Task<void> history(std::ostream& out, std::string chat_title, int32_t limit);
+  coro::Task<void> history(std::ostream& out, std::string chat_title, std::string date, int32_t limit);
+  coro::Task<void> history(std::ostream& out, MessagePtr& msg, int32_t limit);
 
 private:
+  coro::Task<void> runAsync(std::ostream& out);
+  coro::Task<void> printHistory(std::ostream& out, int64_t chat_id, int64_t from_id, int32_t limit);
+
   std::string chat_;
   int32_t limit_;
   std::string date_;
   std::string from_;
+  std::string export_;
+  bool all_;
+  std::string since_;
+  std::string output_;
 };
 
 class CmdMessageLink : public Program {
@@ -131,9 +208,63 @@ public:
   void reset() override;
 
 private:
+  coro::Task<void> runAsync(std::ostream& out);
+
   std::string link_;
   std::string input_file_;
   std::vector<std::string> range_;
 };
 
+class CmdArchive : public Program {
+public:
+  CmdArchive(std::shared_ptr<TdChannel> &channel);
+
+  void run(std::ostream& out) override;
+  void reset() override;
+
+private:
+  void query(std::ostream& out);
+  void info(std::ostream& out);
+
+  CLI::App *query_;
+  CLI::App *info_;
+  std::string file_;
+  std::string chat_;
+  std::vector<int64_t> range_;
+  std::string since_;
+  std::string until_;
+  std::string type_;
+  int64_t sender_;
+  std::string text_;
+  std::string format_;
+  int32_t limit_;
+  std::string output_;
+};
+
+class CmdSearch : public Program {
+public:
+  CmdSearch(std::shared_ptr<TdChannel> &channel);
+
+  void run(std::ostream& out) override;
+  void reset() override;
+
+private:
+  std::vector<std::string> query_;
+  std::string chat_;
+  int32_t limit_;
+  bool download_;
+  std::string output_folder_;
+};
+
+class CmdStats : public Program {
+public:
+  CmdStats(std::shared_ptr<TdChannel> &channel);
+
+  void run(std::ostream& out) override;
+  void reset() override;
+
+private:
+  bool prometheus_;
+};
+
 #endif // COMMANDS_H
\ No newline at end of file
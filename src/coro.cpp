@@ -0,0 +1,31 @@
+#include "coro.h"
+
+namespace coro
+{
+
+static thread_local Executor *current_executor = nullptr;
+
+Executor *Executor::current() {
+  return current_executor;
+}
+
+std::coroutine_handle<> Executor::next() {
+  if (timers_.empty())
+    return ready_.pop();
+  if (auto handle = ready_.popUntil(timers_.top().time))
+    return *handle;
+  auto handle = timers_.top().handle;
+  timers_.pop();
+  return handle;
+}
+
+Executor::Scope::Scope(Executor *executor)
+  : previous(current_executor) {
+  current_executor = executor;
+}
+
+Executor::Scope::~Scope() {
+  current_executor = previous;
+}
+
+} // namespace coro
@@ -0,0 +1,265 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "utils.h"
+
+// Coroutine support for commands that keep many TDLib queries in flight
+// from a single thread. A command body is a Task that co_awaits
+// TdChannel::query(), and runs on an Executor: TdChannel workers only
+// hand finished queries back to it, coroutines are always resumed on the
+// thread that called Executor::run().
+namespace coro
+{
+
+template<typename T> class Task;
+
+// Runs coroutines on the calling thread.
+class Executor {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  Executor() = default;
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  // Start a task and resume coroutines as their queries complete until it
+  // finishes, then return its result or rethrow its exception.
+  template<typename T>
+  T run(Task<T> task);
+
+  // Queue a coroutine to be resumed by run(), from any thread.
+  void post(std::coroutine_handle<> handle) { ready_.push(handle); }
+  // Resume a coroutine once `time` has come, from the executor's thread.
+  void postAt(Clock::time_point time, std::coroutine_handle<> handle) { timers_.push(Timer{time, handle}); }
+
+  // The executor running on this thread, if any.
+  static Executor *current();
+
+private:
+  struct Scope;
+
+  struct Timer {
+    Clock::time_point time;
+    std::coroutine_handle<> handle;
+    bool operator>(const Timer &other) const { return time > other.time; }
+  };
+
+  // Wait for the next coroutine to resume, posted or due.
+  std::coroutine_handle<> next();
+
+  AsynUtil::CompletionQueue<std::coroutine_handle<>> ready_;
+  // Only touched by the thread running the executor.
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+};
+
+namespace detail
+{
+
+class PromiseBase {
+public:
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  // Resume whoever awaits the task, if anyone does yet.
+  auto final_suspend() noexcept {
+    struct Awaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept {
+        return continuation ? continuation : std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+      std::coroutine_handle<> continuation;
+    };
+    return Awaiter{continuation_};
+  }
+
+  void unhandled_exception() { exception_ = std::current_exception(); }
+
+  void setContinuation(std::coroutine_handle<> continuation) { continuation_ = continuation; }
+
+protected:
+  void rethrow() {
+    if (exception_)
+      std::rethrow_exception(exception_);
+  }
+
+private:
+  std::coroutine_handle<> continuation_;
+  std::exception_ptr exception_;
+};
+
+template<typename T>
+class Promise : public PromiseBase {
+public:
+  Task<T> get_return_object();
+  void return_value(T value) { value_.emplace(std::move(value)); }
+  T result() {
+    rethrow();
+    return std::move(*value_);
+  }
+
+private:
+  std::optional<T> value_;
+};
+
+template<>
+class Promise<void> : public PromiseBase {
+public:
+  Task<void> get_return_object();
+  void return_void() {}
+  void result() { rethrow(); }
+};
+
+} // namespace detail
+
+// A lazily started coroutine returning T. It runs when it is awaited, or
+// when start() is called to get several tasks going at once.
+template<typename T = void>
+class [[nodiscard]] Task {
+public:
+  using promise_type = detail::Promise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  explicit Task(Handle handle) : handle_(handle) {}
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  Task& operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (handle_)
+        handle_.destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  ~Task() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  // Run the task until it first suspends.
+  void start() {
+    if (!started_) {
+      started_ = true;
+      handle_.resume();
+    }
+  }
+
+  bool done() const { return handle_.done(); }
+  T result() { return handle_.promise().result(); }
+
+  bool await_ready() const { return started_ && handle_.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+    handle_.promise().setContinuation(awaiting);
+    if (started_)
+      return std::noop_coroutine();
+    started_ = true;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().result(); }
+
+private:
+  Handle handle_;
+  bool started_{false};
+};
+
+namespace detail
+{
+
+template<typename T>
+Task<T> Promise<T>::get_return_object() {
+  return Task<T>{std::coroutine_handle<Promise<T>>::from_promise(*this)};
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>{std::coroutine_handle<Promise<void>>::from_promise(*this)};
+}
+
+} // namespace detail
+
+struct Executor::Scope {
+  explicit Scope(Executor *executor);
+  ~Scope();
+  Executor *previous;
+};
+
+template<typename T>
+T Executor::run(Task<T> task) {
+  Scope scope{this};
+  task.start();
+  while (!task.done())
+    next().resume();
+  return task.result();
+}
+
+// co_await sleepFor(duration) suspends a coroutine for a while, without
+// blocking the executor running it.
+inline auto sleepFor(Executor::Clock::duration duration) {
+  struct Awaiter {
+    Executor::Clock::duration duration;
+
+    bool await_ready() const noexcept { return duration <= Executor::Clock::duration::zero(); }
+    void await_suspend(std::coroutine_handle<> handle) {
+      auto executor = Executor::current();
+      if (!executor)
+        throw std::logic_error("coro::sleepFor() must be awaited inside coro::Executor::run().");
+      executor->postAt(Executor::Clock::now() + duration, handle);
+    }
+    void await_resume() noexcept {}
+  };
+  return Awaiter{duration};
+}
+
+// Run tasks concurrently and collect their results in order. Every task
+// is waited for, even when one fails, so that no query outlives its
+// coroutine; the first exception is then rethrown.
+template<typename T>
+Task<std::vector<T>> whenAll(std::vector<Task<T>> tasks) {
+  for (auto &task : tasks)
+    task.start();
+
+  std::vector<T> results;
+  results.reserve(tasks.size());
+  std::exception_ptr error;
+  for (auto &task : tasks) {
+    try {
+      results.push_back(co_await task);
+    } catch (...) {
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+
+  if (error)
+    std::rethrow_exception(error);
+  co_return results;
+}
+
+inline Task<void> whenAll(std::vector<Task<void>> tasks) {
+  for (auto &task : tasks)
+    task.start();
+
+  std::exception_ptr error;
+  for (auto &task : tasks) {
+    try {
+      co_await task;
+    } catch (...) {
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+} // namespace coro
+
+#endif // CORO_H
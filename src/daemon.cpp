@@ -0,0 +1,341 @@
+#include "daemon.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <streambuf>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "tdshell.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+std::string DaemonServer::socketPath(const std::string &database_directory) {
+  return FileUtil::u8string(FileUtil::u8path(database_directory) / "tdshell.sock");
+}
+
+#ifndef _WIN32
+
+namespace
+{
+
+enum FrameType : std::uint8_t {
+  ArgsFrame = 1,    // Working directory then arguments, each one ends with '\0'
+  OutputFrame = 2,  // Part of the output
+  ExitFrame = 3     // Exit status, a 32-bit integer
+};
+
+// Requests are a few arguments, don't let a client make us allocate more.
+const std::uint32_t MAX_REQUEST = 1 << 20;
+// A client that connects has this long to send its request, so that an
+// idle one can't hold the daemon up when it stops.
+const int REQUEST_TIMEOUT_SECONDS = 5;
+
+// Lock-free, so it is safe to set from a signal handler on any thread.
+std::atomic<bool> stop_requested{false};
+
+void onSignal(int) {
+  stop_requested = true;
+}
+
+bool sendAll(int fd, const char *data, std::size_t size) {
+  while (size > 0) {
+#ifdef MSG_NOSIGNAL
+    auto n = ::send(fd, data, size, MSG_NOSIGNAL);
+#else
+    auto n = ::send(fd, data, size, 0);
+#endif
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool recvAll(int fd, char *data, std::size_t size) {
+  while (size > 0) {
+    auto n = ::recv(fd, data, size, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool sendFrame(int fd, FrameType type, const char *data, std::uint32_t size) {
+  char header[5];
+  header[0] = static_cast<char>(type);
+  std::memcpy(header + 1, &size, sizeof(size));
+  return sendAll(fd, header, sizeof(header)) && sendAll(fd, data, size);
+}
+
+bool recvFrame(int fd, FrameType &type, std::string &payload, std::uint32_t max_size) {
+  char header[5];
+  if (!recvAll(fd, header, sizeof(header)))
+    return false;
+  std::uint32_t size;
+  std::memcpy(&size, header + 1, sizeof(size));
+  if (size > max_size)
+    return false;
+  type = static_cast<FrameType>(header[0]);
+  payload.resize(size);
+  return recvAll(fd, &payload[0], size);
+}
+
+// Sends what a command writes to the client as output frames.
+class SocketBuf : public std::streambuf {
+public:
+  explicit SocketBuf(int fd) : fd_(fd) {
+    setp(buffer_, buffer_ + sizeof(buffer_));
+  }
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (sync() != 0)
+      return traits_type::eof();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  // A client that went away only loses the output, the command goes on.
+  int sync() override {
+    auto size = static_cast<std::uint32_t>(pptr() - pbase());
+    if (size > 0 && !failed_)
+      failed_ = !sendFrame(fd_, OutputFrame, pbase(), size);
+    setp(buffer_, buffer_ + sizeof(buffer_));
+    return failed_ ? -1 : 0;
+  }
+
+private:
+  int fd_;
+  bool failed_{false};
+  char buffer_[4096];
+};
+
+sockaddr_un socketAddress(const std::string &path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+    throw std::runtime_error("Socket path is too long: " + path);
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+int connectTo(const sockaddr_un &address) {
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+} // namespace
+
+DaemonServer::DaemonServer(TdShell &shell, const std::string &socket_path)
+  : shell_(shell), socket_path_(socket_path)
+{
+  auto address = socketAddress(socket_path_);
+
+  // Only remove the socket if nobody is listening on it any more.
+  int existing = connectTo(address);
+  if (existing >= 0) {
+    ::close(existing);
+    throw std::runtime_error("A daemon is already running on " + socket_path_);
+  }
+  ::unlink(socket_path_.c_str());
+
+  listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0)
+    throw std::runtime_error("Failed to create socket: " + std::string(std::strerror(errno)));
+
+  // The daemon acts on behalf of the logged in account, keep other users out.
+  // The socket is created without group and other permissions, and is only
+  // listened on once it is 0600, so nobody else can connect in between.
+  mode_t previous_umask = ::umask(S_IRWXG | S_IRWXO);
+  int bound = ::bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+  ::umask(previous_umask);
+  if (bound != 0) {
+    auto error = std::string(std::strerror(errno));
+    ::close(listen_fd_);
+    throw std::runtime_error("Failed to bind " + socket_path_ + ": " + error);
+  }
+  if (::chmod(socket_path_.c_str(), S_IRUSR | S_IWUSR) != 0 || ::listen(listen_fd_, 16) != 0) {
+    auto error = std::string(std::strerror(errno));
+    ::close(listen_fd_);
+    ::unlink(socket_path_.c_str());
+    throw std::runtime_error("Failed to listen on " + socket_path_ + ": " + error);
+  }
+}
+
+DaemonServer::~DaemonServer() {
+  ::close(listen_fd_);
+  ::unlink(socket_path_.c_str());
+  // Let the commands still running finish.
+  connections_.clear();
+}
+
+void DaemonServer::run() {
+  stop_requested = false;
+  auto previous_int = std::signal(SIGINT, onSignal);
+  auto previous_term = std::signal(SIGTERM, onSignal);
+
+  while (!stop_requested) {
+    pollfd pfd{listen_fd_, POLLIN, 0};
+    int ready = ::poll(&pfd, 1, 500);
+    reap();
+    if (ready <= 0)
+      continue;
+
+    int fd = ::accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0)
+      continue;
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    timeval timeout{REQUEST_TIMEOUT_SECONDS, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    auto connection = std::make_unique<Connection>();
+    auto &ref = *connection;
+    connection->thread = std::make_unique<ScopedThread>([this, fd, &ref] {
+      serve(fd);
+      ref.done = true;
+    });
+    connections_.push_back(std::move(connection));
+  }
+
+  std::signal(SIGINT, previous_int);
+  std::signal(SIGTERM, previous_term);
+}
+
+void DaemonServer::reap() {
+  connections_.remove_if([](const std::unique_ptr<Connection> &connection) {
+    return connection->done.load();
+  });
+}
+
+void DaemonServer::serve(int fd) {
+  FrameType type;
+  std::string payload;
+  if (!recvFrame(fd, type, payload, MAX_REQUEST) || type != ArgsFrame) {
+    ::close(fd);
+    return;
+  }
+
+  std::vector<std::string> args;
+  for (std::size_t begin = 0, end; (end = payload.find('\0', begin)) != std::string::npos; begin = end + 1)
+    args.push_back(payload.substr(begin, end - begin));
+  // Threads share the working directory, so the client's one is handed to
+  // the command instead of changing to it.
+  std::string working_directory;
+  if (!args.empty()) {
+    working_directory = std::move(args.front());
+    args.erase(args.begin());
+  }
+
+  std::int32_t status = 0;
+  {
+    SocketBuf buffer{fd};
+    std::ostream out{&buffer};
+    try {
+      if (args.empty())
+        throw std::logic_error("No command given.");
+      shell_.runCommand(args, out, working_directory);
+    } catch (const std::exception &e) {
+      out << "Error: " << e.what() << std::endl;
+      status = 1;
+    }
+    out.flush();
+  }
+
+  sendFrame(fd, ExitFrame, reinterpret_cast<const char*>(&status), sizeof(status));
+  ::close(fd);
+}
+
+std::optional<int> DaemonClient::forward(const std::string &socket_path,
+                                         const std::vector<std::string> &args, std::ostream &out) {
+  if (socket_path.size() >= sizeof(sockaddr_un::sun_path) || !fs::exists(FileUtil::u8path(socket_path)))
+    return std::nullopt;
+
+  int fd = connectTo(socketAddress(socket_path));
+  if (fd < 0)
+    return std::nullopt;
+
+  std::string request = FileUtil::u8string(fs::current_path());
+  request += '\0';
+  for (auto &arg : args) {
+    request += arg;
+    request += '\0';
+  }
+  if (!sendFrame(fd, ArgsFrame, request.data(), static_cast<std::uint32_t>(request.size()))) {
+    ::close(fd);
+    throw std::runtime_error("Failed to send the command to the daemon.");
+  }
+
+  FrameType type;
+  std::string payload;
+  while (recvFrame(fd, type, payload, UINT32_MAX)) {
+    if (type == OutputFrame) {
+      out.write(payload.data(), payload.size());
+      out.flush();
+    } else if (type == ExitFrame && payload.size() == sizeof(std::int32_t)) {
+      std::int32_t status;
+      std::memcpy(&status, payload.data(), sizeof(status));
+      ::close(fd);
+      return status;
+    }
+  }
+
+  ::close(fd);
+  throw std::runtime_error("The daemon closed the connection.");
+}
+
+#else // _WIN32
+
+DaemonServer::DaemonServer(TdShell &shell, const std::string &socket_path)
+  : shell_(shell), socket_path_(socket_path)
+{
+  throw std::runtime_error("Daemon mode is only available on POSIX systems.");
+}
+
+DaemonServer::~DaemonServer() {}
+
+void DaemonServer::run() {}
+
+void DaemonServer::reap() {}
+
+void DaemonServer::serve(int) {}
+
+std::optional<int> DaemonClient::forward(const std::string &, const std::vector<std::string> &, std::ostream &) {
+  return std::nullopt;
+}
+
+#endif // _WIN32
@@ -0,0 +1,63 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "scopedthread.h"
+
+class TdShell;
+
+// Keeps a logged in TdShell resident and runs the commands of other
+// tdshell processes, which connect to a Unix domain socket in the database
+// directory. Every client runs on a thread of its own, all of them share
+// the same TdChannel and caches. Only available on POSIX systems.
+//
+// A client sends its working directory and arguments, the daemon streams
+// the output of the command back and ends with its exit status. Every
+// message is a frame made of a one byte type, a 32-bit length and the
+// payload.
+class DaemonServer {
+public:
+  DaemonServer(TdShell &shell, const std::string &socket_path);
+  ~DaemonServer();
+
+  DaemonServer(const DaemonServer&) = delete;
+  DaemonServer& operator=(const DaemonServer&) = delete;
+
+  // Serve clients until SIGINT or SIGTERM.
+  void run();
+
+  static std::string socketPath(const std::string &database_directory);
+
+private:
+  struct Connection {
+    std::atomic<bool> done{false};
+    std::unique_ptr<ScopedThread> thread;
+  };
+
+  void serve(int fd);
+  void reap();
+
+  TdShell &shell_;
+  std::string socket_path_;
+  int listen_fd_{-1};
+  std::list<std::unique_ptr<Connection>> connections_;
+};
+
+class DaemonClient {
+public:
+  // Run a command on the daemon listening at `socket_path` and copy its
+  // output to `out`. Returns the exit status of the command, or nothing
+  // if no daemon is running.
+  static std::optional<int> forward(const std::string &socket_path,
+                                    const std::vector<std::string> &args, std::ostream &out);
+};
+
+#endif // DAEMON_H
@@ -0,0 +1,176 @@
+#include "downloadjournal.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <sstream>
+#include <stdexcept>
+#include <nowide/cstdio.hpp>
+#include <nowide/fstream.hpp>
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+static const int JOURNAL_VERSION = 1;
+// Records are forced to disk at least this often, however few were written.
+static const auto SYNC_INTERVAL = std::chrono::seconds(1);
+
+DownloadJournal::DownloadJournal(const std::string &path, bool append, std::size_t sync_every)
+  : sync_every_(std::max<std::size_t>(sync_every, 1)), last_sync_(std::chrono::steady_clock::now())
+{
+  fs::create_directories(FileUtil::u8path(path).parent_path());
+  file_ = nowide::fopen(path.c_str(), append ? "ab" : "wb");
+  if (!file_)
+    throw std::runtime_error("Failed to open job journal " + path);
+}
+
+DownloadJournal::~DownloadJournal() {
+  sync();
+  std::fclose(file_);
+}
+
+std::string DownloadJournal::pathFor(const std::string &database_directory, const std::string &job) {
+  if (job.empty() || job.find_first_of("/\\") != std::string::npos || job == "." || job == "..")
+    throw std::logic_error("Invalid job name: " + job);
+  return FileUtil::u8string(FileUtil::u8path(database_directory) / "jobs" / FileUtil::u8path(job + ".journal"));
+}
+
+DownloadJournal::State DownloadJournal::load(const std::string &path) {
+  nowide::ifstream in(path);
+  if (!in)
+    throw std::logic_error("Can't open job journal " + path);
+
+  State state;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream ss(line);
+    char type = 0;
+    ss >> type;
+    // A crash may leave a truncated last record, skip anything malformed.
+    switch (type) {
+    case 'J': {
+      int version = 0;
+      ss >> version;
+      if (version != JOURNAL_VERSION)
+        throw std::runtime_error("Unsupported job journal version " + std::to_string(version));
+      ss.get();
+      std::getline(ss, state.output_folder);
+      break;
+    }
+    case 'L': {
+      std::string link;
+      ss.get();
+      if (std::getline(ss, link) && !link.empty())
+        state.links.push_back(std::move(link));
+      break;
+    }
+    case 'M': {
+      std::int64_t chat_id = 0, message_id = 0;
+      if (ss >> chat_id >> message_id)
+        state.messages.emplace_back(chat_id, message_id);
+      break;
+    }
+    case 'R':
+      ss >> state.chat_id >> state.from_id >> state.to_id >> state.media;
+      break;
+    case 'T': {
+      Entry entry;
+      if (!(ss >> entry.chat_id >> entry.message_id >> entry.file_id >> entry.size))
+        break;
+      ss.get();
+      std::getline(ss, entry.filename);
+      state.tasks[entry.file_id] = std::move(entry);
+      break;
+    }
+    case 'C': {
+      std::int64_t message_id = 0;
+      if (ss >> message_id)
+        state.checkpoint = message_id;
+      break;
+    }
+    case 'E':
+      state.resolved = true;
+      break;
+    case 'D': {
+      std::int32_t file_id = 0;
+      if (ss >> file_id)
+        state.done.insert(file_id);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  return state;
+}
+
+void DownloadJournal::recordHeader(const std::string &output_folder) {
+  append("J " + std::to_string(JOURNAL_VERSION) + " " + output_folder);
+}
+
+void DownloadJournal::recordLink(const std::string &link) {
+  append("L " + link);
+}
+
+void DownloadJournal::recordMessage(std::int64_t chat_id, std::int64_t message_id) {
+  append("M " + std::to_string(chat_id) + " " + std::to_string(message_id));
+}
+
+void DownloadJournal::recordRange(std::int64_t chat_id, std::int64_t from_id, std::int64_t to_id, unsigned media) {
+  append("R " + std::to_string(chat_id) + " " + std::to_string(from_id) + " " + std::to_string(to_id) +
+         " " + std::to_string(media));
+}
+
+void DownloadJournal::recordTask(const DownloadTask &task) {
+  std::string filename = task.filename;
+  std::replace(filename.begin(), filename.end(), '\n', ' ');
+  std::replace(filename.begin(), filename.end(), '\r', ' ');
+  append("T " + std::to_string(task.chat_id) + " " + std::to_string(task.message_id) + " " +
+         std::to_string(task.file_id) + " " + std::to_string(task.size) + " " + filename);
+}
+
+void DownloadJournal::recordCheckpoint(std::int64_t message_id) {
+  append("C " + std::to_string(message_id));
+}
+
+void DownloadJournal::recordResolved() {
+  append("E");
+}
+
+void DownloadJournal::recordDone(std::int32_t file_id) {
+  append("D " + std::to_string(file_id));
+}
+
+void DownloadJournal::append(const std::string &line) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  std::fputs(line.c_str(), file_);
+  std::fputc('\n', file_);
+  // Hand every record to the kernel so that it survives a crash of the
+  // process, but only pay for fsync once per batch.
+  std::fflush(file_);
+  if (++unsynced_ >= sync_every_ || std::chrono::steady_clock::now() - last_sync_ >= SYNC_INTERVAL)
+    syncLocked();
+}
+
+void DownloadJournal::sync() {
+  std::lock_guard<std::mutex> guard{mutex_};
+  syncLocked();
+}
+
+void DownloadJournal::syncLocked() {
+  std::fflush(file_);
+#ifdef _WIN32
+  _commit(_fileno(file_));
+#else
+  fsync(fileno(file_));
+#endif
+  unsynced_ = 0;
+  last_sync_ = std::chrono::steady_clock::now();
+}
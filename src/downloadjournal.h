@@ -0,0 +1,90 @@
+#ifndef DOWNLOAD_JOURNAL_H
+#define DOWNLOAD_JOURNAL_H
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "downloadscheduler.h"
+
+// An append-only record of a download job: the files it resolved and the
+// ones already finished, so that an interrupted job can be resumed without
+// resolving and planning everything again. Each record is one text line:
+//
+//   J <version> <output folder>          job header
+//   L <link>                             message link given to the job
+//   M <chat id> <msg id>                 message id given to the job
+//   R <chat id> <newest id> <oldest id> <media>
+//                                        message range of a range job
+//   T <chat id> <msg id> <file id> <size> <file name>
+//   C <msg id>                           range resolved down to this message
+//   E                                    all messages resolved
+//   D <file id>                          file finished
+class DownloadJournal {
+public:
+  struct Entry {
+    std::int64_t chat_id{0};
+    std::int64_t message_id{0};
+    std::int32_t file_id{0};
+    std::int64_t size{0};
+    std::string filename;
+  };
+
+  struct State {
+    std::string output_folder;
+    std::int64_t chat_id{0};
+    std::int64_t from_id{0};
+    std::int64_t to_id{0};
+    std::int64_t checkpoint{0};
+    // MessageCursor::Media walked, 0 for every message as in older journals.
+    unsigned media{0};
+    bool resolved{false};
+    // Messages given by link or id, resolved again on resume unless
+    // their file is among the tasks.
+    std::vector<std::string> links;
+    std::vector<std::pair<std::int64_t, std::int64_t>> messages;
+    std::map<std::int32_t, Entry> tasks;
+    std::set<std::int32_t> done;
+
+    bool isRange() const { return from_id != 0; }
+  };
+
+  // Open the journal, starting a new job unless `append` is set.
+  DownloadJournal(const std::string &path, bool append, std::size_t sync_every = 64);
+  ~DownloadJournal();
+
+  DownloadJournal(const DownloadJournal&) = delete;
+  DownloadJournal& operator=(const DownloadJournal&) = delete;
+
+  static std::string pathFor(const std::string &database_directory, const std::string &job);
+  static State load(const std::string &path);
+
+  void recordHeader(const std::string &output_folder);
+  void recordLink(const std::string &link);
+  void recordMessage(std::int64_t chat_id, std::int64_t message_id);
+  void recordRange(std::int64_t chat_id, std::int64_t from_id, std::int64_t to_id, unsigned media);
+  void recordTask(const DownloadTask &task);
+  void recordCheckpoint(std::int64_t message_id);
+  void recordResolved();
+  void recordDone(std::int32_t file_id);
+
+  // Force the records written so far to disk.
+  void sync();
+
+private:
+  void append(const std::string &line);
+  void syncLocked();
+
+  std::mutex mutex_;
+  std::FILE *file_{nullptr};
+  std::size_t sync_every_;
+  std::size_t unsynced_{0};
+  std::chrono::steady_clock::time_point last_sync_;
+};
+
+#endif // DOWNLOAD_JOURNAL_H
@@ -0,0 +1,269 @@
+#include "downloadscheduler.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "metrics.h"
+#include "tdchannel.h"
+
+DownloadScheduler::DownloadScheduler(TdChannel &channel, std::ostream &out, Options options)
+  : DownloadScheduler(std::vector<TdChannel*>{&channel}, out, options)
+{
+}
+
+DownloadScheduler::DownloadScheduler(std::vector<TdChannel*> channels, std::ostream &out, Options options)
+  : out_(out), options_(options), owner_(std::make_shared<Owner>())
+{
+  owner_->scheduler = this;
+  if (channels.empty())
+    throw std::logic_error("A download scheduler needs at least one account.");
+  if (options_.max_concurrent == 0)
+    options_.max_concurrent = 1;
+  options_.priority = std::clamp(options_.priority, 1, 32);
+  if (options_.show_progress)
+    progress_ = std::make_unique<ProgressBoard>(out_);
+
+  for (auto channel : channels)
+    accounts_.emplace_back().channel = channel;
+
+  // Updates of files this scheduler doesn't run are ignored by onUpdate().
+  for (std::size_t i = 0; i < accounts_.size(); i++) {
+    accounts_[i].subscription = accounts_[i].channel->updates().subscribe<td_api::updateFile>(
+      [this, i](const td_api::updateFile &update) {
+        onUpdate(i, *update.file_);
+      });
+  }
+}
+
+DownloadScheduler::~DownloadScheduler() {
+  {
+    // Waits for a handler still using the scheduler.
+    std::lock_guard<std::mutex> guard{owner_->mutex};
+    owner_->scheduler = nullptr;
+  }
+  for (auto &account : accounts_)
+    account.channel->updates().unsubscribe(account.subscription);
+
+  // Don't let downloads go on if we were interrupted before every task finished.
+  std::lock_guard<std::mutex> guard{mutex_};
+  for (auto &pair : active_) {
+    accounts_[pair.second.account].channel->send_query(
+      td_api::make_object<td_api::cancelDownloadFile>(pair.second.file_id, false), {});
+  }
+}
+
+void DownloadScheduler::report(const std::string &line) {
+  if (progress_) {
+    progress_->print(line);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
+  out_ << line << std::endl;
+}
+
+DownloadOrder DownloadScheduler::parseOrder(const std::string &name) {
+  if (name == "message")
+    return DownloadOrder::Message;
+  if (name == "smallest")
+    return DownloadOrder::SmallestFirst;
+  if (name == "largest")
+    return DownloadOrder::LargestFirst;
+  throw std::logic_error("Unknown download order: " + name);
+}
+
+bool DownloadScheduler::TaskOrder::operator()(const DownloadTask &a, const DownloadTask &b) const {
+  // Ties are broken by message and then file id so that the order is deterministic.
+  switch (order) {
+  case DownloadOrder::SmallestFirst:
+    if (a.size != b.size) return a.size < b.size;
+    break;
+  case DownloadOrder::LargestFirst:
+    if (a.size != b.size) return a.size > b.size;
+    break;
+  default:
+    break;
+  }
+
+  if (a.message_id != b.message_id)
+    return a.message_id > b.message_id;
+  return a.file_id > b.file_id;
+}
+
+bool DownloadScheduler::add(DownloadTask task) {
+  if (task.account >= accounts_.size())
+    throw std::logic_error("Unknown download account: " + std::to_string(task.account));
+
+  std::unique_lock<std::mutex> lock{mutex_};
+  if (!known_files_.insert(keyOf(task.account, task.file_id)).second)
+    return false;
+
+  ++pending_;
+
+  if (!task.can_be_downloaded) {
+    task.error = "File can't be download: " + task.filename;
+    lock.unlock();
+    completed_.push(std::move(task));
+    return true;
+  }
+
+  if (task.is_downloading_completed) {
+    lock.unlock();
+    completed_.push(std::move(task));
+    return true;
+  }
+
+  auto &account = accounts_[task.account];
+  auto chat_id = task.chat_id;
+  auto it = account.queued.find(chat_id);
+  if (it == account.queued.end()) {
+    it = account.queued.emplace(chat_id, std::multiset<DownloadTask, TaskOrder>{TaskOrder{options_.order}}).first;
+  }
+  if (it->second.empty())
+    account.chat_turns.push_back(chat_id);
+  queued_count_++;
+  queued_bytes_ += task.size;
+  it->second.insert(std::move(task));
+
+  fillSlots();
+  return true;
+}
+
+std::size_t DownloadScheduler::pending() const {
+  std::lock_guard<std::mutex> guard{mutex_};
+  return pending_;
+}
+
+DownloadTask DownloadScheduler::next() {
+  {
+    std::lock_guard<std::mutex> guard{mutex_};
+    if (pending_ == 0)
+      throw std::logic_error("No download is pending.");
+  }
+
+  auto task = completed_.pop();
+
+  std::lock_guard<std::mutex> guard{mutex_};
+  --pending_;
+  return task;
+}
+
+std::optional<DownloadTask> DownloadScheduler::tryNext() {
+  auto task = completed_.tryPop();
+  if (task) {
+    std::lock_guard<std::mutex> guard{mutex_};
+    --pending_;
+  }
+  return task;
+}
+
+// Must be called with mutex_ held.
+void DownloadScheduler::fillSlots() {
+  for (auto &account : accounts_) {
+    while (account.active < options_.max_concurrent && !account.chat_turns.empty()) {
+      auto chat_id = account.chat_turns.front();
+      account.chat_turns.pop_front();
+
+      auto &queue = account.queued.find(chat_id)->second;
+      auto node = queue.extract(queue.begin());
+      if (!queue.empty())
+        account.chat_turns.push_back(chat_id);
+
+      queued_count_--;
+      queued_bytes_ -= node.value().size;
+      start(std::move(node.value()));
+    }
+  }
+
+  if (progress_)
+    progress_->setQueued(queued_count_, queued_bytes_);
+}
+
+// Must be called with mutex_ held.
+void DownloadScheduler::start(DownloadTask task) {
+  auto file_id = task.file_id;
+  auto index = task.account;
+  auto &account = accounts_[index];
+  // Downloads started earlier get a higher priority so that they finish
+  // first instead of all of them progressing at the same pace.
+  auto priority = std::max<std::int32_t>(1, options_.priority - static_cast<std::int32_t>(account.active));
+  account.active++;
+  active_.emplace(keyOf(index, file_id), std::move(task));
+
+  // Handlers run on TdChannel workers, they must never block on a query.
+  account.channel->send_query(
+    td_api::make_object<td_api::downloadFile>(file_id, priority, 0, 0, false),
+    [owner = owner_, index, file_id](ObjectPtr object) {
+      if (object->get_id() != td_api::error::ID)
+        return;
+      auto error = td::move_tl_object_as<td_api::error>(object);
+      std::lock_guard<std::mutex> guard{owner->mutex};
+      if (owner->scheduler)
+        owner->scheduler->onFailed(index, file_id, error->message_);
+    });
+}
+
+void DownloadScheduler::onUpdate(std::size_t account, const td_api::file &file) {
+  auto key = keyOf(account, file.id_);
+  std::unique_lock<std::mutex> lock{mutex_};
+  auto it = active_.find(key);
+  // TDLib may repeat the final updateFile, report each file only once.
+  if (it == active_.end())
+    return;
+
+  auto &downloaded = it->second.downloaded_size;
+  Metrics::instance().addDownloaded(file.local_->downloaded_size_ - downloaded);
+  downloaded = file.local_->downloaded_size_;
+
+  // Only record the state, the board is drawn from its own thread.
+  if (progress_) {
+    std::int64_t total = file.size_ != 0 ? file.size_ : file.expected_size_;
+    progress_->update(key, it->second.filename, total, file.local_->downloaded_size_);
+  }
+
+  if (!file.local_->is_downloading_completed_)
+    return;
+
+  if (progress_)
+    progress_->remove(key, true);
+
+  auto task = std::move(it->second);
+  active_.erase(it);
+  accounts_[account].active--;
+  task.is_downloading_completed = true;
+  // The update is shared with other subscribers, copy what finalizing needs.
+  if (!task.file) {
+    task.file = td_api::make_object<td_api::file>();
+    task.file->id_ = file.id_;
+  }
+  if (!task.file->local_)
+    task.file->local_ = td_api::make_object<td_api::localFile>();
+  task.file->size_ = file.size_;
+  task.file->expected_size_ = file.expected_size_;
+  task.file->local_->path_ = file.local_->path_;
+  task.file->local_->downloaded_size_ = file.local_->downloaded_size_;
+  task.file->local_->is_downloading_completed_ = true;
+  fillSlots();
+
+  lock.unlock();
+  completed_.push(std::move(task));
+}
+
+void DownloadScheduler::onFailed(std::size_t account, std::int32_t file_id, const std::string &error) {
+  auto key = keyOf(account, file_id);
+  std::unique_lock<std::mutex> lock{mutex_};
+  auto it = active_.find(key);
+  if (it == active_.end())
+    return;
+
+  auto task = std::move(it->second);
+  active_.erase(it);
+  accounts_[account].active--;
+  if (progress_)
+    progress_->remove(key, false);
+  task.error = error;
+  fillSlots();
+
+  lock.unlock();
+  completed_.push(std::move(task));
+}
@@ -0,0 +1,163 @@
+#ifndef DOWNLOAD_SCHEDULER_H
+#define DOWNLOAD_SCHEDULER_H
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "progressboard.h"
+#include "updatebus.h"
+#include "utils.h"
+
+class TdChannel;
+
+struct DownloadTask {
+  std::int32_t file_id;
+  std::string filename;
+  bool can_be_downloaded;
+  bool is_downloading_completed;
+  FilePtr file;
+  std::int64_t chat_id{0};
+  std::int64_t message_id{0};
+  std::int64_t size{0};
+  // Remote unique id, the same for a file in every chat and session.
+  std::string unique_id;
+  // Set when the download failed, the task is then reported without a file.
+  std::string error;
+  // The account downloading the file, an index in the scheduler channels.
+  std::size_t account{0};
+  // The file id in the account that first resolved the message, file ids
+  // of other accounts differ.
+  std::int32_t origin_file_id;
+  // Bytes already downloaded as of the last update.
+  std::int64_t downloaded_size{0};
+
+  // Default constructor
+  DownloadTask() = delete;
+
+  // Constructor to initialize the struct with values
+  DownloadTask(std::int32_t id, const std::string& name, bool can_download,
+                bool is_download_completed, FilePtr f)
+    : file_id(id), filename(name), can_be_downloaded(can_download),
+      is_downloading_completed(is_download_completed), file(std::move(f)),
+      origin_file_id(id) {
+    if (file) {
+      size = file->size_ != 0 ? file->size_ : file->expected_size_;
+      if (file->remote_)
+        unique_id = file->remote_->unique_id_;
+      if (file->local_)
+        downloaded_size = file->local_->downloaded_size_;
+    }
+  }
+
+  DownloadTask(DownloadTask&& other) noexcept = default;
+  DownloadTask& operator=(DownloadTask&& other) noexcept = default;
+};
+
+enum class DownloadOrder {
+  Message,        // Newest message first
+  SmallestFirst,
+  LargestFirst
+};
+
+// Runs a bounded number of TDLib downloads at a time for each account.
+// Queued tasks are ordered by the chosen policy inside each chat, chats
+// take turns when a slot frees up, and finished tasks are handed back
+// through next().
+class DownloadScheduler {
+public:
+  struct Options {
+    // Per account.
+    std::size_t max_concurrent = 4;
+    DownloadOrder order = DownloadOrder::Message;
+    // TDLib priority (1-32) of the first download, later ones get lower.
+    std::int32_t priority = 32;
+    // Draw a progress board, only makes sense on a terminal.
+    bool show_progress = true;
+  };
+
+  DownloadScheduler(TdChannel &channel, std::ostream &out, Options options);
+  // Download with several accounts, DownloadTask::account indexes `channels`.
+  DownloadScheduler(std::vector<TdChannel*> channels, std::ostream &out, Options options);
+  ~DownloadScheduler();
+
+  DownloadScheduler(const DownloadScheduler&) = delete;
+  DownloadScheduler& operator=(const DownloadScheduler&) = delete;
+
+  // Queue a task. Returns false if the same file was already added.
+  bool add(DownloadTask task);
+
+  // Number of added tasks not yet returned by next().
+  std::size_t pending() const;
+
+  // Block until a task finishes and return it.
+  DownloadTask next();
+  // Return a finished task if there is one, without blocking.
+  std::optional<DownloadTask> tryNext();
+
+  // Print a line without messing up the progress board.
+  void report(const std::string &line);
+
+  std::size_t accounts() const { return accounts_.size(); }
+  TdChannel &channel(std::size_t account) { return *accounts_.at(account).channel; }
+
+  static DownloadOrder parseOrder(const std::string &name);
+
+private:
+  struct TaskOrder {
+    DownloadOrder order;
+    bool operator()(const DownloadTask &a, const DownloadTask &b) const;
+  };
+
+  struct Account {
+    TdChannel *channel;
+    UpdateBus::SubscriptionId subscription{0};
+    // Queued tasks per chat, and the chats in the order they take turns.
+    std::map<std::int64_t, std::multiset<DownloadTask, TaskOrder>> queued;
+    std::deque<std::int64_t> chat_turns;
+    std::size_t active{0};
+  };
+
+  // File ids are only unique inside an account.
+  static std::int64_t keyOf(std::size_t account, std::int32_t file_id) {
+    return (static_cast<std::int64_t>(account) << 32) | static_cast<std::uint32_t>(file_id);
+  }
+
+  void fillSlots();
+  void start(DownloadTask task);
+  void onUpdate(std::size_t account, const td_api::file &file);
+  void onFailed(std::size_t account, std::int32_t file_id, const std::string &error);
+
+  std::ostream &out_;
+  Options options_;
+
+  mutable std::mutex mutex_;
+  // A deque, since the queues of an account are move only.
+  std::deque<Account> accounts_;
+  std::set<std::int64_t> known_files_;
+  std::size_t queued_count_{0};
+  std::int64_t queued_bytes_{0};
+  std::unordered_map<std::int64_t, DownloadTask> active_;
+  std::size_t pending_{0};
+
+  AsynUtil::CompletionQueue<DownloadTask> completed_;
+  std::unique_ptr<ProgressBoard> progress_;
+
+  // The response to a downloadFile query may come after the scheduler is
+  // gone, its handler reaches the scheduler through this and finds null.
+  struct Owner {
+    std::mutex mutex;
+    DownloadScheduler *scheduler;
+  };
+  std::shared_ptr<Owner> owner_;
+};
+
+#endif // DOWNLOAD_SCHEDULER_H
@@ -0,0 +1,544 @@
+#include "fakebackend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+
+#include <nowide/fstream.hpp>
+
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+// TDLib numbers the messages of a chat in steps of 2^20.
+static const int MESSAGE_ID_SHIFT = 20;
+static const std::int64_t SUPERGROUP_CHAT_ID_BASE = -1000000000000LL;
+static const std::int64_t FIRST_SUPERGROUP_ID = 1000000;
+static const std::int32_t FIRST_DATE = 1600000000;
+
+static const char *const WORDS[] = {
+  "lorem", "ipsum", "dolor", "sit", "amet", "download", "channel", "archive",
+  "release", "notes", "chapter", "season", "episode", "привет", "файл", "下载",
+  "文件", "ファイル", "📦", "🎬", "https://example.org/page", "#tag", "@someone", "\n"
+};
+
+FakeBackend::FakeBackend(Options options)
+  : options_(std::move(options))
+{
+  std::mt19937 random{options_.seed};
+  std::uniform_real_distribution<double> media(0.0, 1.0);
+  std::uniform_int_distribution<int> kind(1, 3);
+  std::uniform_int_distribution<std::int64_t> uniform(options_.min_size, options_.max_size);
+  std::lognormal_distribution<double> lognormal(std::log(static_cast<double>(options_.median_size)), options_.size_sigma);
+
+  chats_.resize(options_.chats);
+  for (auto &messages : chats_) {
+    messages.reserve(options_.messages_per_chat);
+    for (std::size_t i = 0; i < options_.messages_per_chat; i++) {
+      Message message{Kind::Text, 0, static_cast<std::uint32_t>(random())};
+      if (media(random) < options_.media_ratio) {
+        message.kind = static_cast<Kind>(kind(random));
+        switch (options_.size_distribution) {
+        case SizeDistribution::Fixed:
+          message.size = options_.median_size;
+          break;
+        case SizeDistribution::Uniform:
+          message.size = uniform(random);
+          break;
+        case SizeDistribution::LogNormal:
+          message.size = std::clamp(static_cast<std::int64_t>(lognormal(random)), options_.min_size, options_.max_size);
+          break;
+        }
+      }
+      messages.push_back(message);
+    }
+  }
+}
+
+std::int32_t FakeBackend::createClientId() {
+  std::lock_guard<std::mutex> guard{mutex_};
+  return next_client_id_++;
+}
+
+// Like TDLib, a client says nothing before its first query.
+void FakeBackend::send(std::int32_t client_id, std::uint64_t request_id,
+                       td_api::object_ptr<td_api::Function> function) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  if (logged_in_.insert(client_id).second)
+    login(client_id);
+
+  // Reserve the place of the response before the downloads it starts.
+  Event event;
+  event.due = Clock::now() + options_.latency;
+  event.sequence = sequence_++;
+  event.response = Response{client_id, request_id, answer(client_id, *function)};
+  post(std::move(event));
+}
+
+ClientBackend::Response FakeBackend::receive(double timeout) {
+  std::unique_lock<std::mutex> lock{mutex_};
+  auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeout));
+
+  while (true) {
+    auto now = Clock::now();
+    if (!events_.empty() && events_.front().due <= now) {
+      std::pop_heap(events_.begin(), events_.end(), Later{});
+      auto event = std::move(events_.back());
+      events_.pop_back();
+      if (event.file_id != 0)
+        finishStep(event);
+      // Steps of cancelled downloads are left without an update.
+      if (event.response.object)
+        return std::move(event.response);
+      continue;
+    }
+
+    if (now >= deadline || interrupted_) {
+      interrupted_ = false;
+      return Response{0, 0, nullptr};
+    }
+    cond_.wait_until(lock, events_.empty() ? deadline : std::min(deadline, events_.front().due));
+  }
+}
+
+void FakeBackend::interrupt() {
+  std::lock_guard<std::mutex> guard{mutex_};
+  interrupted_ = true;
+  cond_.notify_all();
+}
+
+void FakeBackend::post(Event event) {
+  events_.push_back(std::move(event));
+  std::push_heap(events_.begin(), events_.end(), Later{});
+  cond_.notify_one();
+}
+
+void FakeBackend::postObject(std::int32_t client_id, std::uint64_t request_id, ObjectPtr object) {
+  Event event;
+  event.due = Clock::now();
+  event.sequence = sequence_++;
+  event.response = Response{client_id, request_id, std::move(object)};
+  post(std::move(event));
+}
+
+void FakeBackend::login(std::int32_t client_id) {
+  postObject(client_id, 0, td_api::make_object<td_api::updateAuthorizationState>(
+    td_api::make_object<td_api::authorizationStateReady>()));
+  for (std::size_t chat = 0; chat < chats_.size(); chat++)
+    postObject(client_id, 0, td_api::make_object<td_api::updateNewChat>(makeChat(chat)));
+}
+
+// The index of the newest message of a page: the one right before
+// from_message_id, or the last message, and a negative offset adds newer
+// messages, -1 includes from_message_id.
+std::int64_t FakeBackend::pageStart(std::size_t chat, std::int64_t from_message_id, std::int32_t offset) const {
+  auto count = static_cast<std::int64_t>(chats_[chat].size());
+  const std::int64_t step = 1 << MESSAGE_ID_SHIFT;
+  auto start = from_message_id == 0 ? count - 1
+             : std::min((from_message_id + step - 1) / step - 2, count - 1);
+  return std::min(start - std::min<std::int64_t>(offset, 0), count - 1);
+}
+
+ObjectPtr FakeBackend::answer(std::int32_t client_id, td_api::Function &function) {
+  switch (function.get_id()) {
+  case td_api::getOption::ID: {
+    auto value = td_api::make_object<td_api::optionValueString>();
+    value->value_ = "fake";
+    return value;
+  }
+  case td_api::loadChats::ID:
+    // Every chat was sent on login.
+    return makeError(404, "Not Found");
+  case td_api::getChats::ID: {
+    auto &query = static_cast<td_api::getChats &>(function);
+    auto chats = td_api::make_object<td_api::chats>();
+    for (std::size_t chat = 0; chat < chats_.size() && chat < static_cast<std::size_t>(query.limit_); chat++)
+      chats->chat_ids_.push_back(chatId(chat));
+    chats->total_count_ = static_cast<std::int32_t>(chats_.size());
+    return chats;
+  }
+  case td_api::getChat::ID: {
+    std::size_t chat;
+    if (!findChat(static_cast<td_api::getChat &>(function).chat_id_, chat))
+      return makeError(400, "Chat not found");
+    return makeChat(chat);
+  }
+  case td_api::createSupergroupChat::ID: {
+    auto supergroup_id = static_cast<td_api::createSupergroupChat &>(function).supergroup_id_;
+    std::size_t chat;
+    if (!findChat(SUPERGROUP_CHAT_ID_BASE - supergroup_id, chat))
+      return makeError(400, "Supergroup not found");
+    return makeChat(chat);
+  }
+  case td_api::getMessage::ID: {
+    auto &query = static_cast<td_api::getMessage &>(function);
+    std::size_t chat, index;
+    if (!findMessage(query.chat_id_, query.message_id_, chat, index))
+      return makeError(404, "Not Found");
+    return makeMessage(client_id, chat, index);
+  }
+  case td_api::getMessageLinkInfo::ID: {
+    // Only private links, https://t.me/c/<supergroup id>/<message>
+    auto &url = static_cast<td_api::getMessageLinkInfo &>(function).url_;
+    const std::string prefix = "https://t.me/c/";
+    long long supergroup_id = 0, server_id = 0;
+    if (url.compare(0, prefix.size(), prefix) != 0
+        || std::sscanf(url.c_str() + prefix.size(), "%lld/%lld", &supergroup_id, &server_id) != 2)
+      return makeError(400, "Invalid message link");
+
+    auto info = td_api::make_object<td_api::messageLinkInfo>();
+    info->chat_id_ = SUPERGROUP_CHAT_ID_BASE - supergroup_id;
+    std::size_t chat, index;
+    if (findMessage(info->chat_id_, static_cast<std::int64_t>(server_id) << MESSAGE_ID_SHIFT, chat, index))
+      info->message_ = makeMessage(client_id, chat, index);
+    return info;
+  }
+  case td_api::getChatHistory::ID: {
+    auto &query = static_cast<td_api::getChatHistory &>(function);
+    std::size_t chat;
+    if (!findChat(query.chat_id_, chat))
+      return makeError(400, "Chat not found");
+
+    auto start = pageStart(chat, query.from_message_id_, query.offset_);
+    auto limit = std::clamp<std::int64_t>(query.limit_, 1, 100);
+
+    auto messages = td_api::make_object<td_api::messages>();
+    for (auto index = start; index >= 0 && start - index < limit; index--)
+      messages->messages_.push_back(makeMessage(client_id, chat, static_cast<std::size_t>(index)));
+    messages->total_count_ = static_cast<std::int32_t>(messages->messages_.size());
+    return messages;
+  }
+  case td_api::searchChatMessages::ID: {
+    // Only the media filters, the way a range download searches.
+    auto &query = static_cast<td_api::searchChatMessages &>(function);
+    std::size_t chat;
+    if (!findChat(query.chat_id_, chat))
+      return makeError(400, "Chat not found");
+    if (!query.query_.empty() || !query.filter_)
+      return makeError(400, "Only searches by filter are supported");
+
+    auto filter = query.filter_->get_id();
+    auto matches = [filter](Kind kind) {
+      switch (filter) {
+      case td_api::searchMessagesFilterPhoto::ID: return kind == Kind::Photo;
+      case td_api::searchMessagesFilterVideo::ID: return kind == Kind::Video;
+      case td_api::searchMessagesFilterPhotoAndVideo::ID: return kind == Kind::Photo || kind == Kind::Video;
+      case td_api::searchMessagesFilterDocument::ID: return kind == Kind::Document;
+      default: return true;
+      }
+    };
+
+    auto start = pageStart(chat, query.from_message_id_, query.offset_);
+    auto limit = static_cast<std::size_t>(std::clamp<std::int64_t>(query.limit_, 1, 100));
+    auto messages = td_api::make_object<td_api::messages>();
+    for (auto index = start; index >= 0 && messages->messages_.size() < limit; index--) {
+      if (matches(chats_[chat][static_cast<std::size_t>(index)].kind))
+        messages->messages_.push_back(makeMessage(client_id, chat, static_cast<std::size_t>(index)));
+    }
+    messages->total_count_ = static_cast<std::int32_t>(messages->messages_.size());
+    return messages;
+  }
+  case td_api::downloadFile::ID:
+    return startDownload(client_id, static_cast<td_api::downloadFile &>(function).file_id_);
+  case td_api::getFile::ID: {
+    auto file_id = static_cast<td_api::getFile &>(function).file_id_;
+    auto chat = static_cast<std::size_t>(file_id - 1) / std::max<std::size_t>(options_.messages_per_chat, 1);
+    auto index = static_cast<std::size_t>(file_id - 1) % std::max<std::size_t>(options_.messages_per_chat, 1);
+    if (file_id <= 0 || chat >= chats_.size() || chats_[chat][index].kind == Kind::Text)
+      return makeError(400, "Invalid file identifier");
+    auto it = downloads_.find(downloadKey(client_id, file_id));
+    auto download = it == downloads_.end() ? nullptr : &it->second;
+    return makeFile(file_id, chats_[chat][index].size, download, pathOf(client_id, file_id));
+  }
+  case td_api::cancelDownloadFile::ID: {
+    auto it = downloads_.find(downloadKey(client_id, static_cast<td_api::cancelDownloadFile &>(function).file_id_));
+    if (it != downloads_.end() && it->second.active) {
+      it->second.active = false;
+      it->second.generation = ++sequence_;
+    }
+    return td_api::make_object<td_api::ok>();
+  }
+  default:
+    return makeError(400, "Unsupported by the fake backend");
+  }
+}
+
+// Answer with the state of the file and queue its progress: evenly spaced
+// steps over the time the download takes at options_.download_speed.
+ObjectPtr FakeBackend::startDownload(std::int32_t client_id, std::int32_t file_id) {
+  auto per_chat = std::max<std::size_t>(options_.messages_per_chat, 1);
+  auto chat = static_cast<std::size_t>(file_id - 1) / per_chat;
+  auto index = static_cast<std::size_t>(file_id - 1) % per_chat;
+  if (file_id <= 0 || chat >= chats_.size() || chats_[chat][index].kind == Kind::Text)
+    return makeError(400, "Invalid file identifier");
+
+  auto size = chats_[chat][index].size;
+  auto &download = downloads_[downloadKey(client_id, file_id)];
+  if (!download.completed && !download.active) {
+    download.active = true;
+    download.generation = ++sequence_;
+
+    auto steps = std::max<std::size_t>(options_.progress_updates, 1);
+    std::chrono::duration<double> duration{options_.download_speed > 0
+      ? static_cast<double>(size - download.downloaded) / options_.download_speed : 0.0};
+    auto begin = Clock::now() + options_.latency;
+    for (std::size_t step = 1; step <= steps; step++) {
+      Event event;
+      event.due = begin + std::chrono::duration_cast<Clock::duration>(duration * step / steps);
+      event.sequence = sequence_++;
+      event.response = Response{client_id, 0, nullptr};
+      event.file_id = file_id;
+      event.generation = download.generation;
+      event.downloaded = download.downloaded + (size - download.downloaded) * static_cast<std::int64_t>(step) / static_cast<std::int64_t>(steps);
+      post(std::move(event));
+    }
+  }
+
+  return makeFile(file_id, size, &download, pathOf(client_id, file_id));
+}
+
+void FakeBackend::finishStep(Event &event) {
+  auto client_id = event.response.client_id;
+  auto it = downloads_.find(downloadKey(client_id, event.file_id));
+  if (it == downloads_.end() || it->second.generation != event.generation)
+    return;
+
+  auto &download = it->second;
+  auto per_chat = std::max<std::size_t>(options_.messages_per_chat, 1);
+  auto size = chats_[(event.file_id - 1) / per_chat][(event.file_id - 1) % per_chat].size;
+  auto path = pathOf(client_id, event.file_id);
+
+  download.downloaded = event.downloaded;
+  if (download.downloaded >= size) {
+    download.active = false;
+    download.completed = true;
+
+    std::error_code ec;
+    auto file = FileUtil::u8path(path);
+    fs::create_directories(file.parent_path(), ec);
+    {
+      nowide::ofstream create(path, std::ios::binary);
+    }
+    fs::resize_file(file, static_cast<std::uintmax_t>(size), ec);
+  }
+
+  event.response.object = td_api::make_object<td_api::updateFile>(makeFile(event.file_id, size, &download, path));
+}
+
+void FakeBackend::sendFileUpdates(std::int32_t client_id, std::size_t count) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  std::size_t sent = 0;
+  while (sent < count) {
+    auto before = sent;
+    for (std::size_t chat = 0; chat < chats_.size(); chat++) {
+      for (std::size_t index = 0; index < chats_[chat].size(); index++) {
+        auto &info = chats_[chat][index];
+        if (info.kind == Kind::Text)
+          continue;
+        auto file_id = fileIdOf(chat, index);
+        postObject(client_id, 0, td_api::make_object<td_api::updateFile>(
+          makeFile(file_id, info.size, nullptr, pathOf(client_id, file_id))));
+        if (++sent == count)
+          return;
+      }
+    }
+    // There is no file to send updates of.
+    if (sent == before)
+      return;
+  }
+}
+
+void FakeBackend::resetDownloads() {
+  std::lock_guard<std::mutex> guard{mutex_};
+  downloads_.clear();
+}
+
+std::int64_t FakeBackend::chatId(std::size_t chat) const {
+  return SUPERGROUP_CHAT_ID_BASE - (FIRST_SUPERGROUP_ID + static_cast<std::int64_t>(chat));
+}
+
+std::string FakeBackend::chatTitle(std::size_t chat) const {
+  return "Fake channel " + std::to_string(chat);
+}
+
+std::int64_t FakeBackend::messageId(std::size_t index) const {
+  return static_cast<std::int64_t>(index + 1) << MESSAGE_ID_SHIFT;
+}
+
+std::int64_t FakeBackend::mediaBytes(std::size_t chat, std::size_t first, std::size_t last) const {
+  std::int64_t bytes = 0;
+  for (auto index = first; index <= last && index < chats_.at(chat).size(); index++)
+    bytes += chats_[chat][index].size;
+  return bytes;
+}
+
+bool FakeBackend::findChat(std::int64_t chat_id, std::size_t &chat) const {
+  auto number = SUPERGROUP_CHAT_ID_BASE - chat_id - FIRST_SUPERGROUP_ID;
+  if (number < 0 || number >= static_cast<std::int64_t>(chats_.size()))
+    return false;
+  chat = static_cast<std::size_t>(number);
+  return true;
+}
+
+bool FakeBackend::findMessage(std::int64_t chat_id, std::int64_t message_id,
+                              std::size_t &chat, std::size_t &index) const {
+  if (!findChat(chat_id, chat) || message_id <= 0 || (message_id & ((1 << MESSAGE_ID_SHIFT) - 1)) != 0)
+    return false;
+  auto number = (message_id >> MESSAGE_ID_SHIFT) - 1;
+  if (number >= static_cast<std::int64_t>(chats_[chat].size()))
+    return false;
+  index = static_cast<std::size_t>(number);
+  return true;
+}
+
+std::int32_t FakeBackend::fileIdOf(std::size_t chat, std::size_t index) const {
+  return static_cast<std::int32_t>(1 + chat * options_.messages_per_chat + index);
+}
+
+std::int64_t FakeBackend::downloadKey(std::int32_t client_id, std::int32_t file_id) {
+  return (static_cast<std::int64_t>(client_id) << 32) | static_cast<std::uint32_t>(file_id);
+}
+
+std::string FakeBackend::pathOf(std::int32_t client_id, std::int32_t file_id) const {
+  auto directory = options_.files_directory.empty()
+    ? fs::temp_directory_path() / "tdshell-fake" : FileUtil::u8path(options_.files_directory);
+  return FileUtil::u8string(directory / ("client_" + std::to_string(client_id)) / ("file_" + std::to_string(file_id) + ".bin"));
+}
+
+td_api::object_ptr<td_api::error> FakeBackend::makeError(std::int32_t code, const std::string &message) {
+  return td_api::make_object<td_api::error>(code, message);
+}
+
+td_api::object_ptr<td_api::chat> FakeBackend::makeChat(std::size_t chat) const {
+  auto type = td_api::make_object<td_api::chatTypeSupergroup>();
+  type->supergroup_id_ = FIRST_SUPERGROUP_ID + static_cast<std::int64_t>(chat);
+  type->is_channel_ = true;
+
+  auto result = td_api::make_object<td_api::chat>();
+  result->id_ = chatId(chat);
+  result->type_ = std::move(type);
+  result->title_ = chatTitle(chat);
+  return result;
+}
+
+td_api::object_ptr<td_api::file> FakeBackend::makeFile(std::int32_t file_id, std::int64_t size,
+                                                       const Download *download, const std::string &path) const {
+  auto local = td_api::make_object<td_api::localFile>();
+  local->can_be_downloaded_ = true;
+  local->can_be_deleted_ = true;
+  if (download) {
+    local->is_downloading_active_ = download->active;
+    local->is_downloading_completed_ = download->completed;
+    local->downloaded_prefix_size_ = download->downloaded;
+    local->downloaded_size_ = download->downloaded;
+    if (download->completed)
+      local->path_ = path;
+  }
+
+  auto remote = td_api::make_object<td_api::remoteFile>();
+  remote->id_ = "fake" + std::to_string(file_id);
+  remote->unique_id_ = "AgADfake" + std::to_string(file_id);
+  remote->is_uploading_completed_ = true;
+  remote->uploaded_size_ = size;
+
+  auto file = td_api::make_object<td_api::file>();
+  file->id_ = file_id;
+  file->size_ = size;
+  file->expected_size_ = size;
+  file->local_ = std::move(local);
+  file->remote_ = std::move(remote);
+  return file;
+}
+
+std::string FakeBackend::textOf(std::uint32_t seed) const {
+  std::mt19937 random{seed};
+  auto words = random() % 48;
+  std::string text;
+  for (std::uint32_t i = 0; i < words; i++) {
+    if (!text.empty())
+      text += ' ';
+    text += WORDS[random() % (sizeof(WORDS) / sizeof(WORDS[0]))];
+  }
+  return text;
+}
+
+td_api::object_ptr<td_api::message> FakeBackend::message(std::size_t chat, std::size_t index) const {
+  return makeMessage(0, chat, index);
+}
+
+// Files carry the download state of the client, if it isn't 0.
+td_api::object_ptr<td_api::message> FakeBackend::makeMessage(std::int32_t client_id,
+                                                             std::size_t chat, std::size_t index) const {
+  auto &info = chats_.at(chat).at(index);
+  auto caption = td_api::make_object<td_api::formattedText>();
+  caption->text_ = textOf(info.text_seed);
+
+  auto file_id = fileIdOf(chat, index);
+  auto name = std::to_string(file_id);
+  const Download *download = nullptr;
+  if (client_id != 0 && info.kind != Kind::Text) {
+    auto it = downloads_.find(downloadKey(client_id, file_id));
+    if (it != downloads_.end())
+      download = &it->second;
+  }
+  auto path = download ? pathOf(client_id, file_id) : std::string();
+
+  td_api::object_ptr<td_api::MessageContent> content;
+  switch (info.kind) {
+  case Kind::Text: {
+    auto text = td_api::make_object<td_api::messageText>();
+    text->text_ = std::move(caption);
+    content = std::move(text);
+    break;
+  }
+  case Kind::Document: {
+    auto document = td_api::make_object<td_api::document>();
+    document->file_name_ = "document_" + name + ".pdf";
+    document->mime_type_ = "application/pdf";
+    document->document_ = makeFile(file_id, info.size, download, path);
+    auto message_document = td_api::make_object<td_api::messageDocument>();
+    message_document->document_ = std::move(document);
+    message_document->caption_ = std::move(caption);
+    content = std::move(message_document);
+    break;
+  }
+  case Kind::Video: {
+    auto video = td_api::make_object<td_api::video>();
+    video->duration_ = static_cast<std::int32_t>(info.size / (256 << 10));
+    video->width_ = 1280;
+    video->height_ = 720;
+    video->file_name_ = "video_" + name + ".mp4";
+    video->mime_type_ = "video/mp4";
+    video->video_ = makeFile(file_id, info.size, download, path);
+    auto message_video = td_api::make_object<td_api::messageVideo>();
+    message_video->video_ = std::move(video);
+    message_video->caption_ = std::move(caption);
+    content = std::move(message_video);
+    break;
+  }
+  case Kind::Photo: {
+    auto size = td_api::make_object<td_api::photoSize>();
+    size->type_ = "y";
+    size->photo_ = makeFile(file_id, info.size, download, path);
+    size->width_ = 1280;
+    size->height_ = 960;
+    auto photo = td_api::make_object<td_api::photo>();
+    photo->sizes_.push_back(std::move(size));
+    auto message_photo = td_api::make_object<td_api::messagePhoto>();
+    message_photo->photo_ = std::move(photo);
+    message_photo->caption_ = std::move(caption);
+    content = std::move(message_photo);
+    break;
+  }
+  }
+
+  auto result = td_api::make_object<td_api::message>();
+  result->id_ = messageId(index);
+  result->sender_id_ = td_api::make_object<td_api::messageSenderChat>(chatId(chat));
+  result->chat_id_ = chatId(chat);
+  result->date_ = FIRST_DATE + static_cast<std::int32_t>(index) * 60;
+  result->content_ = std::move(content);
+  return result;
+}
@@ -0,0 +1,145 @@
+#ifndef FAKE_BACKEND_H
+#define FAKE_BACKEND_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "clientbackend.h"
+#include "common.h"
+
+// Answers the queries of tdshell in process, from channels filled with
+// generated messages, and downloads files by sending updateFile progress
+// the way TDLib does. Every client is logged in and sees the same chats.
+//
+// Chats are numbered from 0 and messages from 0, the oldest, so that the
+// ids to ask for can be computed with chatId() and messageId().
+class FakeBackend : public ClientBackend {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  enum class SizeDistribution {
+    Fixed,      // Every file has median_size bytes
+    Uniform,    // Between min_size and max_size
+    LogNormal   // Around median_size, clamped to [min_size, max_size]
+  };
+
+  struct Options {
+    std::size_t chats = 1;
+    std::size_t messages_per_chat = 1000;
+    // Share of the messages with a document, a video or a photo.
+    double media_ratio = 0.5;
+    SizeDistribution size_distribution = SizeDistribution::LogNormal;
+    std::int64_t median_size = 4 << 20;
+    std::int64_t min_size = 16 << 10;
+    std::int64_t max_size = 2LL << 30;
+    double size_sigma = 1.5;
+    // Time taken to answer a query.
+    std::chrono::microseconds latency{0};
+    // Bytes per second downloaded for each file, 0 to download at once.
+    std::int64_t download_speed = 0;
+    // updateFile sent for each download, the last one completes it.
+    std::size_t progress_updates = 8;
+    // Finished downloads are created here as sparse files of their size.
+    std::string files_directory;
+    std::uint32_t seed = 1;
+  };
+
+  explicit FakeBackend(Options options);
+
+  FakeBackend(const FakeBackend&) = delete;
+  FakeBackend& operator=(const FakeBackend&) = delete;
+
+  std::int32_t createClientId() override;
+  void send(std::int32_t client_id, std::uint64_t request_id,
+            td_api::object_ptr<td_api::Function> function) override;
+  Response receive(double timeout) override;
+  void interrupt() override;
+
+  std::int64_t chatId(std::size_t chat) const;
+  std::string chatTitle(std::size_t chat) const;
+  std::int64_t messageId(std::size_t index) const;
+  // The same message getMessage() returns.
+  td_api::object_ptr<td_api::message> message(std::size_t chat, std::size_t index) const;
+  // Sum of the sizes of the files in a range of messages of a chat.
+  std::int64_t mediaBytes(std::size_t chat, std::size_t first, std::size_t last) const;
+
+  // Send `count` updates of files nobody downloads to a client.
+  void sendFileUpdates(std::int32_t client_id, std::size_t count);
+  // Forget every download, as if the files were deleted.
+  void resetDownloads();
+
+private:
+  enum class Kind : std::uint8_t { Text, Document, Video, Photo };
+
+  struct Message {
+    Kind kind;
+    std::int64_t size;
+    std::uint32_t text_seed;
+  };
+
+  struct Download {
+    // Changes when a download starts or is cancelled, the steps queued for
+    // an earlier one are then dropped.
+    std::uint64_t generation{0};
+    std::int64_t downloaded{0};
+    bool active{false};
+    bool completed{false};
+  };
+
+  struct Event {
+    Clock::time_point due;
+    std::uint64_t sequence;
+    Response response;
+    // A step of a download when file_id is set, its update is made when due.
+    std::int32_t file_id{0};
+    std::uint64_t generation{0};
+    std::int64_t downloaded{0};
+  };
+
+  struct Later {
+    bool operator()(const Event &a, const Event &b) const {
+      return a.due != b.due ? a.due > b.due : a.sequence > b.sequence;
+    }
+  };
+
+  ObjectPtr answer(std::int32_t client_id, td_api::Function &function);
+  td_api::object_ptr<td_api::message> makeMessage(std::int32_t client_id, std::size_t chat, std::size_t index) const;
+  ObjectPtr startDownload(std::int32_t client_id, std::int32_t file_id);
+  void login(std::int32_t client_id);
+  void post(Event event);
+  void postObject(std::int32_t client_id, std::uint64_t request_id, ObjectPtr object);
+  void finishStep(Event &event);
+
+  bool findChat(std::int64_t chat_id, std::size_t &chat) const;
+  bool findMessage(std::int64_t chat_id, std::int64_t message_id, std::size_t &chat, std::size_t &index) const;
+  std::int64_t pageStart(std::size_t chat, std::int64_t from_message_id, std::int32_t offset) const;
+  std::int32_t fileIdOf(std::size_t chat, std::size_t index) const;
+  td_api::object_ptr<td_api::chat> makeChat(std::size_t chat) const;
+  td_api::object_ptr<td_api::file> makeFile(std::int32_t file_id, std::int64_t size,
+                                            const Download *download, const std::string &path) const;
+  std::string textOf(std::uint32_t seed) const;
+  std::string pathOf(std::int32_t client_id, std::int32_t file_id) const;
+  static std::int64_t downloadKey(std::int32_t client_id, std::int32_t file_id);
+  static td_api::object_ptr<td_api::error> makeError(std::int32_t code, const std::string &message);
+
+  Options options_;
+  std::vector<std::vector<Message>> chats_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::int32_t next_client_id_{1};
+  std::unordered_set<std::int32_t> logged_in_;
+  std::unordered_map<std::int64_t, Download> downloads_;
+  // A heap ordered by Later, the next event to send is at the front.
+  std::vector<Event> events_;
+  std::uint64_t sequence_{0};
+  bool interrupted_{false};
+};
+
+#endif // FAKE_BACKEND_H
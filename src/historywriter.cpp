@@ -0,0 +1,239 @@
+#include "historywriter.h"
+
+#include <charconv>
+#include <stdexcept>
+
+// The record types, a type is stored as its index.
+static const char *const TYPES[] = {"other", "text", "photo", "video", "document", "audio"};
+static const std::size_t TYPE_COUNT = sizeof(TYPES) / sizeof(TYPES[0]);
+
+std::uint8_t HistoryWriter::typeNumber(std::string_view type) {
+  for (std::size_t i = 0; i < TYPE_COUNT; i++) {
+    if (type == TYPES[i])
+      return static_cast<std::uint8_t>(i);
+  }
+  return 0;
+}
+
+const char *HistoryWriter::typeName(std::uint8_t number) {
+  return TYPES[number < TYPE_COUNT ? number : 0];
+}
+
+HistoryWriter::Format HistoryWriter::parseFormat(const std::string &name) {
+  if (name == "ndjson")
+    return Format::Ndjson;
+  if (name == "csv")
+    return Format::Csv;
+  throw std::logic_error("Unknown export format: " + name);
+}
+
+HistoryWriter::HistoryWriter(std::ostream &out, Format format, std::size_t buffer_size)
+  : out_(out), format_(format), buffer_size_(buffer_size)
+{
+  buffer_.reserve(buffer_size_ + 4096);
+  if (format_ == Format::Csv)
+    buffer_ += "id,chat_id,date,sender_id,type,text,file_name,file_size,mime_type\r\n";
+}
+
+HistoryWriter::~HistoryWriter() {
+  try {
+    flush();
+  } catch (...) {
+  }
+}
+
+void HistoryWriter::flush() {
+  if (!buffer_.empty()) {
+    out_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+  }
+  out_.flush();
+  if (!out_)
+    throw std::runtime_error("Failed to write the export.");
+}
+
+void HistoryWriter::write(const td_api::message &message) {
+  write(describe(message));
+}
+
+void HistoryWriter::write(const Record &record) {
+  if (format_ == Format::Ndjson)
+    writeJson(record);
+  else
+    writeCsv(record);
+  count_++;
+
+  if (buffer_.size() >= buffer_size_) {
+    out_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    buffer_.clear();
+  }
+}
+
+HistoryWriter::Record HistoryWriter::describe(const td_api::message &message) {
+  Record record;
+  record.id = message.id_;
+  record.chat_id = message.chat_id_;
+  record.date = message.date_;
+  if (message.sender_id_) {
+    td_api::downcast_call(
+      const_cast<td_api::MessageSender &>(*message.sender_id_), overloaded(
+        [&](td_api::messageSenderUser &sender) { record.sender_id = sender.user_id_; },
+        [&](td_api::messageSenderChat &sender) { record.sender_id = sender.chat_id_; }
+      )
+    );
+  }
+
+  if (!message.content_)
+    return record;
+
+  auto setFile = [&](const td_api::object_ptr<td_api::file> &file) {
+    if (file)
+      record.file_size = file->size_ != 0 ? file->size_ : file->expected_size_;
+  };
+
+  td_api::downcast_call(
+    const_cast<td_api::MessageContent &>(*message.content_), overloaded(
+      [&](td_api::messageText &content) {
+        record.type = "text";
+        if (content.text_)
+          record.text = content.text_->text_;
+      },
+      [&](td_api::messagePhoto &content) {
+        record.type = "photo";
+        if (content.caption_)
+          record.text = content.caption_->text_;
+        // The largest size is the one downloaded.
+        if (content.photo_) {
+          for (auto &size : content.photo_->sizes_) {
+            if (size->photo_ && size->photo_->expected_size_ > record.file_size)
+              setFile(size->photo_);
+          }
+        }
+      },
+      [&](td_api::messageVideo &content) {
+        record.type = "video";
+        if (content.caption_)
+          record.text = content.caption_->text_;
+        if (content.video_) {
+          record.file_name = content.video_->file_name_;
+          record.mime_type = content.video_->mime_type_;
+          setFile(content.video_->video_);
+        }
+      },
+      [&](td_api::messageDocument &content) {
+        record.type = "document";
+        if (content.caption_)
+          record.text = content.caption_->text_;
+        if (content.document_) {
+          record.file_name = content.document_->file_name_;
+          record.mime_type = content.document_->mime_type_;
+          setFile(content.document_->document_);
+        }
+      },
+      [&](td_api::messageAudio &content) {
+        record.type = "audio";
+        if (content.caption_)
+          record.text = content.caption_->text_;
+        if (content.audio_) {
+          record.file_name = content.audio_->file_name_;
+          record.mime_type = content.audio_->mime_type_;
+          setFile(content.audio_->audio_);
+        }
+      },
+      [](auto &) {}
+    )
+  );
+  return record;
+}
+
+void HistoryWriter::writeJson(const Record &record) {
+  buffer_ += "{\"id\":";
+  appendNumber(record.id);
+  buffer_ += ",\"chat_id\":";
+  appendNumber(record.chat_id);
+  buffer_ += ",\"date\":";
+  appendNumber(record.date);
+  buffer_ += ",\"sender_id\":";
+  appendNumber(record.sender_id);
+  buffer_ += ",\"type\":\"";
+  buffer_ += record.type;
+  buffer_ += "\",\"text\":";
+  appendJsonString(record.text);
+  if (record.file_size >= 0) {
+    buffer_ += ",\"file_name\":";
+    appendJsonString(record.file_name);
+    buffer_ += ",\"file_size\":";
+    appendNumber(record.file_size);
+    buffer_ += ",\"mime_type\":";
+    appendJsonString(record.mime_type);
+  }
+  buffer_ += "}\n";
+}
+
+void HistoryWriter::writeCsv(const Record &record) {
+  appendNumber(record.id);
+  buffer_ += ',';
+  appendNumber(record.chat_id);
+  buffer_ += ',';
+  appendNumber(record.date);
+  buffer_ += ',';
+  appendNumber(record.sender_id);
+  buffer_ += ',';
+  buffer_ += record.type;
+  buffer_ += ',';
+  appendCsvField(record.text);
+  buffer_ += ',';
+  appendCsvField(record.file_name);
+  buffer_ += ',';
+  if (record.file_size >= 0)
+    appendNumber(record.file_size);
+  buffer_ += ',';
+  appendCsvField(record.mime_type);
+  buffer_ += "\r\n";
+}
+
+void HistoryWriter::appendNumber(std::int64_t value) {
+  char digits[24];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value);
+  buffer_.append(digits, result.ptr);
+}
+
+// UTF-8 is kept as is, only quotes, backslashes and control characters
+// are escaped.
+void HistoryWriter::appendJsonString(std::string_view text) {
+  static const char HEX[] = "0123456789abcdef";
+  buffer_ += '"';
+  for (unsigned char c : text) {
+    switch (c) {
+    case '"': buffer_ += "\\\""; break;
+    case '\\': buffer_ += "\\\\"; break;
+    case '\n': buffer_ += "\\n"; break;
+    case '\r': buffer_ += "\\r"; break;
+    case '\t': buffer_ += "\\t"; break;
+    default:
+      if (c < 0x20) {
+        buffer_ += "\\u00";
+        buffer_ += HEX[c >> 4];
+        buffer_ += HEX[c & 0xf];
+      } else {
+        buffer_ += static_cast<char>(c);
+      }
+    }
+  }
+  buffer_ += '"';
+}
+
+void HistoryWriter::appendCsvField(std::string_view text) {
+  if (text.find_first_of(",\"\r\n") == std::string_view::npos) {
+    buffer_ += text;
+    return;
+  }
+
+  buffer_ += '"';
+  for (auto c : text) {
+    if (c == '"')
+      buffer_ += '"';
+    buffer_ += c;
+  }
+  buffer_ += '"';
+}
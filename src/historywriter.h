@@ -0,0 +1,71 @@
+#ifndef HISTORY_WRITER_H
+#define HISTORY_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include "common.h"
+
+// Writes messages as records, one per line, for other programs to read.
+// Records are collected in a buffer that is written out in large blocks,
+// so memory use doesn't grow with the number of messages.
+class HistoryWriter {
+public:
+  enum class Format {
+    Ndjson,   // A JSON object per line
+    Csv       // RFC 4180, with a header line
+  };
+
+  // The fields of a record, file fields are empty without a file. The
+  // strings point into the message it was made from.
+  struct Record {
+    std::int64_t id = 0;
+    std::int64_t chat_id = 0;
+    std::int64_t date = 0;
+    std::int64_t sender_id = 0;
+    const char *type = "other";
+    std::string_view text;
+    std::string_view file_name;
+    std::string_view mime_type;
+    std::int64_t file_size = -1;
+  };
+
+  static Format parseFormat(const std::string &name);
+  static Record describe(const td_api::message &message);
+
+  // Archives and the search index store the type of a record as a number.
+  // Unknown types are "other", number 0.
+  static std::uint8_t typeNumber(std::string_view type);
+  static const char *typeName(std::uint8_t number);
+
+  HistoryWriter(std::ostream &out, Format format, std::size_t buffer_size = 1 << 16);
+  // Flushes what is left, errors are then ignored.
+  ~HistoryWriter();
+
+  HistoryWriter(const HistoryWriter&) = delete;
+  HistoryWriter& operator=(const HistoryWriter&) = delete;
+
+  void write(const td_api::message &message);
+  void write(const Record &record);
+  void flush();
+
+  std::size_t count() const { return count_; }
+
+private:
+  void writeJson(const Record &record);
+  void writeCsv(const Record &record);
+  void appendNumber(std::int64_t value);
+  void appendJsonString(std::string_view text);
+  void appendCsvField(std::string_view text);
+
+  std::ostream &out_;
+  Format format_;
+  std::size_t buffer_size_;
+  std::string buffer_;
+  std::size_t count_{0};
+};
+
+#endif // HISTORY_WRITER_H
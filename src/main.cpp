@@ -1,16 +1,21 @@
 #include "tdshell.h"
 
 #include <stdexcept>
+#include <nowide/fstream.hpp>
 #include <nowide/iostream.hpp>
 #include <nowide/args.hpp>
 
 #include "common.h"
+#include "daemon.h"
+#include "metrics.h"
 #include "utils.h"
 #include "session.h"
+#include "startuptimer.h"
 
 using namespace cli;
 
 int main(int argc, char* argv[]) {
+  auto &timer = StartupTimer::instance();
   nowide::args _(argc,argv); // Fix arguments - make them UTF-8
 
   CLI::App app{"Telegram shell based on TDLib"};
@@ -25,26 +30,135 @@ int main(int argc, char* argv[]) {
     "where the TDLib database is to be stored; must point to a writable directory.")
     ->capture_default_str();
 
+  std::string files_path;
+  app.add_option("--files-directory", files_path, "The directory where TDLib stores downloaded "
+    "files, put it on the filesystem of your output folders to finalize downloads by renaming. "
+    "Defaults to a folder in the database directory.");
+
+  std::vector<std::string> accounts;
+  app.add_option("--account", accounts, "The database directory of another account to log in. "
+    "Can be repeated, downloads from chats the accounts share are spread over all of them.");
+
+  std::size_t workers = 2;
+  app.add_option("--workers", workers, "The number of threads running TDLib response handlers. "
+    "File updates are spread over all but the first one.")
+    ->check(CLI::PositiveNumber)
+    ->capture_default_str();
+
+  std::string script;
+  auto opt_script = app.add_option("--script", script, "Run the commands in a file, one per line, and exit. "
+    "Use - to read them from stdin, which is also done when stdin is not a terminal.");
+
+  std::size_t jobs = 1;
+  app.add_option("-j,--jobs", jobs, "The number of script commands run at the same time, "
+    "their output is still printed in script order.")
+    ->check(CLI::PositiveNumber)
+    ->capture_default_str();
+
+  bool daemon = false;
+  app.add_flag("--daemon", daemon, "Keep the session resident and run the commands of later "
+    "tdshell calls on the same database, which connect to a socket in the database directory.")
+    ->excludes(opt_script);
+  bool no_daemon = false;
+  app.add_flag("--no-daemon", no_daemon, "Run a one-shot command in this process even if a daemon is running.");
+
+  std::string metrics_file;
+  app.add_option("--metrics-file", metrics_file, "Write the metrics shown by `stats` to this "
+    "file in the Prometheus text format, for instance for the node exporter textfile collector.");
+  int metrics_interval = 10;
+  app.add_option("--metrics-interval", metrics_interval, "Seconds between two writes of the metrics file.")
+    ->check(CLI::PositiveNumber)
+    ->capture_default_str();
+
+  bool timings = false;
+  app.add_flag("--timings", timings, "Print how long each startup phase took when exiting.");
+
   app.prefix_command();
 
+  // Report the timings whichever way main returns.
+  struct TimingsReport {
+    const bool &enabled;
+    ~TimingsReport() {
+      if (enabled)
+        StartupTimer::instance().print(std::cerr);
+    }
+  } timings_report{timings};
+
   try {
 
-    CLI11_PARSE(app, argc, argv);
+    {
+      auto phase = timer.phase("arguments");
+      CLI11_PARSE(app, argc, argv);
+    }
 
     std::vector<std::string> arguments = app.remaining();
-    bool interactive = arguments.empty();
+    bool batch = !script.empty() || (arguments.empty() && !ConsoleUtil::isInputTerminal());
+    bool interactive = arguments.empty() && !batch;
+
+    // Run a one-shot command on the resident session if there is one.
+    if (!arguments.empty() && !daemon && !no_daemon) {
+      auto phase = timer.phase("daemon");
+      auto status = DaemonClient::forward(DaemonServer::socketPath(database_path), arguments, nowide::cout);
+      if (status)
+        return *status;
+    }
+
+    std::unique_ptr<MetricsFileWriter> metrics_writer;
+    if (!metrics_file.empty())
+      metrics_writer = std::make_unique<MetricsFileWriter>(metrics_file, std::chrono::seconds(metrics_interval));
 
     TdShell shell;
     shell.channel()->useEmptyEncryptionKey(empty_key);
     shell.channel()->setDatabaseDirectory(database_path);
-    shell.open();
+    shell.channel()->setFilesDirectory(files_path);
+    shell.channel()->setWorkerCount(workers);
+    for (auto &account : accounts)
+      shell.addAccount(account)->useEmptyEncryptionKey(empty_key);
+
+    // Get the menu ready while logging in, and only wait for the login
+    // right before running anything.
+    shell.beginOpen();
+    std::unique_ptr<Menu> menu;
+    {
+      auto phase = timer.phase("menu");
+      menu = shell.make_menu();
+    }
+    shell.finishOpen();
 
     if (new_key) {
       std::string new_password = ConsoleUtil::getPassword("Enter a new encryption key: ");
       shell.channel()->invoke<td_api::setDatabaseEncryptionKey>(new_password);
     }
 
-    Cli cli(shell.make_menu());
+    if (daemon) {
+      {
+        // The server joins the commands still running when it goes, and
+        // they need the TDLib workers until then.
+        DaemonServer server(shell, DaemonServer::socketPath(database_path));
+        nowide::cout << "Daemon running, stop it with Ctrl-C" << std::endl;
+        server.run();
+      }
+      shell.close();
+      return 0;
+    }
+
+    if (batch) {
+      // Log in once and run the whole script in this process.
+      auto phase = timer.phase("script");
+      std::size_t failed = 0;
+      if (script.empty() || script == "-") {
+        failed = shell.runScript(nowide::cin, nowide::cout, jobs);
+      } else {
+        nowide::ifstream in(script);
+        if (!in)
+          throw std::runtime_error("Failed to open script " + script);
+        failed = shell.runScript(in, nowide::cout, jobs);
+      }
+      shell.close();
+      return failed == 0 ? 0 : 1;
+    }
+
+    Cli cli(std::move(menu));
     SetColor();
 
     TDShellSession localSession(cli, nowide::cout, nowide::cin, 200);
@@ -61,6 +175,7 @@ int main(int argc, char* argv[]) {
     if (interactive) {
       localSession.Start();
     } else {
+      auto phase = timer.phase("command");
       localSession.Feed(StrUtil::join(arguments, " "));
       localSession.Exit();
       localSession.Stop();
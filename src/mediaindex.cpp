@@ -0,0 +1,321 @@
+#include "mediaindex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+#ifndef _WIN32
+    #include <cerrno>
+    #include <fcntl.h>
+    #include <sys/file.h>
+    #include <unistd.h>
+#endif
+
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+static const char INDEX_MAGIC[8] = {'T', 'D', 'S', 'M', 'I', 'D', 'X', '\0'};
+static const std::uint32_t INDEX_VERSION = 1;
+static const std::uint64_t INITIAL_CAPACITY = 1024;
+// Slots read or written at once when the table is rebuilt.
+static const std::size_t SLOT_BATCH = 4096;
+
+MediaIndex::MediaIndex(const std::string &directory) {
+  fs::path dir = FileUtil::u8path(directory);
+  fs::create_directories(dir);
+  index_path_ = FileUtil::u8string(dir / "media.idx");
+  records_path_ = FileUtil::u8string(dir / "media.paths");
+
+#ifndef _WIN32
+  lock_fd_ = ::open(records_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+#endif
+  {
+    // Another process may be creating the index at the same time.
+    FileLock lock(*this, true);
+    read_only_ = !lock;
+    if (!fs::exists(FileUtil::u8path(index_path_)))
+      create(index_path_, INITIAL_CAPACITY);
+    openIndex();
+  }
+
+  records_.open(records_path_, std::ios::in | std::ios::out | std::ios::binary | std::ios::app);
+  if (!records_)
+    throw std::runtime_error("Failed to open media index in " + directory);
+}
+
+MediaIndex::~MediaIndex() {
+#ifndef _WIN32
+  if (lock_fd_ >= 0)
+    ::close(lock_fd_);
+#endif
+}
+
+MediaIndex::FileLock::FileLock(MediaIndex &index, bool exclusive) : index_(index), locked_(true) {
+#ifndef _WIN32
+  locked_ = index_.lock_fd_ >= 0;
+  while (locked_ && ::flock(index_.lock_fd_, exclusive ? LOCK_EX : LOCK_SH) != 0) {
+    if (errno != EINTR)
+      locked_ = false;
+  }
+#endif
+}
+
+MediaIndex::FileLock::~FileLock() {
+#ifndef _WIN32
+  if (locked_)
+    ::flock(index_.lock_fd_, LOCK_UN);
+#endif
+}
+
+void MediaIndex::openIndex() {
+  index_.close();
+  index_.open(index_path_, std::ios::in | std::ios::out | std::ios::binary);
+  if (!index_)
+    throw std::runtime_error("Failed to open media index " + index_path_);
+  readHeader();
+}
+
+void MediaIndex::readHeader() {
+  index_.clear();
+  index_.seekg(0);
+  index_.read(reinterpret_cast<char*>(&header_), sizeof(header_));
+  if (!index_ || std::memcmp(header_.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+      || header_.version != INDEX_VERSION || header_.capacity == 0
+      || (header_.capacity & (header_.capacity - 1)) != 0)
+    throw std::runtime_error("Invalid media index " + index_path_);
+}
+
+void MediaIndex::reload() {
+  // Growing replaces the file with one twice as large, reopen it then.
+  std::error_code ec;
+  auto size = fs::file_size(FileUtil::u8path(index_path_), ec);
+  if (!ec && size != sizeof(Header) + header_.capacity * sizeof(Slot))
+    openIndex();
+  else
+    readHeader();
+}
+
+std::shared_ptr<MediaIndex> MediaIndex::shared(const std::string &directory) {
+  static std::mutex mutex;
+  static std::map<std::string, std::weak_ptr<MediaIndex>> indexes;
+
+  std::lock_guard<std::mutex> guard{mutex};
+  auto &entry = indexes[directory];
+  auto index = entry.lock();
+  if (!index) {
+    index = std::make_shared<MediaIndex>(directory);
+    entry = index;
+  }
+  return index;
+}
+
+std::uint64_t MediaIndex::size() const {
+  std::lock_guard<std::mutex> guard{mutex_};
+  return header_.count;
+}
+
+std::uint64_t MediaIndex::hashKey(const std::string &unique_id, std::int64_t size) {
+  // FNV-1a over the unique id, then mix in the size.
+  std::uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : unique_id) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  hash ^= static_cast<std::uint64_t>(size) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  return hash == 0 ? 1 : hash;
+}
+
+std::string MediaIndex::find(const std::string &unique_id, std::int64_t size) {
+  if (unique_id.empty())
+    return {};
+
+  std::lock_guard<std::mutex> guard{mutex_};
+  FileLock lock(*this, false);
+  if (lock)
+    reload();
+  Slot slot;
+  bool found = false;
+  probe(unique_id, size, slot, found);
+  if (!found)
+    return {};
+
+  std::string id, path;
+  readRecord(slot, id, path);
+  return path;
+}
+
+void MediaIndex::insert(const std::string &unique_id, std::int64_t size, const std::string &path) {
+  if (unique_id.empty() || read_only_)
+    return;
+
+  std::lock_guard<std::mutex> guard{mutex_};
+  FileLock lock(*this, true);
+  if (!lock)
+    return;
+  reload();
+  // Keep the load factor under 0.7 so that probe sequences stay short.
+  if ((header_.count + 1) * 10 > header_.capacity * 7)
+    grow();
+
+  Slot slot;
+  bool found = false;
+  auto index = probe(unique_id, size, slot, found);
+
+  records_.clear();
+  records_.seekp(0, std::ios::end);
+  std::uint64_t offset = static_cast<std::uint64_t>(records_.tellp());
+  records_.write(unique_id.data(), unique_id.size());
+  records_.put('\0');
+  records_.write(path.data(), path.size());
+  records_.flush();
+
+  slot.hash = hashKey(unique_id, size);
+  slot.size = size;
+  slot.offset = offset;
+  slot.length = static_cast<std::uint32_t>(unique_id.size() + 1 + path.size());
+  slot.reserved = 0;
+  writeSlot(index, slot);
+
+  if (!found) {
+    header_.count++;
+    writeHeader();
+  }
+  index_.flush();
+}
+
+std::uint64_t MediaIndex::probe(const std::string &unique_id, std::int64_t size, Slot &slot, bool &found) {
+  auto hash = hashKey(unique_id, size);
+  auto mask = header_.capacity - 1;
+  auto index = hash & mask;
+
+  while (true) {
+    slot = readSlot(index);
+    if (slot.hash == 0) {
+      found = false;
+      return index;
+    }
+
+    if (slot.hash == hash && slot.size == size) {
+      std::string id, path;
+      if (readRecord(slot, id, path) && id == unique_id) {
+        found = true;
+        return index;
+      }
+    }
+
+    index = (index + 1) & mask;
+  }
+}
+
+bool MediaIndex::readRecord(const Slot &slot, std::string &unique_id, std::string &path) {
+  std::string record(slot.length, '\0');
+  records_.clear();
+  records_.seekg(static_cast<std::streamoff>(slot.offset));
+  records_.read(&record[0], record.size());
+  if (!records_)
+    return false;
+
+  auto sep = record.find('\0');
+  if (sep == std::string::npos)
+    return false;
+  unique_id = record.substr(0, sep);
+  path = record.substr(sep + 1);
+  return true;
+}
+
+MediaIndex::Slot MediaIndex::readSlot(std::uint64_t index) {
+  Slot slot{};
+  index_.clear();
+  index_.seekg(static_cast<std::streamoff>(sizeof(Header) + index * sizeof(Slot)));
+  index_.read(reinterpret_cast<char*>(&slot), sizeof(slot));
+  if (!index_)
+    throw std::runtime_error("Failed to read media index " + index_path_);
+  return slot;
+}
+
+void MediaIndex::writeSlot(std::uint64_t index, const Slot &slot) {
+  index_.clear();
+  index_.seekp(static_cast<std::streamoff>(sizeof(Header) + index * sizeof(Slot)));
+  index_.write(reinterpret_cast<const char*>(&slot), sizeof(slot));
+}
+
+void MediaIndex::writeHeader() {
+  index_.clear();
+  index_.seekp(0);
+  index_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+}
+
+void MediaIndex::create(const std::string &filename, std::uint64_t capacity) {
+  nowide::ofstream out(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!out)
+    throw std::runtime_error("Failed to create media index " + filename);
+
+  Header header{};
+  std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  header.version = INDEX_VERSION;
+  header.capacity = capacity;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  std::vector<Slot> empty(SLOT_BATCH, Slot{});
+  for (std::uint64_t written = 0; written < capacity; written += SLOT_BATCH) {
+    auto n = std::min<std::uint64_t>(SLOT_BATCH, capacity - written);
+    out.write(reinterpret_cast<const char*>(empty.data()), n * sizeof(Slot));
+  }
+
+  if (!out)
+    throw std::runtime_error("Failed to create media index " + filename);
+}
+
+// Rebuild the table with twice the capacity. The records file is left
+// untouched, only the slots are moved.
+void MediaIndex::grow() {
+  auto capacity = header_.capacity * 2;
+  auto tmp_path = index_path_ + ".tmp";
+  create(tmp_path, capacity);
+
+  {
+    nowide::fstream tmp(tmp_path, std::ios::in | std::ios::out | std::ios::binary);
+    auto mask = capacity - 1;
+    std::vector<Slot> batch(SLOT_BATCH);
+    for (std::uint64_t first = 0; first < header_.capacity; first += SLOT_BATCH) {
+      auto n = std::min<std::uint64_t>(SLOT_BATCH, header_.capacity - first);
+      index_.clear();
+      index_.seekg(static_cast<std::streamoff>(sizeof(Header) + first * sizeof(Slot)));
+      index_.read(reinterpret_cast<char*>(batch.data()), n * sizeof(Slot));
+
+      for (std::uint64_t i = 0; i < n; i++) {
+        auto &slot = batch[i];
+        if (slot.hash == 0)
+          continue;
+
+        // Keys are unique already, find the first free slot.
+        for (auto index = slot.hash & mask;; index = (index + 1) & mask) {
+          Slot existing{};
+          tmp.seekg(static_cast<std::streamoff>(sizeof(Header) + index * sizeof(Slot)));
+          tmp.read(reinterpret_cast<char*>(&existing), sizeof(existing));
+          if (existing.hash == 0) {
+            tmp.seekp(static_cast<std::streamoff>(sizeof(Header) + index * sizeof(Slot)));
+            tmp.write(reinterpret_cast<const char*>(&slot), sizeof(slot));
+            break;
+          }
+        }
+      }
+    }
+
+    Header header = header_;
+    header.capacity = capacity;
+    tmp.seekp(0);
+    tmp.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!tmp)
+      throw std::runtime_error("Failed to grow media index " + index_path_);
+  }
+
+  index_.close();
+  fs::rename(FileUtil::u8path(tmp_path), FileUtil::u8path(index_path_));
+  index_.open(index_path_, std::ios::in | std::ios::out | std::ios::binary);
+  header_.capacity = capacity;
+}
@@ -0,0 +1,96 @@
+#ifndef MEDIA_INDEX_H
+#define MEDIA_INDEX_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <nowide/fstream.hpp>
+
+// A persistent index of downloaded media, keyed by the remote unique id
+// of a file and its size, that records where the file lives locally.
+//
+// It is made of two files in the given directory: `media.idx` is an open
+// addressing hash table of fixed size slots, and `media.paths` is an
+// append-only list of the unique ids and paths the slots point to. A lookup
+// reads one or a few slots and one record, whatever the number of entries.
+//
+// Several processes may share the index: lookups take a shared lock and
+// inserts an exclusive one. The lock is taken on `media.paths`, since
+// growing replaces `media.idx`. If the lock can't be taken, the index is
+// only read and nothing new is recorded.
+class MediaIndex {
+public:
+  explicit MediaIndex(const std::string &directory);
+  ~MediaIndex();
+
+  // The index of a directory shared by every command running at the same
+  // time, separate instances would overwrite each other's slots.
+  static std::shared_ptr<MediaIndex> shared(const std::string &directory);
+
+  MediaIndex(const MediaIndex&) = delete;
+  MediaIndex& operator=(const MediaIndex&) = delete;
+
+  // Return the path recorded for a file, or an empty string.
+  std::string find(const std::string &unique_id, std::int64_t size);
+  void insert(const std::string &unique_id, std::int64_t size, const std::string &path);
+
+  std::uint64_t size() const;
+  bool readOnly() const { return read_only_; }
+
+private:
+  struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    std::uint64_t capacity;
+    std::uint64_t count;
+  };
+
+  struct Slot {
+    std::uint64_t hash;  // 0 marks an empty slot
+    std::int64_t size;
+    std::uint64_t offset;
+    std::uint32_t length;
+    std::uint32_t reserved;
+  };
+
+  static std::uint64_t hashKey(const std::string &unique_id, std::int64_t size);
+
+  // Find the slot of a key, or the empty slot where it would go.
+  std::uint64_t probe(const std::string &unique_id, std::int64_t size, Slot &slot, bool &found);
+  bool readRecord(const Slot &slot, std::string &unique_id, std::string &path);
+  Slot readSlot(std::uint64_t index);
+  void writeSlot(std::uint64_t index, const Slot &slot);
+  void writeHeader();
+  void create(const std::string &filename, std::uint64_t capacity);
+  void grow();
+  void openIndex();
+  void readHeader();
+  // Pick up what other processes changed while the lock was released.
+  void reload();
+
+  // Holds the lock shared with other processes for a scope.
+  class FileLock {
+  public:
+    FileLock(MediaIndex &index, bool exclusive);
+    ~FileLock();
+    explicit operator bool() const { return locked_; }
+
+  private:
+    MediaIndex &index_;
+    bool locked_;
+  };
+
+  std::string index_path_;
+  std::string records_path_;
+  mutable std::mutex mutex_;
+  nowide::fstream index_;
+  nowide::fstream records_;
+  Header header_;
+  int lock_fd_{-1};
+  bool read_only_{false};
+};
+
+#endif // MEDIA_INDEX_H
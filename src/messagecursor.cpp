@@ -0,0 +1,176 @@
+#include "messagecursor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+// Consecutive empty pages tolerated before giving up on reaching `to`.
+static const int MAX_EMPTY_PAGES = 5;
+// TDLib may answer with an empty page while it is still fetching the
+// history from the server, so give it a moment before asking again.
+static const auto EMPTY_PAGE_DELAY = std::chrono::milliseconds(200);
+
+MessageCursor::MessageCursor(TdChannel &channel, MessagePtr from, MessagePtr to, int32_t page_size)
+  : channel_(channel), page_size_(page_size)
+{
+  chat_id_ = from->chat_id_;
+  if (chat_id_ != to->chat_id_)
+    throw std::runtime_error("Two messages were not from the same chat.");
+
+  if (from->id_ < to->id_)
+    std::swap(from, to);
+
+  to_id_ = to->id_;
+  addStream(0, from->id_);
+}
+
+MessageCursor::MessageCursor(TdChannel &channel, int64_t chat_id, int64_t from_id, int32_t page_size)
+  : channel_(channel), chat_id_(chat_id), to_id_(0), page_size_(page_size)
+{
+  addStream(0, from_id);
+}
+
+MessageCursor::MessageCursor(TdChannel &channel, int64_t chat_id, int64_t from_id, int64_t to_id,
+                             unsigned media, int32_t page_size)
+  : channel_(channel), chat_id_(chat_id), to_id_(to_id), page_size_(page_size)
+{
+  if (to_id_ > from_id)
+    std::swap(from_id, to_id_);
+
+  streams_.reserve(2);
+  if ((media & AnyMedia) == AnyMessage) {
+    addStream(0, from_id);
+    return;
+  }
+
+  // There is no filter for documents and something else, but photos and
+  // videos are one search.
+  if ((media & Photos) && (media & Videos))
+    addStream(td_api::searchMessagesFilterPhotoAndVideo::ID, from_id);
+  else if (media & Photos)
+    addStream(td_api::searchMessagesFilterPhoto::ID, from_id);
+  else if (media & Videos)
+    addStream(td_api::searchMessagesFilterVideo::ID, from_id);
+  if (media & Documents)
+    addStream(td_api::searchMessagesFilterDocument::ID, from_id);
+}
+
+static td_api::object_ptr<td_api::SearchMessagesFilter> makeFilter(int32_t id) {
+  switch (id) {
+  case td_api::searchMessagesFilterPhotoAndVideo::ID:
+    return td_api::make_object<td_api::searchMessagesFilterPhotoAndVideo>();
+  case td_api::searchMessagesFilterPhoto::ID:
+    return td_api::make_object<td_api::searchMessagesFilterPhoto>();
+  case td_api::searchMessagesFilterVideo::ID:
+    return td_api::make_object<td_api::searchMessagesFilterVideo>();
+  case td_api::searchMessagesFilterDocument::ID:
+    return td_api::make_object<td_api::searchMessagesFilterDocument>();
+  default:
+    throw std::logic_error("Unknown search filter " + std::to_string(id));
+  }
+}
+
+bool MessageCursor::atEnd() const {
+  return std::all_of(streams_.begin(), streams_.end(), [](const Stream &stream) {
+    return stream.done && stream.buffer.empty();
+  });
+}
+
+void MessageCursor::addStream(int32_t filter, int64_t from_id) {
+  Stream stream;
+  stream.filter = filter;
+  stream.next_from_id = from_id;
+  requestPage(stream);
+  streams_.push_back(std::move(stream));
+}
+
+void MessageCursor::requestPage(Stream &stream) {
+  // An offset of -1 includes the message `next_from_id` itself, which
+  // the first page has to start with.
+  int32_t offset = stream.started ? 0 : -1;
+  if (stream.filter == 0) {
+    stream.pending = channel_.prefetch<td_api::getChatHistory>(
+      chat_id_, stream.next_from_id, offset, page_size_, false);
+  } else {
+    stream.pending = channel_.prefetch<td_api::searchChatMessages>(
+      chat_id_, "", nullptr, stream.next_from_id, offset, page_size_, makeFilter(stream.filter), 0);
+  }
+}
+
+coro::Task<void> MessageCursor::fetchPage(Stream &stream) {
+  auto msgs = co_await std::move(*stream.pending);
+  stream.pending.reset();
+  std::size_t fetched = 0;
+
+  // Messages are ordered from newest to oldest, and the page starts at
+  // `next_from_id` which was already returned unless this is the first page.
+  for (auto &msg : msgs->messages_) {
+    if (msg->id_ > stream.next_from_id || (msg->id_ == stream.next_from_id && stream.started))
+      continue;
+
+    if (msg->id_ < to_id_) {
+      stream.done = true;
+      break;
+    }
+
+    stream.buffer.push_back(std::move(msg));
+    fetched++;
+    if (stream.buffer.back()->id_ == to_id_) {
+      stream.done = true;
+      break;
+    }
+  }
+
+  if (fetched > 0) {
+    stream.next_from_id = stream.buffer.back()->id_;
+    stream.started = true;
+    stream.empty_pages = 0;
+  } else if (!stream.done) {
+    // An empty page is the end of an open walk, and of a search, which
+    // doesn't have to meet `to` itself.
+    if (to_id_ == 0 || stream.filter != 0)
+      stream.done = true;
+    else if (++stream.empty_pages > MAX_EMPTY_PAGES)
+      throw std::runtime_error("Chat history ended before reaching message " + std::to_string(to_id_));
+  }
+
+  if (stream.done)
+    co_return;
+  if (stream.empty_pages > 0)
+    co_await coro::sleepFor(EMPTY_PAGE_DELAY);
+  // Prefetch the following page before the caller gets this one.
+  requestPage(stream);
+}
+
+coro::Task<std::vector<MessagePtr>> MessageCursor::nextPage() {
+  for (auto &stream : streams_) {
+    while (!stream.done && stream.buffer.empty())
+      co_await fetchPage(stream);
+  }
+
+  // A stream still going can only bring messages older than those it
+  // holds, so everything down to the highest of their oldest ones is in
+  // order already.
+  int64_t bound = 0;
+  for (auto &stream : streams_) {
+    if (!stream.done)
+      bound = std::max(bound, stream.buffer.back()->id_);
+  }
+
+  std::vector<MessagePtr> page;
+  for (auto &stream : streams_) {
+    while (!stream.buffer.empty() && stream.buffer.front()->id_ >= bound) {
+      page.push_back(std::move(stream.buffer.front()));
+      stream.buffer.pop_front();
+    }
+  }
+  if (streams_.size() > 1) {
+    std::sort(page.begin(), page.end(), [](const MessagePtr &a, const MessagePtr &b) {
+      return a->id_ > b->id_;
+    });
+  }
+
+  if (auto index = channel_.searchIndex())
+    index->add(page);
+  co_return page;
+}
@@ -0,0 +1,70 @@
+#ifndef MESSAGE_CURSOR_H
+#define MESSAGE_CURSOR_H
+
+#include <deque>
+#include <optional>
+#include <vector>
+
+#include "common.h"
+#include "coro.h"
+#include "tdchannel.h"
+
+// Walks the messages between two messages of a chat (inclusive), from the
+// newest to the oldest, one page at a time. The request for the next page
+// is already in flight while the caller works on the current one, and only
+// a single page is held in memory. Pages are co_awaited, so a cursor is
+// used from coroutines running on a coro::Executor.
+//
+// Given kinds of media, the cursor asks searchChatMessages for them instead
+// of getChatHistory, so that other messages are skipped by the server. Each
+// search filter is walked on its own and their pages merged by id.
+class MessageCursor {
+public:
+  enum Media : unsigned {
+    AnyMessage = 0,
+    Photos = 1,
+    Videos = 2,
+    Documents = 4,
+    AnyMedia = Photos | Videos | Documents
+  };
+
+  MessageCursor(TdChannel &channel, MessagePtr from, MessagePtr to, int32_t page_size = 100);
+  // Walk from message `from_id` back to the first message of the chat.
+  MessageCursor(TdChannel &channel, int64_t chat_id, int64_t from_id, int32_t page_size = 100);
+  // Walk from message `from_id` back to `to_id`, or to the first message
+  // when it is 0, returning only the `media` given.
+  MessageCursor(TdChannel &channel, int64_t chat_id, int64_t from_id, int64_t to_id,
+                unsigned media, int32_t page_size = 100);
+
+  // Return the next page of messages, or an empty vector once the range
+  // is exhausted.
+  coro::Task<std::vector<MessagePtr>> nextPage();
+
+  bool atEnd() const;
+
+private:
+  struct Stream {
+    // A searchMessagesFilter id, or 0 for the history.
+    int32_t filter;
+    int64_t next_from_id;
+    bool started{false};
+    bool done{false};
+    int empty_pages{0};
+    std::optional<TdChannel::Prefetched<MessageListPtr>> pending;
+    // Fetched, newest first, but not returned yet.
+    std::deque<MessagePtr> buffer;
+  };
+
+  void addStream(int32_t filter, int64_t from_id);
+  void requestPage(Stream &stream);
+  coro::Task<void> fetchPage(Stream &stream);
+
+  TdChannel &channel_;
+  int64_t chat_id_;
+  // 0 to walk until the history ends.
+  int64_t to_id_;
+  int32_t page_size_;
+  std::vector<Stream> streams_;
+};
+
+#endif // MESSAGE_CURSOR_H
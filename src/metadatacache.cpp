@@ -0,0 +1,144 @@
+#include "metadatacache.h"
+
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#include <nowide/cstdio.hpp>
+
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+static const char CACHE_MAGIC[8] = {'T', 'D', 'S', 'M', 'E', 'T', 'A', '\0'};
+static const std::uint32_t CACHE_VERSION = 1;
+static const std::size_t HEADER_SIZE = sizeof(CACHE_MAGIC) + 2 * sizeof(std::uint32_t);
+// kind, id and value length
+static const std::size_t RECORD_HEADER_SIZE = 1 + sizeof(std::int64_t) + sizeof(std::uint32_t);
+// Compact when the file holds this many records more than live entries.
+static const std::int64_t COMPACT_SLACK = 4096;
+static const auto FLUSH_INTERVAL = std::chrono::seconds(1);
+
+MetadataCache::MetadataCache(const std::string &filename)
+  : filename_(filename)
+{
+  auto path = FileUtil::u8path(filename_);
+  if (path.has_parent_path())
+    fs::create_directories(path.parent_path());
+
+  std::int64_t records = fs::exists(path) ? replay() : -1;
+  if (records < 0 || records > static_cast<std::int64_t>(entries_.size()) * 2 + COMPACT_SLACK) {
+    compact();
+  } else {
+    file_ = nowide::fopen(filename_.c_str(), "ab");
+  }
+
+  if (!file_)
+    throw std::runtime_error("Failed to open metadata cache " + filename_);
+  last_flush_ = std::chrono::steady_clock::now();
+}
+
+MetadataCache::~MetadataCache() {
+  if (file_)
+    std::fclose(file_);
+}
+
+std::int64_t MetadataCache::replay() {
+  FileUtil::MappedFile mapped(FileUtil::u8path(filename_));
+  const char *data = mapped.data();
+  std::size_t size = mapped.size();
+
+  std::uint32_t version = 0;
+  if (size < HEADER_SIZE || std::memcmp(data, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0)
+    return -1;
+  std::memcpy(&version, data + sizeof(CACHE_MAGIC), sizeof(version));
+  if (version != CACHE_VERSION)
+    return -1;
+
+  std::int64_t records = 0;
+  std::size_t pos = HEADER_SIZE;
+  while (pos + RECORD_HEADER_SIZE <= size) {
+    std::uint8_t kind = static_cast<std::uint8_t>(data[pos]);
+    std::int64_t id;
+    std::uint32_t length;
+    std::memcpy(&id, data + pos + 1, sizeof(id));
+    std::memcpy(&length, data + pos + 1 + sizeof(id), sizeof(length));
+    if (pos + RECORD_HEADER_SIZE + length > size)
+      break;
+
+    entries_[Key{static_cast<Kind>(kind), id}].assign(data + pos + RECORD_HEADER_SIZE, length);
+    pos += RECORD_HEADER_SIZE + length;
+    records++;
+  }
+
+  // A record cut short by a crash, rewrite the file without it.
+  if (pos != size)
+    return -1;
+  return records;
+}
+
+// Rewrite the file with only the live entries and keep it open for appending.
+void MetadataCache::compact() {
+  if (file_) {
+    std::fclose(file_);
+    file_ = nullptr;
+  }
+
+  auto tmp_path = filename_ + ".tmp";
+  file_ = nowide::fopen(tmp_path.c_str(), "wb");
+  if (!file_)
+    throw std::runtime_error("Failed to write metadata cache " + tmp_path);
+
+  std::uint32_t header[2] = {CACHE_VERSION, 0};
+  std::fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC), file_);
+  std::fwrite(header, 1, sizeof(header), file_);
+  for (auto &entry : entries_)
+    append(entry.first.first, entry.first.second, entry.second);
+
+  bool ok = std::fflush(file_) == 0 && !std::ferror(file_);
+  std::fclose(file_);
+  file_ = nullptr;
+  if (!ok)
+    throw std::runtime_error("Failed to write metadata cache " + tmp_path);
+
+  fs::rename(FileUtil::u8path(tmp_path), FileUtil::u8path(filename_));
+  file_ = nowide::fopen(filename_.c_str(), "ab");
+}
+
+void MetadataCache::forEach(const Visitor &visit) const {
+  std::lock_guard<std::mutex> guard{mutex_};
+  for (auto &entry : entries_)
+    visit(entry.first.first, entry.first.second, entry.second);
+}
+
+void MetadataCache::record(Kind kind, std::int64_t id, const std::string &value) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  auto it = entries_.find(Key{kind, id});
+  if (it != entries_.end() && it->second == value)
+    return;
+  entries_[Key{kind, id}] = value;
+  append(kind, id, value);
+
+  // Updates come in bursts at startup, don't make a syscall for each one.
+  auto now = std::chrono::steady_clock::now();
+  if (now - last_flush_ >= FLUSH_INTERVAL) {
+    std::fflush(file_);
+    last_flush_ = now;
+  }
+}
+
+void MetadataCache::flush() {
+  std::lock_guard<std::mutex> guard{mutex_};
+  std::fflush(file_);
+  last_flush_ = std::chrono::steady_clock::now();
+}
+
+void MetadataCache::append(Kind kind, std::int64_t id, const std::string &value) {
+  char header[RECORD_HEADER_SIZE];
+  auto length = static_cast<std::uint32_t>(value.size());
+  header[0] = static_cast<char>(kind);
+  std::memcpy(header + 1, &id, sizeof(id));
+  std::memcpy(header + 1 + sizeof(id), &length, sizeof(length));
+  std::fwrite(header, 1, sizeof(header), file_);
+  std::fwrite(value.data(), 1, value.size(), file_);
+}
@@ -0,0 +1,57 @@
+#ifndef METADATA_CACHE_H
+#define METADATA_CACHE_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+// A persistent snapshot of the chat and user metadata TDLib sends through
+// updates, so that titles can be resolved as soon as the shell starts.
+//
+// The file is a versioned header followed by an append-only list of
+// records, each one replacing the previous value of its entry. It is
+// memory mapped and replayed at startup, and rewritten with only the live
+// entries once superseded records dominate it.
+class MetadataCache {
+public:
+  enum class Kind : std::uint8_t {
+    ChatTitle = 1,
+    ChatUsername = 2,
+    UserName = 3
+  };
+
+  using Visitor = std::function<void(Kind kind, std::int64_t id, const std::string &value)>;
+
+  explicit MetadataCache(const std::string &filename);
+  ~MetadataCache();
+
+  MetadataCache(const MetadataCache&) = delete;
+  MetadataCache& operator=(const MetadataCache&) = delete;
+
+  // Call visit with the latest value of every entry.
+  void forEach(const Visitor &visit) const;
+  // Append a record unless the entry already has this value.
+  void record(Kind kind, std::int64_t id, const std::string &value);
+  void flush();
+
+private:
+  using Key = std::pair<Kind, std::int64_t>;
+
+  // Parse the file, returns the number of records or -1 if it is not usable.
+  std::int64_t replay();
+  void compact();
+  void append(Kind kind, std::int64_t id, const std::string &value);
+
+  std::string filename_;
+  mutable std::mutex mutex_;
+  std::map<Key, std::string> entries_;
+  std::FILE *file_{nullptr};
+  std::chrono::steady_clock::time_point last_flush_;
+};
+
+#endif // METADATA_CACHE_H
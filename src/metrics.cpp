@@ -0,0 +1,307 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <bit>
+#include <filesystem>
+#include <iomanip>
+#include <vector>
+#include <nowide/fstream.hpp>
+
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+Metrics &Metrics::instance() {
+  static Metrics metrics;
+  return metrics;
+}
+
+Metrics::Metrics()
+  : started_(Clock::now()), functions_(new FunctionStats[FUNCTIONS])
+{
+}
+
+std::size_t Metrics::bucketOf(std::uint64_t micros) {
+  if (micros < SUB_BUCKETS)
+    return micros;
+  auto msb = 63 - std::countl_zero(micros);
+  auto bucket = static_cast<std::size_t>(msb - 2) * SUB_BUCKETS + ((micros >> (msb - 3)) & (SUB_BUCKETS - 1));
+  return std::min(bucket, BUCKETS - 1);
+}
+
+std::uint64_t Metrics::bucketLowerBound(std::size_t bucket) {
+  if (bucket < SUB_BUCKETS)
+    return bucket;
+  auto group = bucket / SUB_BUCKETS;
+  return (SUB_BUCKETS + bucket % SUB_BUCKETS) << (group - 1);
+}
+
+Metrics::FunctionStats *Metrics::querySent(const td_api::Function &function) {
+  if (!enabled())
+    return nullptr;
+  auto id = function.get_id();
+  auto hash = static_cast<std::uint32_t>(id) * 2654435761u;
+  for (std::size_t i = 0; i < FUNCTIONS; i++) {
+    auto &stats = functions_[(hash + i) & (FUNCTIONS - 1)];
+    auto current = stats.id.load(std::memory_order_acquire);
+    if (current == 0) {
+      if (stats.id.compare_exchange_strong(current, id, std::memory_order_acq_rel)) {
+        // Only the first query of a function pays for its name. The whole
+        // query is printed, but only its name is kept.
+        auto text = td_api::to_string(function);
+        stats.name = text.substr(0, text.find_first_of(" \n"));
+        stats.ready.store(true, std::memory_order_release);
+        current = id;
+      }
+    }
+    if (current == id) {
+      stats.count.fetch_add(1, std::memory_order_relaxed);
+      stats.in_flight.fetch_add(1, std::memory_order_relaxed);
+      return &stats;
+    }
+  }
+  return nullptr;
+}
+
+void Metrics::queryDone(FunctionStats *stats, Clock::time_point sent, const td_api::Object &response) {
+  if (!enabled())
+    return;
+  bool failed = response.get_id() == td_api::error::ID;
+  if (failed) {
+    auto code = static_cast<const td_api::error &>(response).code_;
+    auto index = code > 0 && code < static_cast<std::int32_t>(MAX_ERROR_CODE) ? code : 0;
+    errors_by_code_[index].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  if (!stats)
+    return;
+
+  auto micros = static_cast<std::uint64_t>(
+    std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent).count());
+  stats->in_flight.fetch_sub(1, std::memory_order_relaxed);
+  if (failed)
+    stats->errors.fetch_add(1, std::memory_order_relaxed);
+  stats->latency[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+  stats->latency_sum.fetch_add(micros, std::memory_order_relaxed);
+  auto max = stats->latency_max.load(std::memory_order_relaxed);
+  while (micros > max && !stats->latency_max.compare_exchange_weak(max, micros, std::memory_order_relaxed)) {}
+}
+
+std::int64_t Metrics::nowSeconds() {
+  return std::chrono::duration_cast<std::chrono::seconds>(Clock::now().time_since_epoch()).count();
+}
+
+void Metrics::addDownloaded(std::int64_t bytes) {
+  if (bytes <= 0)
+    return;
+  downloaded_.fetch_add(bytes, std::memory_order_relaxed);
+
+  // Bytes of the current second. The thread that moves a slot on to a new
+  // second clears it, a few bytes added meanwhile may be lost to the rate.
+  auto second = nowSeconds();
+  auto &slot = rate_slots_[second % rate_slots_.size()];
+  auto previous = slot.second.load(std::memory_order_relaxed);
+  if (previous != second && slot.second.compare_exchange_strong(previous, second, std::memory_order_relaxed))
+    slot.bytes.store(0, std::memory_order_relaxed);
+  slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+double Metrics::downloadRate() const {
+  // Whole seconds only, the current one is still filling up.
+  auto now = nowSeconds();
+  std::uint64_t bytes = 0;
+  for (auto &slot : rate_slots_) {
+    auto second = slot.second.load(std::memory_order_relaxed);
+    if (second < now && second >= now - RATE_SECONDS)
+      bytes += slot.bytes.load(std::memory_order_relaxed);
+  }
+  return static_cast<double>(bytes) / RATE_SECONDS;
+}
+
+// Functions queried so far, by name.
+std::vector<const Metrics::FunctionStats*> Metrics::readyFunctions() const {
+  std::vector<const FunctionStats*> functions;
+  for (std::size_t i = 0; i < FUNCTIONS; i++) {
+    if (functions_[i].ready.load(std::memory_order_acquire))
+      functions.push_back(&functions_[i]);
+  }
+  std::sort(functions.begin(), functions.end(), [](auto a, auto b) { return a->name < b->name; });
+  return functions;
+}
+
+// The latency under which a fraction q of the queries fall, in seconds.
+double Metrics::quantile(const FunctionStats &stats, double q) {
+  std::uint64_t total = 0;
+  std::array<std::uint64_t, BUCKETS> counts;
+  for (std::size_t i = 0; i < BUCKETS; i++) {
+    counts[i] = stats.latency[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0)
+    return 0;
+
+  auto rank = static_cast<std::uint64_t>(q * total);
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < BUCKETS; i++) {
+    seen += counts[i];
+    if (seen > rank) {
+      // Report the middle of the bucket, but never more than the maximum.
+      auto low = bucketLowerBound(i);
+      auto high = i + 1 < BUCKETS ? bucketLowerBound(i + 1) : low;
+      auto micros = std::min<double>((low + high) / 2.0, stats.latency_max.load(std::memory_order_relaxed));
+      return micros / 1e6;
+    }
+  }
+  return stats.latency_max.load(std::memory_order_relaxed) / 1e6;
+}
+
+void Metrics::writeText(std::ostream &out) const {
+  auto functions = readyFunctions();
+
+  auto ms = [](double seconds) { return seconds * 1000.0; };
+  auto flags = out.flags();
+  auto precision = out.precision();
+  out << std::left << std::setw(28) << "function" << std::right
+      << std::setw(9) << "count" << std::setw(8) << "errors" << std::setw(8) << "flight"
+      << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms" << std::setw(10) << "p99 ms"
+      << std::setw(10) << "max ms" << "\n";
+  out << std::fixed << std::setprecision(1);
+  for (auto stats : functions) {
+    out << std::left << std::setw(28) << stats->name << std::right
+        << std::setw(9) << stats->count.load(std::memory_order_relaxed)
+        << std::setw(8) << stats->errors.load(std::memory_order_relaxed)
+        << std::setw(8) << stats->in_flight.load(std::memory_order_relaxed)
+        << std::setw(10) << ms(quantile(*stats, 0.5))
+        << std::setw(10) << ms(quantile(*stats, 0.9))
+        << std::setw(10) << ms(quantile(*stats, 0.99))
+        << std::setw(10) << stats->latency_max.load(std::memory_order_relaxed) / 1000.0 << "\n";
+  }
+
+  std::string errors;
+  for (std::size_t code = 0; code < MAX_ERROR_CODE; code++) {
+    auto count = errors_by_code_[code].load(std::memory_order_relaxed);
+    if (count > 0)
+      errors += " " + (code == 0 ? std::string("other") : std::to_string(code)) + "=" + std::to_string(count);
+  }
+  out << "errors by code:" << (errors.empty() ? " none" : errors) << "\n";
+
+  out << "downloaded: " << StrUtil::formatBytes(downloaded_.load(std::memory_order_relaxed))
+      << ", " << StrUtil::formatBytes(downloadRate()) << "/s"
+      << " over the last " << RATE_SECONDS << "s" << std::endl;
+  out.flags(flags);
+  out.precision(precision);
+}
+
+static std::string escapeLabel(const std::string &value) {
+  std::string escaped;
+  for (auto c : value) {
+    if (c == '\n') {
+      escaped += "\\n";
+      continue;
+    }
+    if (c == '\\' || c == '"')
+      escaped += '\\';
+    escaped += c;
+  }
+  return escaped;
+}
+
+void Metrics::writePrometheus(std::ostream &out) const {
+  auto functions = readyFunctions();
+
+  auto label = [](const FunctionStats *stats) {
+    return "{function=\"" + escapeLabel(stats->name) + "\"";
+  };
+
+  out << "# HELP tdshell_queries_total Queries sent to TDLib.\n"
+      << "# TYPE tdshell_queries_total counter\n";
+  for (auto stats : functions)
+    out << "tdshell_queries_total" << label(stats) << "} " << stats->count.load(std::memory_order_relaxed) << "\n";
+
+  out << "# HELP tdshell_query_errors_total Queries answered with an error.\n"
+      << "# TYPE tdshell_query_errors_total counter\n";
+  for (auto stats : functions)
+    out << "tdshell_query_errors_total" << label(stats) << "} " << stats->errors.load(std::memory_order_relaxed) << "\n";
+
+  out << "# HELP tdshell_queries_in_flight Queries waiting for their response.\n"
+      << "# TYPE tdshell_queries_in_flight gauge\n";
+  for (auto stats : functions)
+    out << "tdshell_queries_in_flight" << label(stats) << "} " << stats->in_flight.load(std::memory_order_relaxed) << "\n";
+
+  out << "# HELP tdshell_query_latency_seconds Time from sending a query to its response.\n"
+      << "# TYPE tdshell_query_latency_seconds summary\n";
+  for (auto stats : functions) {
+    for (auto q : {0.5, 0.9, 0.99})
+      out << "tdshell_query_latency_seconds" << label(stats) << ",quantile=\"" << q << "\"} " << quantile(*stats, q) << "\n";
+    std::uint64_t count = 0;
+    for (auto &bucket : stats->latency)
+      count += bucket.load(std::memory_order_relaxed);
+    out << "tdshell_query_latency_seconds_sum" << label(stats) << "} "
+        << stats->latency_sum.load(std::memory_order_relaxed) / 1e6 << "\n";
+    out << "tdshell_query_latency_seconds_count" << label(stats) << "} " << count << "\n";
+  }
+
+  out << "# HELP tdshell_errors_total TDLib errors by code, 0 for codes out of range.\n"
+      << "# TYPE tdshell_errors_total counter\n";
+  for (std::size_t code = 0; code < MAX_ERROR_CODE; code++) {
+    auto count = errors_by_code_[code].load(std::memory_order_relaxed);
+    if (count > 0)
+      out << "tdshell_errors_total{code=\"" << code << "\"} " << count << "\n";
+  }
+
+  out << "# HELP tdshell_download_bytes_total Bytes downloaded.\n"
+      << "# TYPE tdshell_download_bytes_total counter\n"
+      << "tdshell_download_bytes_total " << downloaded_.load(std::memory_order_relaxed) << "\n"
+      << "# HELP tdshell_download_bytes_per_second Download rate over the last " << RATE_SECONDS << " seconds.\n"
+      << "# TYPE tdshell_download_bytes_per_second gauge\n"
+      << "tdshell_download_bytes_per_second " << downloadRate() << "\n"
+      << "# HELP tdshell_uptime_seconds Time since the process started.\n"
+      << "# TYPE tdshell_uptime_seconds gauge\n"
+      << "tdshell_uptime_seconds "
+      << std::chrono::duration<double>(Clock::now() - started_).count() << std::endl;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// MetricsFileWriter
+/////////////////////////////////////////////////////////////////////////////
+
+MetricsFileWriter::MetricsFileWriter(const std::string &path, std::chrono::seconds interval)
+  : path_(path), interval_(interval.count() > 0 ? interval : std::chrono::seconds(1))
+{
+  thread_ = std::make_unique<ScopedThread>([this] { run(); });
+}
+
+MetricsFileWriter::~MetricsFileWriter() {
+  {
+    std::lock_guard<std::mutex> guard{mutex_};
+    stop_ = true;
+  }
+  cond_.notify_all();
+  thread_.reset();
+}
+
+void MetricsFileWriter::run() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (!cond_.wait_for(lock, interval_, [this] { return stop_; })) {
+    lock.unlock();
+    write();
+    lock.lock();
+  }
+  // Leave the final counts behind.
+  lock.unlock();
+  write();
+}
+
+void MetricsFileWriter::write() {
+  auto temp = path_ + ".tmp";
+  {
+    nowide::ofstream out(temp, std::ios::trunc);
+    if (!out)
+      return;
+    Metrics::instance().writePrometheus(out);
+    if (!out)
+      return;
+  }
+  std::error_code ec;
+  fs::rename(FileUtil::u8path(temp), FileUtil::u8path(path_), ec);
+}
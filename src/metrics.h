@@ -0,0 +1,117 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "scopedthread.h"
+
+// Counters of the queries sent to TDLib and of downloaded bytes, shared by
+// every account of the process. Recording a query only takes a lock-free
+// lookup of its function, a clock read and a few relaxed atomic updates.
+class Metrics {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // Latencies in microseconds go to log-linear buckets: 8 linear steps
+  // within each power of two, so a bucket is at most 12.5% wide.
+  static constexpr std::size_t SUB_BUCKETS = 8;
+  static constexpr std::size_t BUCKETS = 40 * SUB_BUCKETS;
+
+  struct FunctionStats {
+    std::atomic<std::int32_t> id{0};
+    std::atomic<bool> ready{false};  // Set once name is written
+    std::string name;
+
+    std::atomic<std::uint64_t> count{0};
+    std::atomic<std::uint64_t> errors{0};
+    std::atomic<std::int64_t> in_flight{0};
+    std::atomic<std::uint64_t> latency_sum{0};
+    std::atomic<std::uint64_t> latency_max{0};
+    std::array<std::atomic<std::uint64_t>, BUCKETS> latency{};
+  };
+
+  static Metrics &instance();
+
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  // On by default. While off, queries are not recorded at all, which the
+  // benchmarks use to measure what recording costs.
+  void setEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // Record a query being sent. Returns the slot to pass to queryDone(),
+  // null once the table of functions is full or while recording is off.
+  FunctionStats *querySent(const td_api::Function &function);
+  void queryDone(FunctionStats *stats, Clock::time_point sent, const td_api::Object &response);
+  void addDownloaded(std::int64_t bytes);
+
+  // Bytes per second over the last few seconds.
+  double downloadRate() const;
+
+  // A table for people, and the Prometheus text format.
+  void writeText(std::ostream &out) const;
+  void writePrometheus(std::ostream &out) const;
+
+  static std::size_t bucketOf(std::uint64_t micros);
+  // The smallest latency that falls in a bucket.
+  static std::uint64_t bucketLowerBound(std::size_t bucket);
+
+private:
+  Metrics();
+
+  static constexpr std::size_t FUNCTIONS = 256;
+  static constexpr std::size_t MAX_ERROR_CODE = 600;
+  static constexpr std::int64_t RATE_SECONDS = 10;
+
+  struct RateSlot {
+    std::atomic<std::int64_t> second{-1};
+    std::atomic<std::uint64_t> bytes{0};
+  };
+
+  std::vector<const FunctionStats*> readyFunctions() const;
+  static double quantile(const FunctionStats &stats, double q);
+  static std::int64_t nowSeconds();
+
+  Clock::time_point started_;
+  std::atomic<bool> enabled_{true};
+  std::unique_ptr<FunctionStats[]> functions_;
+  // Codes outside of [1, MAX_ERROR_CODE) are counted at 0.
+  std::array<std::atomic<std::uint64_t>, MAX_ERROR_CODE> errors_by_code_{};
+  std::atomic<std::uint64_t> downloaded_{0};
+  std::array<RateSlot, RATE_SECONDS + 2> rate_slots_;
+};
+
+// Writes the metrics to a file in the Prometheus text format at a fixed
+// interval, replacing the file at once so that readers never see half of it.
+class MetricsFileWriter {
+public:
+  MetricsFileWriter(const std::string &path, std::chrono::seconds interval);
+  ~MetricsFileWriter();
+
+  MetricsFileWriter(const MetricsFileWriter&) = delete;
+  MetricsFileWriter& operator=(const MetricsFileWriter&) = delete;
+
+private:
+  void run();
+  void write();
+
+  std::string path_;
+  std::chrono::seconds interval_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_{false};
+  std::unique_ptr<ScopedThread> thread_;
+};
+
+#endif // METRICS_H
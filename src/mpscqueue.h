@@ -0,0 +1,80 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+
+// An unbounded multi-producer single-consumer queue (Dmitry Vyukov's
+// intrusive node queue). Producers never take a lock nor wait for each
+// other: a push is one allocation, one exchange and one store. The
+// consumer can sleep in popWait() until something is pushed.
+template<typename T>
+class MpscQueue {
+public:
+  MpscQueue() : head_(new Node), tail_(head_.load()) {}
+
+  ~MpscQueue() {
+    while (tryPop()) {}
+    delete tail_;
+  }
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  void push(T value) {
+    auto node = new Node;
+    node->value.emplace(std::move(value));
+    auto prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+    wake();
+  }
+
+  // Consumer only. May miss an item whose push is still in progress, the
+  // pushing thread wakes the consumer once it is done.
+  std::optional<T> tryPop() {
+    auto tail = tail_;
+    auto next = tail->next.load(std::memory_order_acquire);
+    if (!next)
+      return std::nullopt;
+
+    std::optional<T> value{std::move(next->value)};
+    next->value.reset();
+    tail_ = next;
+    delete tail;
+    return value;
+  }
+
+  // Consumer only. Block until an item arrives, or return nothing once
+  // `stop` is set and the queue is drained.
+  std::optional<T> popWait(const std::atomic<bool> &stop) {
+    while (true) {
+      auto signal = signal_.load(std::memory_order_acquire);
+      if (auto value = tryPop())
+        return value;
+      if (stop.load(std::memory_order_acquire))
+        return tryPop();
+      signal_.wait(signal, std::memory_order_acquire);
+    }
+  }
+
+  // Wake the consumer, for instance after setting its stop flag.
+  void wake() {
+    signal_.fetch_add(1, std::memory_order_release);
+    signal_.notify_one();
+  }
+
+private:
+  struct Node {
+    std::atomic<Node*> next{nullptr};
+    std::optional<T> value;
+  };
+
+  // Producers append at head_, the consumer owns tail_, a node whose value
+  // was already taken.
+  alignas(64) std::atomic<Node*> head_;
+  alignas(64) Node *tail_;
+  alignas(64) std::atomic<std::uint32_t> signal_{0};
+};
+
+#endif // MPSC_QUEUE_H
@@ -0,0 +1,143 @@
+#include "progressboard.h"
+
+#include <iomanip>
+#include <sstream>
+
+#include "utils.h"
+
+// Files drawn at most, the others are only counted in the summary.
+static const std::size_t MAX_FILE_LINES = 8;
+// Weight of the latest sample in the smoothed speeds.
+static const double SPEED_SMOOTHING = 0.3;
+
+static std::string formatDuration(double seconds) {
+  if (seconds < 0 || seconds > 99 * 3600)
+    return "--:--:--";
+  auto total = static_cast<long long>(seconds);
+  std::ostringstream ss;
+  ss << std::setfill('0') << std::setw(2) << total / 3600 << ":"
+     << std::setw(2) << total / 60 % 60 << ":" << std::setw(2) << total % 60;
+  return ss.str();
+}
+
+ProgressBoard::ProgressBoard(std::ostream &out, std::chrono::milliseconds interval)
+  : out_(out), interval_(interval), last_frame_(std::chrono::steady_clock::now())
+{
+  thread_ = std::make_unique<ScopedThread>([this] { run(); });
+}
+
+ProgressBoard::~ProgressBoard() {
+  {
+    std::lock_guard<std::mutex> guard{mutex_};
+    stop_ = true;
+  }
+  cond_.notify_one();
+  thread_.reset();
+
+  std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
+  clearLocked();
+}
+
+void ProgressBoard::update(std::int64_t key, const std::string &filename,
+                           std::int64_t total, std::int64_t downloaded) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  // Files such as photos may have no name, only the key tells a new one.
+  auto inserted = files_.try_emplace(key);
+  auto &state = inserted.first->second;
+  if (inserted.second) {
+    state.filename = filename;
+    state.drawn_bytes = downloaded;
+  }
+  state.total = total;
+  state.downloaded = downloaded;
+}
+
+void ProgressBoard::remove(std::int64_t key, bool completed) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  auto it = files_.find(key);
+  if (it != files_.end()) {
+    finished_bytes_ += it->second.downloaded - it->second.drawn_bytes;
+    files_.erase(it);
+  }
+  if (completed)
+    done_++;
+}
+
+void ProgressBoard::setQueued(std::size_t count, std::int64_t bytes) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  queued_ = count;
+  queued_bytes_ = bytes;
+}
+
+void ProgressBoard::print(const std::string &line) {
+  std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
+  clearLocked();
+  out_ << line << std::endl;
+}
+
+void ProgressBoard::run() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (!stop_) {
+    cond_.wait_for(lock, interval_, [this] { return stop_; });
+    if (stop_)
+      break;
+
+    lock.unlock();
+    render();
+    lock.lock();
+  }
+}
+
+void ProgressBoard::render() {
+  std::ostringstream frame;
+  std::size_t lines = 0;
+
+  {
+    std::lock_guard<std::mutex> guard{mutex_};
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_frame_).count();
+    last_frame_ = now;
+    if (elapsed <= 0)
+      return;
+
+    std::int64_t frame_bytes = finished_bytes_;
+    std::int64_t remaining = queued_bytes_;
+    finished_bytes_ = 0;
+
+    for (auto &pair : files_) {
+      auto &state = pair.second;
+      auto delta = state.downloaded - state.drawn_bytes;
+      state.drawn_bytes = state.downloaded;
+      state.speed += SPEED_SMOOTHING * (delta / elapsed - state.speed);
+      frame_bytes += delta;
+      remaining += std::max<std::int64_t>(state.total - state.downloaded, 0);
+
+      if (lines < MAX_FILE_LINES) {
+        ConsoleUtil::printProgress(frame, state.filename, state.total, state.downloaded);
+        auto left = std::max<std::int64_t>(state.total - state.downloaded, 0);
+        frame << std::setw(12) << StrUtil::formatBytes(state.speed) + "/s"
+              << "  " << formatDuration(state.speed > 1 ? left / state.speed : -1) << "\n";
+        lines++;
+      }
+    }
+    speed_ += SPEED_SMOOTHING * (frame_bytes / elapsed - speed_);
+
+    frame << "active: " << files_.size() << ", queued: " << queued_ << ", done: " << done_
+          << " | " << StrUtil::formatBytes(speed_) << "/s"
+          << " | ETA " << formatDuration(speed_ > 1 ? remaining / speed_ : -1) << "\n";
+    lines++;
+  }
+
+  std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
+  clearLocked();
+  out_ << frame.str() << std::flush;
+  drawn_lines_ = lines;
+}
+
+// Erase the last frame, ConsoleUtil::output_lock must be held.
+void ProgressBoard::clearLocked() {
+  if (drawn_lines_ == 0)
+    return;
+  out_ << "\x1b[" << drawn_lines_ << "A\r\x1b[J";
+  drawn_lines_ = 0;
+}
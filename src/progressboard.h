@@ -0,0 +1,68 @@
+#ifndef PROGRESS_BOARD_H
+#define PROGRESS_BOARD_H
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#include "scopedthread.h"
+
+// Draws the progress of several downloads from its own thread at a fixed
+// rate. Updates only record the latest state, so they are cheap enough to
+// be made from the handler of every updateFile.
+class ProgressBoard {
+public:
+  explicit ProgressBoard(std::ostream &out,
+                         std::chrono::milliseconds interval = std::chrono::milliseconds(100));
+  ~ProgressBoard();
+
+  ProgressBoard(const ProgressBoard&) = delete;
+  ProgressBoard& operator=(const ProgressBoard&) = delete;
+
+  // Files are keyed by the caller, file ids alone clash across accounts.
+  void update(std::int64_t key, const std::string &filename, std::int64_t total, std::int64_t downloaded);
+  // Stop showing a file, `completed` tells whether it counts as done.
+  void remove(std::int64_t key, bool completed);
+  void setQueued(std::size_t count, std::int64_t bytes);
+
+  // Print a line above the board.
+  void print(const std::string &line);
+
+private:
+  struct FileState {
+    std::string filename;
+    std::int64_t total{0};
+    std::int64_t downloaded{0};
+    std::int64_t drawn_bytes{0};
+    double speed{0};
+  };
+
+  void run();
+  void render();
+  void clearLocked();
+
+  std::ostream &out_;
+  std::chrono::milliseconds interval_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_{false};
+  std::map<std::int64_t, FileState> files_;
+  std::size_t queued_{0};
+  std::int64_t queued_bytes_{0};
+  std::size_t done_{0};
+  // Bytes of files that finished since the last frame.
+  std::int64_t finished_bytes_{0};
+  double speed_{0};
+  std::chrono::steady_clock::time_point last_frame_;
+  // Number of lines drawn by the last frame, guarded by ConsoleUtil::output_lock.
+  std::size_t drawn_lines_{0};
+
+  std::unique_ptr<ScopedThread> thread_;
+};
+
+#endif // PROGRESS_BOARD_H
@@ -0,0 +1,109 @@
+#include "scriptrunner.h"
+
+#include <memory>
+#include <sstream>
+#include <cli/detail/split.h>
+
+#include "scopedthread.h"
+#include "utils.h"
+
+ScriptRunner::ScriptRunner(Execute execute, std::size_t jobs)
+  : execute_(std::move(execute)), jobs_(jobs == 0 ? 1 : jobs)
+{
+}
+
+std::vector<std::string> ScriptRunner::parseLine(const std::string &line) {
+  std::vector<std::string> args;
+  auto text = StrUtil::trim(line);
+  if (text.empty() || text.front() == '#')
+    return args;
+  cli::detail::split(args, text);
+  return args;
+}
+
+std::size_t ScriptRunner::run(std::istream &in, std::ostream &out) {
+  out_ = &out;
+
+  std::vector<std::unique_ptr<ScopedThread>> workers;
+  for (std::size_t i = 0; i < jobs_; i++)
+    workers.push_back(std::make_unique<ScopedThread>([this] { work(); }));
+
+  // Outputs are kept until they can be printed, so don't read too far
+  // ahead of the slowest command.
+  const std::size_t window = jobs_ * 4;
+  std::string line;
+  std::size_t lineno = 0;
+  while (std::getline(in, line)) {
+    lineno++;
+    auto args = parseLine(line);
+    if (args.empty())
+      continue;
+    if (args.size() == 1 && args.front() == "exit")
+      break;
+
+    std::unique_lock<std::mutex> lock{mutex_};
+    room_.wait(lock, [&] { return submitted_ - printed_ < window; });
+    queue_.push_back(Command{submitted_++, lineno, std::move(args)});
+    lock.unlock();
+    ready_.notify_one();
+  }
+
+  {
+    std::lock_guard<std::mutex> guard{mutex_};
+    closed_ = true;
+  }
+  ready_.notify_all();
+  workers.clear();
+
+  return failed_;
+}
+
+void ScriptRunner::work() {
+  while (true) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    ready_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+    if (queue_.empty())
+      return;
+    auto command = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+
+    std::ostringstream buffer;
+    bool ok = true;
+    try {
+      execute_(command.args, buffer);
+    } catch (const std::exception &e) {
+      buffer << "Error: line " << command.line << ": " << e.what() << std::endl;
+      ok = false;
+    }
+
+    finish(command.index, buffer.str(), ok);
+  }
+}
+
+void ScriptRunner::finish(std::size_t index, std::string output, bool ok) {
+  std::unique_lock<std::mutex> lock{mutex_};
+  if (!ok)
+    failed_++;
+  done_.emplace(index, std::move(output));
+
+  // One thread at a time prints every output that is next in order,
+  // including those finished while it was printing.
+  if (printing_)
+    return;
+  printing_ = true;
+  for (auto it = done_.find(printed_); it != done_.end(); it = done_.find(printed_)) {
+    auto text = std::move(it->second);
+    done_.erase(it);
+    lock.unlock();
+    {
+      std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
+      *out_ << text << std::flush;
+    }
+    lock.lock();
+    printed_++;
+  }
+  printing_ = false;
+  lock.unlock();
+  room_.notify_all();
+}
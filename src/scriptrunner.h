@@ -0,0 +1,62 @@
+#ifndef SCRIPT_RUNNER_H
+#define SCRIPT_RUNNER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Runs a script of shell commands, one per line, on a number of threads.
+// The output of every command is buffered and printed in script order as
+// soon as the command and all of those before it are done.
+class ScriptRunner {
+public:
+  typedef std::function<void(const std::vector<std::string> &args, std::ostream &out)> Execute;
+
+  ScriptRunner(Execute execute, std::size_t jobs);
+
+  ScriptRunner(const ScriptRunner&) = delete;
+  ScriptRunner& operator=(const ScriptRunner&) = delete;
+
+  // Run commands until the end of `in` or an `exit` line, and return the
+  // number of commands that failed.
+  std::size_t run(std::istream &in, std::ostream &out);
+
+  // Split a line the way the interactive shell does. Blank lines and
+  // comments starting with '#' give no arguments.
+  static std::vector<std::string> parseLine(const std::string &line);
+
+private:
+  struct Command {
+    std::size_t index;
+    std::size_t line;
+    std::vector<std::string> args;
+  };
+
+  void work();
+  void finish(std::size_t index, std::string output, bool ok);
+
+  Execute execute_;
+  std::size_t jobs_;
+  std::ostream *out_{nullptr};
+
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::condition_variable room_;
+  std::deque<Command> queue_;
+  bool closed_{false};
+  std::size_t submitted_{0};
+  // Outputs waiting for the commands before them to finish.
+  std::map<std::size_t, std::string> done_;
+  std::size_t printed_{0};
+  bool printing_{false};
+  std::size_t failed_{0};
+};
+
+#endif // SCRIPT_RUNNER_H
@@ -0,0 +1,836 @@
+#include "searchindex.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <queue>
+#include <stdexcept>
+#include <tuple>
+
+#include <nowide/cstdio.hpp>
+#include <td/utils/utf8.h>
+
+#include "historywriter.h"
+#include "varint.h"
+
+namespace fs = std::filesystem;
+
+static const char SEGMENT_MAGIC[8] = {'T', 'D', 'S', 'S', 'E', 'G', '\0', '\0'};
+static const std::uint32_t SEGMENT_VERSION = 1;
+// The table in memory is written out past either of these.
+static const std::size_t MEMTABLE_DOCUMENTS = 50000;
+static const std::size_t MEMTABLE_POSTINGS = 1 << 20;
+// Or this long after its first message, which is what a crash may lose.
+static const std::chrono::seconds FLUSH_INTERVAL{30};
+// add() of a page waits while this many tables are waiting to be written.
+static const std::size_t MAX_FROZEN = 2;
+// Only the start of a text is kept to show with the hits.
+static const std::size_t STORED_TEXT = 300;
+static const std::size_t MAX_TERM = 64;
+
+namespace
+{
+
+struct SegmentHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t reserved;
+  std::uint64_t documents;
+  std::uint64_t terms;
+};
+
+// Sorted by chat and message id.
+struct DocumentEntry {
+  std::int64_t chat_id;
+  std::int64_t message_id;
+  std::int64_t date;
+  std::uint32_t type;
+  std::uint32_t reserved;
+  std::uint64_t strings;  // Text and file name, varint length and bytes each
+};
+
+// Sorted by term.
+struct TermEntry {
+  std::uint64_t term;  // Varint length and bytes
+  std::uint64_t postings;
+  std::uint32_t count;
+  std::uint32_t reserved;
+};
+
+std::uint64_t getVarint(const char *&pos, const char *end) {
+  std::uint64_t value = 0;
+  for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+    auto byte = static_cast<std::uint8_t>(*pos++);
+    value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+  throw std::runtime_error("Corrupted search index segment");
+}
+
+std::string_view getString(const char *&pos, const char *end) {
+  auto length = getVarint(pos, end);
+  if (length > static_cast<std::uint64_t>(end - pos))
+    throw std::runtime_error("Corrupted search index segment");
+  std::string_view text(pos, static_cast<std::size_t>(length));
+  pos += length;
+  return text;
+}
+
+// Cut text to at most `size` bytes without splitting a character.
+std::string_view truncateUtf8(std::string_view text, std::size_t size) {
+  if (text.size() <= size)
+    return text;
+  while (size > 0 && (static_cast<unsigned char>(text[size]) & 0xc0) == 0x80)
+    size--;
+  return text.substr(0, size);
+}
+
+// The union of sorted lists, sorted.
+std::vector<std::uint32_t> unite(std::vector<std::vector<std::uint32_t>> lists) {
+  if (lists.size() == 1)
+    return std::move(lists.front());
+  std::vector<std::uint32_t> result;
+  for (auto &list : lists)
+    result.insert(result.end(), list.begin(), list.end());
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+// Intersect sorted lists, the shortest first.
+std::vector<std::uint32_t> intersect(std::vector<std::vector<std::uint32_t>> lists) {
+  if (lists.empty())
+    return {};
+  std::sort(lists.begin(), lists.end(), [](auto &a, auto &b) { return a.size() < b.size(); });
+  auto result = std::move(lists.front());
+  for (std::size_t i = 1; i < lists.size() && !result.empty(); i++) {
+    std::vector<std::uint32_t> next;
+    std::set_intersection(result.begin(), result.end(), lists[i].begin(), lists[i].end(),
+                          std::back_inserter(next));
+    result = std::move(next);
+  }
+  return result;
+}
+
+// Lays out a segment: the header, the document and term tables, then the
+// strings and postings they point to.
+class SegmentBuilder {
+public:
+  SegmentBuilder(std::uint64_t documents, std::uint64_t terms)
+    : base_(sizeof(SegmentHeader) + documents * sizeof(DocumentEntry) + terms * sizeof(TermEntry))
+  {
+    documents_.reserve(documents);
+    terms_.reserve(terms);
+  }
+
+  // In the order of chat and message ids.
+  void addDocument(std::int64_t chat_id, std::int64_t message_id, std::int64_t date, std::uint8_t type,
+                   std::string_view text, std::string_view file_name) {
+    DocumentEntry entry{chat_id, message_id, date, type, 0, base_ + data_.size()};
+    putVarint(data_, text.size());
+    data_.append(text.data(), text.size());
+    putVarint(data_, file_name.size());
+    data_.append(file_name.data(), file_name.size());
+    documents_.push_back(entry);
+  }
+
+  // In the order of terms, with the sorted numbers of their documents.
+  void addTerm(std::string_view term, const std::vector<std::uint32_t> &postings) {
+    TermEntry entry{base_ + data_.size(), 0, static_cast<std::uint32_t>(postings.size()), 0};
+    putVarint(data_, term.size());
+    data_.append(term.data(), term.size());
+    entry.postings = base_ + data_.size();
+    std::uint32_t last = 0;
+    for (auto document : postings) {
+      putVarint(data_, document - last);
+      last = document;
+    }
+    terms_.push_back(entry);
+  }
+
+  // Written under a temporary name, then renamed.
+  void write(const std::string &path) {
+    SegmentHeader header{};
+    std::memcpy(header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    header.version = SEGMENT_VERSION;
+    header.documents = documents_.size();
+    header.terms = terms_.size();
+
+    auto tmp_path = path + ".tmp";
+    auto file = nowide::fopen(tmp_path.c_str(), "wb");
+    if (!file)
+      throw std::runtime_error("Failed to write search index segment " + tmp_path);
+    std::fwrite(&header, 1, sizeof(header), file);
+    std::fwrite(documents_.data(), sizeof(DocumentEntry), documents_.size(), file);
+    std::fwrite(terms_.data(), sizeof(TermEntry), terms_.size(), file);
+    std::fwrite(data_.data(), 1, data_.size(), file);
+    bool ok = std::fflush(file) == 0 && !std::ferror(file);
+    std::fclose(file);
+    if (!ok)
+      throw std::runtime_error("Failed to write search index segment " + tmp_path);
+    fs::rename(FileUtil::u8path(tmp_path), FileUtil::u8path(path));
+  }
+
+private:
+  std::uint64_t base_;
+  std::vector<DocumentEntry> documents_;
+  std::vector<TermEntry> terms_;
+  std::string data_;
+};
+
+} // namespace
+
+/////////////////////////////////////////////////////////////////////////////
+// SearchIndex::Segment
+/////////////////////////////////////////////////////////////////////////////
+
+class SearchIndex::Segment {
+public:
+  // Segments are named after the generations of the tables they hold.
+  Segment(const std::string &path, std::uint64_t first, std::uint64_t last)
+    : path_(path), first_(first), last_(last), file_(FileUtil::u8path(path))
+  {
+    SegmentHeader header;
+    if (file_.size() < sizeof(header))
+      throw std::runtime_error("Invalid search index segment " + path);
+    std::memcpy(&header, file_.data(), sizeof(header));
+    if (std::memcmp(header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0 || header.version != SEGMENT_VERSION
+        || sizeof(header) + header.documents * sizeof(DocumentEntry) + header.terms * sizeof(TermEntry) > file_.size())
+      throw std::runtime_error("Invalid search index segment " + path);
+    documents_ = header.documents;
+    terms_ = header.terms;
+  }
+
+  const std::string &path() const { return path_; }
+  std::uint64_t first() const { return first_; }
+  std::uint64_t last() const { return last_; }
+  std::uint64_t documents() const { return documents_; }
+  std::uint64_t terms() const { return terms_; }
+
+  DocumentEntry entry(std::uint64_t index) const {
+    DocumentEntry entry;
+    std::memcpy(&entry, file_.data() + sizeof(SegmentHeader) + index * sizeof(DocumentEntry), sizeof(entry));
+    return entry;
+  }
+
+  Document document(std::uint64_t index) const {
+    auto e = entry(index);
+    const char *pos = at(e.strings);
+    const char *end = file_.data() + file_.size();
+    Document document{e.chat_id, e.message_id, e.date, static_cast<std::uint8_t>(e.type), {}, {}};
+    document.text = getString(pos, end);
+    document.file_name = getString(pos, end);
+    return document;
+  }
+
+  bool contains(std::int64_t chat_id, std::int64_t message_id) const {
+    std::uint64_t low = 0, high = documents_;
+    auto key = std::make_pair(chat_id, message_id);
+    while (low < high) {
+      auto middle = low + (high - low) / 2;
+      auto e = entry(middle);
+      if (std::make_pair(e.chat_id, e.message_id) < key)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+    if (low == documents_)
+      return false;
+    auto e = entry(low);
+    return e.chat_id == chat_id && e.message_id == message_id;
+  }
+
+  std::string_view term(std::uint64_t index) const {
+    auto e = termEntry(index);
+    const char *pos = at(e.term);
+    return getString(pos, file_.data() + file_.size());
+  }
+
+  std::vector<std::uint32_t> postings(std::uint64_t index) const {
+    auto e = termEntry(index);
+    const char *pos = at(e.postings);
+    const char *end = file_.data() + file_.size();
+    std::vector<std::uint32_t> result(e.count);
+    std::uint32_t document = 0;
+    for (auto &value : result)
+      value = document += static_cast<std::uint32_t>(getVarint(pos, end));
+    return result;
+  }
+
+  // The documents with the term, or with a term it starts for a prefix.
+  std::vector<std::uint32_t> find(const Term &term) const {
+    std::uint64_t low = 0, high = terms_;
+    while (low < high) {
+      auto middle = low + (high - low) / 2;
+      if (this->term(middle) < term.text)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+
+    std::vector<std::vector<std::uint32_t>> lists;
+    for (auto i = low; i < terms_; i++) {
+      auto text = this->term(i);
+      if (term.prefix ? text.substr(0, term.text.size()) != term.text : text != term.text)
+        break;
+      lists.push_back(postings(i));
+    }
+    if (lists.empty())
+      return {};
+    return unite(std::move(lists));
+  }
+
+private:
+  TermEntry termEntry(std::uint64_t index) const {
+    TermEntry entry;
+    std::memcpy(&entry, file_.data() + sizeof(SegmentHeader) + documents_ * sizeof(DocumentEntry)
+                + index * sizeof(TermEntry), sizeof(entry));
+    return entry;
+  }
+
+  const char *at(std::uint64_t offset) const {
+    if (offset >= file_.size())
+      throw std::runtime_error("Corrupted search index segment " + path_);
+    return file_.data() + offset;
+  }
+
+  std::string path_;
+  std::uint64_t first_;
+  std::uint64_t last_;
+  FileUtil::MappedFile file_;
+  std::uint64_t documents_{0};
+  std::uint64_t terms_{0};
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// SearchIndex
+/////////////////////////////////////////////////////////////////////////////
+
+SearchIndex::SearchIndex(const std::string &directory)
+  : directory_(directory)
+{
+  auto dir = FileUtil::u8path(directory_);
+  fs::create_directories(dir);
+
+  for (auto &item : fs::directory_iterator(dir)) {
+    auto name = FileUtil::u8string(item.path().filename());
+    unsigned long long first = 0, last = 0;
+    char tail = 0;
+    if (item.path().extension() == ".tmp") {
+      // Left by a crash while a segment was written.
+      fs::remove(item.path());
+      continue;
+    }
+    if (std::sscanf(name.c_str(), "seg-%llu-%llu.id%c", &first, &last, &tail) != 3 || tail != 'x')
+      continue;
+    try {
+      segments_.push_back(std::make_shared<Segment>(FileUtil::u8string(item.path()), first, last));
+    } catch (const std::runtime_error &) {
+      // Only an index, messages are indexed again as they are seen.
+      fs::remove(item.path());
+    }
+  }
+
+  // A crash between writing a merged segment and removing the ones it
+  // merged leaves both, keep the merged one.
+  std::sort(segments_.begin(), segments_.end(), [](auto &a, auto &b) {
+    return std::make_tuple(a->last(), b->first()) < std::make_tuple(b->last(), a->first());
+  });
+  std::vector<std::shared_ptr<Segment>> kept;
+  for (auto &segment : segments_) {
+    while (!kept.empty() && kept.back()->first() >= segment->first()) {
+      fs::remove(FileUtil::u8path(kept.back()->path()));
+      kept.pop_back();
+    }
+    kept.push_back(segment);
+  }
+  segments_ = std::move(kept);
+  if (!segments_.empty())
+    next_generation_ = segments_.back()->last() + 1;
+
+  merge_thread_ = std::make_unique<ScopedThread>([this] { mergeLoop(); });
+}
+
+SearchIndex::~SearchIndex() {
+  {
+    std::lock_guard<std::mutex> guard{mutex_};
+    stop_ = true;
+  }
+  merge_cond_.notify_all();
+  merge_thread_.reset();
+
+  try {
+    flush();
+  } catch (...) {
+  }
+}
+
+std::vector<std::string> SearchIndex::tokenize(std::string_view text) {
+  std::vector<std::string> tokens;
+  // utf8_to_lower folds the case of non-ASCII letters as well.
+  std::string lower = td::utf8_to_lower(std::string(text));
+  std::string word;
+  auto endWord = [&] {
+    if (!word.empty() && word.size() <= MAX_TERM)
+      tokens.push_back(std::move(word));
+    word.clear();
+  };
+
+  std::size_t pos = 0;
+  while (pos < lower.size()) {
+    auto c = static_cast<unsigned char>(lower[pos]);
+    if (c < 0x80) {
+      if (std::isalnum(c) || c == '_')
+        word += static_cast<char>(c);
+      else
+        endWord();
+      pos++;
+      continue;
+    }
+
+    std::size_t length = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+    length = std::min(length, lower.size() - pos);
+    std::uint32_t code = length == 1 ? c : c & (0x7f >> length);
+    for (std::size_t i = 1; i < length; i++)
+      code = (code << 6) | (static_cast<unsigned char>(lower[pos + i]) & 0x3f);
+
+    bool ideograph = (code >= 0x3040 && code <= 0x30ff) || (code >= 0x3400 && code <= 0x9fff)
+                     || (code >= 0xf900 && code <= 0xfaff) || (code >= 0x20000 && code <= 0x2fa1f);
+    // Punctuation, symbols, emoji and the like.
+    bool separator = (code >= 0x2000 && code <= 0x2bff) || (code >= 0x3000 && code <= 0x303f)
+                     || (code >= 0xfe00 && code <= 0xfe6f) || (code >= 0xff00 && code <= 0xff0f)
+                     || (code >= 0x1f000 && code <= 0x1faff) || code == 0xa0 || code == 0xad;
+    if (ideograph) {
+      // Without spaces between words, each character is a term.
+      endWord();
+      tokens.emplace_back(lower, pos, length);
+    } else if (separator) {
+      endWord();
+    } else {
+      word.append(lower, pos, length);
+    }
+    pos += length;
+  }
+  endWord();
+  return tokens;
+}
+
+void SearchIndex::add(const td_api::message &message) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  addLocked(message);
+}
+
+void SearchIndex::add(const std::vector<MessagePtr> &messages) {
+  std::unique_lock<std::mutex> lock{mutex_};
+  written_cond_.wait(lock, [this] { return frozen_.size() < MAX_FROZEN || stop_; });
+  for (auto &message : messages) {
+    if (message)
+      addLocked(*message);
+  }
+}
+
+void SearchIndex::addLocked(const td_api::message &message) {
+  auto record = HistoryWriter::describe(message);
+  if (record.text.empty() && record.file_name.empty())
+    return;
+
+  auto &table = memtable_;
+  if (table.documents.empty()) {
+    table.started = std::chrono::steady_clock::now();
+    // The background thread writes it out after FLUSH_INTERVAL.
+    merge_cond_.notify_one();
+  }
+  auto number = static_cast<std::uint32_t>(table.documents.size());
+  auto &slot = table.keys[message.chat_id_][message.id_];
+  if (slot != 0)
+    table.replaced[slot - 1] = true;
+  slot = number + 1;
+
+  table.documents.push_back(Document{
+    message.chat_id_, message.id_, message.date_, HistoryWriter::typeNumber(record.type),
+    std::string(truncateUtf8(record.text, STORED_TEXT)), std::string(record.file_name)
+  });
+  table.replaced.push_back(false);
+
+  auto tokens = tokenize(record.text);
+  auto name_tokens = tokenize(record.file_name);
+  tokens.insert(tokens.end(), name_tokens.begin(), name_tokens.end());
+  std::sort(tokens.begin(), tokens.end());
+  tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+  for (auto &token : tokens)
+    table.postings[token].push_back(number);
+  table.postings_count += tokens.size();
+
+  if (table.documents.size() >= MEMTABLE_DOCUMENTS || table.postings_count >= MEMTABLE_POSTINGS)
+    freezeLocked();
+}
+
+bool SearchIndex::MemTable::contains(std::int64_t chat_id, std::int64_t message_id) const {
+  auto it = keys.find(chat_id);
+  return it != keys.end() && it->second.count(message_id) != 0;
+}
+
+void SearchIndex::flush() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  freezeLocked();
+  writeFrozenLocked(lock);
+}
+
+// Hand the table in memory over to be written, it is searched meanwhile.
+void SearchIndex::freezeLocked() {
+  if (memtable_.documents.empty())
+    return;
+  frozen_.push_back(FrozenTable{std::make_shared<const MemTable>(std::move(memtable_)), next_generation_++});
+  memtable_ = MemTable{};
+  merge_cond_.notify_one();
+}
+
+// Write the frozen tables as segments, oldest first, one thread at a time.
+// The lock is released while a segment is built and written.
+void SearchIndex::writeFrozenLocked(std::unique_lock<std::mutex> &lock) {
+  while (!frozen_.empty()) {
+    if (writing_) {
+      written_cond_.wait(lock);
+      continue;
+    }
+    writing_ = true;
+    auto frozen = frozen_.front();
+    lock.unlock();
+
+    std::shared_ptr<Segment> segment;
+    try {
+      auto path = writeSegment(*frozen.table, frozen.generation);
+      segment = std::make_shared<Segment>(path, frozen.generation, frozen.generation);
+    } catch (...) {
+      lock.lock();
+      writing_ = false;
+      written_cond_.notify_all();
+      throw;
+    }
+
+    lock.lock();
+    segments_.push_back(std::move(segment));
+    frozen_.erase(frozen_.begin());
+    writing_ = false;
+    written_cond_.notify_all();
+    merge_cond_.notify_one();
+
+    // Free the table, which takes a while, outside of the lock.
+    lock.unlock();
+    frozen.table.reset();
+    lock.lock();
+  }
+}
+
+std::string SearchIndex::writeSegment(const MemTable &table, std::uint64_t generation) const {
+
+  // Number the documents in the order of their keys.
+  std::vector<std::uint32_t> order;
+  for (std::uint32_t i = 0; i < table.documents.size(); i++) {
+    if (!table.replaced[i])
+      order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+    auto &x = table.documents[a], &y = table.documents[b];
+    return std::make_pair(x.chat_id, x.message_id) < std::make_pair(y.chat_id, y.message_id);
+  });
+  std::vector<std::uint32_t> renumbered(table.documents.size(), UINT32_MAX);
+  for (std::uint32_t i = 0; i < order.size(); i++)
+    renumbered[order[i]] = i;
+
+  std::vector<const std::string*> terms;
+  terms.reserve(table.postings.size());
+  for (auto &entry : table.postings)
+    terms.push_back(&entry.first);
+  std::sort(terms.begin(), terms.end(), [](auto a, auto b) { return *a < *b; });
+
+  SegmentBuilder builder(order.size(), terms.size());
+  for (auto i : order) {
+    auto &document = table.documents[i];
+    builder.addDocument(document.chat_id, document.message_id, document.date, document.type,
+                        document.text, document.file_name);
+  }
+  std::vector<std::uint32_t> postings;
+  for (auto term : terms) {
+    postings.clear();
+    for (auto document : table.postings.at(*term)) {
+      if (renumbered[document] != UINT32_MAX)
+        postings.push_back(renumbered[document]);
+    }
+    std::sort(postings.begin(), postings.end());
+    builder.addTerm(*term, postings);
+  }
+
+  auto path = segmentPath(generation, generation);
+  builder.write(path);
+  return path;
+}
+
+std::string SearchIndex::segmentPath(std::uint64_t first, std::uint64_t last) const {
+  return FileUtil::u8string(FileUtil::u8path(directory_)
+                            / ("seg-" + std::to_string(first) + "-" + std::to_string(last) + ".idx"));
+}
+
+std::vector<std::uint32_t> SearchIndex::memTableMatches(const MemTable &table, const std::vector<Term> &terms) {
+  std::vector<std::vector<std::uint32_t>> lists;
+  for (auto &term : terms) {
+    std::vector<std::vector<std::uint32_t>> matches;
+    if (term.prefix) {
+      for (auto &entry : table.postings) {
+        if (entry.first.compare(0, term.text.size(), term.text) == 0)
+          matches.push_back(entry.second);
+      }
+    } else {
+      auto it = table.postings.find(term.text);
+      if (it != table.postings.end())
+        matches.push_back(it->second);
+    }
+    if (matches.empty())
+      return {};
+    lists.push_back(unite(std::move(matches)));
+  }
+
+  auto result = intersect(std::move(lists));
+  result.erase(std::remove_if(result.begin(), result.end(), [&table](std::uint32_t document) {
+    return table.replaced[document];
+  }), result.end());
+  return result;
+}
+
+std::vector<SearchIndex::Hit> SearchIndex::search(const std::string &query, std::int64_t chat_id, std::size_t limit) const {
+  std::vector<Term> terms;
+  std::size_t start = 0;
+  while (start < query.size()) {
+    auto end = query.find(' ', start);
+    if (end == std::string::npos)
+      end = query.size();
+    auto word = std::string_view(query).substr(start, end - start);
+    start = end + 1;
+
+    bool prefix = !word.empty() && word.back() == '*';
+    auto tokens = tokenize(prefix ? word.substr(0, word.size() - 1) : word);
+    for (std::size_t i = 0; i < tokens.size(); i++)
+      terms.push_back(Term{std::move(tokens[i]), prefix && i + 1 == tokens.size()});
+  }
+  if (terms.empty() || limit == 0)
+    return {};
+
+  // The newest `limit` hits, the oldest of them on top.
+  using Candidate = std::tuple<std::int64_t, std::int64_t, std::int64_t, std::size_t, std::uint32_t>;
+  std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> best;
+  auto consider = [&](Candidate candidate) {
+    if (best.size() < limit) {
+      best.push(candidate);
+    } else if (best.top() < candidate) {
+      best.pop();
+      best.push(candidate);
+    }
+  };
+
+  // Segments are only read, queries are short enough to hold the lock.
+  std::lock_guard<std::mutex> guard{mutex_};
+  // The tables in memory come after the segments, those being written first.
+  std::vector<const MemTable*> tables;
+  for (auto &frozen : frozen_)
+    tables.push_back(frozen.table.get());
+  tables.push_back(&memtable_);
+  auto replacedFrom = [&](std::size_t table, std::int64_t chat, std::int64_t message) {
+    for (; table < tables.size(); table++) {
+      if (tables[table]->contains(chat, message))
+        return true;
+    }
+    return false;
+  };
+
+  const auto memory = segments_.size();
+  for (std::size_t t = 0; t < tables.size(); t++) {
+    for (auto document : memTableMatches(*tables[t], terms)) {
+      auto &d = tables[t]->documents[document];
+      if ((chat_id == 0 || d.chat_id == chat_id) && !replacedFrom(t + 1, d.chat_id, d.message_id))
+        consider(Candidate{d.date, d.chat_id, d.message_id, memory + t, document});
+    }
+  }
+
+  for (std::size_t s = 0; s < segments_.size(); s++) {
+    auto &segment = *segments_[s];
+    std::vector<std::vector<std::uint32_t>> lists;
+    for (auto &term : terms) {
+      auto list = segment.find(term);
+      if (list.empty()) {
+        lists.clear();
+        break;
+      }
+      lists.push_back(std::move(list));
+    }
+
+    // Backwards, newest first within a chat, so that most of the older
+    // hits are turned down before looking for later copies.
+    auto matches = intersect(std::move(lists));
+    for (auto document = matches.rbegin(); document != matches.rend(); ++document) {
+      auto e = segment.entry(*document);
+      if (chat_id != 0 && e.chat_id != chat_id)
+        continue;
+      Candidate candidate{e.date, e.chat_id, e.message_id, s, *document};
+      if (best.size() >= limit && !(best.top() < candidate))
+        continue;
+
+      // A later copy of the message replaces this one.
+      bool replaced = replacedFrom(0, e.chat_id, e.message_id);
+      for (auto later = s + 1; later < segments_.size() && !replaced; later++)
+        replaced = segments_[later]->contains(e.chat_id, e.message_id);
+      if (!replaced)
+        consider(candidate);
+    }
+  }
+
+  std::vector<Hit> hits(best.size());
+  for (auto hit = hits.rbegin(); hit != hits.rend(); ++hit) {
+    auto [date, chat, message, source, document] = best.top();
+    best.pop();
+    auto d = source < memory ? segments_[source]->document(document)
+                             : tables[source - memory]->documents[document];
+    *hit = Hit{d.chat_id, d.message_id, d.date, HistoryWriter::typeName(d.type),
+               std::move(d.text), std::move(d.file_name)};
+  }
+  return hits;
+}
+
+std::size_t SearchIndex::segmentCount() const {
+  std::lock_guard<std::mutex> guard{mutex_};
+  return segments_.size();
+}
+
+// Write out the tables in memory that are full or due, and merge the two
+// newest segments while the older one is no more than twice the size of
+// the newer, so that there are about log2(documents) of them.
+void SearchIndex::mergeLoop() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  auto due = [this] {
+    return !memtable_.documents.empty()
+           && std::chrono::steady_clock::now() >= memtable_.started + FLUSH_INTERVAL;
+  };
+  auto mergeable = [this] {
+    auto n = segments_.size();
+    return n >= 2 && segments_[n - 2]->documents() <= 2 * segments_[n - 1]->documents();
+  };
+  while (true) {
+    auto ready = [&] { return stop_ || !frozen_.empty() || due() || mergeable(); };
+    // Once the table in memory gets its first message, wait for it too.
+    if (memtable_.documents.empty())
+      merge_cond_.wait(lock, [&] { return ready() || !memtable_.documents.empty(); });
+    else
+      merge_cond_.wait_until(lock, memtable_.started + FLUSH_INTERVAL, ready);
+    if (stop_)
+      return;
+
+    if (due())
+      freezeLocked();
+    if (!frozen_.empty()) {
+      try {
+        writeFrozenLocked(lock);
+      } catch (const std::exception &) {
+        // Keep the tables and try again later.
+        merge_cond_.wait_for(lock, FLUSH_INTERVAL, [this] { return stop_; });
+      }
+      continue;
+    }
+    if (!mergeable())
+      continue;
+
+    auto older = segments_[segments_.size() - 2];
+    auto newer = segments_.back();
+    lock.unlock();
+
+    // Documents of both, those of the newer one replacing the same
+    // messages of the older one.
+    std::vector<std::uint32_t> older_numbers(older->documents(), UINT32_MAX);
+    std::vector<std::uint32_t> newer_numbers(newer->documents());
+    std::vector<std::pair<int, std::uint64_t>> order;
+    std::uint64_t i = 0, j = 0;
+    while (i < older->documents() || j < newer->documents()) {
+      if (j == newer->documents()) {
+        order.emplace_back(0, i++);
+        continue;
+      }
+      if (i == older->documents()) {
+        order.emplace_back(1, j++);
+        continue;
+      }
+      auto a = older->entry(i), b = newer->entry(j);
+      auto ka = std::make_pair(a.chat_id, a.message_id), kb = std::make_pair(b.chat_id, b.message_id);
+      if (ka < kb) {
+        order.emplace_back(0, i++);
+      } else {
+        if (ka == kb)
+          i++;
+        order.emplace_back(1, j++);
+      }
+    }
+    for (std::uint32_t k = 0; k < order.size(); k++)
+      (order[k].first == 0 ? older_numbers : newer_numbers)[order[k].second] = k;
+
+    // Terms of both, in order.
+    std::vector<std::tuple<std::string_view, std::int64_t, std::int64_t>> terms;
+    i = 0;
+    j = 0;
+    while (i < older->terms() || j < newer->terms()) {
+      if (j == newer->terms() || (i < older->terms() && older->term(i) < newer->term(j))) {
+        terms.emplace_back(older->term(i), static_cast<std::int64_t>(i), -1);
+        i++;
+      } else if (i == older->terms() || newer->term(j) < older->term(i)) {
+        terms.emplace_back(newer->term(j), -1, static_cast<std::int64_t>(j));
+        j++;
+      } else {
+        terms.emplace_back(newer->term(j), static_cast<std::int64_t>(i), static_cast<std::int64_t>(j));
+        i++;
+        j++;
+      }
+    }
+
+    std::shared_ptr<Segment> merged;
+    try {
+      SegmentBuilder builder(order.size(), terms.size());
+      for (auto &[which, index] : order) {
+        auto document = (which == 0 ? older : newer)->document(index);
+        builder.addDocument(document.chat_id, document.message_id, document.date, document.type,
+                            document.text, document.file_name);
+      }
+      std::vector<std::uint32_t> postings;
+      for (auto &[term, a, b] : terms) {
+        postings.clear();
+        if (a >= 0) {
+          for (auto document : older->postings(a)) {
+            if (older_numbers[document] != UINT32_MAX)
+              postings.push_back(older_numbers[document]);
+          }
+        }
+        if (b >= 0) {
+          for (auto document : newer->postings(b))
+            postings.push_back(newer_numbers[document]);
+        }
+        std::sort(postings.begin(), postings.end());
+        builder.addTerm(term, postings);
+      }
+
+      auto path = segmentPath(older->first(), newer->last());
+      builder.write(path);
+      merged = std::make_shared<Segment>(path, older->first(), newer->last());
+    } catch (const std::exception &) {
+      // Try again with the next flush.
+      lock.lock();
+      merge_cond_.wait(lock, [&] { return stop_ || !frozen_.empty() || due() || segments_.back() != newer; });
+      continue;
+    }
+
+    lock.lock();
+    // Newer segments may have been added since, these two are still together.
+    auto it = std::find(segments_.begin(), segments_.end(), older);
+    it = segments_.erase(it, it + 2);
+    segments_.insert(it, merged);
+    std::error_code ec;
+    fs::remove(FileUtil::u8path(older->path()), ec);
+    fs::remove(FileUtil::u8path(newer->path()), ec);
+  }
+}
@@ -0,0 +1,126 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "scopedthread.h"
+#include "utils.h"
+
+// A local full-text index of message texts, captions and file names, so
+// that messages can be found without asking Telegram.
+//
+// It is log structured: new messages go to a table in memory, which is
+// written out as an immutable segment file once it is large enough, 30
+// seconds after its first message or when the index is closed. A segment
+// holds its messages sorted by chat and id, a sorted dictionary of terms
+// and, for each term, the numbers of the messages that contain it as delta
+// varints. Segments are memory mapped. A background thread writes them,
+// outside of the lock add() and search() take, and merges them so that
+// there are only a few; a message indexed again, after an edit or a second
+// history walk, replaces the copy in older segments.
+//
+// A crash loses the messages still in memory, those of about the last 30
+// seconds; a later walk of their history indexes them again.
+class SearchIndex {
+public:
+  struct Hit {
+    std::int64_t chat_id;
+    std::int64_t message_id;
+    std::int64_t date;
+    std::string type;
+    std::string text;       // The first few hundred bytes
+    std::string file_name;
+  };
+
+  explicit SearchIndex(const std::string &directory);
+  // Writes the messages still in memory.
+  ~SearchIndex();
+
+  SearchIndex(const SearchIndex&) = delete;
+  SearchIndex& operator=(const SearchIndex&) = delete;
+
+  void add(const td_api::message &message);
+  // Waits while the background thread is behind with writing segments.
+  void add(const std::vector<MessagePtr> &messages);
+  // Write the messages in memory to a segment, returns once it is written.
+  void flush();
+
+  // Messages containing every word of the query, newest first. A word
+  // ending with '*' matches the words it starts. chat_id 0 searches every
+  // chat.
+  std::vector<Hit> search(const std::string &query, std::int64_t chat_id = 0, std::size_t limit = 20) const;
+
+  std::size_t segmentCount() const;
+
+  // Lower case words, CJK ideographs and kana one by one, as indexed.
+  static std::vector<std::string> tokenize(std::string_view text);
+
+private:
+  class Segment;
+
+  struct Document {
+    std::int64_t chat_id;
+    std::int64_t message_id;
+    std::int64_t date;
+    std::uint8_t type;
+    std::string text;
+    std::string file_name;
+  };
+
+  struct Term {
+    std::string text;
+    bool prefix;
+  };
+
+  struct MemTable {
+    std::vector<Document> documents;
+    // Documents replaced by a later copy of the same message.
+    std::vector<bool> replaced;
+    std::unordered_map<std::string, std::vector<std::uint32_t>> postings;
+    std::unordered_map<std::int64_t, std::unordered_map<std::int64_t, std::uint32_t>> keys;
+    std::size_t postings_count{0};
+    std::chrono::steady_clock::time_point started;
+
+    bool contains(std::int64_t chat_id, std::int64_t message_id) const;
+  };
+
+  // A table taken out of memtable_, searched until its segment is written.
+  struct FrozenTable {
+    std::shared_ptr<const MemTable> table;
+    std::uint64_t generation;
+  };
+
+  void addLocked(const td_api::message &message);
+  void freezeLocked();
+  void writeFrozenLocked(std::unique_lock<std::mutex> &lock);
+  std::string writeSegment(const MemTable &table, std::uint64_t generation) const;
+  static std::vector<std::uint32_t> memTableMatches(const MemTable &table, const std::vector<Term> &terms);
+  std::string segmentPath(std::uint64_t first, std::uint64_t last) const;
+  void mergeLoop();
+
+  std::string directory_;
+  mutable std::mutex mutex_;
+  MemTable memtable_;
+  // Oldest first, they shadow the segments and memtable_ shadows them.
+  std::vector<FrozenTable> frozen_;
+  bool writing_{false};
+  // Oldest first, each one shadows the messages of those before it.
+  std::vector<std::shared_ptr<Segment>> segments_;
+  std::uint64_t next_generation_{1};
+
+  std::condition_variable merge_cond_;
+  std::condition_variable written_cond_;
+  bool stop_{false};
+  std::unique_ptr<ScopedThread> merge_thread_;
+};
+
+#endif // SEARCH_INDEX_H
@@ -0,0 +1,81 @@
+#ifndef SHARDED_MAP_H
+#define SHARDED_MAP_H
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+// A hash map split into independently locked shards. Threads touching
+// different keys rarely contend, which lets the command threads register
+// query handlers while the workers resolve others.
+template <typename Key, typename Value, std::size_t Shards = 64>
+class ShardedMap {
+  static_assert((Shards & (Shards - 1)) == 0, "Shards must be a power of two");
+
+public:
+  // Insert a value, replacing the existing one with the same key.
+  void insert(const Key &key, Value value) {
+    auto &shard = shardFor(key);
+    std::lock_guard<std::mutex> guard{shard.mutex};
+    shard.items.insert_or_assign(key, std::move(value));
+  }
+
+  /** Copy the value out without removing it */
+  bool find(const Key &key, Value &value) const {
+    auto &shard = shardFor(key);
+    std::lock_guard<std::mutex> guard{shard.mutex};
+    auto it = shard.items.find(key);
+    if (it == shard.items.end())
+      return false;
+    value = it->second;
+    return true;
+  }
+
+  /** Move the value out and remove it from the map */
+  bool take(const Key &key, Value &value) {
+    auto &shard = shardFor(key);
+    std::lock_guard<std::mutex> guard{shard.mutex};
+    auto it = shard.items.find(key);
+    if (it == shard.items.end())
+      return false;
+    value = std::move(it->second);
+    shard.items.erase(it);
+    return true;
+  }
+
+  bool erase(const Key &key) {
+    auto &shard = shardFor(key);
+    std::lock_guard<std::mutex> guard{shard.mutex};
+    return shard.items.erase(key) > 0;
+  }
+
+  std::size_t size() const {
+    std::size_t total = 0;
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> guard{shard.mutex};
+      total += shard.items.size();
+    }
+    return total;
+  }
+
+private:
+  // Keep each shard on its own cache line so that locks don't false-share.
+  struct alignas(64) Shard {
+    mutable std::mutex mutex;
+    std::unordered_map<Key, Value> items;
+  };
+
+  Shard &shardFor(const Key &key) {
+    return shards_[std::hash<Key>{}(key) & (Shards - 1)];
+  }
+
+  const Shard &shardFor(const Key &key) const {
+    return shards_[std::hash<Key>{}(key) & (Shards - 1)];
+  }
+
+  std::array<Shard, Shards> shards_;
+};
+
+#endif // SHARDED_MAP_H
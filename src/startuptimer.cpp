@@ -0,0 +1,52 @@
+#include "startuptimer.h"
+
+#include <algorithm>
+#include <iomanip>
+
+StartupTimer &StartupTimer::instance() {
+  static StartupTimer timer;
+  return timer;
+}
+
+void StartupTimer::Phase::end() {
+  if (timer_) {
+    timer_->finish(index_);
+    timer_ = nullptr;
+  }
+}
+
+StartupTimer::Phase StartupTimer::phase(const std::string &name) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  auto now = Clock::now();
+  records_.push_back(Record{name, now, now});
+  return Phase(this, records_.size() - 1);
+}
+
+void StartupTimer::finish(std::size_t index) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  records_[index].end = Clock::now();
+}
+
+void StartupTimer::print(std::ostream &out) const {
+  auto ms = [](Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+  };
+
+  std::lock_guard<std::mutex> guard{mutex_};
+  std::size_t width = 5;
+  for (auto &record : records_)
+    width = std::max(width, record.name.size());
+
+  auto flags = out.flags();
+  out << std::left << std::setw(width) << "phase" << std::right
+      << std::setw(10) << "start ms" << std::setw(10) << "took ms" << "\n";
+  out << std::fixed << std::setprecision(1);
+  for (auto &record : records_) {
+    out << std::left << std::setw(width) << record.name << std::right
+        << std::setw(10) << ms(record.begin - origin_)
+        << std::setw(10) << ms(record.end - record.begin) << "\n";
+  }
+  out << std::left << std::setw(width) << "total" << std::right
+      << std::setw(10) << "" << std::setw(10) << ms(Clock::now() - origin_) << std::endl;
+  out.flags(flags);
+}
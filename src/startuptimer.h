@@ -0,0 +1,59 @@
+#ifndef STARTUP_TIMER_H
+#define STARTUP_TIMER_H
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Measures the phases of startup for `--timings`. Phases running on
+// different threads may overlap, each one is reported with the time it
+// started at and how long it took.
+class StartupTimer {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // Ends its phase when destroyed, or earlier with end().
+  class Phase {
+  public:
+    Phase(StartupTimer *timer, std::size_t index) : timer_(timer), index_(index) {}
+    Phase(Phase &&other) noexcept : timer_(other.timer_), index_(other.index_) { other.timer_ = nullptr; }
+    Phase(const Phase&) = delete;
+    Phase& operator=(const Phase&) = delete;
+    ~Phase() { end(); }
+
+    void end();
+
+  private:
+    StartupTimer *timer_;
+    std::size_t index_;
+  };
+
+  StartupTimer() : origin_(Clock::now()) {}
+
+  // The timer of this process, started by its first use in main().
+  static StartupTimer &instance();
+
+  StartupTimer(const StartupTimer&) = delete;
+  StartupTimer& operator=(const StartupTimer&) = delete;
+
+  Phase phase(const std::string &name);
+  void print(std::ostream &out) const;
+
+private:
+  struct Record {
+    std::string name;
+    Clock::time_point begin;
+    Clock::time_point end;
+  };
+
+  void finish(std::size_t index);
+
+  Clock::time_point origin_;
+  mutable std::mutex mutex_;
+  std::vector<Record> records_;
+};
+
+#endif // STARTUP_TIMER_H
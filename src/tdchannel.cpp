@@ -3,68 +3,72 @@
 #include <limits>
 #include <iostream>
 #include <algorithm>
-#include <thread>
-#include <chrono>
-#include <nowide/iostream.hpp>
+#include <filesystem>
 
 #include "utils.h"
 
-TdChannel::TdChannel() {
-  td::ClientManager::execute(td_api::make_object<td_api::setLogVerbosityLevel>(0));
-  td::ClientManager::execute(td_api::make_object<td_api::setLogStream>(td_api::make_object<td_api::logStreamEmpty>()));
-  td::ClientManager::set_log_message_callback(1, [] (int verbosity_level, const char *message) {
-    if (verbosity_level == 0)
-      nowide::cerr << "Fatal ";
-    nowide::cerr << "Error: " << message << std::endl;
-  });
+// Supergroup and channel chat ids are derived from the supergroup id.
+static const std::int64_t SUPERGROUP_CHAT_ID_BASE = -1000000000000LL;
 
-  client_manager_ = std::make_unique<td::ClientManager>();
-  client_id_ = client_manager_->create_client_id();
+TdChannel::TdChannel(std::shared_ptr<ClientHub> hub)
+  : hub_(hub ? std::move(hub) : std::make_shared<ClientHub>())
+{
+  client_id_ = hub_->addChannel(this);
+  extra_account_ = hub_->channels().size() > 1;
+  subscribeMetadata();
   send_query(td_api::make_object<td_api::getOption>("version"), {});
 }
 
-void TdChannel::start() {
-  thread_ = std::make_unique<ScopedThread>([this] {
-    this->receiveResponses();
-  });
+TdChannel::~TdChannel() {
+  hub_->removeChannel(client_id_);
+  if (metadata_)
+    metadata_->flush();
 }
 
-void TdChannel::stop() {
-  stop_ = true;
+void TdChannel::start() {
+  hub_->start();
 }
 
-void TdChannel::receiveResponses() {
-  while(true) {
-    if (stop_) return;
-    auto response = client_manager_->receive(5);
-    if (response.object) {
-      process_response(std::move(response));
-    }
-  }
+void TdChannel::stop() {
+  hub_->stop();
+  if (metadata_)
+    metadata_->flush();
 }
 
 void TdChannel::waitForLogin() {
+  openMetadataCache();
+  {
+    // Handle the state that came while another account was logging in.
+    std::lock_guard<std::mutex> guard{authorization_mutex_};
+    logging_in_ = true;
+    if (authorization_state_)
+      on_authorization_state_update();
+  }
   while(!are_authorized_) {
-    auto response = client_manager_->receive(5);
-    if (response.object) {
-      process_response(std::move(response));
-    }
+    // Once the hub runs, only its receive thread may receive responses.
+    if (hub_->started())
+      are_authorized_.wait(false);
+    else
+      hub_->poll(5);
   }
 }
 
 void TdChannel::send_query(td_api::object_ptr<td_api::Function> f, std::function<void(ObjectPtr)> handler) {
   auto query_id = next_query_id();
-  if (handler) {
-    handlers_.emplace(query_id, std::move(handler));
-  }
-  client_manager_->send(client_id_, query_id, std::move(f));
+  // Queries without a handler are tracked too, for their latency.
+  auto stats = Metrics::instance().querySent(*f);
+  auto sent = stats ? Metrics::Clock::now() : Metrics::Clock::time_point{};
+  handlers_.insert(query_id, PendingQuery{std::move(handler), stats, sent});
+  hub_->send(client_id_, query_id, std::move(f));
 }
 
 std::uint64_t TdChannel::next_query_id() {
-  if (current_query_id_ == std::numeric_limits<uint64_t>::max())
-    current_query_id_ = 1;
-  
-  return current_query_id_++;
+  auto query_id = current_query_id_.fetch_add(1, std::memory_order_relaxed);
+  // Request id 0 is reserved for updates, skip it when the counter wraps around.
+  if (query_id == 0)
+    query_id = current_query_id_.fetch_add(1, std::memory_order_relaxed);
+
+  return query_id;
 }
 
 void TdChannel::process_response(td::ClientManager::Response response) {
@@ -76,52 +80,54 @@ void TdChannel::process_response(td::ClientManager::Response response) {
     return process_update(std::move(response.object));
   }
 
-  auto it = handlers_.find(response.request_id);
-  if (it != handlers_.end()) {
-    it->second(std::move(response.object));
-    handlers_.erase(it);
+  // Run the handler outside of the registry lock.
+  PendingQuery query;
+  if (handlers_.take(response.request_id, query)) {
+    Metrics::instance().queryDone(query.stats, query.sent, *response.object);
+    if (query.handler)
+      query.handler(std::move(response.object));
   }
 }
 
 void TdChannel::process_update(td_api::object_ptr<td_api::Object> update) {
-  td_api::downcast_call(
-      *update, overloaded(
-                    [this](td_api::updateAuthorizationState &update_authorization_state) {
-                      authorization_state_ = std::move(update_authorization_state.authorization_state_);
-                      on_authorization_state_update();
-                    },
-                    [this](td_api::updateNewChat &update_new_chat) {
-                      chat_title_[update_new_chat.chat_->id_] = update_new_chat.chat_->title_;
-                    },
-                    [this](td_api::updateChatTitle &update_chat_title) {
-                      chat_title_[update_chat_title.chat_id_] = update_chat_title.title_;
-                    },
-                    [this](td_api::updateUser &update_user) {
-                      auto user_id = update_user.user_->id_;
-                      users_[user_id] = std::move(update_user.user_);
-                    },
-                    [this](td_api::updateNewMessage &update_new_message) {
-                      auto chat_id = update_new_message.message_->chat_id_;
-                      std::string sender_name;
-                      td_api::downcast_call(*update_new_message.message_->sender_id_,
-                                            overloaded(
-                                                [this, &sender_name](td_api::messageSenderUser &user) {
-                                                  sender_name = get_user_name(user.user_id_);
-                                                },
-                                                [this, &sender_name](td_api::messageSenderChat &chat) {
-                                                  sender_name = get_chat_title(chat.chat_id_);
-                                                }));
-                      std::string text;
-                      if (update_new_message.message_->content_->get_id() == td_api::messageText::ID) {
-                        text = static_cast<td_api::messageText &>(*update_new_message.message_->content_).text_->text_;
-                      }
-                      //std::cout << "Got message: [chat_id:" << chat_id << "] [from:" << sender_name << "] [" << text
-                      //          << "]" << std::endl;
-                    },
-                    [this](td_api::updateFile &update_file) {
-                      invokeDownloadHandler(std::move(update_file.file_));
-                    },
-                    [](auto &update) {}));
+  // The authorization state is taken over by TdChannel, it isn't published.
+  if (update->get_id() == td_api::updateAuthorizationState::ID) {
+    auto &update_authorization_state = static_cast<td_api::updateAuthorizationState &>(*update);
+    std::lock_guard<std::mutex> guard{authorization_mutex_};
+    authorization_state_ = std::move(update_authorization_state.authorization_state_);
+    if (logging_in_)
+      on_authorization_state_update();
+    return;
+  }
+
+  updates_.publish(SharedUpdate(update.release()));
+}
+
+/** Keep the chat and user metadata up to date */
+void TdChannel::subscribeMetadata() {
+  updates_.subscribe<td_api::updateNewChat>([this](const td_api::updateNewChat &update_new_chat) {
+    auto &chat = *update_new_chat.chat_;
+    setChatTitle(chat.id_, chat.title_);
+    std::lock_guard<std::mutex> guard{chat_kinds_mutex_};
+    chat_kinds_[chat.id_] = chatKind(*chat.type_);
+  });
+  updates_.subscribe<td_api::updateChatTitle>([this](const td_api::updateChatTitle &update_chat_title) {
+    setChatTitle(update_chat_title.chat_id_, update_chat_title.title_);
+  });
+  updates_.subscribe<td_api::updateUser>([this](const td_api::updateUser &update_user) {
+    auto &user = *update_user.user_;
+    setUserName(user.id_, user.first_name_ + " " + user.last_name_);
+    // The private chat with a user has the same id as the user.
+    setChatUsername(user.id_, user.username_);
+  });
+  updates_.subscribe<td_api::updateSupergroup>([this](const td_api::updateSupergroup &update_supergroup) {
+    auto &supergroup = *update_supergroup.supergroup_;
+    setChatUsername(supergroupChatId(supergroup.id_), supergroup.username_);
+  });
+  updates_.subscribe<td_api::updateNewMessage>([this](const td_api::updateNewMessage &update_new_message) {
+    if (search_index_ && update_new_message.message_)
+      search_index_->add(*update_new_message.message_);
+  });
 }
 
 void TdChannel::on_authorization_state_update() {
@@ -131,6 +137,7 @@ void TdChannel::on_authorization_state_update() {
       overloaded(
           [this](td_api::authorizationStateReady &) {
             are_authorized_ = true;
+            are_authorized_.notify_all();
           },
           [this](td_api::authorizationStateLoggingOut &) {
             are_authorized_ = false;
@@ -143,7 +150,7 @@ void TdChannel::on_authorization_state_update() {
             console("Terminated");
           },
           [this](td_api::authorizationStateWaitCode &) {
-            std::cout << "Enter authentication code: " << std::flush;
+            std::cout << prompt("Enter authentication code: ") << std::flush;
             std::string code;
             std::cin >> code;
             send_query(td_api::make_object<td_api::checkAuthenticationCode>(code),
@@ -153,26 +160,26 @@ void TdChannel::on_authorization_state_update() {
             std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
             std::string first_name;
             std::string last_name;
-            std::cout << "Enter your first name: " << std::flush;
+            std::cout << prompt("Enter your first name: ") << std::flush;
             std::cin >> first_name;
-            std::cout << "Enter your last name: " << std::flush;
+            std::cout << prompt("Enter your last name: ") << std::flush;
             std::cin >> last_name;
             send_query(td_api::make_object<td_api::registerUser>(first_name, last_name),
                         create_authentication_query_handler());
           },
           [this](td_api::authorizationStateWaitPassword &) {
             std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
-            std::string password = ConsoleUtil::getPassword("Enter authentication password: ");
+            std::string password = ConsoleUtil::getPassword(prompt("Enter authentication password: "));
             std::getline(std::cin, password);
             send_query(td_api::make_object<td_api::checkAuthenticationPassword>(password),
                         create_authentication_query_handler());
           },
           [this](td_api::authorizationStateWaitOtherDeviceConfirmation &state) {
-            console("Confirm this login link on another device: " + state.link_);
+            console(prompt("Confirm this login link on another device: ") + state.link_);
           },
           [this](td_api::authorizationStateWaitPhoneNumber &) {
             std::lock_guard<std::mutex> guard{ConsoleUtil::output_lock};
-            std::cout << "Enter phone number: " << std::flush;
+            std::cout << prompt("Enter phone number: ") << std::flush;
             std::string phone_number;
             std::cin >> phone_number;
             send_query(td_api::make_object<td_api::setAuthenticationPhoneNumber>(phone_number, nullptr),
@@ -185,7 +192,7 @@ void TdChannel::on_authorization_state_update() {
 
             std::string encrypt_key;
             if (!empty_encryption_key_)
-              encrypt_key = ConsoleUtil::getPassword("Enter encryption key: ");
+              encrypt_key = ConsoleUtil::getPassword(prompt("Enter encryption key: "));
             send_query(td_api::make_object<td_api::checkDatabaseEncryptionKey>(encrypt_key),
                         create_authentication_query_handler());
             // Prevent endless errors
@@ -196,6 +203,9 @@ void TdChannel::on_authorization_state_update() {
             // database_directory — The path to the directory on the local diskwhere 
             // the TDLib database is to be stored; must point to a writable directory.
             parameters->database_directory_ = database_directory_.empty() ? "tdlib" : database_directory_;
+            // Downloads can be kept on the filesystem of the output folder so
+            // that moving them there is a plain rename.
+            parameters->files_directory_ = files_directory_;
             parameters->use_message_database_ = true;
             parameters->use_secret_chats_ = true;
             parameters->api_id_ = 94575;
@@ -212,7 +222,8 @@ void TdChannel::on_authorization_state_update() {
 void TdChannel::check_authentication_error(ObjectPtr object) {
   if (object->get_id() == td_api::error::ID) {
     auto error = td::move_tl_object_as<td_api::error>(object);
-    std::cout << "Error: " << to_string(error) << std::flush;
+    std::cout << prompt("Error: ") << to_string(error) << std::flush;
+    std::lock_guard<std::mutex> guard{authorization_mutex_};
     on_authorization_state_update();
   }
 }
@@ -222,56 +233,150 @@ void TdChannel::console(const std::string &msg) {
   std::cout << msg << std::endl;
 }
 
+std::string TdChannel::prompt(const std::string &text) const {
+  return extra_account_ ? "[" + database_directory_ + "] " + text : text;
+}
+
 std::string TdChannel::get_user_name(std::int64_t user_id) const {
-  auto it = users_.find(user_id);
-  if (it == users_.end()) {
+  std::lock_guard<std::mutex> guard{users_mutex_};
+  auto it = user_names_.find(user_id);
+  if (it == user_names_.end()) {
     return "unknown user";
   }
-  return it->second->first_name_ + " " + it->second->last_name_;
+  return it->second;
 }
 
 std::string TdChannel::get_chat_title(std::int64_t chat_id) const {
-  auto it = chat_title_.find(chat_id);
-  if (it == chat_title_.end()) {
+  auto title = chat_index_.title(chat_id);
+  if (title.empty() && !chat_index_.contains(chat_id)) {
     return "unknown chat";
   }
-  return it->second;
+  return title;
+}
+
+ChatKind TdChannel::get_chat_kind(std::int64_t chat_id) const {
+  std::lock_guard<std::mutex> guard{chat_kinds_mutex_};
+  auto it = chat_kinds_.find(chat_id);
+  return it == chat_kinds_.end() ? ChatKind::Unknown : it->second;
+}
+
+ChatKind TdChannel::chatKind(const td_api::ChatType &type) {
+  switch (type.get_id()) {
+  case td_api::chatTypePrivate::ID:
+    return ChatKind::Private;
+  case td_api::chatTypeSecret::ID:
+    return ChatKind::Secret;
+  case td_api::chatTypeBasicGroup::ID:
+    return ChatKind::BasicGroup;
+  case td_api::chatTypeSupergroup::ID:
+    return static_cast<const td_api::chatTypeSupergroup &>(type).is_channel_
+      ? ChatKind::Channel : ChatKind::Supergroup;
+  default:
+    return ChatKind::Unknown;
+  }
+}
+
+int64_t TdChannel::supergroupId(int64_t chat_id) {
+  return SUPERGROUP_CHAT_ID_BASE - chat_id;
+}
+
+int64_t TdChannel::supergroupChatId(int64_t supergroup_id) {
+  return SUPERGROUP_CHAT_ID_BASE - supergroup_id;
 }
 
 int64_t TdChannel::get_chat_id(const std::string & title) const
 {
-  auto result = std::find_if(
-    chat_title_.cbegin(),
-    chat_title_.cend(),
-    [&title] (const auto& p) { return p.second == title; }
-  );
-
-  if (result != chat_title_.cend())
-    return result->first;
-  else
-    return 0;
+  if (!title.empty() && title[0] == '@')
+    return chat_index_.findUsername(title);
+
+  auto chat_id = chat_index_.findExact(title);
+  if (chat_id == 0)
+    chat_id = chat_index_.findNormalized(title);
+  if (chat_id == 0)
+    chat_id = chat_index_.findUsername(title);
+  if (chat_id == 0) {
+    // Accept a prefix only when it designates a single chat.
+    auto matches = chat_index_.findPrefix(title, 2);
+    if (matches.size() == 1)
+      chat_id = matches.front();
+  }
+  return chat_id;
 }
 
 void TdChannel::updateChatList(int64_t id, std::string title) {
-  chat_title_[id] = title;
+  setChatTitle(id, title);
+}
+
+/** Load the metadata saved by earlier sessions so that chats resolve before any update */
+void TdChannel::openMetadataCache() {
+  if (metadata_)
+    return;
+
+  try {
+    auto path = FileUtil::u8path(databaseDirectory()) / "metadata.cache";
+    metadata_ = std::make_unique<MetadataCache>(FileUtil::u8string(path));
+  } catch (const std::exception &e) {
+    console(std::string("Warning: metadata cache disabled, ") + e.what());
+    return;
+  }
+
+  metadata_->forEach([this](MetadataCache::Kind kind, std::int64_t id, const std::string &value) {
+    switch (kind) {
+    case MetadataCache::Kind::ChatTitle:
+      chat_index_.set(id, value);
+      break;
+    case MetadataCache::Kind::ChatUsername:
+      chat_index_.setUsername(id, value);
+      break;
+    case MetadataCache::Kind::UserName: {
+      std::lock_guard<std::mutex> guard{users_mutex_};
+      user_names_[id] = value;
+      break;
+    }
+    }
+  });
+}
+
+void TdChannel::openSearchIndex() {
+  if (search_index_)
+    return;
+
+  try {
+    auto path = FileUtil::u8path(databaseDirectory()) / "search";
+    search_index_ = std::make_unique<SearchIndex>(FileUtil::u8string(path));
+  } catch (const std::exception &e) {
+    console(std::string("Warning: search index disabled, ") + e.what());
+  }
 }
 
-void TdChannel::addDownloadHandler(int32_t id, std::function<void(FilePtr)> handler) {
-  download_handlers_.emplace(id, std::move(handler));
+void TdChannel::setChatTitle(std::int64_t chat_id, const std::string &title) {
+  chat_index_.set(chat_id, title);
+  if (metadata_)
+    metadata_->record(MetadataCache::Kind::ChatTitle, chat_id, title);
 }
 
-/** Remove donwload handler if it exists */
-void TdChannel::removeDownloadHandler(int32_t id) {
-  auto it = download_handlers_.find(id);
-  if (it != download_handlers_.end())
-      download_handlers_.erase(id);
+void TdChannel::setChatUsername(std::int64_t chat_id, const std::string &username) {
+  chat_index_.setUsername(chat_id, username);
+  if (metadata_)
+    metadata_->record(MetadataCache::Kind::ChatUsername, chat_id, username);
 }
 
-void TdChannel::invokeDownloadHandler(FilePtr file) {
-  auto id = file->id_;
-  auto it = download_handlers_.find(id);
-  if (it != download_handlers_.end())
-    it->second(std::move(file));
+void TdChannel::setUserName(std::int64_t user_id, const std::string &name) {
+  {
+    std::lock_guard<std::mutex> guard{users_mutex_};
+    user_names_[user_id] = name;
+  }
+  if (metadata_)
+    metadata_->record(MetadataCache::Kind::UserName, user_id, name);
+}
+
+void TdChannel::loadChatList() {
+  std::call_once(chat_list_loaded_, [this] {
+    // TDLib answers 404 once every chat of the list is known locally.
+    // Chats arrive as updates, handled before the response.
+    while (tryInvoke<td_api::loadChats>(nullptr, 100))
+      ;
+  });
 }
 
 int64_t TdChannel::getChatId(const std::string &chat) {
@@ -281,57 +386,21 @@ int64_t TdChannel::getChatId(const std::string &chat) {
     chat_id = std::stoll(chat);
   } catch (std::invalid_argument const&) {
     chat_id = get_chat_id(chat);
-    if (chat_id == 0)
+    if (chat_id == 0) {
+      loadChatList();
+      chat_id = get_chat_id(chat);
+    }
+    if (chat_id == 0) {
+      std::string suggestions;
+      for (auto id : chat_index_.findFuzzy(chat))
+        suggestions += (suggestions.empty() ? "" : ", ") + chat_index_.title(id);
+      if (!suggestions.empty())
+        throw std::logic_error("Not found chat " + chat + ". Did you mean: " + suggestions + "?");
       throw std::logic_error(
         "Not found chat " + chat +
         ". Please use command 'chats' to update chat list.");
-  }
-
-  return chat_id;
-}
-
-/** Find all messages between two messages (inclusive) */
-std::vector<MessagePtr> TdChannel::getMessageForRange(MessagePtr from, MessagePtr to, uint8_t wait)
-{
-  int64_t chat_id = from->chat_id_;
-  if (chat_id != to->chat_id_)
-    throw std::runtime_error("Two messages were not from the same chat.");
-
-  if (from->id_ == to->id_)
-    return {};
-
-  if (from->date_ < to->date_)
-    std::swap(from, to);
-
-  if (from->id_ < to->id_)
-    std::swap(from, to);
-
-  int64_t id_ptr = from->id_;
-  std::vector<MessagePtr> messages;
-  messages.push_back(std::move(from));
-  while (true) {
-    // getChatHistory will return `from_message` as the first message.
-    auto msgs = invoke<td_api::getChatHistory>(
-      chat_id, id_ptr, -1, 50, false);
-    if (msgs->messages_.size() > 1) {
-      // The messages are ordered from newest to oldest,
-      // find the position of the 'to' message if it is in the current batch
-      auto it = std::find_if(msgs->messages_.begin() + 1, msgs->messages_.end(),
-                             [&to](const MessagePtr& msg) { return msg->id_ == to->id_; });
-      if (it != msgs->messages_.end()) {
-        // 'to' message found, move all messages from the batch to 'messages' vector
-        std::move(msgs->messages_.begin() + 1, it + 1, std::back_inserter(messages));
-        break;
-      } else {
-        // Update id_ptr for the next batch
-        id_ptr = msgs->messages_.back()->id_;
-        // 'to' message not found, move all messages from the batch to 'messages' vector
-        std::move(msgs->messages_.begin() + 1, msgs->messages_.end(), std::back_inserter(messages));
-      }
-    } else {
-      std::this_thread::sleep_for(std::chrono::milliseconds(wait));
     }
   }
 
-  return messages;
+  return chat_id;
 }
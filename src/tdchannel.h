@@ -1,28 +1,85 @@
 #ifndef TDCORE_H
 #define TDCORE_H
 
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
 #include <functional>
 #include <map>
 #include <future>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #include <td/telegram/Client.h>
 #include <td/telegram/td_api.h>
 #include <td/telegram/td_api.hpp>
 
+#include "chatindex.h"
+#include "coro.h"
+#include "metadatacache.h"
+#include "metrics.h"
+#include "clienthub.h"
 #include "scopedthread.h"
+#include "searchindex.h"
+#include "shardedmap.h"
+#include "updatebus.h"
 #include "common.h"
 
+/** The outcome of a query sent by TdChannel::invokeMany() or TdChannel::tryInvoke() */
+template<typename RET>
+struct QueryResult {
+  RET value;
+  td_api::object_ptr<td_api::error> error;
+
+  explicit operator bool() const { return error == nullptr; }
+};
+
+enum class ChatKind {
+  Unknown,
+  Private,
+  Secret,
+  BasicGroup,
+  Supergroup,
+  Channel
+};
+
 class TdChannel {
 
 public:
-  TdChannel();
+  // Channels sharing a hub share its TDLib client manager and threads,
+  // each one is a separate client with its own account.
+  explicit TdChannel(std::shared_ptr<ClientHub> hub = nullptr);
+  ~TdChannel();
+
+  TdChannel(const TdChannel&) = delete;
+  TdChannel& operator=(const TdChannel&) = delete;
 
   void start();
   void stop();
   void waitForLogin();
+  // Load the metadata of earlier sessions, waitForLogin() does it first.
+  void openMetadataCache();
+  // Index the messages seen in updates and history walks, for `search`.
+  // Like the metadata cache it is opened before updates are handled.
+  void openSearchIndex();
+  // Null unless openSearchIndex() succeeded.
+  SearchIndex *searchIndex() const { return search_index_.get(); }
+  // Load the main chat list, once per session. Chats are otherwise only
+  // known from the metadata cache and updates, getChatId() calls it when
+  // a chat can't be found.
+  void loadChatList();
 
   void useEmptyEncryptionKey(bool use) { empty_encryption_key_ = use; }
   void setDatabaseDirectory(const std::string &folder) { database_directory_ = folder; }
+  std::string databaseDirectory() const { return database_directory_.empty() ? "tdlib" : database_directory_; }
+  void setFilesDirectory(const std::string &folder) { files_directory_ = folder; }
+  // Number of threads running response handlers, set before start().
+  void setWorkerCount(std::size_t count) { hub_->setWorkerCount(count); }
+  const std::shared_ptr<ClientHub> &hub() const { return hub_; }
+  std::int32_t clientId() const { return client_id_; }
 
   void send_query(td_api::object_ptr<td_api::Function> f, std::function<void(ObjectPtr)> handler);
 
@@ -45,6 +102,29 @@ public:
     );
   }
 
+  // Send a query without waiting for it. The returned future becomes ready
+  // when the response arrives and rethrows TDLib errors as std::logic_error.
+  template<typename FUN, typename ... Args>
+  std::future<typename FUN::ReturnType> invokeAsync(Args&&... args) {
+    auto prom = std::make_shared<std::promise<typename FUN::ReturnType>>();
+    auto future = prom->get_future();
+    send_query(td_api::make_object<FUN>(std::forward<Args>(args)...),
+      [prom](ObjectPtr object)
+      {
+        if (object->get_id() == td_api::error::ID) {
+          auto error = td::move_tl_object_as<td_api::error>(object);
+          prom->set_exception(std::make_exception_ptr(
+            std::logic_error("Error: " + td_api::to_string(error))
+          ));
+          return;
+        }
+
+        prom->set_value(td::move_tl_object_as<typename FUN::ReturnType::element_type>(object));
+      }
+    );
+    return future;
+  }
+
   template<typename FUN, typename ... Args>
   typename FUN::ReturnType invoke(Args&&... args) {
     std::promise<typename FUN::ReturnType> prom;
@@ -52,47 +132,292 @@ public:
     return std::move(prom.get_future().get());
   }
 
+  // Like invoke() but report a TDLib error in the result instead.
+  template<typename FUN, typename ... Args>
+  QueryResult<typename FUN::ReturnType> tryInvoke(Args&&... args) {
+    std::promise<ObjectPtr> prom;
+    send_query(td_api::make_object<FUN>(std::forward<Args>(args)...), [&prom](ObjectPtr object) {
+      prom.set_value(std::move(object));
+    });
+    auto object = prom.get_future().get();
+
+    QueryResult<typename FUN::ReturnType> result;
+    if (object->get_id() == td_api::error::ID)
+      result.error = td::move_tl_object_as<td_api::error>(object);
+    else
+      result.value = td::move_tl_object_as<typename FUN::ReturnType::element_type>(object);
+    return result;
+  }
+
+  // Send all queries keeping at most `window` of them in flight, and collect
+  // the results in the order of `queries`. A failed query doesn't abort the
+  // others, its error is reported in the corresponding result instead.
+  // Must not be called from a handler.
+  template<typename FUN>
+  std::vector<QueryResult<typename FUN::ReturnType>> invokeMany(
+      std::vector<td_api::object_ptr<FUN>> queries, std::size_t window = 64) {
+    using Result = QueryResult<typename FUN::ReturnType>;
+    std::vector<Result> results(queries.size());
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::size_t in_flight = 0;
+
+    for (std::size_t i = 0; i < queries.size(); i++) {
+      {
+        std::unique_lock<std::mutex> lock{mutex};
+        cond.wait(lock, [&] { return in_flight < window; });
+        ++in_flight;
+      }
+
+      send_query(std::move(queries[i]), [&, i](ObjectPtr object) {
+        auto &result = results[i];
+        if (object->get_id() == td_api::error::ID)
+          result.error = td::move_tl_object_as<td_api::error>(object);
+        else
+          result.value = td::move_tl_object_as<typename FUN::ReturnType::element_type>(object);
+
+        // Notify under the lock: the waiter owns `cond` and may return right after.
+        std::lock_guard<std::mutex> guard{mutex};
+        --in_flight;
+        cond.notify_one();
+      });
+    }
+
+    std::unique_lock<std::mutex> lock{mutex};
+    cond.wait(lock, [&] { return in_flight == 0; });
+    return results;
+  }
+
+  // Awaited by TdChannel::query() and TdChannel::tryQuery(). The response
+  // handler only stores the result and posts the coroutine back to the
+  // executor it was suspended on.
+  template<typename FUN, bool THROW>
+  class QueryAwaiter {
+  public:
+    using Result = std::conditional_t<THROW,
+      typename FUN::ReturnType, QueryResult<typename FUN::ReturnType>>;
+
+    QueryAwaiter(TdChannel &channel, td_api::object_ptr<FUN> function)
+      : channel_(channel), function_(std::move(function)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+      auto executor = coro::Executor::current();
+      if (!executor)
+        throw std::logic_error("TdChannel::query() must be awaited inside coro::Executor::run().");
+
+      channel_.send_query(std::move(function_), [this, executor, handle](ObjectPtr object) {
+        response_ = std::move(object);
+        executor->post(handle);
+      });
+    }
+
+    Result await_resume() {
+      using Value = typename FUN::ReturnType::element_type;
+      if constexpr (THROW) {
+        return takeResponse<typename FUN::ReturnType>(response_);
+      } else {
+        Result result;
+        if (response_->get_id() == td_api::error::ID)
+          result.error = td::move_tl_object_as<td_api::error>(response_);
+        else
+          result.value = td::move_tl_object_as<Value>(response_);
+        return result;
+      }
+    }
+
+  private:
+    TdChannel &channel_;
+    td_api::object_ptr<FUN> function_;
+    ObjectPtr response_;
+  };
+
+  // co_await the response of a query, TDLib errors are thrown as
+  // std::logic_error like invoke() does.
+  template<typename FUN, typename ... Args>
+  QueryAwaiter<FUN, true> query(Args&&... args) {
+    return {*this, td_api::make_object<FUN>(std::forward<Args>(args)...)};
+  }
+
+  // Like query() but report a TDLib error in the result instead.
+  template<typename FUN, typename ... Args>
+  QueryAwaiter<FUN, false> tryQuery(Args&&... args) {
+    return {*this, td_api::make_object<FUN>(std::forward<Args>(args)...)};
+  }
+
+  // The response of a query sent by prefetch(), co_awaited once it is
+  // needed. It may be dropped before the response comes, which is then
+  // ignored.
+  template<typename RET>
+  class Prefetched {
+  public:
+    Prefetched(Prefetched&&) = default;
+    Prefetched& operator=(Prefetched&&) = default;
+    Prefetched(const Prefetched&) = delete;
+    Prefetched& operator=(const Prefetched&) = delete;
+
+    bool await_ready() const {
+      std::lock_guard<std::mutex> guard{state_->mutex};
+      return state_->response != nullptr;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      auto executor = coro::Executor::current();
+      if (!executor)
+        throw std::logic_error("A prefetched query must be awaited inside coro::Executor::run().");
+
+      std::lock_guard<std::mutex> guard{state_->mutex};
+      if (state_->response)
+        return false;
+      state_->executor = executor;
+      state_->handle = handle;
+      return true;
+    }
+
+    RET await_resume() {
+      std::lock_guard<std::mutex> guard{state_->mutex};
+      return takeResponse<RET>(state_->response);
+    }
+
+  private:
+    friend class TdChannel;
+
+    struct State {
+      std::mutex mutex;
+      ObjectPtr response;
+      // Set while a coroutine awaits the response.
+      coro::Executor *executor{nullptr};
+      std::coroutine_handle<> handle;
+    };
+
+    explicit Prefetched(std::shared_ptr<State> state) : state_(std::move(state)) {}
+
+    std::shared_ptr<State> state_;
+  };
+
+  // Send a query now and co_await its response later, so that it runs
+  // while the caller does something else. Errors are thrown like query().
+  template<typename FUN, typename ... Args>
+  Prefetched<typename FUN::ReturnType> prefetch(Args&&... args) {
+    auto state = std::make_shared<typename Prefetched<typename FUN::ReturnType>::State>();
+    send_query(td_api::make_object<FUN>(std::forward<Args>(args)...), [state](ObjectPtr object) {
+      std::unique_lock<std::mutex> lock{state->mutex};
+      state->response = std::move(object);
+      if (state->handle) {
+        auto executor = state->executor;
+        auto handle = state->handle;
+        lock.unlock();
+        executor->post(handle);
+      }
+    });
+    return Prefetched<typename FUN::ReturnType>{state};
+  }
+
+  // Send the queries keeping at most `window` of them in flight, like
+  // invokeMany(), and co_await their results in the order of `queries`.
+  // Unlike invokeMany() no thread is blocked meanwhile.
+  template<typename FUN>
+  coro::Task<std::vector<QueryResult<typename FUN::ReturnType>>> queryMany(
+      std::vector<td_api::object_ptr<FUN>> queries, std::size_t window = 64) {
+    std::vector<QueryResult<typename FUN::ReturnType>> results(queries.size());
+    std::size_t next = 0;
+    std::vector<coro::Task<void>> senders;
+    for (std::size_t i = 0; i < std::max<std::size_t>(window, 1) && i < queries.size(); i++)
+      senders.push_back(sendQueries(queries, results, next));
+    co_await coro::whenAll(std::move(senders));
+    co_return results;
+  }
+
   //void getChats(std::promise<ChatListPtr>&, const uint32_t limit = 20);
   std::string get_chat_title(std::int64_t chat_id) const;
+  ChatKind get_chat_kind(std::int64_t chat_id) const;
+  static ChatKind chatKind(const td_api::ChatType &type);
+  // Supergroup chat ids are -100 followed by the supergroup id.
+  static int64_t supergroupId(int64_t chat_id);
+  static int64_t supergroupChatId(int64_t supergroup_id);
   int64_t get_chat_id(const std::string & title) const;
   std::string get_user_name(std::int64_t user_id) const;
 
   void updateChatList(int64_t id, std::string title);
-  void addDownloadHandler(int32_t id, std::function<void(FilePtr)> handler);
-  void removeDownloadHandler(int32_t id);
-  void invokeDownloadHandler(FilePtr file);
+  // Subscribe here to the updates TDLib sends, see UpdateBus.
+  UpdateBus &updates() { return updates_; }
   int64_t getChatId(const std::string &chat);
-  std::vector<MessagePtr> getMessageForRange(MessagePtr from, MessagePtr to, uint8_t wait = 5);
+  const ChatIndex &chatIndex() const { return chat_index_; }
 
 private:
-  std::unique_ptr<td::ClientManager> client_manager_;
+  std::shared_ptr<ClientHub> hub_;
   std::int32_t client_id_{0};
-  std::uint64_t current_query_id_{1};
-  std::map<std::uint64_t, std::function<void(ObjectPtr)>> handlers_;
-  std::map<std::int32_t, std::function<void(FilePtr)>> download_handlers_;
+  std::atomic<std::uint64_t> current_query_id_{1};
+  struct PendingQuery {
+    std::function<void(ObjectPtr)> handler;
+    Metrics::FunctionStats *stats{nullptr};
+    Metrics::Clock::time_point sent;
+  };
+  // Written by command threads and read by the workers.
+  ShardedMap<std::uint64_t, PendingQuery> handlers_;
+  UpdateBus updates_;
 
   td_api::object_ptr<td_api::AuthorizationState> authorization_state_;
+  // Authorization states are only acted on once waitForLogin() is called,
+  // so that accounts sharing a hub log in one after another.
+  std::mutex authorization_mutex_;
+  bool logging_in_{false};
+  // Not the first channel of its hub, its prompts name its database.
+  bool extra_account_{false};
   bool empty_encryption_key_{false};
   std::uint8_t key_retry_{0};
   std::string database_directory_;
+  std::string files_directory_;
   std::uint64_t authentication_query_id_{0};
-  std::map<std::int64_t, std::string> chat_title_;
-  std::map<std::int64_t, td_api::object_ptr<td_api::user>> users_;
+  ChatIndex chat_index_;
+  std::unordered_map<std::int64_t, std::string> user_names_;
+  mutable std::mutex users_mutex_;
+  std::unordered_map<std::int64_t, ChatKind> chat_kinds_;
+  mutable std::mutex chat_kinds_mutex_;
+  std::unique_ptr<MetadataCache> metadata_;
+  std::unique_ptr<SearchIndex> search_index_;
+  std::once_flag chat_list_loaded_;
 
-  std::unique_ptr<ScopedThread> thread_;
-
-  bool are_authorized_{false};
-  bool need_restart_{false};
-  bool stop_{false};
+  std::atomic<bool> are_authorized_{false};
+  std::atomic<bool> need_restart_{false};
 
 private:
-  void receiveResponses();
+  // One of the coroutines of queryMany(), sending the next query whenever
+  // its previous one is answered. They all run on the same executor.
+  template<typename FUN>
+  coro::Task<void> sendQueries(std::vector<td_api::object_ptr<FUN>> &queries,
+                               std::vector<QueryResult<typename FUN::ReturnType>> &results,
+                               std::size_t &next) {
+    while (next < queries.size()) {
+      auto i = next++;
+      results[i] = co_await QueryAwaiter<FUN, false>{*this, std::move(queries[i])};
+    }
+  }
+
+  friend class ClientHub;
+
+  // The object of a response, TDLib errors are thrown as std::logic_error.
+  template<typename RET>
+  static RET takeResponse(ObjectPtr &response) {
+    if (response->get_id() == td_api::error::ID) {
+      auto error = td::move_tl_object_as<td_api::error>(response);
+      throw std::logic_error("Error: " + td_api::to_string(error));
+    }
+    return td::move_tl_object_as<typename RET::element_type>(response);
+  }
+
   void console(const std::string &msg);
+  std::string prompt(const std::string &text) const;
 
   std::uint64_t next_query_id();
   void process_response(td::ClientManager::Response response);
   void process_update(td_api::object_ptr<td_api::Object> update);
   void on_authorization_state_update();
+  void subscribeMetadata();
+  void setChatTitle(std::int64_t chat_id, const std::string &title);
+  void setChatUsername(std::int64_t chat_id, const std::string &username);
+  void setUserName(std::int64_t user_id, const std::string &name);
   void check_authentication_error(ObjectPtr object);
 
   auto create_authentication_query_handler() {
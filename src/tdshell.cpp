@@ -11,36 +11,108 @@
 #include <td/telegram/td_api.hpp>
 
 #include "common.h"
+#include "scriptrunner.h"
+#include "startuptimer.h"
 
 using namespace cli;
 
 TdShell::TdShell() {
+  auto phase = StartupTimer::instance().phase("td client");
   channel_ = std::make_shared<TdChannel>();
 
-  commands_["download"] = std::make_unique<CmdDownload>(channel_);
-  commands_["chats"] = std::make_unique<CmdChats>(channel_);
-  commands_["chatinfo"] = std::make_unique<CmdChatInfo>(channel_);
-  commands_["history"] = std::make_unique<CmdHistory>(channel_);
-  commands_["messagelink"] = std::make_unique<CmdMessageLink>(channel_);
+  factories_["download"] = [this] { return std::make_unique<CmdDownload>(channel_); };
+  factories_["chats"] = [this] { return std::make_unique<CmdChats>(channel_); };
+  factories_["chatinfo"] = [this] { return std::make_unique<CmdChatInfo>(channel_); };
+  factories_["history"] = [this] { return std::make_unique<CmdHistory>(channel_); };
+  factories_["messagelink"] = [this] { return std::make_unique<CmdMessageLink>(channel_); };
+  factories_["search"] = [this] { return std::make_unique<CmdSearch>(channel_); };
+  factories_["archive"] = [this] { return std::make_unique<CmdArchive>(channel_); };
+  factories_["stats"] = [this] { return std::make_unique<CmdStats>(channel_); };
+
+  for (auto &pair : factories_)
+    commands_[pair.first] = pair.second();
 }
 
 TdShell::~TdShell() {
   close();
 }
 
+TdChannel *TdShell::addAccount(const std::string &database_directory) {
+  auto account = std::make_shared<TdChannel>(channel_->hub());
+  account->setDatabaseDirectory(database_directory);
+  accounts_.push_back(account);
+  return account.get();
+}
+
 void TdShell::open() {
-  channel_->waitForLogin();
+  beginOpen();
+  finishOpen();
+}
+
+void TdShell::beginOpen() {
+  opening_ = std::async(std::launch::async, [this] { login(); });
+}
+
+void TdShell::finishOpen() {
+  if (opening_.valid())
+    opening_.get();
+}
+
+void TdShell::login() {
+  auto &timer = StartupTimer::instance();
+  {
+    auto phase = timer.phase("metadata cache");
+    channel_->openMetadataCache();
+  }
+  {
+    auto phase = timer.phase("search index");
+    channel_->openSearchIndex();
+  }
+  {
+    auto phase = timer.phase("authorization");
+    channel_->waitForLogin();
+  }
+  for (auto &account : accounts_) {
+    auto phase = timer.phase("authorization " + account->databaseDirectory());
+    std::cout << "Logging in account " << account->databaseDirectory() << std::endl;
+    account->waitForLogin();
+  }
+  auto phase = timer.phase("receive thread");
   channel_->start();
 }
 
 void TdShell::close() {
+  // Don't stop the hub under a login still in progress.
+  if (opening_.valid())
+    opening_.wait();
   channel_->stop();
+  for (auto &account : accounts_)
+    account->stop();
 }
 
 void TdShell::execute(std::string cmd, std::vector<std::string> &args, std::ostream &out) {
   commands_[cmd]->execute(args, out);
 }
 
+void TdShell::runCommand(const std::vector<std::string> &args, std::ostream &out,
+                         const std::string &working_directory) {
+  auto it = factories_.find(args.front());
+  if (it == factories_.end())
+    throw std::logic_error("Unknown command: " + args.front());
+
+  auto program = it->second();
+  program->setBufferedOutput(true);
+  program->setWorkingDirectory(working_directory);
+  program->execute(std::vector<std::string>(args.begin() + 1, args.end()), out);
+}
+
+std::size_t TdShell::runScript(std::istream &in, std::ostream &out, std::size_t jobs) {
+  ScriptRunner runner([this](const std::vector<std::string> &args, std::ostream &out) {
+    runCommand(args, out);
+  }, jobs);
+  return runner.run(in, out);
+}
+
 std::unique_ptr<Menu> TdShell::make_menu() {
   auto rootMenu = std::make_unique<Menu>("tdshell");
 
@@ -62,11 +134,15 @@ std::unique_ptr<Menu> TdShell::make_menu() {
 std::map<int32_t, std::string> TdShell::getFileIdFromMessages(
   int64_t chat_id, std::vector<int64_t> msg_ids) {
 
+  std::vector<td_api::object_ptr<td_api::getMessage>> queries;
+  for (auto msg_id : msg_ids)
+    queries.push_back(td_api::make_object<td_api::getMessage>(chat_id, msg_id));
+
   std::vector<MessagePtr> MsgObjs;
-  for (auto msg_id : msg_ids) {
-    std::promise<MessagePtr> prom;
-    channel_->make_query<td_api::getMessage>(prom, chat_id, msg_id);
-    MsgObjs.push_back(std::move(prom.get_future().get()));
+  for (auto &result : channel_->invokeMany(std::move(queries))) {
+    if (!result)
+      throw std::logic_error("Error: " + td_api::to_string(result.error));
+    MsgObjs.push_back(std::move(result.value));
   }
 
   std::map<int32_t, std::string> filenames;
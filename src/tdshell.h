@@ -1,6 +1,8 @@
 #ifndef TDSHELL_H
 #define TDSHELL_H
 
+#include <functional>
+#include <future>
 #include <iostream>
 #include <sstream>
 #include <cli/cli.h>
@@ -16,8 +18,20 @@ public:
   ~TdShell();
 
   void open();
+  // Log in on a thread of its own so that the caller can get ready in the
+  // meantime, finishOpen() waits for it and rethrows its errors.
+  void beginOpen();
+  void finishOpen();
   void close();
   void execute(std::string cmd, std::vector<std::string> &args, std::ostream &out);
+  // Run a command line on a Program of its own, so that several can run at once.
+  // Relative paths in `args` are resolved against `working_directory`,
+  // or the process's own one if it is empty.
+  void runCommand(const std::vector<std::string> &args, std::ostream &out,
+                  const std::string &working_directory = "");
+  // Run the commands read from `in` with up to `jobs` of them at a time,
+  // and return the number of commands that failed.
+  std::size_t runScript(std::istream &in, std::ostream &out, std::size_t jobs);
 
   void error(std::ostream& out, std::string msg);
   std::map<int32_t, std::string> getFileIdFromMessages(int64_t chat_id, std::vector<int64_t> msg_ids);
@@ -26,11 +40,19 @@ public:
   std::unique_ptr<cli::Menu> make_menu();
 
   TdChannel *channel() { return channel_.get(); }
+  // Add another account sharing the TDLib client manager, before open().
+  TdChannel *addAccount(const std::string &database_directory);
 
 private:
   std::shared_ptr<TdChannel> channel_;
+  // Extra accounts, bulk downloads are shared between them and channel_.
+  std::vector<std::shared_ptr<TdChannel>> accounts_;
+  std::map<std::string, std::function<std::unique_ptr<Program>()>> factories_;
   std::map<std::string, std::unique_ptr<Program>> commands_;
   std::unique_ptr<CLI::App> app_;
+  std::future<void> opening_;
+
+  void login();
 };
 
 #endif // TDSHELL_H
\ No newline at end of file
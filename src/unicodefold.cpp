@@ -0,0 +1,284 @@
+#include "unicodefold.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+
+namespace
+{
+
+// Code points first..last fold to `to`, to + 1, ... when `step` is set,
+// otherwise all to `to`. 0 drops combining marks, 0x20 is a separator.
+struct FoldRun {
+  std::uint32_t first;
+  std::uint32_t last;
+  std::uint32_t to;
+  std::uint8_t step;
+};
+
+// Generated with Python's unicodedata (Unicode 14.0). Separators are the
+// Z* and P* categories and C1 controls. Combining marks are U+0300-036F,
+// 1AB0-1AFF, 1DC0-1DFF, 20D0-20FF, FE00-FE0F and FE20-FE2F, the marks of
+// other scripts are letters of their own. Letters are the code points of
+// U+0080-024F, 0370-04FF, 1E00-1FFF, 2100-214F, 2460-24FF, FF00-FFEF,
+// 1D400-1D7FF and 1F100-1F1FF whose NFKD without those marks is a single
+// Latin, Greek or Cyrillic code point, lowered.
+const FoldRun FOLD_RUNS[] = {
+  {0x80, 0xA1, 0x20, 0}, {0xA7, 0xA8, 0x20, 0}, {0xAA, 0xAA, 0x61, 0}, {0xAB, 0xAB, 0x20, 0},
+  {0xAF, 0xAF, 0x20, 0}, {0xB2, 0xB3, 0x32, 1}, {0xB4, 0xB4, 0x20, 0}, {0xB5, 0xB5, 0x3BC, 0},
+  {0xB6, 0xB8, 0x20, 0}, {0xB9, 0xB9, 0x31, 0}, {0xBA, 0xBA, 0x6F, 0}, {0xBB, 0xBB, 0x20, 0},
+  {0xBF, 0xBF, 0x20, 0}, {0xC0, 0xC5, 0x61, 0}, {0xC7, 0xC7, 0x63, 0}, {0xC8, 0xCB, 0x65, 0},
+  {0xCC, 0xCF, 0x69, 0}, {0xD1, 0xD2, 0x6E, 1}, {0xD3, 0xD6, 0x6F, 0}, {0xD9, 0xDC, 0x75, 0},
+  {0xDD, 0xDD, 0x79, 0}, {0xE0, 0xE5, 0x61, 0}, {0xE7, 0xE7, 0x63, 0}, {0xE8, 0xEB, 0x65, 0},
+  {0xEC, 0xEF, 0x69, 0}, {0xF1, 0xF2, 0x6E, 1}, {0xF3, 0xF6, 0x6F, 0}, {0xF9, 0xFC, 0x75, 0},
+  {0xFD, 0xFD, 0x79, 0}, {0xFF, 0xFF, 0x79, 0}, {0x100, 0x105, 0x61, 0}, {0x106, 0x10D, 0x63, 0},
+  {0x10E, 0x10F, 0x64, 0}, {0x112, 0x11B, 0x65, 0}, {0x11C, 0x123, 0x67, 0},
+  {0x124, 0x125, 0x68, 0}, {0x128, 0x130, 0x69, 0}, {0x134, 0x135, 0x6A, 0},
+  {0x136, 0x137, 0x6B, 0}, {0x139, 0x13E, 0x6C, 0}, {0x143, 0x148, 0x6E, 0},
+  {0x14C, 0x151, 0x6F, 0}, {0x154, 0x159, 0x72, 0}, {0x15A, 0x161, 0x73, 0},
+  {0x162, 0x165, 0x74, 0}, {0x168, 0x173, 0x75, 0}, {0x174, 0x175, 0x77, 0},
+  {0x176, 0x178, 0x79, 0}, {0x179, 0x17E, 0x7A, 0}, {0x17F, 0x17F, 0x73, 0},
+  {0x1A0, 0x1A1, 0x6F, 0}, {0x1AF, 0x1B0, 0x75, 0}, {0x1CD, 0x1CE, 0x61, 0},
+  {0x1CF, 0x1D0, 0x69, 0}, {0x1D1, 0x1D2, 0x6F, 0}, {0x1D3, 0x1DC, 0x75, 0},
+  {0x1DE, 0x1E1, 0x61, 0}, {0x1E2, 0x1E3, 0xE6, 0}, {0x1E6, 0x1E7, 0x67, 0},
+  {0x1E8, 0x1E9, 0x6B, 0}, {0x1EA, 0x1ED, 0x6F, 0}, {0x1EE, 0x1EF, 0x292, 0},
+  {0x1F0, 0x1F0, 0x6A, 0}, {0x1F4, 0x1F5, 0x67, 0}, {0x1F8, 0x1F9, 0x6E, 0},
+  {0x1FA, 0x1FB, 0x61, 0}, {0x1FC, 0x1FD, 0xE6, 0}, {0x1FE, 0x1FF, 0xF8, 0},
+  {0x200, 0x203, 0x61, 0}, {0x204, 0x207, 0x65, 0}, {0x208, 0x20B, 0x69, 0},
+  {0x20C, 0x20F, 0x6F, 0}, {0x210, 0x213, 0x72, 0}, {0x214, 0x217, 0x75, 0},
+  {0x218, 0x219, 0x73, 0}, {0x21A, 0x21B, 0x74, 0}, {0x21E, 0x21F, 0x68, 0},
+  {0x226, 0x227, 0x61, 0}, {0x228, 0x229, 0x65, 0}, {0x22A, 0x231, 0x6F, 0},
+  {0x232, 0x233, 0x79, 0}, {0x300, 0x36F, 0x0, 0}, {0x374, 0x374, 0x2B9, 0},
+  {0x37A, 0x37A, 0x20, 0}, {0x37E, 0x37E, 0x20, 0}, {0x384, 0x385, 0x20, 0},
+  {0x386, 0x386, 0x3B1, 0}, {0x387, 0x387, 0x20, 0}, {0x388, 0x388, 0x3B5, 0},
+  {0x389, 0x389, 0x3B7, 0}, {0x38A, 0x38A, 0x3B9, 0}, {0x38C, 0x38C, 0x3BF, 0},
+  {0x38E, 0x38E, 0x3C5, 0}, {0x38F, 0x38F, 0x3C9, 0}, {0x390, 0x390, 0x3B9, 0},
+  {0x3AA, 0x3AA, 0x3B9, 0}, {0x3AB, 0x3AB, 0x3C5, 0}, {0x3AC, 0x3AC, 0x3B1, 0},
+  {0x3AD, 0x3AD, 0x3B5, 0}, {0x3AE, 0x3AE, 0x3B7, 0}, {0x3AF, 0x3AF, 0x3B9, 0},
+  {0x3B0, 0x3B0, 0x3C5, 0}, {0x3CA, 0x3CA, 0x3B9, 0}, {0x3CB, 0x3CB, 0x3C5, 0},
+  {0x3CC, 0x3CC, 0x3BF, 0}, {0x3CD, 0x3CD, 0x3C5, 0}, {0x3CE, 0x3CE, 0x3C9, 0},
+  {0x3D0, 0x3D0, 0x3B2, 0}, {0x3D1, 0x3D1, 0x3B8, 0}, {0x3D2, 0x3D4, 0x3C5, 0},
+  {0x3D5, 0x3D5, 0x3C6, 0}, {0x3D6, 0x3D6, 0x3C0, 0}, {0x3F0, 0x3F0, 0x3BA, 0},
+  {0x3F1, 0x3F2, 0x3C1, 1}, {0x3F5, 0x3F5, 0x3B5, 0}, {0x3F9, 0x3F9, 0x3C3, 0},
+  {0x400, 0x401, 0x435, 0}, {0x403, 0x403, 0x433, 0}, {0x407, 0x407, 0x456, 0},
+  {0x40C, 0x40C, 0x43A, 0}, {0x40D, 0x40D, 0x438, 0}, {0x40E, 0x40E, 0x443, 0},
+  {0x419, 0x419, 0x438, 0}, {0x439, 0x439, 0x438, 0}, {0x450, 0x451, 0x435, 0},
+  {0x453, 0x453, 0x433, 0}, {0x457, 0x457, 0x456, 0}, {0x45C, 0x45C, 0x43A, 0},
+  {0x45D, 0x45D, 0x438, 0}, {0x45E, 0x45E, 0x443, 0}, {0x476, 0x477, 0x475, 0},
+  {0x4C1, 0x4C2, 0x436, 0}, {0x4D0, 0x4D3, 0x430, 0}, {0x4D6, 0x4D7, 0x435, 0},
+  {0x4DA, 0x4DB, 0x4D9, 0}, {0x4DC, 0x4DD, 0x436, 0}, {0x4DE, 0x4DF, 0x437, 0},
+  {0x4E2, 0x4E5, 0x438, 0}, {0x4E6, 0x4E7, 0x43E, 0}, {0x4EA, 0x4EB, 0x4E9, 0},
+  {0x4EC, 0x4ED, 0x44D, 0}, {0x4EE, 0x4F3, 0x443, 0}, {0x4F4, 0x4F5, 0x447, 0},
+  {0x4F8, 0x4F9, 0x44B, 0}, {0x55A, 0x55F, 0x20, 0}, {0x589, 0x58A, 0x20, 0},
+  {0x5BE, 0x5BE, 0x20, 0}, {0x5C0, 0x5C0, 0x20, 0}, {0x5C3, 0x5C3, 0x20, 0},
+  {0x5C6, 0x5C6, 0x20, 0}, {0x5F3, 0x5F4, 0x20, 0}, {0x609, 0x60A, 0x20, 0},
+  {0x60C, 0x60D, 0x20, 0}, {0x61B, 0x61B, 0x20, 0}, {0x61D, 0x61F, 0x20, 0},
+  {0x66A, 0x66D, 0x20, 0}, {0x6D4, 0x6D4, 0x20, 0}, {0x700, 0x70D, 0x20, 0},
+  {0x7F7, 0x7F9, 0x20, 0}, {0x830, 0x83E, 0x20, 0}, {0x85E, 0x85E, 0x20, 0},
+  {0x964, 0x965, 0x20, 0}, {0x970, 0x970, 0x20, 0}, {0x9FD, 0x9FD, 0x20, 0},
+  {0xA76, 0xA76, 0x20, 0}, {0xAF0, 0xAF0, 0x20, 0}, {0xC77, 0xC77, 0x20, 0},
+  {0xC84, 0xC84, 0x20, 0}, {0xDF4, 0xDF4, 0x20, 0}, {0xE4F, 0xE4F, 0x20, 0},
+  {0xE5A, 0xE5B, 0x20, 0}, {0xF04, 0xF12, 0x20, 0}, {0xF14, 0xF14, 0x20, 0},
+  {0xF3A, 0xF3D, 0x20, 0}, {0xF85, 0xF85, 0x20, 0}, {0xFD0, 0xFD4, 0x20, 0},
+  {0xFD9, 0xFDA, 0x20, 0}, {0x104A, 0x104F, 0x20, 0}, {0x10FB, 0x10FB, 0x20, 0},
+  {0x1360, 0x1368, 0x20, 0}, {0x1400, 0x1400, 0x20, 0}, {0x166E, 0x166E, 0x20, 0},
+  {0x1680, 0x1680, 0x20, 0}, {0x169B, 0x169C, 0x20, 0}, {0x16EB, 0x16ED, 0x20, 0},
+  {0x1735, 0x1736, 0x20, 0}, {0x17D4, 0x17D6, 0x20, 0}, {0x17D8, 0x17DA, 0x20, 0},
+  {0x1800, 0x180A, 0x20, 0}, {0x1944, 0x1945, 0x20, 0}, {0x1A1E, 0x1A1F, 0x20, 0},
+  {0x1AA0, 0x1AA6, 0x20, 0}, {0x1AA8, 0x1AAD, 0x20, 0}, {0x1AB0, 0x1ACE, 0x0, 0},
+  {0x1B5A, 0x1B60, 0x20, 0}, {0x1B7D, 0x1B7E, 0x20, 0}, {0x1BFC, 0x1BFF, 0x20, 0},
+  {0x1C3B, 0x1C3F, 0x20, 0}, {0x1C7E, 0x1C7F, 0x20, 0}, {0x1CC0, 0x1CC7, 0x20, 0},
+  {0x1CD3, 0x1CD3, 0x20, 0}, {0x1DC0, 0x1DFF, 0x0, 0}, {0x1E00, 0x1E01, 0x61, 0},
+  {0x1E02, 0x1E07, 0x62, 0}, {0x1E08, 0x1E09, 0x63, 0}, {0x1E0A, 0x1E13, 0x64, 0},
+  {0x1E14, 0x1E1D, 0x65, 0}, {0x1E1E, 0x1E1F, 0x66, 0}, {0x1E20, 0x1E21, 0x67, 0},
+  {0x1E22, 0x1E2B, 0x68, 0}, {0x1E2C, 0x1E2F, 0x69, 0}, {0x1E30, 0x1E35, 0x6B, 0},
+  {0x1E36, 0x1E3D, 0x6C, 0}, {0x1E3E, 0x1E43, 0x6D, 0}, {0x1E44, 0x1E4B, 0x6E, 0},
+  {0x1E4C, 0x1E53, 0x6F, 0}, {0x1E54, 0x1E57, 0x70, 0}, {0x1E58, 0x1E5F, 0x72, 0},
+  {0x1E60, 0x1E69, 0x73, 0}, {0x1E6A, 0x1E71, 0x74, 0}, {0x1E72, 0x1E7B, 0x75, 0},
+  {0x1E7C, 0x1E7F, 0x76, 0}, {0x1E80, 0x1E89, 0x77, 0}, {0x1E8A, 0x1E8D, 0x78, 0},
+  {0x1E8E, 0x1E8F, 0x79, 0}, {0x1E90, 0x1E95, 0x7A, 0}, {0x1E96, 0x1E96, 0x68, 0},
+  {0x1E97, 0x1E97, 0x74, 0}, {0x1E98, 0x1E98, 0x77, 0}, {0x1E99, 0x1E99, 0x79, 0},
+  {0x1E9B, 0x1E9B, 0x73, 0}, {0x1EA0, 0x1EB7, 0x61, 0}, {0x1EB8, 0x1EC7, 0x65, 0},
+  {0x1EC8, 0x1ECB, 0x69, 0}, {0x1ECC, 0x1EE3, 0x6F, 0}, {0x1EE4, 0x1EF1, 0x75, 0},
+  {0x1EF2, 0x1EF9, 0x79, 0}, {0x1F00, 0x1F0F, 0x3B1, 0}, {0x1F10, 0x1F15, 0x3B5, 0},
+  {0x1F18, 0x1F1D, 0x3B5, 0}, {0x1F20, 0x1F2F, 0x3B7, 0}, {0x1F30, 0x1F3F, 0x3B9, 0},
+  {0x1F40, 0x1F45, 0x3BF, 0}, {0x1F48, 0x1F4D, 0x3BF, 0}, {0x1F50, 0x1F57, 0x3C5, 0},
+  {0x1F59, 0x1F59, 0x3C5, 0}, {0x1F5B, 0x1F5B, 0x3C5, 0}, {0x1F5D, 0x1F5D, 0x3C5, 0},
+  {0x1F5F, 0x1F5F, 0x3C5, 0}, {0x1F60, 0x1F6F, 0x3C9, 0}, {0x1F70, 0x1F71, 0x3B1, 0},
+  {0x1F72, 0x1F73, 0x3B5, 0}, {0x1F74, 0x1F75, 0x3B7, 0}, {0x1F76, 0x1F77, 0x3B9, 0},
+  {0x1F78, 0x1F79, 0x3BF, 0}, {0x1F7A, 0x1F7B, 0x3C5, 0}, {0x1F7C, 0x1F7D, 0x3C9, 0},
+  {0x1F80, 0x1F8F, 0x3B1, 0}, {0x1F90, 0x1F9F, 0x3B7, 0}, {0x1FA0, 0x1FAF, 0x3C9, 0},
+  {0x1FB0, 0x1FB4, 0x3B1, 0}, {0x1FB6, 0x1FBC, 0x3B1, 0}, {0x1FBD, 0x1FBD, 0x20, 0},
+  {0x1FBE, 0x1FBE, 0x3B9, 0}, {0x1FBF, 0x1FC1, 0x20, 0}, {0x1FC2, 0x1FC4, 0x3B7, 0},
+  {0x1FC6, 0x1FC7, 0x3B7, 0}, {0x1FC8, 0x1FC9, 0x3B5, 0}, {0x1FCA, 0x1FCC, 0x3B7, 0},
+  {0x1FCD, 0x1FCF, 0x20, 0}, {0x1FD0, 0x1FD3, 0x3B9, 0}, {0x1FD6, 0x1FDB, 0x3B9, 0},
+  {0x1FDD, 0x1FDF, 0x20, 0}, {0x1FE0, 0x1FE3, 0x3C5, 0}, {0x1FE4, 0x1FE5, 0x3C1, 0},
+  {0x1FE6, 0x1FEB, 0x3C5, 0}, {0x1FEC, 0x1FEC, 0x3C1, 0}, {0x1FED, 0x1FEE, 0x20, 0},
+  {0x1FEF, 0x1FEF, 0x60, 0}, {0x1FF2, 0x1FF4, 0x3C9, 0}, {0x1FF6, 0x1FF7, 0x3C9, 0},
+  {0x1FF8, 0x1FF9, 0x3BF, 0}, {0x1FFA, 0x1FFC, 0x3C9, 0}, {0x1FFD, 0x1FFE, 0x20, 0},
+  {0x2000, 0x200A, 0x20, 0}, {0x2010, 0x2029, 0x20, 0}, {0x202F, 0x2043, 0x20, 0},
+  {0x2045, 0x2051, 0x20, 0}, {0x2053, 0x205F, 0x20, 0}, {0x207D, 0x207E, 0x20, 0},
+  {0x208D, 0x208E, 0x20, 0}, {0x20D0, 0x20F0, 0x0, 0}, {0x2102, 0x2102, 0x63, 0},
+  {0x2107, 0x2107, 0x25B, 0}, {0x210A, 0x210B, 0x67, 1}, {0x210C, 0x210E, 0x68, 0},
+  {0x210F, 0x210F, 0x127, 0}, {0x2110, 0x2111, 0x69, 0}, {0x2112, 0x2113, 0x6C, 0},
+  {0x2115, 0x2115, 0x6E, 0}, {0x2119, 0x211B, 0x70, 1}, {0x211C, 0x211D, 0x72, 0},
+  {0x2124, 0x2124, 0x7A, 0}, {0x2128, 0x2128, 0x7A, 0}, {0x212B, 0x212D, 0x61, 1},
+  {0x212F, 0x2130, 0x65, 0}, {0x2131, 0x2131, 0x66, 0}, {0x2133, 0x2133, 0x6D, 0},
+  {0x2134, 0x2134, 0x6F, 0}, {0x2139, 0x2139, 0x69, 0}, {0x213C, 0x213C, 0x3C0, 0},
+  {0x213D, 0x213E, 0x3B3, 0}, {0x213F, 0x213F, 0x3C0, 0}, {0x2145, 0x2146, 0x64, 0},
+  {0x2147, 0x2147, 0x65, 0}, {0x2148, 0x2149, 0x69, 1}, {0x2308, 0x230B, 0x20, 0},
+  {0x2329, 0x232A, 0x20, 0}, {0x2460, 0x2468, 0x31, 1}, {0x24B6, 0x24CF, 0x61, 1},
+  {0x24D0, 0x24E9, 0x61, 1}, {0x24EA, 0x24EA, 0x30, 0}, {0x2768, 0x2775, 0x20, 0},
+  {0x27C5, 0x27C6, 0x20, 0}, {0x27E6, 0x27EF, 0x20, 0}, {0x2983, 0x2998, 0x20, 0},
+  {0x29D8, 0x29DB, 0x20, 0}, {0x29FC, 0x29FD, 0x20, 0}, {0x2CF9, 0x2CFC, 0x20, 0},
+  {0x2CFE, 0x2CFF, 0x20, 0}, {0x2D70, 0x2D70, 0x20, 0}, {0x2E00, 0x2E2E, 0x20, 0},
+  {0x2E30, 0x2E4F, 0x20, 0}, {0x2E52, 0x2E5D, 0x20, 0}, {0x3000, 0x3003, 0x20, 0},
+  {0x3008, 0x3011, 0x20, 0}, {0x3014, 0x301F, 0x20, 0}, {0x3030, 0x3030, 0x20, 0},
+  {0x303D, 0x303D, 0x20, 0}, {0x30A0, 0x30A0, 0x20, 0}, {0x30FB, 0x30FB, 0x20, 0},
+  {0xA4FE, 0xA4FF, 0x20, 0}, {0xA60D, 0xA60F, 0x20, 0}, {0xA673, 0xA673, 0x20, 0},
+  {0xA67E, 0xA67E, 0x20, 0}, {0xA6F2, 0xA6F7, 0x20, 0}, {0xA874, 0xA877, 0x20, 0},
+  {0xA8CE, 0xA8CF, 0x20, 0}, {0xA8F8, 0xA8FA, 0x20, 0}, {0xA8FC, 0xA8FC, 0x20, 0},
+  {0xA92E, 0xA92F, 0x20, 0}, {0xA95F, 0xA95F, 0x20, 0}, {0xA9C1, 0xA9CD, 0x20, 0},
+  {0xA9DE, 0xA9DF, 0x20, 0}, {0xAA5C, 0xAA5F, 0x20, 0}, {0xAADE, 0xAADF, 0x20, 0},
+  {0xAAF0, 0xAAF1, 0x20, 0}, {0xABEB, 0xABEB, 0x20, 0}, {0xFD3E, 0xFD3F, 0x20, 0},
+  {0xFE00, 0xFE0F, 0x0, 0}, {0xFE10, 0xFE19, 0x20, 0}, {0xFE20, 0xFE2F, 0x0, 0},
+  {0xFE30, 0xFE52, 0x20, 0}, {0xFE54, 0xFE61, 0x20, 0}, {0xFE63, 0xFE63, 0x20, 0},
+  {0xFE68, 0xFE68, 0x20, 0}, {0xFE6A, 0xFE6B, 0x20, 0}, {0xFF01, 0xFF03, 0x20, 0},
+  {0xFF04, 0xFF04, 0x24, 0}, {0xFF05, 0xFF0A, 0x20, 0}, {0xFF0B, 0xFF0B, 0x2B, 0},
+  {0xFF0C, 0xFF0F, 0x20, 0}, {0xFF10, 0xFF19, 0x30, 1}, {0xFF1A, 0xFF1B, 0x20, 0},
+  {0xFF1C, 0xFF1E, 0x3C, 1}, {0xFF1F, 0xFF20, 0x20, 0}, {0xFF21, 0xFF3A, 0x61, 1},
+  {0xFF3B, 0xFF3D, 0x20, 0}, {0xFF3E, 0xFF3E, 0x5E, 0}, {0xFF3F, 0xFF3F, 0x20, 0},
+  {0xFF40, 0xFF5A, 0x60, 1}, {0xFF5B, 0xFF5B, 0x20, 0}, {0xFF5C, 0xFF5C, 0x7C, 0},
+  {0xFF5D, 0xFF5D, 0x20, 0}, {0xFF5E, 0xFF5E, 0x7E, 0}, {0xFF5F, 0xFF65, 0x20, 0},
+  {0xFFE0, 0xFFE1, 0xA2, 1}, {0xFFE2, 0xFFE2, 0xAC, 0}, {0xFFE3, 0xFFE3, 0x20, 0},
+  {0xFFE4, 0xFFE4, 0xA6, 0}, {0xFFE5, 0xFFE5, 0xA5, 0}, {0x10100, 0x10102, 0x20, 0},
+  {0x1039F, 0x1039F, 0x20, 0}, {0x103D0, 0x103D0, 0x20, 0}, {0x1056F, 0x1056F, 0x20, 0},
+  {0x10857, 0x10857, 0x20, 0}, {0x1091F, 0x1091F, 0x20, 0}, {0x1093F, 0x1093F, 0x20, 0},
+  {0x10A50, 0x10A58, 0x20, 0}, {0x10A7F, 0x10A7F, 0x20, 0}, {0x10AF0, 0x10AF6, 0x20, 0},
+  {0x10B39, 0x10B3F, 0x20, 0}, {0x10B99, 0x10B9C, 0x20, 0}, {0x10EAD, 0x10EAD, 0x20, 0},
+  {0x10F55, 0x10F59, 0x20, 0}, {0x10F86, 0x10F89, 0x20, 0}, {0x11047, 0x1104D, 0x20, 0},
+  {0x110BB, 0x110BC, 0x20, 0}, {0x110BE, 0x110C1, 0x20, 0}, {0x11140, 0x11143, 0x20, 0},
+  {0x11174, 0x11175, 0x20, 0}, {0x111C5, 0x111C8, 0x20, 0}, {0x111CD, 0x111CD, 0x20, 0},
+  {0x111DB, 0x111DB, 0x20, 0}, {0x111DD, 0x111DF, 0x20, 0}, {0x11238, 0x1123D, 0x20, 0},
+  {0x112A9, 0x112A9, 0x20, 0}, {0x1144B, 0x1144F, 0x20, 0}, {0x1145A, 0x1145B, 0x20, 0},
+  {0x1145D, 0x1145D, 0x20, 0}, {0x114C6, 0x114C6, 0x20, 0}, {0x115C1, 0x115D7, 0x20, 0},
+  {0x11641, 0x11643, 0x20, 0}, {0x11660, 0x1166C, 0x20, 0}, {0x116B9, 0x116B9, 0x20, 0},
+  {0x1173C, 0x1173E, 0x20, 0}, {0x1183B, 0x1183B, 0x20, 0}, {0x11944, 0x11946, 0x20, 0},
+  {0x119E2, 0x119E2, 0x20, 0}, {0x11A3F, 0x11A46, 0x20, 0}, {0x11A9A, 0x11A9C, 0x20, 0},
+  {0x11A9E, 0x11AA2, 0x20, 0}, {0x11C41, 0x11C45, 0x20, 0}, {0x11C70, 0x11C71, 0x20, 0},
+  {0x11EF7, 0x11EF8, 0x20, 0}, {0x11FFF, 0x11FFF, 0x20, 0}, {0x12470, 0x12474, 0x20, 0},
+  {0x12FF1, 0x12FF2, 0x20, 0}, {0x16A6E, 0x16A6F, 0x20, 0}, {0x16AF5, 0x16AF5, 0x20, 0},
+  {0x16B37, 0x16B3B, 0x20, 0}, {0x16B44, 0x16B44, 0x20, 0}, {0x16E97, 0x16E9A, 0x20, 0},
+  {0x16FE2, 0x16FE2, 0x20, 0}, {0x1BC9F, 0x1BC9F, 0x20, 0}, {0x1D400, 0x1D419, 0x61, 1},
+  {0x1D41A, 0x1D433, 0x61, 1}, {0x1D434, 0x1D44D, 0x61, 1}, {0x1D44E, 0x1D454, 0x61, 1},
+  {0x1D456, 0x1D467, 0x69, 1}, {0x1D468, 0x1D481, 0x61, 1}, {0x1D482, 0x1D49B, 0x61, 1},
+  {0x1D49C, 0x1D49C, 0x61, 0}, {0x1D49E, 0x1D49F, 0x63, 1}, {0x1D4A2, 0x1D4A2, 0x67, 0},
+  {0x1D4A5, 0x1D4A6, 0x6A, 1}, {0x1D4A9, 0x1D4AC, 0x6E, 1}, {0x1D4AE, 0x1D4B5, 0x73, 1},
+  {0x1D4B6, 0x1D4B9, 0x61, 1}, {0x1D4BB, 0x1D4BB, 0x66, 0}, {0x1D4BD, 0x1D4C3, 0x68, 1},
+  {0x1D4C5, 0x1D4CF, 0x70, 1}, {0x1D4D0, 0x1D4E9, 0x61, 1}, {0x1D4EA, 0x1D503, 0x61, 1},
+  {0x1D504, 0x1D505, 0x61, 1}, {0x1D507, 0x1D50A, 0x64, 1}, {0x1D50D, 0x1D514, 0x6A, 1},
+  {0x1D516, 0x1D51C, 0x73, 1}, {0x1D51E, 0x1D537, 0x61, 1}, {0x1D538, 0x1D539, 0x61, 1},
+  {0x1D53B, 0x1D53E, 0x64, 1}, {0x1D540, 0x1D544, 0x69, 1}, {0x1D546, 0x1D546, 0x6F, 0},
+  {0x1D54A, 0x1D550, 0x73, 1}, {0x1D552, 0x1D56B, 0x61, 1}, {0x1D56C, 0x1D585, 0x61, 1},
+  {0x1D586, 0x1D59F, 0x61, 1}, {0x1D5A0, 0x1D5B9, 0x61, 1}, {0x1D5BA, 0x1D5D3, 0x61, 1},
+  {0x1D5D4, 0x1D5ED, 0x61, 1}, {0x1D5EE, 0x1D607, 0x61, 1}, {0x1D608, 0x1D621, 0x61, 1},
+  {0x1D622, 0x1D63B, 0x61, 1}, {0x1D63C, 0x1D655, 0x61, 1}, {0x1D656, 0x1D66F, 0x61, 1},
+  {0x1D670, 0x1D689, 0x61, 1}, {0x1D68A, 0x1D6A3, 0x61, 1}, {0x1D6A4, 0x1D6A4, 0x131, 0},
+  {0x1D6A5, 0x1D6A5, 0x237, 0}, {0x1D6A8, 0x1D6B8, 0x3B1, 1}, {0x1D6B9, 0x1D6B9, 0x3B8, 0},
+  {0x1D6BA, 0x1D6C0, 0x3C3, 1}, {0x1D6C2, 0x1D6DA, 0x3B1, 1}, {0x1D6DC, 0x1D6DC, 0x3B5, 0},
+  {0x1D6DD, 0x1D6DD, 0x3B8, 0}, {0x1D6DE, 0x1D6DE, 0x3BA, 0}, {0x1D6DF, 0x1D6DF, 0x3C6, 0},
+  {0x1D6E0, 0x1D6E0, 0x3C1, 0}, {0x1D6E1, 0x1D6E1, 0x3C0, 0}, {0x1D6E2, 0x1D6F2, 0x3B1, 1},
+  {0x1D6F3, 0x1D6F3, 0x3B8, 0}, {0x1D6F4, 0x1D6FA, 0x3C3, 1}, {0x1D6FC, 0x1D714, 0x3B1, 1},
+  {0x1D716, 0x1D716, 0x3B5, 0}, {0x1D717, 0x1D717, 0x3B8, 0}, {0x1D718, 0x1D718, 0x3BA, 0},
+  {0x1D719, 0x1D719, 0x3C6, 0}, {0x1D71A, 0x1D71A, 0x3C1, 0}, {0x1D71B, 0x1D71B, 0x3C0, 0},
+  {0x1D71C, 0x1D72C, 0x3B1, 1}, {0x1D72D, 0x1D72D, 0x3B8, 0}, {0x1D72E, 0x1D734, 0x3C3, 1},
+  {0x1D736, 0x1D74E, 0x3B1, 1}, {0x1D750, 0x1D750, 0x3B5, 0}, {0x1D751, 0x1D751, 0x3B8, 0},
+  {0x1D752, 0x1D752, 0x3BA, 0}, {0x1D753, 0x1D753, 0x3C6, 0}, {0x1D754, 0x1D754, 0x3C1, 0},
+  {0x1D755, 0x1D755, 0x3C0, 0}, {0x1D756, 0x1D766, 0x3B1, 1}, {0x1D767, 0x1D767, 0x3B8, 0},
+  {0x1D768, 0x1D76E, 0x3C3, 1}, {0x1D770, 0x1D788, 0x3B1, 1}, {0x1D78A, 0x1D78A, 0x3B5, 0},
+  {0x1D78B, 0x1D78B, 0x3B8, 0}, {0x1D78C, 0x1D78C, 0x3BA, 0}, {0x1D78D, 0x1D78D, 0x3C6, 0},
+  {0x1D78E, 0x1D78E, 0x3C1, 0}, {0x1D78F, 0x1D78F, 0x3C0, 0}, {0x1D790, 0x1D7A0, 0x3B1, 1},
+  {0x1D7A1, 0x1D7A1, 0x3B8, 0}, {0x1D7A2, 0x1D7A8, 0x3C3, 1}, {0x1D7AA, 0x1D7C2, 0x3B1, 1},
+  {0x1D7C4, 0x1D7C4, 0x3B5, 0}, {0x1D7C5, 0x1D7C5, 0x3B8, 0}, {0x1D7C6, 0x1D7C6, 0x3BA, 0},
+  {0x1D7C7, 0x1D7C7, 0x3C6, 0}, {0x1D7C8, 0x1D7C8, 0x3C1, 0}, {0x1D7C9, 0x1D7C9, 0x3C0, 0},
+  {0x1D7CA, 0x1D7CB, 0x3DD, 0}, {0x1D7CE, 0x1D7D7, 0x30, 1}, {0x1D7D8, 0x1D7E1, 0x30, 1},
+  {0x1D7E2, 0x1D7EB, 0x30, 1}, {0x1D7EC, 0x1D7F5, 0x30, 1}, {0x1D7F6, 0x1D7FF, 0x30, 1},
+  {0x1DA87, 0x1DA8B, 0x20, 0}, {0x1E95E, 0x1E95F, 0x20, 0}, {0x1F12B, 0x1F12B, 0x63, 0},
+  {0x1F12C, 0x1F12C, 0x72, 0}, {0x1F130, 0x1F149, 0x61, 1}
+};
+
+const FoldRun *findRun(std::uint32_t code) {
+  auto it = std::upper_bound(std::begin(FOLD_RUNS), std::end(FOLD_RUNS), code,
+                             [](std::uint32_t code, const FoldRun &run) { return code < run.first; });
+  if (it == std::begin(FOLD_RUNS) || code > (--it)->last)
+    return nullptr;
+  return &*it;
+}
+
+void appendUtf8(std::string &out, std::uint32_t code) {
+  if (code < 0x80) {
+    out += static_cast<char>(code);
+  } else if (code < 0x800) {
+    out += static_cast<char>(0xc0 | (code >> 6));
+    out += static_cast<char>(0x80 | (code & 0x3f));
+  } else if (code < 0x10000) {
+    out += static_cast<char>(0xe0 | (code >> 12));
+    out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (code & 0x3f));
+  } else {
+    out += static_cast<char>(0xf0 | (code >> 18));
+    out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+    out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (code & 0x3f));
+  }
+}
+
+// Decode the code point at `pos`, or return 0 and copy one byte for a
+// sequence that isn't valid UTF-8.
+std::uint32_t nextCode(const std::string &text, std::size_t &pos, std::size_t &length) {
+  auto byte = static_cast<unsigned char>(text[pos]);
+  length = byte >= 0xf0 ? 4 : byte >= 0xe0 ? 3 : byte >= 0xc0 ? 2 : 1;
+  if (length == 1 || pos + length > text.size()) {
+    length = 1;
+    return 0;
+  }
+  std::uint32_t code = byte & (0x3f >> (length - 1));
+  for (std::size_t i = 1; i < length; i++) {
+    auto next = static_cast<unsigned char>(text[pos + i]);
+    if ((next & 0xc0) != 0x80) {
+      length = 1;
+      return 0;
+    }
+    code = (code << 6) | (next & 0x3f);
+  }
+  return code;
+}
+
+} // namespace
+
+namespace UnicodeFold {
+
+std::string fold(const std::string &text) {
+  if (std::all_of(text.begin(), text.end(), [](char c) { return static_cast<unsigned char>(c) < 0x80; }))
+    return text;
+
+  std::string result;
+  result.reserve(text.size());
+  for (std::size_t pos = 0; pos < text.size();) {
+    if (static_cast<unsigned char>(text[pos]) < 0x80) {
+      result += text[pos++];
+      continue;
+    }
+    std::size_t length;
+    auto code = nextCode(text, pos, length);
+    auto run = code ? findRun(code) : nullptr;
+    if (!run)
+      result.append(text, pos, length);
+    else if (run->to != 0)
+      appendUtf8(result, run->step ? run->to + (code - run->first) : run->to);
+    pos += length;
+  }
+  return result;
+}
+
+} // namespace UnicodeFold
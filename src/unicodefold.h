@@ -0,0 +1,18 @@
+#ifndef UNICODE_FOLD_H
+#define UNICODE_FOLD_H
+
+#include <string>
+
+// Folds UTF-8 text so that titles match the way people read them:
+// compatibility decomposition (NFKD) without combining marks, in lower
+// case, with Unicode punctuation and spaces replaced by ' '. Letters are
+// folded for Latin, Greek and Cyrillic, including their accented,
+// full-width, circled and mathematical forms. Other scripts are left as
+// they are, and so is invalid UTF-8.
+namespace UnicodeFold {
+
+std::string fold(const std::string &text);
+
+} // namespace UnicodeFold
+
+#endif // UNICODE_FOLD_H
@@ -0,0 +1,149 @@
+#include "updatebus.h"
+
+#include <algorithm>
+
+UpdateBus::SubscriptionId UpdateBus::add(std::int32_t constructor, Subscriber::Filter filter,
+                                         Subscriber::Callback callback, Options options) {
+  auto subscriber = std::make_shared<Subscriber>(std::move(filter), std::move(callback), options);
+
+  std::unique_lock<std::shared_mutex> lock{mutex_};
+  auto list = std::make_shared<SubscriberList>();
+  auto it = routes_.find(constructor);
+  if (it != routes_.end())
+    *list = *it->second;
+  list->push_back(subscriber);
+  routes_[constructor] = std::move(list);
+
+  auto id = next_id_++;
+  subscriptions_.emplace(id, std::make_pair(constructor, std::move(subscriber)));
+  return id;
+}
+
+void UpdateBus::unsubscribe(SubscriptionId id) {
+  std::shared_ptr<Subscriber> subscriber;
+  {
+    std::unique_lock<std::shared_mutex> lock{mutex_};
+    auto it = subscriptions_.find(id);
+    if (it == subscriptions_.end())
+      return;
+
+    auto constructor = it->second.first;
+    subscriber = std::move(it->second.second);
+    subscriptions_.erase(it);
+
+    auto list = std::make_shared<SubscriberList>(*routes_[constructor]);
+    list->erase(std::remove(list->begin(), list->end(), subscriber), list->end());
+    if (list->empty())
+      routes_.erase(constructor);
+    else
+      routes_[constructor] = std::move(list);
+  }
+
+  // A publisher may still hold the old list, closing makes sure it won't
+  // call the subscriber any more.
+  subscriber->close();
+}
+
+void UpdateBus::publish(const SharedUpdate &update) {
+  std::shared_ptr<const SubscriberList> list;
+  {
+    std::shared_lock<std::shared_mutex> lock{mutex_};
+    auto it = routes_.find(update->get_id());
+    if (it == routes_.end())
+      return;
+    list = it->second;
+  }
+
+  for (auto &subscriber : *list)
+    subscriber->deliver(update);
+}
+
+std::uint64_t UpdateBus::dropped(SubscriptionId id) const {
+  std::shared_lock<std::shared_mutex> lock{mutex_};
+  auto it = subscriptions_.find(id);
+  return it == subscriptions_.end() ? 0 : it->second.second->dropped();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// UpdateBus::Subscriber
+/////////////////////////////////////////////////////////////////////////////
+
+UpdateBus::Subscriber::Subscriber(Filter filter, Callback callback, Options options)
+  : filter_(std::move(filter)), callback_(std::move(callback)), options_(options)
+{
+  if (options_.capacity > 0)
+    thread_ = std::make_unique<ScopedThread>([this] { drain(); });
+}
+
+UpdateBus::Subscriber::~Subscriber() {
+  close();
+}
+
+void UpdateBus::Subscriber::close() {
+  {
+    std::lock_guard<std::mutex> guard{queue_mutex_};
+    stopping_ = true;
+    queue_.clear();
+  }
+  not_empty_.notify_all();
+  not_full_.notify_all();
+  thread_.reset();
+
+  // Wait for a callback running inline on a publisher.
+  std::unique_lock<std::shared_mutex> lock{call_mutex_};
+  closed_ = true;
+}
+
+void UpdateBus::Subscriber::deliver(const SharedUpdate &update) {
+  if (filter_ && !filter_(*update))
+    return;
+
+  if (!thread_) {
+    invoke(*update);
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock{queue_mutex_};
+  if (queue_.size() >= options_.capacity) {
+    switch (options_.overflow) {
+    case Overflow::Block:
+      not_full_.wait(lock, [this] { return stopping_ || queue_.size() < options_.capacity; });
+      break;
+    case Overflow::DropNewest:
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    case Overflow::DropOldest:
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      queue_.pop_front();
+      break;
+    }
+  }
+
+  if (stopping_)
+    return;
+  queue_.push_back(update);
+  lock.unlock();
+  not_empty_.notify_one();
+}
+
+void UpdateBus::Subscriber::invoke(const td_api::Object &update) {
+  std::shared_lock<std::shared_mutex> lock{call_mutex_};
+  if (!closed_)
+    callback_(update);
+}
+
+void UpdateBus::Subscriber::drain() {
+  while (true) {
+    SharedUpdate update;
+    {
+      std::unique_lock<std::mutex> lock{queue_mutex_};
+      not_empty_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_)
+        return;
+      update = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    not_full_.notify_one();
+    invoke(*update);
+  }
+}
@@ -0,0 +1,125 @@
+#ifndef UPDATE_BUS_H
+#define UPDATE_BUS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "scopedthread.h"
+
+typedef std::shared_ptr<const td_api::Object> SharedUpdate;
+
+// Delivers TDLib updates to any number of typed subscribers. Subscribers
+// are looked up by the constructor id of the update, and the subscriber
+// lists are copied on write so that publishing never waits for a
+// subscription to change.
+//
+// By default a callback runs on the TdChannel worker that publishes the
+// update. A subscriber can instead get a bounded queue and a thread of its
+// own, so that a slow one doesn't hold up the others.
+class UpdateBus {
+public:
+  typedef std::uint64_t SubscriptionId;
+
+  enum class Overflow {
+    Block,       // Make the publisher wait for room
+    DropNewest,  // Discard the incoming update
+    DropOldest   // Discard the oldest queued update
+  };
+
+  struct Options {
+    // Number of updates queued for the subscriber, 0 runs it inline.
+    std::size_t capacity = 0;
+    Overflow overflow = Overflow::Block;
+  };
+
+  UpdateBus() = default;
+  UpdateBus(const UpdateBus&) = delete;
+  UpdateBus& operator=(const UpdateBus&) = delete;
+
+  // Call `callback` with every update of type T for which `filter`, if
+  // any, returns true. The filter always runs on the publishing thread.
+  template<typename T>
+  SubscriptionId subscribe(std::function<bool(const T&)> filter,
+                           std::function<void(const T&)> callback,
+                           Options options = {}) {
+    Subscriber::Filter erased_filter;
+    if (filter) {
+      erased_filter = [filter = std::move(filter)](const td_api::Object &update) {
+        return filter(static_cast<const T&>(update));
+      };
+    }
+    return add(T::ID, std::move(erased_filter),
+      [callback = std::move(callback)](const td_api::Object &update) {
+        callback(static_cast<const T&>(update));
+      }, options);
+  }
+
+  template<typename T>
+  SubscriptionId subscribe(std::function<void(const T&)> callback, Options options = {}) {
+    return subscribe<T>(nullptr, std::move(callback), options);
+  }
+
+  // Once it returns, the callback is not running and won't be called
+  // again. Must not be called from the callback itself.
+  void unsubscribe(SubscriptionId id);
+
+  void publish(const SharedUpdate &update);
+
+  // Updates discarded so far because of a full queue.
+  std::uint64_t dropped(SubscriptionId id) const;
+
+private:
+  class Subscriber {
+  public:
+    typedef std::function<bool(const td_api::Object&)> Filter;
+    typedef std::function<void(const td_api::Object&)> Callback;
+
+    Subscriber(Filter filter, Callback callback, Options options);
+    ~Subscriber();
+
+    void deliver(const SharedUpdate &update);
+    void close();
+    std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  private:
+    void invoke(const td_api::Object &update);
+    void drain();
+
+    Filter filter_;
+    Callback callback_;
+    Options options_;
+
+    // Held shared while the callback runs, and exclusively to close.
+    std::shared_mutex call_mutex_;
+    bool closed_{false};
+    std::atomic<std::uint64_t> dropped_{0};
+
+    std::mutex queue_mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<SharedUpdate> queue_;
+    bool stopping_{false};
+    std::unique_ptr<ScopedThread> thread_;
+  };
+
+  typedef std::vector<std::shared_ptr<Subscriber>> SubscriberList;
+
+  SubscriptionId add(std::int32_t constructor, Subscriber::Filter filter,
+                     Subscriber::Callback callback, Options options);
+
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<std::int32_t, std::shared_ptr<const SubscriberList>> routes_;
+  std::unordered_map<SubscriptionId, std::pair<std::int32_t, std::shared_ptr<Subscriber>>> subscriptions_;
+  SubscriptionId next_id_{1};
+};
+
+#endif // UPDATE_BUS_H
@@ -7,16 +7,30 @@
 #include <cstring>
 #include <iostream>
 #include <string>
+#include <cerrno>
 #include <csignal>
 #include <iomanip>
+#include <fstream>
 
 #ifdef _WIN32
     #include <conio.h>
+    #include <io.h>
 #else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
     #include <termios.h>
     #include <unistd.h>
 #endif
 
+#ifdef __linux__
+    #include <fcntl.h>
+    #include <sys/ioctl.h>
+    #include <sys/sendfile.h>
+    #include <sys/stat.h>
+    #include <linux/fs.h>
+#endif
+
 #include <td/utils/utf8.h>
 
 namespace StrUtil {
@@ -103,6 +117,18 @@ std::vector<std::string> split(const std::string &str, const std::string &sep)
   return arr;
 }
 
+std::string formatBytes(double bytes) {
+  static const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+  int unit = 0;
+  while (bytes >= 1024 && unit < 4) {
+    bytes /= 1024;
+    unit++;
+  }
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << bytes << " " << units[unit];
+  return ss.str();
+}
+
 } // StrUtil
 
 namespace ConsoleUtil
@@ -159,8 +185,8 @@ void printMessage(std::ostream& out, MessagePtr &msg, bool elided, std::uint8_t
 
 }
 
-void printProgress(std::ostream& out, std::string filename, int32_t total, int32_t downloaded) {
-  double progress = double(downloaded) / double(total);
+void printProgress(std::ostream& out, std::string filename, int64_t total, int64_t downloaded) {
+  double progress = total > 0 ? std::min(double(downloaded) / double(total), 1.0) : 0.0;
 
   // Print percentage
   out << std::setw(3) << std::setfill(' ') << int(progress * 100.0) << " %";
@@ -177,10 +203,23 @@ void printProgress(std::ostream& out, std::string filename, int32_t total, int32
   out << "] ";
 
   // Print filename
-  out << StrUtil::paddingText(StrUtil::elidedText(filename, 20, StrUtil::Middle), 20, ' ', StrUtil::Right)
-      << "\r";
+  out << StrUtil::paddingText(StrUtil::elidedText(filename, 20, StrUtil::Middle), 20, ' ', StrUtil::Right);
+}
 
-  out.flush();
+bool isTerminal() {
+#ifdef _WIN32
+  return _isatty(_fileno(stdout));
+#else
+  return isatty(STDOUT_FILENO);
+#endif
+}
+
+bool isInputTerminal() {
+#ifdef _WIN32
+  return _isatty(_fileno(stdin));
+#else
+  return isatty(STDIN_FILENO);
+#endif
 }
 
 std::string getPassword(const std::string& prompt = "Enter password: ") {
@@ -219,4 +258,168 @@ std::string getPassword(const std::string& prompt = "Enter password: ") {
     return password;
 }
 
-} // PrintUtil
\ No newline at end of file
+} // PrintUtil
+
+namespace FileUtil
+{
+
+namespace fs = std::filesystem;
+
+fs::path u8path(const std::string &text) {
+#if defined(__cpp_char8_t)
+  return fs::path(std::u8string(text.begin(), text.end()));
+#else
+  return fs::u8path(text);
+#endif
+}
+
+std::string u8string(const fs::path &path) {
+  auto text = path.u8string();
+  return std::string(text.begin(), text.end());
+}
+
+#ifdef __linux__
+static bool kernelCopy(int in, int out, off_t size) {
+#ifdef FICLONE
+  // Share the extents if the filesystem supports reflinks (btrfs, XFS).
+  if (ioctl(out, FICLONE, in) == 0)
+    return true;
+#endif
+
+  bool use_copy_range = true;
+  off_t copied = 0;
+  while (copied < size) {
+    ssize_t n;
+    if (use_copy_range) {
+      n = copy_file_range(in, nullptr, out, nullptr, size - copied, 0);
+      // Older kernels refuse to copy across filesystems, use sendfile then.
+      if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+        use_copy_range = false;
+        continue;
+      }
+    } else {
+      n = sendfile(out, in, nullptr, size - copied);
+    }
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (n == 0)
+      break;
+    copied += n;
+  }
+
+  return copied == size;
+}
+#endif
+
+void copyFile(const fs::path &from, const fs::path &to) {
+#ifdef __linux__
+  int in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+    throw fs::filesystem_error("open", from, std::error_code(errno, std::system_category()));
+
+  struct stat st{};
+  if (fstat(in, &st) != 0) {
+    int err = errno;
+    ::close(in);
+    throw fs::filesystem_error("stat", from, std::error_code(err, std::system_category()));
+  }
+
+  int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+  if (out < 0) {
+    int err = errno;
+    ::close(in);
+    throw fs::filesystem_error("open", to, std::error_code(err, std::system_category()));
+  }
+
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+  bool ok = kernelCopy(in, out, st.st_size);
+  // The copy must be on disk before the caller removes the source. Neither
+  // file is read again soon, so don't let them push other data out of the
+  // page cache.
+  if (ok)
+    ok = ::fdatasync(out) == 0;
+  int err = errno;
+  if (ok) {
+    posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+    posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED);
+  }
+  ::close(in);
+  if (::close(out) != 0 && ok) {
+    ok = false;
+    err = errno;
+  }
+
+  if (!ok) {
+    std::error_code ec;
+    fs::remove(to, ec);
+    throw fs::filesystem_error("copy", from, to, std::error_code(err, std::system_category()));
+  }
+#else
+  // The standard library already uses CopyFile/copyfile on these platforms.
+  fs::copy_file(from, to, fs::copy_options::overwrite_existing);
+#endif
+}
+
+void moveFile(const fs::path &from, const fs::path &to) {
+  std::error_code ec;
+  fs::rename(from, to, ec);
+  if (!ec)
+    return;
+
+  if (ec != std::errc::cross_device_link)
+    throw fs::filesystem_error("rename", from, to, ec);
+
+  // Copy under a temporary name so that `to` never holds a partial file.
+  fs::path part = to;
+  part += ".part";
+  try {
+    copyFile(from, part);
+    fs::rename(part, to);
+  } catch (...) {
+    std::error_code ignored;
+    fs::remove(part, ignored);
+    throw;
+  }
+  fs::remove(from);
+}
+
+MappedFile::MappedFile(const fs::path &path) {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw fs::filesystem_error("open", path, std::error_code(errno, std::generic_category()));
+
+  struct stat st{};
+  if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *addr = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      data_ = static_cast<const char*>(addr);
+      size_ = static_cast<std::size_t>(st.st_size);
+      mapped_ = true;
+    }
+  }
+  ::close(fd);
+  if (mapped_ || st.st_size == 0)
+    return;
+#endif
+
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  if (!in)
+    throw fs::filesystem_error("open", path, std::make_error_code(std::errc::io_error));
+  buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+  if (mapped_)
+    ::munmap(const_cast<char*>(data_), size_);
+#endif
+}
+
+} // namespace FileUtil
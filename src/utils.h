@@ -2,8 +2,12 @@
 #define SRC_UTILS_H
 
 #include <string>
-#include <future>
+#include <chrono>
+#include <filesystem>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
+#include <optional>
 
 #include "common.h"
 
@@ -22,6 +26,8 @@ std::string paddingText(const std::string& text, std::uint8_t width,
 
 std::string join(std::vector<std::string> const &strings, std::string delim);
 std::vector<std::string> split(const std::string &str, const std::string &sep);
+// A byte count with a binary unit, such as "1.5 MB".
+std::string formatBytes(double bytes);
 
 } // namespace StrUtil
 
@@ -31,37 +37,106 @@ namespace ConsoleUtil
 extern std::mutex output_lock;
 
 void printMessage(std::ostream& out, MessagePtr &msg, bool elided = true, std::uint8_t elideWidth = 20);
-void printProgress(std::ostream& out, std::string filename, int32_t total, int32_t downloaded);
+void printProgress(std::ostream& out, std::string filename, int64_t total, int64_t downloaded);
+bool isTerminal();
+bool isInputTerminal();
 std::string getPassword(const std::string& prompt);
 
 } // namespace ConsoleUtil
 
+namespace FileUtil
+{
+
+// Convert between paths and UTF-8 text. std::filesystem uses char8_t for
+// UTF-8 since C++20, the rest of the code keeps it in std::string.
+std::filesystem::path u8path(const std::string &text);
+std::string u8string(const std::filesystem::path &path);
+
+// Copy a file inside the kernel (reflink, copy_file_range or sendfile)
+// where the platform allows it, without bouncing data through userspace.
+void copyFile(const std::filesystem::path &from, const std::filesystem::path &to);
+// Rename a file, or copy it through a temporary name and then rename it
+// when the destination is on another filesystem.
+void moveFile(const std::filesystem::path &from, const std::filesystem::path &to);
+
+// A read-only view of a whole file. It is memory mapped where mmap is
+// available, and read into memory otherwise.
+class MappedFile {
+public:
+  explicit MappedFile(const std::filesystem::path &path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char *data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+private:
+  const char *data_{nullptr};
+  std::size_t size_{0};
+  bool mapped_{false};
+  std::string buffer_;
+};
+
+} // namespace FileUtil
+
 namespace AsynUtil
 {
 
-// Processes a vector of futures by executing a user-provided function on each
-// future once it's ready, and an optional function once all futures are ready.
+// A blocking multi-producer queue of finished work items. Producers (usually
+// handlers running on TdChannel workers) push results as they complete, and
+// the consumer sleeps in pop() until the next one arrives.
 template<typename T>
-void waitFutures(std::vector<std::future<T>>& futures,
-                     std::function<void(T, std::size_t)> on_each,
-                     std::function<void()> on_all = []() {}) {
-  std::vector<bool> completed(futures.size(), false);
-  std::size_t completed_count = 0;
-  const std::size_t total = futures.size();
-
-  while (completed_count < total) {
-    for (std::size_t i = 0; i < total; ++i) {
-      if (!completed[i] && futures[i].wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
-        T value = futures[i].get();
-        on_each(std::move(value), i);
-        completed[i] = true;
-        ++completed_count;
-      }
+class CompletionQueue {
+public:
+  void push(T value) {
+    {
+      std::lock_guard<std::mutex> guard{mutex_};
+      items_.push_back(std::move(value));
     }
+    cond_.notify_one();
+  }
+
+  T pop() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    cond_.wait(lock, [this] { return !items_.empty(); });
+    T value = std::move(items_.front());
+    items_.pop_front();
+    return value;
+  }
+
+  // Like pop(), but give up and return nothing once `deadline` has passed.
+  template<typename Clock, typename Duration>
+  std::optional<T> popUntil(const std::chrono::time_point<Clock, Duration> &deadline) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (!cond_.wait_until(lock, deadline, [this] { return !items_.empty(); }))
+      return std::nullopt;
+    std::optional<T> value{std::move(items_.front())};
+    items_.pop_front();
+    return value;
+  }
+
+  // Take the next item if one is already available, without blocking.
+  std::optional<T> tryPop() {
+    std::lock_guard<std::mutex> guard{mutex_};
+    if (items_.empty())
+      return std::nullopt;
+    std::optional<T> value{std::move(items_.front())};
+    items_.pop_front();
+    return value;
+  }
+
+  bool empty() const {
+    std::lock_guard<std::mutex> guard{mutex_};
+    return items_.empty();
   }
 
-  on_all();
-}
+private:
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<T> items_;
+};
 
 } // namespace AsynUtil
 
@@ -0,0 +1,17 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <cstdint>
+#include <string>
+
+// Unsigned LEB128, how archives and search index segments store numbers:
+// 7 bits per byte, low bits first, the high bit set on all but the last.
+inline void putVarint(std::string &out, std::uint64_t value) {
+  while (value >= 0x80) {
+    out += static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out += static_cast<char>(value);
+}
+
+#endif // VARINT_H